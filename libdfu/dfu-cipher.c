@@ -0,0 +1,464 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * SECTION:dfu-cipher
+ * @short_description: Encrypt and decrypt firmware payloads
+ *
+ * These functions encrypt or decrypt firmware data in place, so they can
+ * be used on element contents or on a private writable mapping of a
+ * file without making a copy.
+ *
+ * XTEA is used in ECB mode, so each 64 bit block is independent. Four
+ * blocks are processed together in separate lanes, which uses SSE2
+ * where the compiler targets it and otherwise lets the compiler
+ * vectorize the generic loop. The generic loop is always built so it
+ * can be tested on any CPU.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dfu-cipher.h"
+#include "dfu-cipher-private.h"
+#include "dfu-error.h"
+
+#define XTEA_DELTA		0x9e3779b9
+#define XTEA_NUM_ROUNDS		32
+#define XTEA_LANES		4
+
+/**
+ * dfu_cipher_xtea_parse_key:
+ **/
+static gboolean
+dfu_cipher_xtea_parse_key (const gchar *key, guint32 *keys, GError **error)
+{
+	guint i;
+	gsize key_len;
+
+	/* too long */
+	key_len = strlen (key);
+	if (key_len > 32) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_NOT_SUPPORTED,
+			     "Key string too long at %i chars, max 16",
+			     (gint) key_len);
+		return FALSE;
+	}
+
+	/* parse 4x32b values or generate a hash */
+	if (key_len == 32) {
+		for (i = 0; i < 4; i++) {
+			gchar buf[] = "xxxxxxxx";
+			gchar *endptr;
+			guint64 tmp;
+
+			/* copy to 4-char buf (with NUL) */
+			memcpy (buf, key + i*8, 8);
+			tmp = g_ascii_strtoull (buf, &endptr, 16);
+			if (endptr && endptr[0] != '\0') {
+				g_set_error (error,
+					     DFU_ERROR,
+					     DFU_ERROR_NOT_SUPPORTED,
+					     "Failed to parse key '%s'", key);
+				return FALSE;
+			}
+			keys[3-i] = tmp;
+		}
+	} else {
+		gsize buf_len = 16;
+		guint8 buf[16];
+		g_autoptr(GChecksum) csum = NULL;
+		csum = g_checksum_new (G_CHECKSUM_MD5);
+		g_checksum_update (csum, (const guchar *) key, key_len);
+		g_checksum_get_digest (csum, buf, &buf_len);
+		g_assert (buf_len == 16);
+		for (i = 0; i < 4; i++) {
+			guint32 tmp;
+			memcpy (&tmp, buf + i * 4, 4);
+			keys[i] = GUINT32_FROM_LE (tmp);
+		}
+	}
+
+	/* success */
+	g_debug ("using XTEA key %04x%04x%04x%04x",
+		 keys[3], keys[2], keys[1], keys[0]);
+	return TRUE;
+}
+
+/**
+ * dfu_cipher_xtea_encrypt_block:
+ **/
+static void
+dfu_cipher_xtea_encrypt_block (const guint32 key[4], guint8 *data)
+{
+	guint32 sum = 0;
+	guint32 v[2];
+	guint i;
+
+	memcpy (v, data, 8);
+	v[0] = GUINT32_FROM_LE (v[0]);
+	v[1] = GUINT32_FROM_LE (v[1]);
+	for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
+		v[0] += (((v[1] << 4) ^ (v[1] >> 5)) + v[1]) ^ (sum + key[sum & 3]);
+		sum += XTEA_DELTA;
+		v[1] += (((v[0] << 4) ^ (v[0] >> 5)) + v[0]) ^ (sum + key[(sum >> 11) & 3]);
+	}
+	v[0] = GUINT32_TO_LE (v[0]);
+	v[1] = GUINT32_TO_LE (v[1]);
+	memcpy (data, v, 8);
+}
+
+/**
+ * dfu_cipher_xtea_decrypt_block:
+ **/
+static void
+dfu_cipher_xtea_decrypt_block (const guint32 key[4], guint8 *data)
+{
+	guint32 sum = XTEA_DELTA * XTEA_NUM_ROUNDS;
+	guint32 v[2];
+	guint i;
+
+	memcpy (v, data, 8);
+	v[0] = GUINT32_FROM_LE (v[0]);
+	v[1] = GUINT32_FROM_LE (v[1]);
+	for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
+		v[1] -= (((v[0] << 4) ^ (v[0] >> 5)) + v[0]) ^ (sum + key[(sum >> 11) & 3]);
+		sum -= XTEA_DELTA;
+		v[0] -= (((v[1] << 4) ^ (v[1] >> 5)) + v[1]) ^ (sum + key[sum & 3]);
+	}
+	v[0] = GUINT32_TO_LE (v[0]);
+	v[1] = GUINT32_TO_LE (v[1]);
+	memcpy (data, v, 8);
+}
+
+#ifdef __SSE2__
+/* splits four blocks into a vector of v0 words and a vector of v1 words */
+#define XTEA_SSE2_LOAD(data, v0, v1) G_STMT_START {				\
+	__m128i _a = _mm_loadu_si128 ((const __m128i *) (data));		\
+	__m128i _b = _mm_loadu_si128 ((const __m128i *) ((data) + 16));	\
+	_a = _mm_shuffle_epi32 (_a, _MM_SHUFFLE (3, 1, 2, 0));			\
+	_b = _mm_shuffle_epi32 (_b, _MM_SHUFFLE (3, 1, 2, 0));			\
+	v0 = _mm_unpacklo_epi64 (_a, _b);					\
+	v1 = _mm_unpackhi_epi64 (_a, _b);					\
+} G_STMT_END
+#define XTEA_SSE2_STORE(data, v0, v1) G_STMT_START {				\
+	__m128i _a = _mm_unpacklo_epi64 (v0, v1);				\
+	__m128i _b = _mm_unpackhi_epi64 (v0, v1);				\
+	_a = _mm_shuffle_epi32 (_a, _MM_SHUFFLE (3, 1, 2, 0));			\
+	_b = _mm_shuffle_epi32 (_b, _MM_SHUFFLE (3, 1, 2, 0));			\
+	_mm_storeu_si128 ((__m128i *) (data), _a);				\
+	_mm_storeu_si128 ((__m128i *) ((data) + 16), _b);			\
+} G_STMT_END
+#define XTEA_SSE2_MIX(v) \
+	_mm_add_epi32 (_mm_xor_si128 (_mm_slli_epi32 (v, 4), _mm_srli_epi32 (v, 5)), v)
+
+/**
+ * dfu_cipher_xtea_encrypt_lanes_sse2:
+ **/
+static void
+dfu_cipher_xtea_encrypt_lanes_sse2 (const guint32 key[4], guint8 *data)
+{
+	__m128i v0;
+	__m128i v1;
+	guint32 sum = 0;
+	guint i;
+
+	XTEA_SSE2_LOAD (data, v0, v1);
+	for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
+		v0 = _mm_add_epi32 (v0, _mm_xor_si128 (XTEA_SSE2_MIX (v1),
+			_mm_set1_epi32 (sum + key[sum & 3])));
+		sum += XTEA_DELTA;
+		v1 = _mm_add_epi32 (v1, _mm_xor_si128 (XTEA_SSE2_MIX (v0),
+			_mm_set1_epi32 (sum + key[(sum >> 11) & 3])));
+	}
+	XTEA_SSE2_STORE (data, v0, v1);
+}
+
+/**
+ * dfu_cipher_xtea_decrypt_lanes_sse2:
+ **/
+static void
+dfu_cipher_xtea_decrypt_lanes_sse2 (const guint32 key[4], guint8 *data)
+{
+	__m128i v0;
+	__m128i v1;
+	guint32 sum = XTEA_DELTA * XTEA_NUM_ROUNDS;
+	guint i;
+
+	XTEA_SSE2_LOAD (data, v0, v1);
+	for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
+		v1 = _mm_sub_epi32 (v1, _mm_xor_si128 (XTEA_SSE2_MIX (v0),
+			_mm_set1_epi32 (sum + key[(sum >> 11) & 3])));
+		sum -= XTEA_DELTA;
+		v0 = _mm_sub_epi32 (v0, _mm_xor_si128 (XTEA_SSE2_MIX (v1),
+			_mm_set1_epi32 (sum + key[sum & 3])));
+	}
+	XTEA_SSE2_STORE (data, v0, v1);
+}
+#endif
+
+/**
+ * dfu_cipher_xtea_encrypt_lanes_generic:
+ **/
+static void
+dfu_cipher_xtea_encrypt_lanes_generic (const guint32 key[4], guint8 *data)
+{
+	guint32 sum = 0;
+	guint32 v0[XTEA_LANES];
+	guint32 v1[XTEA_LANES];
+	guint i;
+	guint j;
+
+	/* the round key is the same in every lane */
+	for (j = 0; j < XTEA_LANES; j++) {
+		guint32 tmp[2];
+		memcpy (tmp, data + j * 8, 8);
+		v0[j] = GUINT32_FROM_LE (tmp[0]);
+		v1[j] = GUINT32_FROM_LE (tmp[1]);
+	}
+	for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
+		guint32 k0 = sum + key[sum & 3];
+		guint32 k1;
+		sum += XTEA_DELTA;
+		k1 = sum + key[(sum >> 11) & 3];
+		for (j = 0; j < XTEA_LANES; j++)
+			v0[j] += (((v1[j] << 4) ^ (v1[j] >> 5)) + v1[j]) ^ k0;
+		for (j = 0; j < XTEA_LANES; j++)
+			v1[j] += (((v0[j] << 4) ^ (v0[j] >> 5)) + v0[j]) ^ k1;
+	}
+	for (j = 0; j < XTEA_LANES; j++) {
+		guint32 tmp[2] = { GUINT32_TO_LE (v0[j]), GUINT32_TO_LE (v1[j]) };
+		memcpy (data + j * 8, tmp, 8);
+	}
+}
+
+/**
+ * dfu_cipher_xtea_decrypt_lanes_generic:
+ **/
+static void
+dfu_cipher_xtea_decrypt_lanes_generic (const guint32 key[4], guint8 *data)
+{
+	guint32 sum = XTEA_DELTA * XTEA_NUM_ROUNDS;
+	guint32 v0[XTEA_LANES];
+	guint32 v1[XTEA_LANES];
+	guint i;
+	guint j;
+
+	for (j = 0; j < XTEA_LANES; j++) {
+		guint32 tmp[2];
+		memcpy (tmp, data + j * 8, 8);
+		v0[j] = GUINT32_FROM_LE (tmp[0]);
+		v1[j] = GUINT32_FROM_LE (tmp[1]);
+	}
+	for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
+		guint32 k1 = sum + key[(sum >> 11) & 3];
+		guint32 k0;
+		sum -= XTEA_DELTA;
+		k0 = sum + key[sum & 3];
+		for (j = 0; j < XTEA_LANES; j++)
+			v1[j] -= (((v0[j] << 4) ^ (v0[j] >> 5)) + v0[j]) ^ k1;
+		for (j = 0; j < XTEA_LANES; j++)
+			v0[j] -= (((v1[j] << 4) ^ (v1[j] >> 5)) + v1[j]) ^ k0;
+	}
+	for (j = 0; j < XTEA_LANES; j++) {
+		guint32 tmp[2] = { GUINT32_TO_LE (v0[j]), GUINT32_TO_LE (v1[j]) };
+		memcpy (data + j * 8, tmp, 8);
+	}
+}
+
+typedef void (*DfuCipherXteaFunc)	(const guint32	 key[4],
+					 guint8		*data);
+
+/**
+ * dfu_cipher_xtea:
+ **/
+static gboolean
+dfu_cipher_xtea (DfuCipherXteaImpl impl,
+		 const gchar *key,
+		 guint8 *data,
+		 gsize length,
+		 gboolean encrypt,
+		 GError **error)
+{
+	DfuCipherXteaFunc block_func;
+	DfuCipherXteaFunc lanes_func = NULL;
+	gsize nr_blocks = length / 8;
+	gsize i = 0;
+	guint32 keys[4];
+
+	/* the fastest one this build supports */
+	if (impl == DFU_CIPHER_XTEA_IMPL_AUTO) {
+#ifdef __SSE2__
+		impl = DFU_CIPHER_XTEA_IMPL_SSE2;
+#else
+		impl = DFU_CIPHER_XTEA_IMPL_LANES;
+#endif
+	}
+	block_func = encrypt ? dfu_cipher_xtea_encrypt_block :
+			       dfu_cipher_xtea_decrypt_block;
+	switch (impl) {
+	case DFU_CIPHER_XTEA_IMPL_BLOCKWISE:
+		break;
+	case DFU_CIPHER_XTEA_IMPL_LANES:
+		lanes_func = encrypt ? dfu_cipher_xtea_encrypt_lanes_generic :
+				       dfu_cipher_xtea_decrypt_lanes_generic;
+		break;
+#ifdef __SSE2__
+	case DFU_CIPHER_XTEA_IMPL_SSE2:
+		lanes_func = encrypt ? dfu_cipher_xtea_encrypt_lanes_sse2 :
+				       dfu_cipher_xtea_decrypt_lanes_sse2;
+		break;
+#endif
+	default:
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_NOT_SUPPORTED,
+			     "XTEA implementation %u not supported",
+			     (guint) impl);
+		return FALSE;
+	}
+
+	if (!dfu_cipher_xtea_parse_key (key, keys, error))
+		return FALSE;
+
+	/* groups of independent blocks, then any left over one at a time;
+	 * a trailing partial block is left unencrypted */
+	if (lanes_func != NULL) {
+		for (; i + XTEA_LANES <= nr_blocks; i += XTEA_LANES)
+			lanes_func (keys, data + i * 8);
+	}
+	for (; i < nr_blocks; i++)
+		block_func (keys, data + i * 8);
+	return TRUE;
+}
+
+/**
+ * dfu_cipher_xtea_with_impl: (skip)
+ * @impl: a #DfuCipherXteaImpl
+ * @key: a key string, e.g. "deadbeef"
+ * @data: data to encrypt or decrypt in place
+ * @length: length of @data
+ * @encrypt: %TRUE to encrypt, %FALSE to decrypt
+ * @error: a #GError, or %NULL
+ *
+ * Runs XTEA using a specific implementation, so the self tests can
+ * check each one against the one block at a time reference.
+ *
+ * Return value: %TRUE for success, or %FALSE if @impl is not built
+ **/
+gboolean
+dfu_cipher_xtea_with_impl (DfuCipherXteaImpl impl,
+			   const gchar *key,
+			   guint8 *data,
+			   gsize length,
+			   gboolean encrypt,
+			   GError **error)
+{
+	g_return_val_if_fail (key != NULL, FALSE);
+	g_return_val_if_fail (data != NULL || length == 0, FALSE);
+	return dfu_cipher_xtea (impl, key, data, length, encrypt, error);
+}
+
+/**
+ * dfu_cipher_encrypt:
+ * @cipher_kind: a #DfuCipherKind, e.g. %DFU_CIPHER_KIND_XTEA
+ * @key: a key string, e.g. "deadbeef"
+ * @data: data to encrypt in place
+ * @length: length of @data
+ * @error: a #GError, or %NULL
+ *
+ * Encrypts firmware data in place.
+ *
+ * For XTEA, @key is either 32 hex characters or any other string of up
+ * to 32 characters, which is hashed to make the key. Any trailing data
+ * that does not fill a whole 8 byte block is left unchanged.
+ *
+ * Return value: %TRUE for success
+ *
+ * Since: 0.7.2
+ **/
+gboolean
+dfu_cipher_encrypt (DfuCipherKind cipher_kind,
+		    const gchar *key,
+		    guint8 *data,
+		    gsize length,
+		    GError **error)
+{
+	g_return_val_if_fail (key != NULL, FALSE);
+	g_return_val_if_fail (data != NULL || length == 0, FALSE);
+
+	if (cipher_kind == DFU_CIPHER_KIND_NONE)
+		return TRUE;
+	if (cipher_kind == DFU_CIPHER_KIND_XTEA)
+		return dfu_cipher_xtea (DFU_CIPHER_XTEA_IMPL_AUTO, key,
+					data, length, TRUE, error);
+	g_set_error (error,
+		     DFU_ERROR,
+		     DFU_ERROR_NOT_SUPPORTED,
+		     "cipher kind %u not supported",
+		     (guint) cipher_kind);
+	return FALSE;
+}
+
+/**
+ * dfu_cipher_decrypt:
+ * @cipher_kind: a #DfuCipherKind, e.g. %DFU_CIPHER_KIND_XTEA
+ * @key: a key string, e.g. "deadbeef"
+ * @data: data to decrypt in place
+ * @length: length of @data
+ * @error: a #GError, or %NULL
+ *
+ * Decrypts firmware data in place. See dfu_cipher_encrypt() for the
+ * format of @key.
+ *
+ * Return value: %TRUE for success
+ *
+ * Since: 0.7.2
+ **/
+gboolean
+dfu_cipher_decrypt (DfuCipherKind cipher_kind,
+		    const gchar *key,
+		    guint8 *data,
+		    gsize length,
+		    GError **error)
+{
+	g_return_val_if_fail (key != NULL, FALSE);
+	g_return_val_if_fail (data != NULL || length == 0, FALSE);
+
+	if (cipher_kind == DFU_CIPHER_KIND_NONE)
+		return TRUE;
+	if (cipher_kind == DFU_CIPHER_KIND_XTEA)
+		return dfu_cipher_xtea (DFU_CIPHER_XTEA_IMPL_AUTO, key,
+					data, length, FALSE, error);
+	g_set_error (error,
+		     DFU_ERROR,
+		     DFU_ERROR_NOT_SUPPORTED,
+		     "cipher kind %u not supported",
+		     (guint) cipher_kind);
+	return FALSE;
+}
@@ -28,7 +28,11 @@
 
 #include "config.h"
 
-#include "dfu-common.h"
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "dfu-common-private.h"
+#include "dfu-error.h"
 
 /**
  * dfu_state_to_string:
@@ -155,3 +159,79 @@ dfu_cipher_kind_to_string (DfuCipherKind cipher_kind)
 		return "xtea";
 	return NULL;
 }
+
+/**
+ * dfu_utils_stream_read_at:
+ * @stream: a seekable #GInputStream
+ * @offset: offset from the start of the stream
+ * @buf: destination buffer
+ * @length: number of bytes to read
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: a #GError, or %NULL
+ *
+ * Reads exactly @length bytes from a specific position in the stream.
+ *
+ * The elements of a firmware share one stream and may be read from
+ * several threads, so the seek and the read are done under a lock.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+dfu_utils_stream_read_at (GInputStream *stream,
+			  goffset offset,
+			  guint8 *buf,
+			  gsize length,
+			  GCancellable *cancellable,
+			  GError **error)
+{
+	static GMutex mutex;
+	gboolean ret;
+	gsize bytes_read = 0;
+
+	g_mutex_lock (&mutex);
+	ret = g_seekable_seek (G_SEEKABLE (stream), offset, G_SEEK_SET,
+			       cancellable, error) &&
+	      g_input_stream_read_all (stream, buf, length, &bytes_read,
+				       cancellable, error);
+	g_mutex_unlock (&mutex);
+	if (!ret)
+		return FALSE;
+	if (bytes_read != length) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INVALID_FILE,
+			     "only read 0x%x of 0x%x bytes at 0x%x",
+			     (guint) bytes_read, (guint) length, (guint) offset);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * dfu_utils_get_state_filename:
+ * @basename: a file or directory name, e.g. "dfu-journal"
+ *
+ * Gets where to keep state that outlives the process. The system
+ * location is used when it can be written to, and otherwise the user
+ * cache directory, so that running as a normal user still works.
+ *
+ * Return value: a filename
+ **/
+gchar *
+dfu_utils_get_state_filename (const gchar *basename)
+{
+	g_autofree gchar *dirname = NULL;
+	g_autofree gchar *dirname_exists = NULL;
+
+	/* the directory might not have been created yet */
+	dirname = g_build_filename (LOCALSTATEDIR, "lib", "fwupd", NULL);
+	dirname_exists = g_strdup (dirname);
+	while (!g_file_test (dirname_exists, G_FILE_TEST_EXISTS)) {
+		gchar *tmp = g_path_get_dirname (dirname_exists);
+		g_free (dirname_exists);
+		dirname_exists = tmp;
+	}
+	if (g_access (dirname_exists, W_OK) == 0)
+		return g_build_filename (dirname, basename, NULL);
+	return g_build_filename (g_get_user_cache_dir (), "fwupd", basename, NULL);
+}
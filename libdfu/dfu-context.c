@@ -33,6 +33,10 @@
  * Please be aware that after device detach or reset the number of #DfuTarget
  * objects may be different and so need to be re-requested.
  *
+ * The devices can be looked up from any thread, and the signals are always
+ * emitted in the thread-default main context that the #DfuContext was
+ * created in, even if a device changes state in a worker thread.
+ *
  * See also: #DfuDevice, #DfuTarget
  */
 
@@ -40,9 +44,9 @@
 
 #include <gusb.h>
 
+#include "dfu-context-private.h"
 #include "dfu-device-private.h"
 #include "dfu-error.h"
-#include "dfu-context.h"
 
 static void dfu_context_finalize			 (GObject *object);
 
@@ -53,17 +57,25 @@ static void dfu_context_finalize			 (GObject *object);
  **/
 typedef struct {
 	GUsbContext		*usb_ctx;
+	GMainContext		*main_ctx;		/* for signals */
 	GPtrArray		*devices;		/* of DfuContextItem */
+	GMutex			 devices_mutex;
 	guint			 timeout;		/* in ms */
 } DfuContextPrivate;
 
 typedef struct {
 	DfuContext		*context;		/* not refcounted */
 	DfuDevice		*device;		/* not refcounted */
-	guint			 timeout_id;
+	GSource			*timeout_source;
 	guint			 state_change_id;
 } DfuContextItem;
 
+typedef struct {
+	DfuContext		*context;
+	DfuDevice		*device;
+	guint			 signal_idx;
+} DfuContextEmitHelper;
+
 enum {
 	SIGNAL_DEVICE_ADDED,
 	SIGNAL_DEVICE_REMOVED,
@@ -82,9 +94,11 @@ G_DEFINE_TYPE_WITH_PRIVATE (DfuContext, dfu_context, G_TYPE_OBJECT)
 static void
 dfu_context_device_free (DfuContextItem *item)
 {
-	if (item->timeout_id > 0)
-		g_source_remove (item->timeout_id);
-	if (item->timeout_id > 0) {
+	if (item->timeout_source != NULL) {
+		g_source_destroy (item->timeout_source);
+		g_source_unref (item->timeout_source);
+	}
+	if (item->state_change_id > 0) {
 		g_signal_handler_disconnect (item->device,
 					     item->state_change_id);
 	}
@@ -92,6 +106,68 @@ dfu_context_device_free (DfuContextItem *item)
 	g_free (item);
 }
 
+/**
+ * dfu_context_emit_helper_free:
+ **/
+static void
+dfu_context_emit_helper_free (DfuContextEmitHelper *helper)
+{
+	g_object_unref (helper->context);
+	g_object_unref (helper->device);
+	g_free (helper);
+}
+
+/**
+ * dfu_context_emit_helper_cb:
+ **/
+static gboolean
+dfu_context_emit_helper_cb (gpointer user_data)
+{
+	DfuContextEmitHelper *helper = (DfuContextEmitHelper *) user_data;
+	g_signal_emit (helper->context, signals[helper->signal_idx], 0, helper->device);
+	return FALSE;
+}
+
+/**
+ * dfu_context_emit:
+ *
+ * Emits a signal in the main context the #DfuContext was created in, as
+ * a device may change state in a worker thread.
+ **/
+static void
+dfu_context_emit (DfuContext *context, guint signal_idx, DfuDevice *device)
+{
+	DfuContextPrivate *priv = GET_PRIVATE (context);
+	DfuContextEmitHelper *helper;
+
+	if (g_main_context_is_owner (priv->main_ctx)) {
+		g_signal_emit (context, signals[signal_idx], 0, device);
+		return;
+	}
+	helper = g_new0 (DfuContextEmitHelper, 1);
+	helper->context = g_object_ref (context);
+	helper->device = g_object_ref (device);
+	helper->signal_idx = signal_idx;
+	g_main_context_invoke_full (priv->main_ctx,
+				    G_PRIORITY_DEFAULT,
+				    dfu_context_emit_helper_cb,
+				    helper,
+				    (GDestroyNotify) dfu_context_emit_helper_free);
+}
+
+/**
+ * dfu_context_remove_timeout:
+ **/
+static void
+dfu_context_remove_timeout (DfuContextItem *item)
+{
+	if (item->timeout_source == NULL)
+		return;
+	g_source_destroy (item->timeout_source);
+	g_source_unref (item->timeout_source);
+	item->timeout_source = NULL;
+}
+
 /**
  * dfu_context_class_init:
  **/
@@ -170,6 +246,8 @@ dfu_context_get_device_id (DfuDevice *device)
 
 /**
  * dfu_context_find_item_by_platform_id:
+ *
+ * The devices_mutex has to be held by the caller.
  **/
 static DfuContextItem *
 dfu_context_find_item_by_platform_id (DfuContext *context, const gchar *platform_id)
@@ -200,8 +278,10 @@ dfu_context_remove_item (DfuContextItem *item)
 	device_id = dfu_context_get_device_id (item->device);
 	g_debug ("%s was removed", device_id);
 
-	g_signal_emit (item->context, signals[SIGNAL_DEVICE_REMOVED], 0, item->device);
+	dfu_context_emit (item->context, SIGNAL_DEVICE_REMOVED, item->device);
+	g_mutex_lock (&priv->devices_mutex);
 	g_ptr_array_remove (priv->devices, item);
+	g_mutex_unlock (&priv->devices_mutex);
 }
 
 /**
@@ -216,6 +296,7 @@ dfu_context_device_timeout_cb (gpointer user_data)
 	/* bad firmware? */
 	device_id = dfu_context_get_device_id (item->device);
 	g_debug ("%s did not come back as a DFU capable device", device_id);
+	g_clear_pointer (&item->timeout_source, g_source_unref);
 	dfu_context_remove_item (item);
 	return FALSE;
 }
@@ -229,7 +310,74 @@ dfu_context_device_state_cb (DfuDevice *device, DfuState state, DfuContext *cont
 	g_autofree gchar *device_id = NULL;
 	device_id = dfu_context_get_device_id (device);
 	g_debug ("%s state now: %s", device_id, dfu_state_to_string (state));
-	g_signal_emit (context, signals[SIGNAL_DEVICE_CHANGED], 0, device);
+	dfu_context_emit (context, SIGNAL_DEVICE_CHANGED, device);
+}
+
+/**
+ * dfu_context_add_device:
+ *
+ * Takes ownership of @device.
+ **/
+static void
+dfu_context_add_device (DfuContext *context, DfuDevice *device)
+{
+	DfuContextPrivate *priv = GET_PRIVATE (context);
+	DfuContextItem *item;
+	g_autofree gchar *device_id = NULL;
+
+	/* add */
+	item = g_new0 (DfuContextItem, 1);
+	item->context = context;
+	item->device = device;
+	item->state_change_id =
+		g_signal_connect (item->device, "state-changed",
+				  G_CALLBACK (dfu_context_device_state_cb), context);
+	g_mutex_lock (&priv->devices_mutex);
+	g_ptr_array_add (priv->devices, item);
+	g_mutex_unlock (&priv->devices_mutex);
+	dfu_context_emit (context, SIGNAL_DEVICE_ADDED, device);
+	device_id = dfu_context_get_device_id (item->device);
+	g_debug ("device %s was added", device_id);
+}
+
+/**
+ * dfu_context_item_replugged:
+ *
+ * Called once the device of @item has been given its new backing device.
+ **/
+static void
+dfu_context_item_replugged (DfuContext *context, DfuContextItem *item)
+{
+	g_autofree gchar *device_id = NULL;
+
+	device_id = dfu_context_get_device_id (item->device);
+	if (item->timeout_source != NULL) {
+		g_debug ("cancelling the remove timeout");
+		dfu_context_remove_timeout (item);
+	}
+
+	/* inform the UI */
+	dfu_context_emit (context, SIGNAL_DEVICE_CHANGED, item->device);
+	g_debug ("device %s came back", device_id);
+}
+
+/**
+ * dfu_context_item_unplugged:
+ *
+ * Called once the backing device of @item has been invalidated; the
+ * item is removed if the device does not come back in time.
+ **/
+static void
+dfu_context_item_unplugged (DfuContext *context, DfuContextItem *item)
+{
+	DfuContextPrivate *priv = GET_PRIVATE (context);
+
+	/* this item has just detached */
+	dfu_context_remove_timeout (item);
+	item->timeout_source = g_timeout_source_new (priv->timeout);
+	g_source_set_callback (item->timeout_source,
+			       dfu_context_device_timeout_cb, item, NULL);
+	g_source_attach (item->timeout_source, priv->main_ctx);
 }
 
 /**
@@ -244,29 +392,20 @@ dfu_context_device_added_cb (GUsbContext *usb_context,
 	DfuDevice *device;
 	DfuContextItem *item;
 	const gchar *platform_id;
-	g_autofree gchar *device_id = NULL;
 	g_autoptr(GError) error = NULL;
 
 	/* are we waiting for this device to come back? */
 	platform_id = g_usb_device_get_platform_id (usb_device);
+	g_mutex_lock (&priv->devices_mutex);
 	item = dfu_context_find_item_by_platform_id (context, platform_id);
+	g_mutex_unlock (&priv->devices_mutex);
 	if (item != NULL) {
-		device_id = dfu_context_get_device_id (item->device);
-		if (item->timeout_id > 0) {
-			g_debug ("cancelling the remove timeout");
-			g_source_remove (item->timeout_id);
-			item->timeout_id  = 0;
-		}
-
 		/* try and be helpful; we may be a daemon like fwupd watching a
 		 * DFU device after dfu-tool or dfu-util has detached the
 		 * device on th command line */
 		if (!dfu_device_set_new_usb_dev (item->device, usb_device, NULL, &error))
 			g_warning ("Failed to set new device: %s", error->message);
-
-		/* inform the UI */
-		g_signal_emit (context, signals[SIGNAL_DEVICE_CHANGED], 0, item->device);
-		g_debug ("device %s came back", device_id);
+		dfu_context_item_replugged (context, item);
 		return;
 	}
 
@@ -276,18 +415,7 @@ dfu_context_device_added_cb (GUsbContext *usb_context,
 		g_debug ("device was not DFU capable");
 		return;
 	}
-
-	/* add */
-	item = g_new0 (DfuContextItem, 1);
-	item->context = context;
-	item->device = device;
-	item->state_change_id =
-		g_signal_connect (item->device, "state-changed",
-				  G_CALLBACK (dfu_context_device_state_cb), context);
-	g_ptr_array_add (priv->devices, item);
-	g_signal_emit (context, signals[SIGNAL_DEVICE_ADDED], 0, device);
-	device_id = dfu_context_get_device_id (item->device);
-	g_debug ("device %s was added", device_id);
+	dfu_context_add_device (context, device);
 }
 
 /**
@@ -304,18 +432,15 @@ dfu_context_device_removed_cb (GUsbContext *usb_context,
 
 	/* find the item */
 	platform_id = g_usb_device_get_platform_id (usb_device);
+	g_mutex_lock (&priv->devices_mutex);
 	item = dfu_context_find_item_by_platform_id (context, platform_id);
+	g_mutex_unlock (&priv->devices_mutex);
 	if (item == NULL)
 		return;
 
 	/* mark the backing USB device as invalid */
 	dfu_device_set_new_usb_dev (item->device, NULL, NULL, NULL);
-
-	/* this item has just detached */
-	if (item->timeout_id > 0)
-		g_source_remove (item->timeout_id);
-	item->timeout_id =
-		g_timeout_add (priv->timeout, dfu_context_device_timeout_cb, item);
+	dfu_context_item_unplugged (context, item);
 }
 
 /**
@@ -326,7 +451,9 @@ dfu_context_init (DfuContext *context)
 {
 	DfuContextPrivate *priv = GET_PRIVATE (context);
 	priv->timeout = 5000;
+	priv->main_ctx = g_main_context_ref_thread_default ();
 	priv->devices = g_ptr_array_new_with_free_func ((GDestroyNotify) dfu_context_device_free);
+	g_mutex_init (&priv->devices_mutex);
 	priv->usb_ctx = g_usb_context_new (NULL);
 	g_signal_connect (priv->usb_ctx, "device-added",
 			  G_CALLBACK (dfu_context_device_added_cb), context);
@@ -344,7 +471,9 @@ dfu_context_finalize (GObject *object)
 	DfuContextPrivate *priv = GET_PRIVATE (context);
 
 	g_ptr_array_unref (priv->devices);
+	g_mutex_clear (&priv->devices_mutex);
 	g_object_unref (priv->usb_ctx);
+	g_main_context_unref (priv->main_ctx);
 
 	G_OBJECT_CLASS (dfu_context_parent_class)->finalize (object);
 }
@@ -449,10 +578,12 @@ dfu_context_get_devices (DfuContext *context)
 	g_return_val_if_fail (DFU_IS_CONTEXT (context), NULL);
 
 	devices = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	g_mutex_lock (&priv->devices_mutex);
 	for (i = 0; i < priv->devices->len; i++) {
 		item = g_ptr_array_index (priv->devices, i);
 		g_ptr_array_add (devices, g_object_ref (item->device));
 	}
+	g_mutex_unlock (&priv->devices_mutex);
 	return devices;
 }
 
@@ -485,14 +616,18 @@ dfu_context_get_device_by_vid_pid (DfuContext *context,
 	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
 
 	/* search all devices */
+	g_mutex_lock (&priv->devices_mutex);
 	for (i = 0; i < priv->devices->len; i++) {
 
 		/* match */
 		item = g_ptr_array_index (priv->devices, i);
 		dev = dfu_device_get_usb_dev (item->device);
+		if (dev == NULL)
+			continue;
 		if (g_usb_device_get_vid (dev) == vid &&
 		    g_usb_device_get_pid (dev) == pid) {
 			if (device != NULL) {
+				g_mutex_unlock (&priv->devices_mutex);
 				g_set_error (error,
 					     DFU_ERROR,
 					     DFU_ERROR_INVALID_DEVICE,
@@ -504,6 +639,9 @@ dfu_context_get_device_by_vid_pid (DfuContext *context,
 			continue;
 		}
 	}
+	if (device != NULL)
+		g_object_ref (device);
+	g_mutex_unlock (&priv->devices_mutex);
 	if (device == NULL) {
 		g_set_error (error,
 			     DFU_ERROR,
@@ -512,7 +650,7 @@ dfu_context_get_device_by_vid_pid (DfuContext *context,
 			     vid, pid);
 		return NULL;
 	}
-	return g_object_ref (device);
+	return device;
 }
 
 /**
@@ -534,19 +672,19 @@ dfu_context_get_device_by_platform_id (DfuContext *context,
 {
 	DfuContextPrivate *priv = GET_PRIVATE (context);
 	DfuContextItem *item;
-	guint i;
 
 	g_return_val_if_fail (DFU_IS_CONTEXT (context), NULL);
 	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
 
 	/* search all devices */
-	for (i = 0; i < priv->devices->len; i++) {
-		item = g_ptr_array_index (priv->devices, i);
-		if (g_strcmp0 (dfu_device_get_platform_id (item->device),
-			       platform_id) == 0) {
-			return g_object_ref (item->device);
-		}
+	g_mutex_lock (&priv->devices_mutex);
+	item = dfu_context_find_item_by_platform_id (context, platform_id);
+	if (item != NULL) {
+		DfuDevice *device = g_object_ref (item->device);
+		g_mutex_unlock (&priv->devices_mutex);
+		return device;
 	}
+	g_mutex_unlock (&priv->devices_mutex);
 	g_set_error (error,
 		     DFU_ERROR,
 		     DFU_ERROR_NOT_FOUND,
@@ -570,14 +708,14 @@ dfu_context_get_device_by_platform_id (DfuContext *context,
 DfuDevice *
 dfu_context_get_device_default (DfuContext *context, GError **error)
 {
-	DfuContextPrivate *priv = GET_PRIVATE (context);
-	DfuContextItem *item;
+	g_autoptr(GPtrArray) devices = NULL;
 
 	g_return_val_if_fail (DFU_IS_CONTEXT (context), NULL);
 	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
 
 	/* none */
-	if (priv->devices->len == 0) {
+	devices = dfu_context_get_devices (context);
+	if (devices->len == 0) {
 		g_set_error_literal (error,
 				     DFU_ERROR,
 				     DFU_ERROR_NOT_FOUND,
@@ -586,13 +724,68 @@ dfu_context_get_device_default (DfuContext *context, GError **error)
 	}
 
 	/* multiple */
-	if (priv->devices->len > 1) {
+	if (devices->len > 1) {
 		g_set_error_literal (error,
 				     DFU_ERROR,
 				     DFU_ERROR_INVALID_DEVICE,
 				     "more than one attached DFU device");
 		return NULL;
 	}
-	item = g_ptr_array_index (priv->devices, 0);
-	return g_object_ref (item->device);
+	return g_object_ref (g_ptr_array_index (devices, 0));
+}
+
+/**
+ * dfu_context_add_emulated: (skip)
+ * @context: a #DfuContext
+ * @device: a #DfuDevice created using dfu_device_new_emulated()
+ *
+ * Adds an emulated device as if it had just been plugged in.
+ **/
+void
+dfu_context_add_emulated (DfuContext *context, DfuDevice *device)
+{
+	g_return_if_fail (DFU_IS_CONTEXT (context));
+	g_return_if_fail (DFU_IS_DEVICE (device));
+	dfu_context_add_device (context, g_object_ref (device));
+}
+
+/**
+ * dfu_context_replug_emulated: (skip)
+ * @context: a #DfuContext
+ * @device: a #DfuDevice added using dfu_context_add_emulated()
+ * @emulator: (allow-none): a #DfuEmulator, or %NULL to unplug
+ *
+ * Unplugs or replugs an emulated device using the same code as the
+ * GUsbContext hotplug events, so it is removed if it does not come
+ * back before the timeout.
+ **/
+void
+dfu_context_replug_emulated (DfuContext *context,
+			     DfuDevice *device,
+			     DfuEmulator *emulator)
+{
+	DfuContextPrivate *priv = GET_PRIVATE (context);
+	DfuContextItem *item = NULL;
+	guint i;
+
+	g_return_if_fail (DFU_IS_CONTEXT (context));
+	g_return_if_fail (DFU_IS_DEVICE (device));
+
+	/* emulated devices all share a platform ID */
+	g_mutex_lock (&priv->devices_mutex);
+	for (i = 0; i < priv->devices->len; i++) {
+		DfuContextItem *item_tmp = g_ptr_array_index (priv->devices, i);
+		if (item_tmp->device == device) {
+			item = item_tmp;
+			break;
+		}
+	}
+	g_mutex_unlock (&priv->devices_mutex);
+	g_return_if_fail (item != NULL);
+
+	dfu_device_set_new_emulator (device, emulator);
+	if (emulator == NULL)
+		dfu_context_item_unplugged (context, item);
+	else
+		dfu_context_item_replugged (context, item);
 }
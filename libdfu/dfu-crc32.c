@@ -0,0 +1,375 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * SECTION:dfu-crc32
+ * @short_description: CRC32 used by the DFU file suffix
+ *
+ * The DFU suffix is protected by a CRC32 using the reflected IEEE
+ * polynomial, seeded with 0xffffffff and with no final XOR.
+ *
+ * The generic implementation processes eight bytes per iteration using
+ * slicing-by-8 tables. The CPU is checked at runtime, and if it has the
+ * ARMv8 CRC32 extension those instructions are used instead. On x86 the
+ * carry-less multiply instruction (PCLMULQDQ) is used to fold 64 bytes
+ * at a time.
+ *
+ * Note: the SSE4.2 crc32 instruction cannot be used here as it only
+ * computes the Castagnoli polynomial and not the IEEE one.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DFU_CRC32_HAVE_PCLMUL
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__linux__)
+#define DFU_CRC32_HAVE_ARMV8
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32		(1 << 7)
+#endif
+#endif
+
+#include "dfu-crc32-private.h"
+
+typedef guint32 (*DfuCrc32UpdateFunc)	(guint32	 crc,
+					 const guint8	*data,
+					 gsize		 length);
+
+typedef struct {
+	const gchar		*name;
+	DfuCrc32UpdateFunc	 update;
+} DfuCrc32Impl;
+
+static guint32 _crctbl[8][256];
+
+/**
+ * dfu_crc32_init_tables:
+ **/
+static void
+dfu_crc32_init_tables (void)
+{
+	guint i;
+	guint j;
+
+	/* the classic byte-at-a-time table */
+	for (i = 0; i < 256; i++) {
+		guint32 tmp = i;
+		for (j = 0; j < 8; j++)
+			tmp = (tmp & 1) ? (tmp >> 1) ^ 0xedb88320 : tmp >> 1;
+		_crctbl[0][i] = tmp;
+	}
+
+	/* each extra table advances the CRC by one more zero byte */
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			guint32 tmp = _crctbl[j - 1][i];
+			_crctbl[j][i] = (tmp >> 8) ^ _crctbl[0][tmp & 0xff];
+		}
+	}
+}
+
+/**
+ * dfu_crc32_update_slice8:
+ **/
+static guint32
+dfu_crc32_update_slice8 (guint32 crc, const guint8 *data, gsize length)
+{
+	/* align so the 32 bit loads are cheap */
+	for (; length > 0 && ((guintptr) data & 7) != 0; length--)
+		crc = _crctbl[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	for (; length >= 8; length -= 8) {
+		guint32 one;
+		guint32 two;
+		memcpy (&one, data + 0, 4);
+		memcpy (&two, data + 4, 4);
+		one = GUINT32_FROM_LE (one) ^ crc;
+		two = GUINT32_FROM_LE (two);
+		crc = _crctbl[7][one & 0xff] ^
+		      _crctbl[6][(one >> 8) & 0xff] ^
+		      _crctbl[5][(one >> 16) & 0xff] ^
+		      _crctbl[4][one >> 24] ^
+		      _crctbl[3][two & 0xff] ^
+		      _crctbl[2][(two >> 8) & 0xff] ^
+		      _crctbl[1][(two >> 16) & 0xff] ^
+		      _crctbl[0][two >> 24];
+		data += 8;
+	}
+
+	/* trailing bytes */
+	for (; length > 0; length--)
+		crc = _crctbl[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef DFU_CRC32_HAVE_ARMV8
+/* use inline assembly so this builds without -march=armv8-a+crc */
+#define DFU_CRC32_ARMV8(insn, crc, value)				\
+	__asm__ (".arch_extension crc\n\t" insn			\
+		 : "+r" (crc) : "r" (value))
+
+/**
+ * dfu_crc32_update_armv8:
+ **/
+static guint32
+dfu_crc32_update_armv8 (guint32 crc, const guint8 *data, gsize length)
+{
+	for (; length > 0 && ((guintptr) data & 7) != 0; length--) {
+		guint32 tmp = *data++;
+		DFU_CRC32_ARMV8 ("crc32b %w0, %w0, %w1", crc, tmp);
+	}
+	for (; length >= 8; length -= 8) {
+		guint64 tmp;
+		memcpy (&tmp, data, 8);
+		tmp = GUINT64_FROM_LE (tmp);
+		DFU_CRC32_ARMV8 ("crc32x %w0, %w0, %x1", crc, tmp);
+		data += 8;
+	}
+	for (; length > 0; length--) {
+		guint32 tmp = *data++;
+		DFU_CRC32_ARMV8 ("crc32b %w0, %w0, %w1", crc, tmp);
+	}
+	return crc;
+}
+#endif
+
+#ifdef DFU_CRC32_HAVE_PCLMUL
+/**
+ * dfu_crc32_update_pclmul:
+ *
+ * Folds four 128 bit lanes in parallel and then reduces the remainder
+ * with a Barrett reduction, using the constants for the reflected IEEE
+ * polynomial from the Intel "Fast CRC Computation Using PCLMULQDQ"
+ * paper. Anything shorter than one 16 byte block is handed to the
+ * table implementation.
+ **/
+__attribute__((target("pclmul,sse4.1")))
+static guint32
+dfu_crc32_update_pclmul (guint32 crc, const guint8 *data, gsize length)
+{
+	static const guint64 k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+	static const guint64 k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+	static const guint64 k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+	static const guint64 poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, mask;
+
+	/* not worth setting up the folding */
+	if (length < 64)
+		return dfu_crc32_update_slice8 (crc, data, length);
+
+	/* load the first 64 bytes and mix in the running CRC */
+	x1 = _mm_loadu_si128 ((const __m128i *) (data + 0x00));
+	x2 = _mm_loadu_si128 ((const __m128i *) (data + 0x10));
+	x3 = _mm_loadu_si128 ((const __m128i *) (data + 0x20));
+	x4 = _mm_loadu_si128 ((const __m128i *) (data + 0x30));
+	x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 ((gint) crc));
+	x0 = _mm_load_si128 ((const __m128i *) k1k2);
+	data += 64;
+	length -= 64;
+
+	/* fold blocks of 64 bytes */
+	for (; length >= 64; length -= 64) {
+		x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128 (x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128 (x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128 (x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128 (x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128 (x4, x0, 0x11);
+		x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5),
+				    _mm_loadu_si128 ((const __m128i *) (data + 0x00)));
+		x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6),
+				    _mm_loadu_si128 ((const __m128i *) (data + 0x10)));
+		x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7),
+				    _mm_loadu_si128 ((const __m128i *) (data + 0x20)));
+		x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8),
+				    _mm_loadu_si128 ((const __m128i *) (data + 0x30)));
+		data += 64;
+	}
+
+	/* fold the four lanes into one */
+	x0 = _mm_load_si128 ((const __m128i *) k3k4);
+	x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+	x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+	x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+	x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+	x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+	x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+	/* fold any remaining blocks of 16 bytes */
+	for (; length >= 16; length -= 16) {
+		x5 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128 (x1, x0, 0x11);
+		x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5),
+				    _mm_loadu_si128 ((const __m128i *) data));
+		data += 16;
+	}
+
+	/* fold 128 bits down to 64 bits */
+	x2 = _mm_clmulepi64_si128 (x1, x0, 0x10);
+	mask = _mm_setr_epi32 (~0, 0, ~0, 0);
+	x1 = _mm_srli_si128 (x1, 8);
+	x1 = _mm_xor_si128 (x1, x2);
+	x0 = _mm_loadl_epi64 ((const __m128i *) k5k0);
+	x2 = _mm_srli_si128 (x1, 4);
+	x1 = _mm_and_si128 (x1, mask);
+	x1 = _mm_clmulepi64_si128 (x1, x0, 0x00);
+	x1 = _mm_xor_si128 (x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128 ((const __m128i *) poly);
+	x2 = _mm_and_si128 (x1, mask);
+	x2 = _mm_clmulepi64_si128 (x2, x0, 0x10);
+	x2 = _mm_and_si128 (x2, mask);
+	x2 = _mm_clmulepi64_si128 (x2, x0, 0x00);
+	x1 = _mm_xor_si128 (x1, x2);
+	crc = (guint32) _mm_extract_epi32 (x1, 1);
+
+	/* trailing bytes */
+	return dfu_crc32_update_slice8 (crc, data, length);
+}
+
+/**
+ * dfu_crc32_cpu_has_pclmul:
+ **/
+static gboolean
+dfu_crc32_cpu_has_pclmul (void)
+{
+	guint eax, ebx, ecx, edx;
+	if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+		return FALSE;
+	return (ecx & bit_PCLMUL) > 0 && (ecx & bit_SSE4_1) > 0;
+}
+#endif
+
+/**
+ * dfu_crc32_get_impl_internal:
+ **/
+static const DfuCrc32Impl *
+dfu_crc32_get_impl_internal (void)
+{
+	static gsize impl_once = 0;
+	static DfuCrc32Impl impl = { NULL, NULL };
+
+	if (g_once_init_enter (&impl_once)) {
+		/* the fallback is also used for tiny updates */
+		dfu_crc32_init_tables ();
+		impl.name = "slice-by-8";
+		impl.update = dfu_crc32_update_slice8;
+
+		/* distro builds target a generic CPU, so ask the kernel */
+#ifdef DFU_CRC32_HAVE_ARMV8
+		if ((getauxval (AT_HWCAP) & HWCAP_CRC32) > 0) {
+			impl.name = "armv8-crc32";
+			impl.update = dfu_crc32_update_armv8;
+		}
+#endif
+#ifdef DFU_CRC32_HAVE_PCLMUL
+		if (dfu_crc32_cpu_has_pclmul ()) {
+			impl.name = "pclmulqdq";
+			impl.update = dfu_crc32_update_pclmul;
+		}
+#endif
+		g_once_init_leave (&impl_once, 1);
+	}
+	return &impl;
+}
+
+/**
+ * dfu_crc32_update:
+ * @crc: the running CRC, initially %DFU_CRC32_INIT
+ * @data: data to add
+ * @length: length of @data
+ *
+ * Adds data to a running DFU CRC32. This can be called several times
+ * to checksum data that is not contiguous in memory.
+ *
+ * Return value: the new running CRC
+ **/
+guint32
+dfu_crc32_update (guint32 crc, const guint8 *data, gsize length)
+{
+	const DfuCrc32Impl *impl = dfu_crc32_get_impl_internal ();
+	if (length == 0)
+		return crc;
+	return impl->update (crc, data, length);
+}
+
+/**
+ * dfu_crc32_update_bytewise:
+ * @crc: the running CRC, initially %DFU_CRC32_INIT
+ * @data: data to add
+ * @length: length of @data
+ *
+ * Adds data to a running DFU CRC32 one byte at a time. This is only
+ * useful as a reference when testing the optimized implementations.
+ *
+ * Return value: the new running CRC
+ **/
+guint32
+dfu_crc32_update_bytewise (guint32 crc, const guint8 *data, gsize length)
+{
+	gsize i;
+	dfu_crc32_get_impl_internal ();
+	for (i = 0; i < length; i++)
+		crc = _crctbl[0][(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/**
+ * dfu_crc32_generate:
+ * @data: data to checksum
+ * @length: length of @data
+ *
+ * Generates the CRC32 used in the DFU file suffix.
+ *
+ * Return value: the CRC
+ **/
+guint32
+dfu_crc32_generate (const guint8 *data, gsize length)
+{
+	return dfu_crc32_update (DFU_CRC32_INIT, data, length);
+}
+
+/**
+ * dfu_crc32_get_impl:
+ *
+ * Gets the name of the CRC32 implementation selected for this CPU.
+ *
+ * Return value: a string, e.g. "slice-by-8"
+ **/
+const gchar *
+dfu_crc32_get_impl (void)
+{
+	return dfu_crc32_get_impl_internal ()->name;
+}
@@ -27,6 +27,7 @@
 #include <gusb.h>
 
 #include "dfu-device.h"
+#include "dfu-emulator-private.h"
 
 G_BEGIN_DECLS
 
@@ -40,11 +41,37 @@ void		 dfu_device_error_fixup			(DfuDevice	*device,
 							 GCancellable	*cancellable,
 							 GError		**error);
 guint		 dfu_device_get_download_timeout	(DfuDevice	*device);
+guint16		 dfu_device_get_transfer_size_max	(DfuDevice	*device);
 gchar		*dfu_device_get_quirks_as_string	(DfuDevice	*device);
 gboolean	 dfu_device_set_new_usb_dev		(DfuDevice	*device,
 							 GUsbDevice	*dev,
 							 GCancellable	*cancellable,
 							 GError		**error);
+gboolean	 dfu_device_control_transfer		(DfuDevice	*device,
+							 GUsbDeviceDirection direction,
+							 guint8		 request,
+							 guint16	 value,
+							 guint8		*data,
+							 gsize		 length,
+							 gsize		*actual_length,
+							 GCancellable	*cancellable,
+							 GError		**error);
+gboolean	 dfu_device_set_interface_alt		(DfuDevice	*device,
+							 guint8		 alt_setting,
+							 GError		**error);
+const gchar	*dfu_device_get_journal_dir		(DfuDevice	*device);
+const gchar	*dfu_device_get_serial_number		(DfuDevice	*device);
+
+/* export this just for the self tests */
+DfuDevice	*dfu_device_new_emulated		(DfuEmulator	*emulator);
+void		 dfu_device_set_new_emulator		(DfuDevice	*device,
+							 DfuEmulator	*emulator);
+void		 dfu_device_set_runtime_release		(DfuDevice	*device,
+							 guint16	 release);
+void		 dfu_device_set_journal_dir		(DfuDevice	*device,
+							 const gchar	*journal_dir);
+void		 dfu_device_set_tuning_filename		(DfuDevice	*device,
+							 const gchar	*tuning_filename);
 
 G_END_DECLS
 
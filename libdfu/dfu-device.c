@@ -32,6 +32,9 @@
  *    file. The file format is chosen automatically, with DfuSe being
  *    chosen if the device contains more than one target.
  *
+ * Different devices can be used from different threads at the same time,
+ * although each device should only be used by one thread at a time.
+ *
  * See also: #DfuTarget, #DfuFirmware
  */
 
@@ -39,6 +42,7 @@
 
 #include <string.h>
 
+#include "dfu-common-private.h"
 #include "dfu-common.h"
 #include "dfu-device-private.h"
 #include "dfu-error.h"
@@ -63,14 +67,26 @@ typedef struct {
 	gboolean		 dfuse_supported;
 	gboolean		 done_upload_or_download;
 	gchar			*display_name;
+	gchar			*serial_number;
 	gchar			*platform_id;
 	guint16			 runtime_pid;
 	guint16			 runtime_vid;
 	guint16			 runtime_release;
 	guint16			 transfer_size;
+	guint16			 transfer_size_max;	/* from the descriptor */
+	gboolean		 transfer_size_set;	/* by the caller */
 	guint8			 iface_number;
 	guint			 dnload_timeout;
 	guint			 timeout_ms;
+	gboolean		 timeout_set;		/* by the caller */
+	GMainContext		*task_context;		/* when in a worker */
+	GMainContext		*context;		/* to wait for replug */
+	GPtrArray		*replug_tasks;		/* of GTask */
+	GMutex			 mutex;			/* for the above */
+	GThread			*thread;		/* created in */
+	DfuEmulator		*emulator;		/* instead of dev */
+	gchar			*journal_dir;
+	gchar			*tuning_filename;
 } DfuDevicePrivate;
 
 enum {
@@ -158,8 +174,14 @@ dfu_device_init (DfuDevice *device)
 	priv->state = DFU_STATE_APP_IDLE;
 	priv->status = DFU_STATUS_OK;
 	priv->targets = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	priv->replug_tasks = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	g_mutex_init (&priv->mutex);
+	priv->context = g_main_context_new ();
+	priv->thread = g_thread_ref (g_thread_self ());
 	priv->timeout_ms = 500;
 	priv->transfer_size = 64;
+	priv->journal_dir = dfu_utils_get_state_filename ("dfu-journal");
+	priv->tuning_filename = dfu_utils_get_state_filename ("dfu-tuning.conf");
 }
 
 /**
@@ -180,6 +202,21 @@ dfu_device_get_transfer_size (DfuDevice *device)
 	return priv->transfer_size;
 }
 
+/**
+ * dfu_device_get_transfer_size_max:
+ *
+ * Gets the largest transfer size the device claims to support, which
+ * the tuned transfer size must not exceed.
+ *
+ * Return value: packet size, or 0 for unknown
+ **/
+guint16
+dfu_device_get_transfer_size_max (DfuDevice *device)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	return priv->transfer_size_max;
+}
+
 /**
  * dfu_device_get_download_timeout:
  * @device: a #GUsbDevice
@@ -213,6 +250,7 @@ dfu_device_set_transfer_size (DfuDevice *device, guint16 transfer_size)
 	DfuDevicePrivate *priv = GET_PRIVATE (device);
 	g_return_if_fail (DFU_IS_DEVICE (device));
 	priv->transfer_size = transfer_size;
+	priv->transfer_size_set = TRUE;
 }
 
 /**
@@ -228,9 +266,19 @@ dfu_device_finalize (GObject *object)
 	if (priv->dev != NULL)
 		g_usb_device_close (priv->dev, NULL);
 
+	if (priv->emulator != NULL)
+		g_object_unref (priv->emulator);
+
 	g_free (priv->display_name);
+	g_free (priv->serial_number);
 	g_free (priv->platform_id);
+	g_free (priv->journal_dir);
+	g_free (priv->tuning_filename);
 	g_ptr_array_unref (priv->targets);
+	g_ptr_array_unref (priv->replug_tasks);
+	g_mutex_clear (&priv->mutex);
+	g_main_context_unref (priv->context);
+	g_thread_unref (priv->thread);
 
 	G_OBJECT_CLASS (dfu_device_parent_class)->finalize (object);
 }
@@ -254,6 +302,7 @@ dfu_device_parse_iface_data (DfuDevice *device, GBytes *iface_data)
 	const DfuFuncDescriptor *desc;
 	gsize iface_data_length;
 	guint16 dfu_version;
+	guint16 transfer_size;
 
 	/* parse the functional descriptor */
 	desc = g_bytes_get_data (iface_data, &iface_data_length);
@@ -269,11 +318,11 @@ dfu_device_parse_iface_data (DfuDevice *device, GBytes *iface_data)
 	}
 
 	/* check transfer size */
-	priv->transfer_size = desc->wTransferSize;
-	if (priv->transfer_size == 0x0000) {
+	transfer_size = desc->wTransferSize;
+	if (transfer_size == 0x0000) {
 		g_warning ("DFU transfer size invalid, using default: 0x%04x",
 			   desc->wTransferSize);
-		priv->transfer_size = 64;
+		transfer_size = 64;
 	}
 
 	/* check DFU version */
@@ -297,7 +346,12 @@ dfu_device_parse_iface_data (DfuDevice *device, GBytes *iface_data)
 	/* ST-specific */
 	if (priv->dfuse_supported &&
 	    desc->bmAttributes & DFU_DEVICE_ATTRIBUTE_CAN_ACCELERATE)
-		priv->transfer_size = 0x1000;
+		transfer_size = 0x1000;
+	priv->transfer_size_max = transfer_size;
+
+	/* keep the size the caller asked for when the device replugs */
+	if (!priv->transfer_size_set)
+		priv->transfer_size = transfer_size;
 
 	/* get attributes about the DFU operation */
 	priv->attributes = desc->bmAttributes;
@@ -471,6 +525,7 @@ dfu_device_set_timeout (DfuDevice *device, guint timeout_ms)
 	DfuDevicePrivate *priv = GET_PRIVATE (device);
 	g_return_if_fail (DFU_IS_DEVICE (device));
 	priv->timeout_ms = timeout_ms;
+	priv->timeout_set = TRUE;
 }
 
 /**
@@ -669,6 +724,49 @@ dfu_device_new (GUsbDevice *dev)
 	return device;
 }
 
+/**
+ * dfu_device_new_emulated: (skip)
+ * @emulator: A #DfuEmulator
+ *
+ * Creates a new DFU device object that talks to an emulated device
+ * rather than to real hardware, which allows the transfer logic to be
+ * tested without any device attached.
+ *
+ * Return value: a new #DfuDevice
+ **/
+DfuDevice *
+dfu_device_new_emulated (DfuEmulator *emulator)
+{
+	DfuDevicePrivate *priv;
+	DfuDevice *device;
+	guint8 i;
+
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), NULL);
+
+	device = g_object_new (DFU_TYPE_DEVICE, NULL);
+	priv = GET_PRIVATE (device);
+	priv->emulator = g_object_ref (emulator);
+	priv->platform_id = g_strdup ("emulated");
+	priv->mode = DFU_MODE_DFU;
+	priv->state = DFU_STATE_DFU_IDLE;
+	priv->iface_number = 0;
+	priv->dfuse_supported = dfu_emulator_get_dfuse (emulator);
+	priv->transfer_size = dfu_emulator_get_transfer_size (emulator);
+	priv->transfer_size_max = priv->transfer_size;
+	priv->attributes = DFU_DEVICE_ATTRIBUTE_CAN_DOWNLOAD |
+			   DFU_DEVICE_ATTRIBUTE_CAN_UPLOAD |
+			   DFU_DEVICE_ATTRIBUTE_MANIFEST_TOL;
+
+	/* one target for each alternate setting */
+	for (i = 0; i < dfu_emulator_get_n_targets (emulator); i++) {
+		DfuTarget *target;
+		target = dfu_target_new_for_alt (device, i,
+						 dfu_emulator_get_alt_name (emulator, i));
+		g_ptr_array_add (priv->targets, target);
+	}
+	return device;
+}
+
 /**
  * dfu_device_get_targets:
  * @device: a #DfuDevice
@@ -876,6 +974,65 @@ dfu_device_get_display_name (DfuDevice *device)
 	return priv->display_name;
 }
 
+typedef struct {
+	DfuDevice	*device;
+	guint		 signal_idx;
+	guint		 value;
+} DfuDeviceEmitHelper;
+
+/**
+ * dfu_device_emit_helper_free:
+ **/
+static void
+dfu_device_emit_helper_free (DfuDeviceEmitHelper *helper)
+{
+	g_object_unref (helper->device);
+	g_free (helper);
+}
+
+/**
+ * dfu_device_emit_helper_cb:
+ **/
+static gboolean
+dfu_device_emit_helper_cb (gpointer user_data)
+{
+	DfuDeviceEmitHelper *helper = (DfuDeviceEmitHelper *) user_data;
+	g_signal_emit (helper->device, signals[helper->signal_idx], 0, helper->value);
+	return FALSE;
+}
+
+/**
+ * dfu_device_emit:
+ *
+ * Emits a signal, but from the main context of the caller if the
+ * transfer is being done in a worker thread.
+ **/
+static void
+dfu_device_emit (DfuDevice *device, guint signal_idx, guint value)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	DfuDeviceEmitHelper *helper;
+	g_autoptr(GMainContext) context = NULL;
+
+	g_mutex_lock (&priv->mutex);
+	if (priv->task_context != NULL)
+		context = g_main_context_ref (priv->task_context);
+	g_mutex_unlock (&priv->mutex);
+	if (context == NULL || g_main_context_is_owner (context)) {
+		g_signal_emit (device, signals[signal_idx], 0, value);
+		return;
+	}
+	helper = g_new0 (DfuDeviceEmitHelper, 1);
+	helper->device = g_object_ref (device);
+	helper->signal_idx = signal_idx;
+	helper->value = value;
+	g_main_context_invoke_full (context,
+				    G_PRIORITY_DEFAULT,
+				    dfu_device_emit_helper_cb,
+				    helper,
+				    (GDestroyNotify) dfu_device_emit_helper_free);
+}
+
 /**
  * dfu_device_set_state:
  **/
@@ -886,7 +1043,7 @@ dfu_device_set_state (DfuDevice *device, DfuState state)
 	if (priv->state == state)
 		return;
 	priv->state = state;
-	g_signal_emit (device, signals[SIGNAL_STATE_CHANGED], 0, state);
+	dfu_device_emit (device, SIGNAL_STATE_CHANGED, state);
 }
 
 /**
@@ -899,7 +1056,87 @@ dfu_device_set_status (DfuDevice *device, DfuStatus status)
 	if (priv->status == status)
 		return;
 	priv->status = status;
-	g_signal_emit (device, signals[SIGNAL_STATUS_CHANGED], 0, status);
+	dfu_device_emit (device, SIGNAL_STATUS_CHANGED, status);
+}
+
+/**
+ * dfu_device_control_transfer: (skip)
+ * @device: a #DfuDevice
+ * @direction: a #GUsbDeviceDirection
+ * @request: a #DfuRequest
+ * @value: the wValue, e.g. the block number
+ * @data: the data buffer, or %NULL
+ * @length: the size of @data
+ * @actual_length: (out): the number of bytes transferred, or %NULL
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: a #GError, or %NULL
+ *
+ * Sends a DFU class request to the interface, or to the emulated device
+ * if one is being used.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+dfu_device_control_transfer (DfuDevice *device,
+			     GUsbDeviceDirection direction,
+			     guint8 request,
+			     guint16 value,
+			     guint8 *data,
+			     gsize length,
+			     gsize *actual_length,
+			     GCancellable *cancellable,
+			     GError **error)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+
+	if (priv->emulator != NULL) {
+		if (g_cancellable_set_error_if_cancelled (cancellable, error))
+			return FALSE;
+		return dfu_emulator_control_transfer (priv->emulator,
+						      direction,
+						      request,
+						      value,
+						      data, length,
+						      actual_length,
+						      error);
+	}
+	return g_usb_device_control_transfer (priv->dev,
+					      direction,
+					      G_USB_DEVICE_REQUEST_TYPE_CLASS,
+					      G_USB_DEVICE_RECIPIENT_INTERFACE,
+					      request,
+					      value,
+					      priv->iface_number,
+					      data, length,
+					      actual_length,
+					      priv->timeout_ms,
+					      cancellable,
+					      error);
+}
+
+/**
+ * dfu_device_set_interface_alt: (skip)
+ * @device: a #DfuDevice
+ * @alt_setting: the alternate setting
+ * @error: a #GError, or %NULL
+ *
+ * Selects the alternate setting on the DFU interface.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+dfu_device_set_interface_alt (DfuDevice *device, guint8 alt_setting, GError **error)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	if (priv->emulator != NULL) {
+		return dfu_emulator_set_alt_setting (priv->emulator,
+						     alt_setting,
+						     error);
+	}
+	return g_usb_device_set_interface_alt (priv->dev,
+					       (gint) priv->iface_number,
+					       (gint) alt_setting,
+					       error);
 }
 
 /**
@@ -926,7 +1163,7 @@ dfu_device_refresh (DfuDevice *device, GCancellable *cancellable, GError **error
 	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
 	/* no backing USB device */
-	if (priv->dev == NULL) {
+	if (priv->dev == NULL && priv->emulator == NULL) {
 		g_set_error (error,
 			     DFU_ERROR,
 			     DFU_ERROR_INTERNAL,
@@ -944,17 +1181,13 @@ dfu_device_refresh (DfuDevice *device, GCancellable *cancellable, GError **error
 		return FALSE;
 	}
 
-	if (!g_usb_device_control_transfer (priv->dev,
-					    G_USB_DEVICE_DIRECTION_DEVICE_TO_HOST,
-					    G_USB_DEVICE_REQUEST_TYPE_CLASS,
-					    G_USB_DEVICE_RECIPIENT_INTERFACE,
-					    DFU_REQUEST_GETSTATUS,
-					    0,
-					    priv->iface_number,
-					    buf, sizeof(buf), &actual_length,
-					    priv->timeout_ms,
-					    cancellable,
-					    &error_local)) {
+	if (!dfu_device_control_transfer (device,
+					  G_USB_DEVICE_DIRECTION_DEVICE_TO_HOST,
+					  DFU_REQUEST_GETSTATUS,
+					  0,
+					  buf, sizeof(buf), &actual_length,
+					  cancellable,
+					  &error_local)) {
 		g_set_error (error,
 			     DFU_ERROR,
 			     DFU_ERROR_NOT_SUPPORTED,
@@ -1042,17 +1275,13 @@ dfu_device_detach (DfuDevice *device, GCancellable *cancellable, GError **error)
 	/* inform UI there's going to be a detach:attach */
 	dfu_device_set_state (device, DFU_STATE_APP_DETACH);
 
-	if (!g_usb_device_control_transfer (priv->dev,
-					    G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE,
-					    G_USB_DEVICE_REQUEST_TYPE_CLASS,
-					    G_USB_DEVICE_RECIPIENT_INTERFACE,
-					    DFU_REQUEST_DETACH,
-					    0,
-					    priv->iface_number,
-					    NULL, 0, NULL,
-					    priv->timeout_ms,
-					    cancellable,
-					    &error_local)) {
+	if (!dfu_device_control_transfer (device,
+					  G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE,
+					  DFU_REQUEST_DETACH,
+					  0,
+					  NULL, 0, NULL,
+					  cancellable,
+					  &error_local)) {
 		/* refresh the error code */
 		dfu_device_error_fixup (device, cancellable, &error_local);
 		g_set_error (error,
@@ -1094,7 +1323,7 @@ dfu_device_abort (DfuDevice *device, GCancellable *cancellable, GError **error)
 	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
 	/* no backing USB device */
-	if (priv->dev == NULL) {
+	if (priv->dev == NULL && priv->emulator == NULL) {
 		g_set_error (error,
 			     DFU_ERROR,
 			     DFU_ERROR_INTERNAL,
@@ -1112,17 +1341,13 @@ dfu_device_abort (DfuDevice *device, GCancellable *cancellable, GError **error)
 		return FALSE;
 	}
 
-	if (!g_usb_device_control_transfer (priv->dev,
-					    G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE,
-					    G_USB_DEVICE_REQUEST_TYPE_CLASS,
-					    G_USB_DEVICE_RECIPIENT_INTERFACE,
-					    DFU_REQUEST_ABORT,
-					    0,
-					    priv->iface_number,
-					    NULL, 0, NULL,
-					    priv->timeout_ms,
-					    cancellable,
-					    &error_local)) {
+	if (!dfu_device_control_transfer (device,
+					  G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE,
+					  DFU_REQUEST_ABORT,
+					  0,
+					  NULL, 0, NULL,
+					  cancellable,
+					  &error_local)) {
 		/* refresh the error code */
 		dfu_device_error_fixup (device, cancellable, &error_local);
 		g_set_error (error,
@@ -1158,7 +1383,7 @@ dfu_device_clear_status (DfuDevice *device, GCancellable *cancellable, GError **
 	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
 	/* no backing USB device */
-	if (priv->dev == NULL) {
+	if (priv->dev == NULL && priv->emulator == NULL) {
 		g_set_error (error,
 			     DFU_ERROR,
 			     DFU_ERROR_INTERNAL,
@@ -1176,17 +1401,13 @@ dfu_device_clear_status (DfuDevice *device, GCancellable *cancellable, GError **
 		return FALSE;
 	}
 
-	if (!g_usb_device_control_transfer (priv->dev,
-					    G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE,
-					    G_USB_DEVICE_REQUEST_TYPE_CLASS,
-					    G_USB_DEVICE_RECIPIENT_INTERFACE,
-					    DFU_REQUEST_CLRSTATUS,
-					    0,
-					    priv->iface_number,
-					    NULL, 0, NULL,
-					    priv->timeout_ms,
-					    cancellable,
-					    &error_local)) {
+	if (!dfu_device_control_transfer (device,
+					  G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE,
+					  DFU_REQUEST_CLRSTATUS,
+					  0,
+					  NULL, 0, NULL,
+					  cancellable,
+					  &error_local)) {
 		/* refresh the error code */
 		dfu_device_error_fixup (device, cancellable, &error_local);
 		g_set_error (error,
@@ -1215,6 +1436,196 @@ dfu_device_get_interface (DfuDevice *device)
 	return priv->iface_number;
 }
 
+/**
+ * dfu_device_get_tuning_group:
+ **/
+static gchar *
+dfu_device_get_tuning_group (DfuDevice *device)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+
+	/* emulated devices have no USB IDs */
+	if (priv->dev == NULL)
+		return g_strdup (priv->platform_id);
+	return g_strdup_printf ("%04x:%04x:%04x",
+				g_usb_device_get_vid (priv->dev),
+				g_usb_device_get_pid (priv->dev),
+				g_usb_device_get_release (priv->dev));
+}
+
+/**
+ * dfu_device_load_tuning:
+ *
+ * Loads the transfer parameters saved by dfu_device_save_tuning(), unless
+ * the caller has already chosen them.
+ **/
+static void
+dfu_device_load_tuning (DfuDevice *device)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	guint64 tmp;
+	guint16 transfer_size_max = G_MAXUINT16;
+	g_autofree gchar *group = NULL;
+	g_autoptr(GError) error_local = NULL;
+	g_autoptr(GKeyFile) kf = NULL;
+
+	kf = g_key_file_new ();
+	if (!g_key_file_load_from_file (kf, priv->tuning_filename, G_KEY_FILE_NONE,
+					&error_local)) {
+		if (!g_error_matches (error_local, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+			g_debug ("failed to load %s: %s",
+				 priv->tuning_filename, error_local->message);
+		}
+		return;
+	}
+	group = dfu_device_get_tuning_group (device);
+	if (!g_key_file_has_group (kf, group))
+		return;
+
+	/* only use sane values */
+	if (priv->transfer_size_max > 0)
+		transfer_size_max = priv->transfer_size_max;
+	if (!priv->transfer_size_set) {
+		tmp = g_key_file_get_uint64 (kf, group, "TransferSize", NULL);
+		if (tmp > 0 && tmp <= transfer_size_max) {
+			g_debug ("using tuned transfer size of 0x%04x", (guint) tmp);
+			priv->transfer_size = tmp;
+		}
+	}
+	if (!priv->timeout_set) {
+		tmp = g_key_file_get_uint64 (kf, group, "Timeout", NULL);
+		if (tmp > 0 && tmp <= G_MAXUINT) {
+			g_debug ("using tuned timeout of %ums", (guint) tmp);
+			priv->timeout_ms = tmp;
+		}
+	}
+}
+
+/**
+ * dfu_device_save_tuning:
+ * @device: a #DfuDevice
+ * @error: a #GError, or %NULL
+ *
+ * Saves the current transfer size and timeout so that they are used
+ * automatically the next time a device with the same VID, PID and
+ * release is opened.
+ *
+ * Return value: %TRUE for success
+ *
+ * Since: 0.7.2
+ **/
+gboolean
+dfu_device_save_tuning (DfuDevice *device, GError **error)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	g_autofree gchar *dirname = NULL;
+	g_autofree gchar *group = NULL;
+	g_autoptr(GError) error_local = NULL;
+	g_autoptr(GKeyFile) kf = NULL;
+
+	g_return_val_if_fail (DFU_IS_DEVICE (device), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	/* no backing USB device */
+	if (priv->dev == NULL && priv->emulator == NULL) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "failed to save tuning: no GUsbDevice for %s",
+			     priv->platform_id);
+		return FALSE;
+	}
+
+	/* keep the values for other devices */
+	kf = g_key_file_new ();
+	if (!g_key_file_load_from_file (kf, priv->tuning_filename,
+					G_KEY_FILE_KEEP_COMMENTS,
+					&error_local)) {
+		if (!g_error_matches (error_local, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INTERNAL,
+				     "failed to load %s: %s",
+				     priv->tuning_filename, error_local->message);
+			return FALSE;
+		}
+	}
+	group = dfu_device_get_tuning_group (device);
+	g_key_file_set_uint64 (kf, group, "TransferSize", priv->transfer_size);
+	g_key_file_set_uint64 (kf, group, "Timeout", priv->timeout_ms);
+
+	/* save */
+	dirname = g_path_get_dirname (priv->tuning_filename);
+	if (g_mkdir_with_parents (dirname, 0755) != 0) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "failed to create %s", dirname);
+		return FALSE;
+	}
+	if (!g_key_file_save_to_file (kf, priv->tuning_filename, &error_local)) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_PERMISSION_DENIED,
+			     "failed to save tuning to %s: %s",
+			     priv->tuning_filename, error_local->message);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * dfu_device_set_tuning_filename:
+ *
+ * Sets the file used for the values saved by dfu_device_save_tuning(),
+ * which is only useful for the self tests.
+ **/
+void
+dfu_device_set_tuning_filename (DfuDevice *device, const gchar *tuning_filename)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	g_free (priv->tuning_filename);
+	priv->tuning_filename = g_strdup (tuning_filename);
+}
+
+/**
+ * dfu_device_get_journal_dir:
+ *
+ * Gets the directory used for the download journals of each target.
+ **/
+const gchar *
+dfu_device_get_journal_dir (DfuDevice *device)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	return priv->journal_dir;
+}
+
+/**
+ * dfu_device_get_serial_number:
+ *
+ * Gets the USB serial number, which is only known once the device is open.
+ **/
+const gchar *
+dfu_device_get_serial_number (DfuDevice *device)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	return priv->serial_number;
+}
+
+/**
+ * dfu_device_set_journal_dir:
+ *
+ * Sets the directory used for the download journals of each target,
+ * which is only useful for the self tests.
+ **/
+void
+dfu_device_set_journal_dir (DfuDevice *device, const gchar *journal_dir)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	g_free (priv->journal_dir);
+	priv->journal_dir = g_strdup (journal_dir);
+}
+
 /**
  * dfu_device_open:
  * @device: a #DfuDevice
@@ -1240,7 +1651,7 @@ dfu_device_open (DfuDevice *device, DfuDeviceOpenFlags flags,
 	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
 	/* no backing USB device */
-	if (priv->dev == NULL) {
+	if (priv->dev == NULL && priv->emulator == NULL) {
 		g_set_error (error,
 			     DFU_ERROR,
 			     DFU_ERROR_INTERNAL,
@@ -1249,51 +1660,65 @@ dfu_device_open (DfuDevice *device, DfuDeviceOpenFlags flags,
 		return FALSE;
 	}
 
-	/* open */
-	if (!g_usb_device_open (priv->dev, &error_local)) {
-		if (g_error_matches (error_local,
-				     G_USB_DEVICE_ERROR,
-				     G_USB_DEVICE_ERROR_ALREADY_OPEN)) {
-			g_debug ("device already open, ignoring");
-			return TRUE;
-		}
-		if (g_error_matches (error_local,
-				     G_USB_DEVICE_ERROR,
-				     G_USB_DEVICE_ERROR_PERMISSION_DENIED)) {
+	/* emulated devices have nothing to open or claim */
+	if (priv->dev != NULL) {
+		/* open */
+		if (!g_usb_device_open (priv->dev, &error_local)) {
+			if (g_error_matches (error_local,
+					     G_USB_DEVICE_ERROR,
+					     G_USB_DEVICE_ERROR_ALREADY_OPEN)) {
+				g_debug ("device already open, ignoring");
+				dfu_device_load_tuning (device);
+				return TRUE;
+			}
+			if (g_error_matches (error_local,
+					     G_USB_DEVICE_ERROR,
+					     G_USB_DEVICE_ERROR_PERMISSION_DENIED)) {
+				g_set_error (error,
+					     DFU_ERROR,
+					     DFU_ERROR_PERMISSION_DENIED,
+					     "%s", error_local->message);
+				return FALSE;
+			}
 			g_set_error (error,
 				     DFU_ERROR,
-				     DFU_ERROR_PERMISSION_DENIED,
-				     "%s", error_local->message);
+				     DFU_ERROR_INVALID_DEVICE,
+				     "cannot open device %s: %s",
+				     g_usb_device_get_platform_id (priv->dev),
+				     error_local->message);
 			return FALSE;
 		}
-		g_set_error (error,
-			     DFU_ERROR,
-			     DFU_ERROR_INVALID_DEVICE,
-			     "cannot open device %s: %s",
-			     g_usb_device_get_platform_id (priv->dev),
-			     error_local->message);
-		return FALSE;
-	}
 
-	/* claim the correct interface if set */
-	if (priv->iface_number != 0xff) {
-		if (!g_usb_device_claim_interface (priv->dev,
-						   (gint) priv->iface_number,
-						   0,
-						   &error_local)) {
-			g_set_error (error,
-				     DFU_ERROR,
-				     DFU_ERROR_INVALID_DEVICE,
-				     "cannot claim interface %i: %s",
-				     priv->iface_number, error_local->message);
-			return FALSE;
+		/* claim the correct interface if set */
+		if (priv->iface_number != 0xff) {
+			if (!g_usb_device_claim_interface (priv->dev,
+							   (gint) priv->iface_number,
+							   0,
+							   &error_local)) {
+				g_set_error (error,
+					     DFU_ERROR,
+					     DFU_ERROR_INVALID_DEVICE,
+					     "cannot claim interface %i: %s",
+					     priv->iface_number, error_local->message);
+				return FALSE;
+			}
 		}
+
+		/* get product name if it exists */
+		idx = g_usb_device_get_product_index (priv->dev);
+		if (idx != 0x00)
+			priv->display_name = g_usb_device_get_string_descriptor (priv->dev, idx, NULL);
+
+		/* get serial number if it exists */
+		g_free (priv->serial_number);
+		priv->serial_number = NULL;
+		idx = g_usb_device_get_serial_number_index (priv->dev);
+		if (idx != 0x00)
+			priv->serial_number = g_usb_device_get_string_descriptor (priv->dev, idx, NULL);
 	}
 
-	/* get product name if it exists */
-	idx = g_usb_device_get_product_index (priv->dev);
-	if (idx != 0x00)
-		priv->display_name = g_usb_device_get_string_descriptor (priv->dev, idx, NULL);
+	/* use any values from 'dfu-tool benchmark' */
+	dfu_device_load_tuning (device);
 
 	/* the device has no DFU runtime, so cheat */
 	if (priv->quirks & DFU_DEVICE_QUIRK_NO_DFU_RUNTIME) {
@@ -1345,6 +1770,10 @@ dfu_device_close (DfuDevice *device, GError **error)
 	DfuDevicePrivate *priv = GET_PRIVATE (device);
 	g_autoptr(GError) error_local = NULL;
 
+	/* nothing to close */
+	if (priv->emulator != NULL)
+		return TRUE;
+
 	/* no backing USB device */
 	if (priv->dev == NULL) {
 		g_set_error (error,
@@ -1373,6 +1802,45 @@ dfu_device_close (DfuDevice *device, GError **error)
 	return TRUE;
 }
 
+static gboolean dfu_device_replug_helper_cb (gpointer user_data);
+
+typedef struct {
+	DfuDevice	*device;
+	GSource		*source_timeout;
+	GSource		*source_cancel;
+	gboolean	 done;
+	gboolean	 present;		/* as last seen by the waiter */
+	gboolean	 present_new;		/* protected by the device mutex */
+	gboolean	 changed;		/* protected by the device mutex */
+	gint64		 time_start;
+	gint64		 time_removed;
+} DfuDeviceReplugHelper;
+
+/**
+ * dfu_device_replug_notify:
+ *
+ * Hands the new device state to anything waiting in
+ * dfu_device_wait_for_replug_async() and wakes it up in the main context
+ * that it was called from, so the waiter never reads priv->dev itself.
+ **/
+static void
+dfu_device_replug_notify (DfuDevice *device)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	guint i;
+
+	g_mutex_lock (&priv->mutex);
+	for (i = 0; i < priv->replug_tasks->len; i++) {
+		GTask *task = g_ptr_array_index (priv->replug_tasks, i);
+		DfuDeviceReplugHelper *helper = g_task_get_task_data (task);
+		g_autoptr(GSource) source = g_idle_source_new ();
+		helper->present_new = priv->dev != NULL || priv->emulator != NULL;
+		helper->changed = TRUE;
+		g_task_attach_source (task, source, dfu_device_replug_helper_cb);
+	}
+	g_mutex_unlock (&priv->mutex);
+}
+
 /**
  * dfu_device_set_new_usb_dev:
  **/
@@ -1391,8 +1859,11 @@ dfu_device_set_new_usb_dev (DfuDevice *device, GUsbDevice *dev,
 	/* device removed */
 	if (dev == NULL) {
 		g_debug ("invalidating backing GUsbDevice");
+		g_mutex_lock (&priv->mutex);
 		g_clear_object (&priv->dev);
+		g_mutex_unlock (&priv->mutex);
 		g_ptr_array_set_size (priv->targets, 0);
+		dfu_device_replug_notify (device);
 		return TRUE;
 	}
 
@@ -1405,7 +1876,9 @@ dfu_device_set_new_usb_dev (DfuDevice *device, GUsbDevice *dev,
 	}
 
 	/* set the new USB device */
+	g_mutex_lock (&priv->mutex);
 	g_set_object (&priv->dev, dev);
+	g_mutex_unlock (&priv->mutex);
 
 	/* should be the same */
 	if (g_strcmp0 (priv->platform_id,
@@ -1431,17 +1904,50 @@ dfu_device_set_new_usb_dev (DfuDevice *device, GUsbDevice *dev,
 				      cancellable, error))
 			return FALSE;
 	}
+
+	/* only once the device is usable */
+	dfu_device_replug_notify (device);
 	return TRUE;
 }
 
-typedef struct {
-	DfuDevice	*device;
-	GError		**error;
-	GMainLoop	*loop;
-	GUsbDevice	*dev;
-	guint		 cnt;
-	guint		 timeout;
-} DfuDeviceReplugHelper;
+/**
+ * dfu_device_set_new_emulator: (skip)
+ * @device: a #DfuDevice created using dfu_device_new_emulated()
+ * @emulator: (allow-none): a #DfuEmulator, or %NULL when unplugged
+ *
+ * Unplugs or replugs an emulated device in the same way as
+ * dfu_device_set_new_usb_dev() does for a real one. The targets are
+ * kept, as they are fixed by the alternate settings of the emulator.
+ **/
+void
+dfu_device_set_new_emulator (DfuDevice *device, DfuEmulator *emulator)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+
+	g_return_if_fail (DFU_IS_DEVICE (device));
+	g_return_if_fail (emulator == NULL || DFU_IS_EMULATOR (emulator));
+
+	g_mutex_lock (&priv->mutex);
+	g_set_object (&priv->emulator, emulator);
+	g_mutex_unlock (&priv->mutex);
+	dfu_device_replug_notify (device);
+}
+
+/**
+ * dfu_device_set_runtime_release: (skip)
+ * @device: a #DfuDevice created using dfu_device_new_emulated()
+ * @release: the runtime release number, e.g. 0x0102
+ *
+ * Sets the release number that an emulated device reports, as if new
+ * runtime firmware had been booted.
+ **/
+void
+dfu_device_set_runtime_release (DfuDevice *device, guint16 release)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	g_return_if_fail (DFU_IS_DEVICE (device));
+	priv->runtime_release = release;
+}
 
 /**
  * dfu_device_replug_helper_free:
@@ -1449,57 +1955,211 @@ typedef struct {
 static void
 dfu_device_replug_helper_free (DfuDeviceReplugHelper *helper)
 {
-	if (helper->dev != NULL)
-		g_object_unref (helper->dev);
+	if (helper->source_timeout != NULL)
+		g_source_unref (helper->source_timeout);
+	if (helper->source_cancel != NULL)
+		g_source_unref (helper->source_cancel);
 	g_object_unref (helper->device);
-	g_main_loop_unref (helper->loop);
 	g_free (helper);
 }
 
+/**
+ * dfu_device_replug_helper_done:
+ *
+ * Stops the task being woken up again; returns %FALSE if it has
+ * already finished.
+ **/
+static gboolean
+dfu_device_replug_helper_done (GTask *task)
+{
+	DfuDeviceReplugHelper *helper = g_task_get_task_data (task);
+	DfuDevicePrivate *priv = GET_PRIVATE (helper->device);
+
+	if (helper->done)
+		return FALSE;
+	helper->done = TRUE;
+	g_mutex_lock (&priv->mutex);
+	g_ptr_array_remove (priv->replug_tasks, task);
+	g_mutex_unlock (&priv->mutex);
+	g_source_destroy (helper->source_timeout);
+	if (helper->source_cancel != NULL)
+		g_source_destroy (helper->source_cancel);
+	return TRUE;
+}
+
 /**
  * dfu_device_replug_helper_cb:
  **/
 static gboolean
 dfu_device_replug_helper_cb (gpointer user_data)
 {
-	DfuDeviceReplugHelper *helper = (DfuDeviceReplugHelper *) user_data;
+	GTask *task = G_TASK (user_data);
+	DfuDeviceReplugHelper *helper = g_task_get_task_data (task);
 	DfuDevicePrivate *priv = GET_PRIVATE (helper->device);
+	gboolean changed;
+	gint64 elapsed;
 
-	/* did the backing GUsbDevice change */
-	if (helper->dev != priv->dev) {
-		g_debug ("device changed GUsbDevice %p->%p",
-			 helper->dev, priv->dev);
-		g_set_object (&helper->dev, priv->dev);
+	/* already timed out or cancelled */
+	if (helper->done)
+		return FALSE;
 
-		/* success */
-		if (helper->dev != NULL) {
-			g_main_loop_quit (helper->loop);
-			return FALSE;
-		}
+	/* take what dfu_device_replug_notify() handed over */
+	g_mutex_lock (&priv->mutex);
+	changed = helper->changed;
+	helper->present = helper->present_new;
+	helper->changed = FALSE;
+	g_mutex_unlock (&priv->mutex);
+	if (!changed)
+		return FALSE;
+	elapsed = (g_get_monotonic_time () - helper->time_start) / 1000;
+
+	/* went away, so keep waiting */
+	if (!helper->present) {
+		helper->time_removed = g_get_monotonic_time ();
+		g_debug ("device went away after %" G_GINT64_FORMAT "ms", elapsed);
+		return FALSE;
 	}
 
-	/* set a limit */
-	if (helper->cnt++ * 100 > helper->timeout) {
-		g_debug ("gave up waiting for device replug");
-		if (helper->dev == NULL) {
-			g_set_error_literal (helper->error,
-					     DFU_ERROR,
-					     DFU_ERROR_INVALID_DEVICE,
-					     "target went away but did not come back");
-		} else {
-			g_set_error_literal (helper->error,
-					     DFU_ERROR,
-					     DFU_ERROR_INVALID_DEVICE,
-					     "target did not disconnect");
-		}
-		g_main_loop_quit (helper->loop);
+	/* success */
+	if (helper->time_removed > 0) {
+		g_debug ("device came back after %" G_GINT64_FORMAT "ms, "
+			 "%" G_GINT64_FORMAT "ms after going away", elapsed,
+			 (g_get_monotonic_time () - helper->time_removed) / 1000);
+	} else {
+		g_debug ("device came back after %" G_GINT64_FORMAT "ms", elapsed);
+	}
+	if (dfu_device_replug_helper_done (task))
+		g_task_return_boolean (task, TRUE);
+	return FALSE;
+}
+
+/**
+ * dfu_device_replug_timeout_cb:
+ **/
+static gboolean
+dfu_device_replug_timeout_cb (gpointer user_data)
+{
+	GTask *task = G_TASK (user_data);
+	DfuDeviceReplugHelper *helper = g_task_get_task_data (task);
+
+	if (!dfu_device_replug_helper_done (task))
 		return FALSE;
+	g_debug ("gave up waiting for device replug after %" G_GINT64_FORMAT "ms",
+		 (g_get_monotonic_time () - helper->time_start) / 1000);
+	if (!helper->present) {
+		g_task_return_new_error (task,
+					 DFU_ERROR,
+					 DFU_ERROR_INVALID_DEVICE,
+					 "target went away but did not come back");
+	} else {
+		g_task_return_new_error (task,
+					 DFU_ERROR,
+					 DFU_ERROR_INVALID_DEVICE,
+					 "target did not disconnect");
 	}
+	return FALSE;
+}
 
-	/* continue waiting */
-	g_debug ("waiting for device replug for %ims -- state is %s",
-		 helper->cnt * 100, dfu_state_to_string (priv->state));
-	return TRUE;
+/**
+ * dfu_device_replug_cancelled_cb:
+ **/
+static gboolean
+dfu_device_replug_cancelled_cb (GCancellable *cancellable, gpointer user_data)
+{
+	GTask *task = G_TASK (user_data);
+	if (dfu_device_replug_helper_done (task))
+		g_task_return_error_if_cancelled (task);
+	return FALSE;
+}
+
+/**
+ * dfu_device_wait_for_replug_async:
+ * @device: a #DfuDevice
+ * @timeout: the maximum amount of time to wait
+ * @cancellable: a #GCancellable, or %NULL
+ * @callback: the function to run on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Waits for a DFU device to disconnect and reconnect without blocking
+ * the thread-default main context.
+ * This does rely on a #DfuContext being set up before this is called.
+ *
+ * Since: 0.7.2
+ **/
+void
+dfu_device_wait_for_replug_async (DfuDevice *device,
+				  guint timeout,
+				  GCancellable *cancellable,
+				  GAsyncReadyCallback callback,
+				  gpointer user_data)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	DfuDeviceReplugHelper *helper;
+	g_autoptr(GTask) task = NULL;
+
+	g_return_if_fail (DFU_IS_DEVICE (device));
+	g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+	helper = g_new0 (DfuDeviceReplugHelper, 1);
+	helper->device = g_object_ref (device);
+	helper->time_start = g_get_monotonic_time ();
+	task = g_task_new (device, cancellable, callback, user_data);
+	g_task_set_task_data (task, helper,
+			      (GDestroyNotify) dfu_device_replug_helper_free);
+
+	/* the timeout is just a deadline, the DfuContext wakes us up */
+	helper->source_timeout = g_timeout_source_new (timeout);
+	g_task_attach_source (task, helper->source_timeout,
+			      dfu_device_replug_timeout_cb);
+	if (cancellable != NULL) {
+		helper->source_cancel = g_cancellable_source_new (cancellable);
+		g_task_attach_source (task, helper->source_cancel,
+				      (GSourceFunc) dfu_device_replug_cancelled_cb);
+	}
+
+	/* in one go, so that no change can be missed */
+	g_mutex_lock (&priv->mutex);
+	helper->present = priv->dev != NULL || priv->emulator != NULL;
+	g_ptr_array_add (priv->replug_tasks, g_object_ref (task));
+	g_mutex_unlock (&priv->mutex);
+}
+
+/**
+ * dfu_device_wait_for_replug_finish:
+ * @device: a #DfuDevice
+ * @res: the #GAsyncResult
+ * @error: a #GError, or %NULL
+ *
+ * Gets the result of dfu_device_wait_for_replug_async().
+ *
+ * Return value: %TRUE for success
+ *
+ * Since: 0.7.2
+ **/
+gboolean
+dfu_device_wait_for_replug_finish (DfuDevice *device,
+				   GAsyncResult *res,
+				   GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, device), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+typedef struct {
+	GMainLoop	*loop;
+	GAsyncResult	*res;
+} DfuDeviceSyncHelper;
+
+/**
+ * dfu_device_sync_helper_cb:
+ **/
+static void
+dfu_device_sync_helper_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	DfuDeviceSyncHelper *helper = (DfuDeviceSyncHelper *) user_data;
+	helper->res = g_object_ref (res);
+	g_main_loop_quit (helper->loop);
 }
 
 /**
@@ -1512,6 +2172,11 @@ dfu_device_replug_helper_cb (gpointer user_data)
  * Waits for a DFU device to disconnect and reconnect.
  * This does rely on a #DfuContext being set up before this is called.
  *
+ * When called from a thread other than the one the device was created
+ * in, for instance a worker thread, or if the thread-default main context
+ * is already being run by another thread, the wait is done in a main
+ * context private to the device.
+ *
  * Return value: %TRUE for success
  *
  * Since: 0.5.4
@@ -1521,25 +2186,46 @@ dfu_device_wait_for_replug (DfuDevice *device, guint timeout,
 			    GCancellable *cancellable, GError **error)
 {
 	DfuDevicePrivate *priv = GET_PRIVATE (device);
-	DfuDeviceReplugHelper *helper;
-	GError *error_tmp = NULL;
-	const guint replug_poll = 100; /* ms */
-
-	helper = g_new0 (DfuDeviceReplugHelper, 1);
-	helper->loop = g_main_loop_new (NULL, FALSE);
-	helper->device = g_object_ref (device);
-	helper->dev = g_object_ref (priv->dev);
-	helper->error = &error_tmp;
-	helper->timeout = timeout;
-	g_timeout_add_full (G_PRIORITY_DEFAULT, replug_poll,
-			    dfu_device_replug_helper_cb, helper,
-			    (GDestroyNotify) dfu_device_replug_helper_free);
-	g_main_loop_run (helper->loop);
-	if (error_tmp != NULL) {
-		g_propagate_error (error, error_tmp);
-		return FALSE;
+	DfuDeviceSyncHelper helper;
+	gboolean ret;
+	GMainContext *context = NULL;
+
+	/* the thread the device was created in waits in its thread-default
+	 * context if it can run it, as the hotplug events may be delivered
+	 * there; other threads must not dispatch the sources of that
+	 * context, so they wait in the private context that the DfuContext
+	 * hotplug handlers wake up directly */
+	if (g_thread_self () == priv->thread) {
+		context = g_main_context_ref_thread_default ();
+		if (!g_main_context_acquire (context))
+			g_clear_pointer (&context, g_main_context_unref);
+	}
+	if (context == NULL) {
+		context = g_main_context_ref (priv->context);
+		if (!g_main_context_acquire (context)) {
+			g_main_context_unref (context);
+			g_set_error_literal (error,
+					     DFU_ERROR,
+					     DFU_ERROR_NOT_SUPPORTED,
+					     "already waiting for replug in another thread");
+			return FALSE;
+		}
 	}
-	return TRUE;
+
+	/* spin a loop until done */
+	g_main_context_push_thread_default (context);
+	helper.loop = g_main_loop_new (context, FALSE);
+	helper.res = NULL;
+	dfu_device_wait_for_replug_async (device, timeout, cancellable,
+					  dfu_device_sync_helper_cb, &helper);
+	g_main_loop_run (helper.loop);
+	ret = dfu_device_wait_for_replug_finish (device, helper.res, error);
+	g_main_loop_unref (helper.loop);
+	g_object_unref (helper.res);
+	g_main_context_pop_thread_default (context);
+	g_main_context_release (context);
+	g_main_context_unref (context);
+	return ret;
 }
 
 /**
@@ -1562,6 +2248,10 @@ dfu_device_reset (DfuDevice *device, GError **error)
 	g_return_val_if_fail (DFU_IS_DEVICE (device), FALSE);
 	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
+	/* nothing to reset */
+	if (priv->emulator != NULL)
+		return TRUE;
+
 	/* no backing USB device */
 	if (priv->dev == NULL) {
 		g_set_error (error,
@@ -1651,7 +2341,7 @@ static void
 dfu_device_percentage_cb (DfuTarget *target, guint percentage, DfuDevice *device)
 {
 	/* FIXME: divide by number of targets? */
-	g_signal_emit (device, signals[SIGNAL_PERCENTAGE_CHANGED], 0, percentage);
+	dfu_device_emit (device, SIGNAL_PERCENTAGE_CHANGED, percentage);
 }
 
 /**
@@ -1678,7 +2368,7 @@ dfu_device_upload (DfuDevice *device,
 	g_autoptr(DfuFirmware) firmware = NULL;
 
 	/* no backing USB device */
-	if (priv->dev == NULL) {
+	if (priv->dev == NULL && priv->emulator == NULL) {
 		g_set_error (error,
 			     DFU_ERROR,
 			     DFU_ERROR_INTERNAL,
@@ -1795,7 +2485,7 @@ dfu_device_download (DfuDevice *device,
 	g_autoptr(GPtrArray) targets = NULL;
 
 	/* no backing USB device */
-	if (priv->dev == NULL) {
+	if (priv->dev == NULL && priv->emulator == NULL) {
 		g_set_error (error,
 			     DFU_ERROR,
 			     DFU_ERROR_INTERNAL,
@@ -1930,8 +2620,11 @@ dfu_device_download (DfuDevice *device,
 		}
 
 		/* download onto target */
-		if (flags & DFU_TARGET_TRANSFER_FLAG_VERIFY)
-			flags_local = DFU_TARGET_TRANSFER_FLAG_VERIFY;
+		flags_local = flags & (DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				       DFU_TARGET_TRANSFER_FLAG_SKIP_BLANK |
+				       DFU_TARGET_TRANSFER_FLAG_DIFFERENTIAL |
+				       DFU_TARGET_TRANSFER_FLAG_RESUME |
+				       DFU_TARGET_TRANSFER_FLAG_NO_MANIFEST);
 		id = g_signal_connect (target_tmp, "percentage-changed",
 				       G_CALLBACK (dfu_device_percentage_cb), device);
 		ret = dfu_target_download (target_tmp,
@@ -1967,6 +2660,246 @@ dfu_device_download (DfuDevice *device,
 	return TRUE;
 }
 
+typedef struct {
+	DfuFirmware		*firmware;
+	DfuTargetTransferFlags	 flags;
+} DfuDeviceTaskHelper;
+
+/**
+ * dfu_device_task_helper_free:
+ **/
+static void
+dfu_device_task_helper_free (DfuDeviceTaskHelper *helper)
+{
+	if (helper->firmware != NULL)
+		g_object_unref (helper->firmware);
+	g_free (helper);
+}
+
+/**
+ * dfu_device_task_new:
+ *
+ * Creates a task for a transfer to be done in a worker thread, or
+ * returns %NULL if the device is already busy.
+ **/
+static GTask *
+dfu_device_task_new (DfuDevice *device,
+		     DfuFirmware *firmware,
+		     DfuTargetTransferFlags flags,
+		     GCancellable *cancellable,
+		     GAsyncReadyCallback callback,
+		     gpointer user_data,
+		     gpointer source_tag)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	DfuDeviceTaskHelper *helper;
+	GTask *task;
+
+	/* signals are proxied back to the context the task completes in */
+	g_mutex_lock (&priv->mutex);
+	if (priv->task_context != NULL) {
+		g_mutex_unlock (&priv->mutex);
+		g_task_report_new_error (device, callback, user_data,
+					 source_tag,
+					 DFU_ERROR,
+					 DFU_ERROR_NOT_SUPPORTED,
+					 "a transfer is already in progress");
+		return NULL;
+	}
+	priv->task_context = g_main_context_ref_thread_default ();
+	g_mutex_unlock (&priv->mutex);
+
+	helper = g_new0 (DfuDeviceTaskHelper, 1);
+	if (firmware != NULL)
+		helper->firmware = g_object_ref (firmware);
+	helper->flags = flags;
+	task = g_task_new (device, cancellable, callback, user_data);
+	g_task_set_source_tag (task, source_tag);
+	g_task_set_task_data (task, helper,
+			      (GDestroyNotify) dfu_device_task_helper_free);
+	return task;
+}
+
+/**
+ * dfu_device_task_done:
+ **/
+static void
+dfu_device_task_done (DfuDevice *device)
+{
+	DfuDevicePrivate *priv = GET_PRIVATE (device);
+	GMainContext *context;
+	g_mutex_lock (&priv->mutex);
+	context = priv->task_context;
+	priv->task_context = NULL;
+	g_mutex_unlock (&priv->mutex);
+	g_main_context_unref (context);
+}
+
+/**
+ * dfu_device_download_thread_cb:
+ **/
+static void
+dfu_device_download_thread_cb (GTask *task,
+			       gpointer source_object,
+			       gpointer task_data,
+			       GCancellable *cancellable)
+{
+	DfuDevice *device = DFU_DEVICE (source_object);
+	DfuDeviceTaskHelper *helper = (DfuDeviceTaskHelper *) task_data;
+	GError *error = NULL;
+	gboolean ret;
+
+	ret = dfu_device_download (device, helper->firmware, helper->flags,
+				   cancellable, &error);
+	dfu_device_task_done (device);
+	if (!ret) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * dfu_device_download_async:
+ * @device: a #DfuDevice
+ * @firmware: a #DfuFirmware
+ * @flags: flags to use, e.g. %DFU_TARGET_TRANSFER_FLAG_VERIFY
+ * @cancellable: a #GCancellable, or %NULL
+ * @callback: the function to run on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Downloads firmware from the host to the target in a worker thread,
+ * optionally verifying the transfer.
+ *
+ * The #DfuDevice::state-changed, #DfuDevice::status-changed and
+ * #DfuDevice::percentage-changed signals are emitted in the
+ * thread-default main context of the caller, which must be running for
+ * the device to be found again after a replug.
+ *
+ * Since: 0.7.2
+ **/
+void
+dfu_device_download_async (DfuDevice *device,
+			   DfuFirmware *firmware,
+			   DfuTargetTransferFlags flags,
+			   GCancellable *cancellable,
+			   GAsyncReadyCallback callback,
+			   gpointer user_data)
+{
+	g_autoptr(GTask) task = NULL;
+
+	g_return_if_fail (DFU_IS_DEVICE (device));
+	g_return_if_fail (DFU_IS_FIRMWARE (firmware));
+	g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+	task = dfu_device_task_new (device, firmware, flags, cancellable,
+				    callback, user_data,
+				    dfu_device_download_async);
+	if (task == NULL)
+		return;
+	g_task_run_in_thread (task, dfu_device_download_thread_cb);
+}
+
+/**
+ * dfu_device_download_finish:
+ * @device: a #DfuDevice
+ * @res: the #GAsyncResult
+ * @error: a #GError, or %NULL
+ *
+ * Gets the result of dfu_device_download_async().
+ *
+ * Return value: %TRUE for success
+ *
+ * Since: 0.7.2
+ **/
+gboolean
+dfu_device_download_finish (DfuDevice *device,
+			    GAsyncResult *res,
+			    GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, device), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+/**
+ * dfu_device_upload_thread_cb:
+ **/
+static void
+dfu_device_upload_thread_cb (GTask *task,
+			     gpointer source_object,
+			     gpointer task_data,
+			     GCancellable *cancellable)
+{
+	DfuDevice *device = DFU_DEVICE (source_object);
+	DfuDeviceTaskHelper *helper = (DfuDeviceTaskHelper *) task_data;
+	DfuFirmware *firmware;
+	GError *error = NULL;
+
+	firmware = dfu_device_upload (device, helper->flags, cancellable, &error);
+	dfu_device_task_done (device);
+	if (firmware == NULL) {
+		g_task_return_error (task, error);
+		return;
+	}
+	g_task_return_pointer (task, firmware, (GDestroyNotify) g_object_unref);
+}
+
+/**
+ * dfu_device_upload_async:
+ * @device: a #DfuDevice
+ * @flags: flags to use, e.g. %DFU_TARGET_TRANSFER_FLAG_VERIFY
+ * @cancellable: a #GCancellable, or %NULL
+ * @callback: the function to run on completion
+ * @user_data: the data to pass to @callback
+ *
+ * Uploads firmware from the target to the host in a worker thread.
+ * Signals are emitted as described for dfu_device_download_async().
+ *
+ * Since: 0.7.2
+ **/
+void
+dfu_device_upload_async (DfuDevice *device,
+			 DfuTargetTransferFlags flags,
+			 GCancellable *cancellable,
+			 GAsyncReadyCallback callback,
+			 gpointer user_data)
+{
+	g_autoptr(GTask) task = NULL;
+
+	g_return_if_fail (DFU_IS_DEVICE (device));
+	g_return_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable));
+
+	task = dfu_device_task_new (device, NULL, flags, cancellable,
+				    callback, user_data,
+				    dfu_device_upload_async);
+	if (task == NULL)
+		return;
+	g_task_run_in_thread (task, dfu_device_upload_thread_cb);
+}
+
+/**
+ * dfu_device_upload_finish:
+ * @device: a #DfuDevice
+ * @res: the #GAsyncResult
+ * @error: a #GError, or %NULL
+ *
+ * Gets the result of dfu_device_upload_async().
+ *
+ * Return value: (transfer full): the uploaded firmware, or %NULL for error
+ *
+ * Since: 0.7.2
+ **/
+DfuFirmware *
+dfu_device_upload_finish (DfuDevice *device,
+			  GAsyncResult *res,
+			  GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, device), NULL);
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+	return g_task_propagate_pointer (G_TASK (res), error);
+}
+
 /**
  * dfu_device_error_fixup:
  **/
@@ -159,6 +159,31 @@ gboolean	 dfu_device_download			(DfuDevice	*device,
 							 DfuTargetTransferFlags flags,
 							 GCancellable	*cancellable,
 							 GError		**error);
+void		 dfu_device_wait_for_replug_async	(DfuDevice	*device,
+							 guint		 timeout,
+							 GCancellable	*cancellable,
+							 GAsyncReadyCallback callback,
+							 gpointer	 user_data);
+gboolean	 dfu_device_wait_for_replug_finish	(DfuDevice	*device,
+							 GAsyncResult	*res,
+							 GError		**error);
+void		 dfu_device_upload_async		(DfuDevice	*device,
+							 DfuTargetTransferFlags flags,
+							 GCancellable	*cancellable,
+							 GAsyncReadyCallback callback,
+							 gpointer	 user_data);
+DfuFirmware	*dfu_device_upload_finish		(DfuDevice	*device,
+							 GAsyncResult	*res,
+							 GError		**error);
+void		 dfu_device_download_async		(DfuDevice	*device,
+							 DfuFirmware	*firmware,
+							 DfuTargetTransferFlags flags,
+							 GCancellable	*cancellable,
+							 GAsyncReadyCallback callback,
+							 gpointer	 user_data);
+gboolean	 dfu_device_download_finish		(DfuDevice	*device,
+							 GAsyncResult	*res,
+							 GError		**error);
 gboolean	 dfu_device_refresh			(DfuDevice	*device,
 							 GCancellable	*cancellable,
 							 GError		**error);
@@ -190,6 +215,8 @@ void		 dfu_device_set_transfer_size		(DfuDevice	*device,
 							 guint16	 transfer_size);
 void		 dfu_device_set_timeout			(DfuDevice	*device,
 							 guint		 timeout_ms);
+gboolean	 dfu_device_save_tuning			(DfuDevice	*device,
+							 GError		**error);
 
 G_END_DECLS
 
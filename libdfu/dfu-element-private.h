@@ -26,11 +26,40 @@
 
 G_BEGIN_DECLS
 
-DfuElement	*dfu_element_from_dfuse		(const guint8	*data,
-						 guint32	 length,
+typedef gboolean (*DfuElementCheckFunc)		(DfuElement	*element,
+						 gpointer	 user_data,
+						 GCancellable	*cancellable,
+						 GError		**error);
+
+DfuElement	*dfu_element_new_take		(gpointer	 data,
+						 gsize		 size);
+DfuElement	*dfu_element_from_dfuse		(GBytes		*bytes,
+						 guint32	 offset,
+						 guint32	*consumed,
+						 GError		**error);
+DfuElement	*dfu_element_from_dfuse_stream	(GInputStream	*stream,
+						 goffset	 offset,
+						 goffset	 limit,
 						 guint32	*consumed,
+						 GCancellable	*cancellable,
+						 GError		**error);
+guint32		 dfu_element_to_dfuse		(DfuElement	*element,
+						 GPtrArray	*segments);
+
+gsize		 dfu_element_get_size		(DfuElement	*element);
+GBytes		*dfu_element_get_chunk		(DfuElement	*element,
+						 gsize		 offset,
+						 gsize		 length,
+						 GCancellable	*cancellable,
 						 GError		**error);
-GBytes		*dfu_element_to_dfuse		(DfuElement	*element);
+void		 dfu_element_set_stream		(DfuElement	*element,
+						 GInputStream	*stream,
+						 goffset	 offset,
+						 gsize		 size);
+void		 dfu_element_set_check_func	(DfuElement	*element,
+						 DfuElementCheckFunc func,
+						 gpointer	 user_data,
+						 GDestroyNotify	 destroy_func);
 
 G_END_DECLS
 
@@ -36,7 +36,7 @@
 #include <string.h>
 #include <stdio.h>
 
-#include "dfu-common.h"
+#include "dfu-common-private.h"
 #include "dfu-element-private.h"
 #include "dfu-error.h"
 
@@ -49,6 +49,13 @@ static void dfu_element_finalize			 (GObject *object);
  **/
 typedef struct {
 	GBytes			*contents;
+	GInputStream		*stream;	/* only if contents is NULL */
+	goffset			 stream_offset;
+	gsize			 stream_size;
+	DfuElementCheckFunc	 check_func;	/* run before first read */
+	gpointer		 check_data;
+	GDestroyNotify		 check_destroy;
+	GMutex			 mutex;		/* for the above */
 	guint32			 target_size;
 	guint32			 address;
 } DfuElementPrivate;
@@ -72,6 +79,8 @@ dfu_element_class_init (DfuElementClass *klass)
 static void
 dfu_element_init (DfuElement *element)
 {
+	DfuElementPrivate *priv = GET_PRIVATE (element);
+	g_mutex_init (&priv->mutex);
 }
 
 /**
@@ -85,6 +94,11 @@ dfu_element_finalize (GObject *object)
 
 	if (priv->contents != NULL)
 		g_bytes_unref (priv->contents);
+	if (priv->stream != NULL)
+		g_object_unref (priv->stream);
+	if (priv->check_destroy != NULL)
+		priv->check_destroy (priv->check_data);
+	g_mutex_clear (&priv->mutex);
 
 	G_OBJECT_CLASS (dfu_element_parent_class)->finalize (object);
 }
@@ -106,13 +120,123 @@ dfu_element_new (void)
 	return element;
 }
 
+/**
+ * dfu_element_new_take: (skip)
+ * @data: data, which is freed with g_free()
+ * @size: size of @data in bytes
+ *
+ * Creates an element for a block of data, e.g. a file header.
+ *
+ * Return value: a new #DfuElement
+ **/
+DfuElement *
+dfu_element_new_take (gpointer data, gsize size)
+{
+	DfuElement *element = dfu_element_new ();
+	DfuElementPrivate *priv = GET_PRIVATE (element);
+	priv->contents = g_bytes_new_take (data, size);
+	return element;
+}
+
+/**
+ * dfu_element_clear_check_func:
+ **/
+static void
+dfu_element_clear_check_func (DfuElement *element)
+{
+	DfuElementPrivate *priv = GET_PRIVATE (element);
+	if (priv->check_destroy != NULL)
+		priv->check_destroy (priv->check_data);
+	priv->check_func = NULL;
+	priv->check_data = NULL;
+	priv->check_destroy = NULL;
+}
+
+/**
+ * dfu_element_run_check_func:
+ **/
+static gboolean
+dfu_element_run_check_func (DfuElement *element,
+			    GCancellable *cancellable,
+			    GError **error)
+{
+	DfuElementPrivate *priv = GET_PRIVATE (element);
+	if (priv->check_func == NULL)
+		return TRUE;
+	if (!priv->check_func (element, priv->check_data, cancellable, error))
+		return FALSE;
+	dfu_element_clear_check_func (element);
+	return TRUE;
+}
+
+/**
+ * dfu_element_load_stream:
+ **/
+static gboolean
+dfu_element_load_stream (DfuElement *element,
+			 GCancellable *cancellable,
+			 GError **error)
+{
+	DfuElementPrivate *priv = GET_PRIVATE (element);
+	guint8 *buf;
+
+	if (!dfu_element_run_check_func (element, cancellable, error))
+		return FALSE;
+	buf = g_malloc (priv->stream_size);
+	if (!dfu_utils_stream_read_at (priv->stream,
+				       priv->stream_offset,
+				       buf,
+				       priv->stream_size,
+				       cancellable, error)) {
+		g_free (buf);
+		return FALSE;
+	}
+	priv->contents = g_bytes_new_take (buf, priv->stream_size);
+	g_clear_object (&priv->stream);
+	return TRUE;
+}
+
+/**
+ * dfu_element_load_contents:
+ * @element: a #DfuElement
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: a #GError, or %NULL
+ *
+ * Reads the element data into memory if the element was parsed using
+ * %DFU_FIRMWARE_PARSE_FLAG_LAZY. This has to be called before
+ * dfu_element_get_contents() so that read and CRC errors can be reported.
+ *
+ * Return value: %TRUE for success
+ *
+ * Since: 0.7.2
+ **/
+gboolean
+dfu_element_load_contents (DfuElement *element,
+			   GCancellable *cancellable,
+			   GError **error)
+{
+	DfuElementPrivate *priv = GET_PRIVATE (element);
+	gboolean ret = TRUE;
+
+	g_return_val_if_fail (DFU_IS_ELEMENT (element), FALSE);
+
+	g_mutex_lock (&priv->mutex);
+	if (priv->contents == NULL && priv->stream != NULL)
+		ret = dfu_element_load_stream (element, cancellable, error);
+	g_mutex_unlock (&priv->mutex);
+	return ret;
+}
+
 /**
  * dfu_element_get_contents:
  * @element: a #DfuElement
  *
  * Gets the element data.
  *
- * Return value: (transfer none): element data
+ * Elements parsed using %DFU_FIRMWARE_PARSE_FLAG_LAZY have no data until
+ * dfu_element_load_contents() has been called.
+ *
+ * Return value: (transfer none): element data, or %NULL if not loaded
  *
  * Since: 0.5.4
  **/
@@ -120,8 +244,117 @@ GBytes *
 dfu_element_get_contents (DfuElement *element)
 {
 	DfuElementPrivate *priv = GET_PRIVATE (element);
+	GBytes *contents;
 	g_return_val_if_fail (DFU_IS_ELEMENT (element), NULL);
-	return priv->contents;
+	g_mutex_lock (&priv->mutex);
+	contents = priv->contents;
+	g_mutex_unlock (&priv->mutex);
+	return contents;
+}
+
+/**
+ * dfu_element_get_size: (skip)
+ * @element: a #DfuElement
+ *
+ * Gets the size of the element data without loading it.
+ *
+ * Return value: size in bytes
+ **/
+gsize
+dfu_element_get_size (DfuElement *element)
+{
+	DfuElementPrivate *priv = GET_PRIVATE (element);
+	if (priv->contents != NULL)
+		return g_bytes_get_size (priv->contents);
+	if (priv->stream != NULL)
+		return priv->stream_size;
+	return 0;
+}
+
+/**
+ * dfu_element_get_chunk: (skip)
+ * @element: a #DfuElement
+ * @offset: offset into the element data
+ * @length: maximum number of bytes
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: a #GError, or %NULL
+ *
+ * Gets part of the element data. If the element is backed by a stream
+ * then only the requested part is read.
+ *
+ * Return value: (transfer full): data, or %NULL for error
+ **/
+GBytes *
+dfu_element_get_chunk (DfuElement *element,
+		       gsize offset,
+		       gsize length,
+		       GCancellable *cancellable,
+		       GError **error)
+{
+	DfuElementPrivate *priv = GET_PRIVATE (element);
+	GBytes *bytes = NULL;
+	gsize size = dfu_element_get_size (element);
+	guint8 *buf;
+
+	/* clamp to the end of the data */
+	if (offset > size) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "offset 0x%x outside element of size 0x%x",
+			     (guint) offset, (guint) size);
+		return NULL;
+	}
+	length = MIN (length, size - offset);
+
+	/* already in memory */
+	g_mutex_lock (&priv->mutex);
+	if (priv->contents != NULL) {
+		bytes = g_bytes_new_from_bytes (priv->contents, offset, length);
+	} else if (priv->stream == NULL) {
+		bytes = g_bytes_new (NULL, 0);
+	} else if (dfu_element_run_check_func (element, cancellable, error)) {
+
+		/* read just this part */
+		buf = g_malloc (length);
+		if (dfu_utils_stream_read_at (priv->stream,
+					      priv->stream_offset + offset,
+					      buf, length,
+					      cancellable, error)) {
+			bytes = g_bytes_new_take (buf, length);
+		} else {
+			g_free (buf);
+		}
+	}
+	g_mutex_unlock (&priv->mutex);
+	return bytes;
+}
+
+/**
+ * dfu_element_set_stream: (skip)
+ * @element: a #DfuElement
+ * @stream: a seekable #GInputStream
+ * @offset: offset of the element data in @stream
+ * @size: size of the element data
+ *
+ * Sets the element data to be a region of a stream, which is only read
+ * when the data is required.
+ **/
+void
+dfu_element_set_stream (DfuElement *element,
+			GInputStream *stream,
+			goffset offset,
+			gsize size)
+{
+	DfuElementPrivate *priv = GET_PRIVATE (element);
+	g_return_if_fail (G_IS_SEEKABLE (stream));
+	if (priv->contents != NULL) {
+		g_bytes_unref (priv->contents);
+		priv->contents = NULL;
+	}
+	g_set_object (&priv->stream, stream);
+	priv->stream_offset = offset;
+	priv->stream_size = size;
 }
 
 /**
@@ -142,6 +375,30 @@ dfu_element_get_address (DfuElement *element)
 	return priv->address;
 }
 
+/**
+ * dfu_element_set_check_func: (skip)
+ * @element: a #DfuElement
+ * @func: a #DfuElementCheckFunc
+ * @user_data: user data for @func
+ * @destroy_func: a #GDestroyNotify for @user_data, or %NULL
+ *
+ * Sets a function that has to succeed before the element data is first
+ * read from the stream, for instance to check the file CRC. The
+ * function is only called until it succeeds once.
+ **/
+void
+dfu_element_set_check_func (DfuElement *element,
+			    DfuElementCheckFunc func,
+			    gpointer user_data,
+			    GDestroyNotify destroy_func)
+{
+	DfuElementPrivate *priv = GET_PRIVATE (element);
+	dfu_element_clear_check_func (element);
+	priv->check_func = func;
+	priv->check_data = user_data;
+	priv->check_destroy = destroy_func;
+}
+
 /**
  * dfu_element_set_contents:
  * @element: a #DfuElement
@@ -157,6 +414,8 @@ dfu_element_set_contents (DfuElement *element, GBytes *contents)
 	DfuElementPrivate *priv = GET_PRIVATE (element);
 	g_return_if_fail (DFU_IS_ELEMENT (element));
 	g_return_if_fail (contents != NULL);
+	g_clear_object (&priv->stream);
+	dfu_element_clear_check_func (element);
 	if (priv->contents == contents)
 		return;
 	if (priv->contents != NULL)
@@ -205,9 +464,9 @@ dfu_element_to_string (DfuElement *element)
 		g_string_append_printf (str, "target:      0x%04x\n",
 					priv->target_size);
 	}
-	if (priv->contents != NULL) {
+	if (priv->contents != NULL || priv->stream != NULL) {
 		g_string_append_printf (str, "contents:    0x%04x\n",
-					(guint32) g_bytes_get_size (priv->contents));
+					(guint32) dfu_element_get_size (element));
 	}
 
 	g_string_truncate (str, str->len - 1);
@@ -238,7 +497,7 @@ dfu_element_set_target_size (DfuElement *element, guint32 target_size)
 	/* save for dump */
 	priv->target_size = target_size;
 
-	/* no need to pad */
+	/* no need to pad, or not loaded yet */
 	if (priv->contents == NULL)
 		return;
 	if (g_bytes_get_size (priv->contents) >= target_size)
@@ -263,41 +522,48 @@ typedef struct __attribute__((packed)) {
 
 /**
  * dfu_element_from_dfuse: (skip)
- * @data: data buffer
- * @length: length of @data we can access
+ * @bytes: data buffer
+ * @offset: offset into @bytes of the element prefix
  * @consumed: (out): the number of bytes we consued
  * @error: a #GError, or %NULL
  *
- * Unpacks an element from DfuSe data.
+ * Unpacks an element from DfuSe data. The element contents reference
+ * @bytes rather than copying the data.
  *
  * Returns: a #DfuElement, or %NULL for error
  **/
 DfuElement *
-dfu_element_from_dfuse (const guint8 *data,
-			guint32 length,
+dfu_element_from_dfuse (GBytes *bytes,
+			guint32 offset,
 			guint32 *consumed,
 			GError **error)
 {
 	DfuElement *element = NULL;
 	DfuElementPrivate *priv;
-	DfuSeElementPrefix *el = (DfuSeElementPrefix *) data;
+	DfuSeElementPrefix *el;
+	const guint8 *data;
+	gsize length;
 	guint32 size;
 
 	g_assert_cmpint(sizeof(DfuSeElementPrefix), ==, 8);
 
 	/* check input buffer size */
-	if (length < sizeof(DfuSeElementPrefix)) {
+	data = g_bytes_get_data (bytes, &length);
+	if (offset > length ||
+	    length - offset < sizeof(DfuSeElementPrefix)) {
 		g_set_error (error,
 			     DFU_ERROR,
 			     DFU_ERROR_INTERNAL,
 			     "invalid element data size %u",
-			     (guint32) length);
+			     (guint32) (length - MIN (offset, length)));
 		return NULL;
 	}
+	length -= offset;
+	el = (DfuSeElementPrefix *) (data + offset);
 
 	/* check size */
 	size = GUINT32_FROM_LE (el->size);
-	if (size + sizeof(DfuSeElementPrefix) > length) {
+	if (size > length - sizeof(DfuSeElementPrefix)) {
 		g_set_error (error,
 			     DFU_ERROR,
 			     DFU_ERROR_INTERNAL,
@@ -311,7 +577,72 @@ dfu_element_from_dfuse (const guint8 *data,
 	element = dfu_element_new ();
 	priv = GET_PRIVATE (element);
 	priv->address = GUINT32_FROM_LE (el->address);
-	priv->contents = g_bytes_new (data + sizeof(DfuSeElementPrefix), size);
+	priv->contents = g_bytes_new_from_bytes (bytes,
+						 offset + sizeof(DfuSeElementPrefix),
+						 size);
+
+	/* return size */
+	if (consumed != NULL)
+		*consumed = sizeof(DfuSeElementPrefix) + size;
+
+	return element;
+}
+
+/**
+ * dfu_element_from_dfuse_stream: (skip)
+ * @stream: a seekable #GInputStream
+ * @offset: offset of the element prefix in @stream
+ * @limit: offset of the end of the DfuSe data in @stream
+ * @consumed: (out): the number of bytes we consued
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: a #GError, or %NULL
+ *
+ * Unpacks an element header from a DfuSe stream. The element data is
+ * not read until it is required.
+ *
+ * Returns: a #DfuElement, or %NULL for error
+ **/
+DfuElement *
+dfu_element_from_dfuse_stream (GInputStream *stream,
+			       goffset offset,
+			       goffset limit,
+			       guint32 *consumed,
+			       GCancellable *cancellable,
+			       GError **error)
+{
+	DfuElement *element;
+	DfuSeElementPrefix el;
+	guint32 size;
+
+	/* check input buffer size */
+	if (offset + (goffset) sizeof(DfuSeElementPrefix) > limit) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "invalid element data size %u",
+			     (guint32) MAX (limit - offset, 0));
+		return NULL;
+	}
+	if (!dfu_utils_stream_read_at (stream, offset, (guint8 *) &el,
+				       sizeof(el), cancellable, error))
+		return NULL;
+
+	/* check size */
+	size = GUINT32_FROM_LE (el.size);
+	offset += sizeof(DfuSeElementPrefix);
+	if ((goffset) size > limit - offset) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "invalid element size %u, only %u bytes left",
+			     size, (guint32) (limit - offset));
+		return NULL;
+	}
+
+	/* create new element */
+	element = dfu_element_new ();
+	dfu_element_set_address (element, GUINT32_FROM_LE (el.address));
+	dfu_element_set_stream (element, stream, offset, size);
 
 	/* return size */
 	if (consumed != NULL)
@@ -323,26 +654,25 @@ dfu_element_from_dfuse (const guint8 *data,
 /**
  * dfu_element_to_dfuse: (skip)
  * @element: a #DfuElement
+ * @segments: (element-type DfuElement): array of segments to append to
  *
- * Packs a DfuSe element.
+ * Packs a DfuSe element. The element header is appended to @segments
+ * followed by the element itself, so data that is backed by a stream
+ * is not read until the segments are written out.
  *
- * Returns: (transfer full): the packed data
+ * Returns: the number of bytes added to @segments
  **/
-GBytes *
-dfu_element_to_dfuse (DfuElement *element)
+guint32
+dfu_element_to_dfuse (DfuElement *element, GPtrArray *segments)
 {
 	DfuElementPrivate *priv = GET_PRIVATE (element);
 	DfuSeElementPrefix *el;
-	const guint8 *data;
-	gsize length;
-	guint8 *buf;
+	gsize length = dfu_element_get_size (element);
 
-	data = g_bytes_get_data (priv->contents, &length);
-	buf = g_malloc0 (length + sizeof (DfuSeElementPrefix));
-	el = (DfuSeElementPrefix *) buf;
+	el = g_new0 (DfuSeElementPrefix, 1);
 	el->address = GUINT32_TO_LE (priv->address);
 	el->size = GUINT32_TO_LE (length);
-
-	memcpy (buf + sizeof (DfuSeElementPrefix), data, length);
-	return g_bytes_new_take (buf, length + sizeof (DfuSeElementPrefix));
+	g_ptr_array_add (segments, dfu_element_new_take (el, sizeof (DfuSeElementPrefix)));
+	g_ptr_array_add (segments, g_object_ref (element));
+	return length + sizeof (DfuSeElementPrefix);
 }
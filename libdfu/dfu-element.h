@@ -57,6 +57,9 @@ void		 dfu_element_set_address	(DfuElement	*element,
 						 guint32	 address);
 void		 dfu_element_set_target_size	(DfuElement	*element,
 						 guint32	 target_size);
+gboolean	 dfu_element_load_contents	(DfuElement	*element,
+						 GCancellable	*cancellable,
+						 GError		**error);
 
 gchar		*dfu_element_to_string		(DfuElement	*element);
 
@@ -0,0 +1,108 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __DFU_EMULATOR_PRIVATE_H
+#define __DFU_EMULATOR_PRIVATE_H
+
+#include <glib-object.h>
+#include <gio/gio.h>
+#include <gusb.h>
+
+#include "dfu-common.h"
+
+G_BEGIN_DECLS
+
+#define DFU_TYPE_EMULATOR (dfu_emulator_get_type ())
+G_DECLARE_DERIVABLE_TYPE (DfuEmulator, dfu_emulator, DFU, EMULATOR, GObject)
+
+struct _DfuEmulatorClass
+{
+	GObjectClass		 parent_class;
+};
+
+/**
+ * DfuEmulatorFault:
+ * @DFU_EMULATOR_FAULT_NONE:		No fault
+ * @DFU_EMULATOR_FAULT_USB_ERROR:	The request fails with an I/O error
+ * @DFU_EMULATOR_FAULT_STALL:		The request is stalled and the device enters dfuERROR
+ * @DFU_EMULATOR_FAULT_WRITE_ERROR:	The next download fails with errWRITE
+ * @DFU_EMULATOR_FAULT_CORRUPT:		The next upload has one bit flipped
+ *
+ * The faults that can be injected into the emulated device.
+ **/
+typedef enum {
+	DFU_EMULATOR_FAULT_NONE,
+	DFU_EMULATOR_FAULT_USB_ERROR,
+	DFU_EMULATOR_FAULT_STALL,
+	DFU_EMULATOR_FAULT_WRITE_ERROR,
+	DFU_EMULATOR_FAULT_CORRUPT,
+	/*< private >*/
+	DFU_EMULATOR_FAULT_LAST
+} DfuEmulatorFault;
+
+DfuEmulator	*dfu_emulator_new			(void);
+
+gboolean	 dfu_emulator_add_target		(DfuEmulator	*emulator,
+							 const gchar	*alt_name,
+							 gsize		 size,
+							 GError		**error);
+guint		 dfu_emulator_get_n_targets		(DfuEmulator	*emulator);
+const gchar	*dfu_emulator_get_alt_name		(DfuEmulator	*emulator,
+							 guint8		 alt_setting);
+gboolean	 dfu_emulator_get_dfuse			(DfuEmulator	*emulator);
+guint16		 dfu_emulator_get_transfer_size		(DfuEmulator	*emulator);
+guint		 dfu_emulator_get_request_count		(DfuEmulator	*emulator,
+							 DfuRequest	 request);
+guint		 dfu_emulator_get_erase_count		(DfuEmulator	*emulator);
+gsize		 dfu_emulator_get_bytes_written		(DfuEmulator	*emulator);
+gsize		 dfu_emulator_get_chunk_size_max		(DfuEmulator	*emulator);
+GBytes		*dfu_emulator_get_memory		(DfuEmulator	*emulator,
+							 guint8		 alt_setting,
+							 guint32	 address,
+							 gsize		 length);
+
+void		 dfu_emulator_set_dfuse			(DfuEmulator	*emulator,
+							 gboolean	 dfuse);
+void		 dfu_emulator_set_transfer_size		(DfuEmulator	*emulator,
+							 guint16	 transfer_size);
+void		 dfu_emulator_set_latency		(DfuEmulator	*emulator,
+							 guint		 latency_ms);
+void		 dfu_emulator_set_poll_timeout		(DfuEmulator	*emulator,
+							 guint		 poll_timeout_ms);
+void		 dfu_emulator_set_fault			(DfuEmulator	*emulator,
+							 DfuEmulatorFault fault,
+							 guint		 request_nr);
+
+gboolean	 dfu_emulator_set_alt_setting		(DfuEmulator	*emulator,
+							 guint8		 alt_setting,
+							 GError		**error);
+gboolean	 dfu_emulator_control_transfer		(DfuEmulator	*emulator,
+							 GUsbDeviceDirection direction,
+							 guint8		 request,
+							 guint16	 value,
+							 guint8		*data,
+							 gsize		 length,
+							 gsize		*actual_length,
+							 GError		**error);
+
+G_END_DECLS
+
+#endif /* __DFU_EMULATOR_PRIVATE_H */
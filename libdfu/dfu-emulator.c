@@ -0,0 +1,992 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * SECTION:dfu-emulator
+ * @short_description: An emulated DFU device
+ *
+ * This object implements the device side of the DFU 1.1 and DfuSe
+ * protocols in memory, so that #DfuDevice and #DfuTarget can be run
+ * without any hardware attached.
+ *
+ * The emulated flash behaves like NOR memory on DfuSe targets: erasing a
+ * sector sets every byte to 0xff and writing can only clear bits, so a
+ * write to a sector that was not erased first fails with errWRITE.
+ *
+ * Faults such as stalls, I/O errors, write errors and corrupted reads
+ * can be injected at a specific request number.
+ *
+ * See also: #DfuDevice
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "dfu-common.h"
+#include "dfu-emulator-private.h"
+#include "dfu-error.h"
+#include "dfu-sector.h"
+#include "dfu-target-private.h"
+
+static void dfu_emulator_finalize			 (GObject *object);
+
+typedef struct {
+	gchar			*alt_name;
+	DfuTarget		*layout;	/* only for DfuSe */
+	guint8			*memory;
+	gsize			 size;
+	guint32			 base;
+} DfuEmulatorAlt;
+
+/**
+ * DfuEmulatorPrivate:
+ *
+ * Private #DfuEmulator data
+ **/
+typedef struct {
+	GPtrArray		*alts;		/* of DfuEmulatorAlt */
+	guint8			 alt_setting;
+	gboolean		 dfuse;
+	guint16			 transfer_size;
+	guint			 latency_ms;
+	guint			 poll_timeout_ms;
+	DfuEmulatorFault	 fault;
+	guint			 fault_request_nr;
+	guint			 request_nr;
+	guint			 request_count[DFU_REQUEST_LAST];
+	guint			 erase_count;	/* of sectors */
+	gsize			 bytes_written;
+	gsize			 chunk_size_max;	/* of any DNLOAD */
+	DfuState		 state;
+	DfuStatus		 status;
+	DfuStatus		 status_pending;	/* reported at GetStatus */
+	gint64			 busy_until;
+	guint32			 address;	/* DfuSe address pointer */
+	gsize			 offset;	/* DFU 1.1 sequential offset */
+} DfuEmulatorPrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (DfuEmulator, dfu_emulator, G_TYPE_OBJECT)
+#define GET_PRIVATE(o) (dfu_emulator_get_instance_private (o))
+
+/**
+ * dfu_emulator_alt_free:
+ **/
+static void
+dfu_emulator_alt_free (DfuEmulatorAlt *alt)
+{
+	if (alt->layout != NULL)
+		g_object_unref (alt->layout);
+	g_free (alt->alt_name);
+	g_free (alt->memory);
+	g_free (alt);
+}
+
+/**
+ * dfu_emulator_class_init:
+ **/
+static void
+dfu_emulator_class_init (DfuEmulatorClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	object_class->finalize = dfu_emulator_finalize;
+}
+
+/**
+ * dfu_emulator_init:
+ **/
+static void
+dfu_emulator_init (DfuEmulator *emulator)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	priv->alts = g_ptr_array_new_with_free_func ((GDestroyNotify) dfu_emulator_alt_free);
+	priv->transfer_size = 1024;
+	priv->state = DFU_STATE_DFU_IDLE;
+	priv->status = DFU_STATUS_OK;
+	priv->status_pending = DFU_STATUS_OK;
+}
+
+/**
+ * dfu_emulator_finalize:
+ **/
+static void
+dfu_emulator_finalize (GObject *object)
+{
+	DfuEmulator *emulator = DFU_EMULATOR (object);
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+
+	g_ptr_array_unref (priv->alts);
+
+	G_OBJECT_CLASS (dfu_emulator_parent_class)->finalize (object);
+}
+
+/**
+ * dfu_emulator_new: (skip)
+ *
+ * Creates a new emulated device with no targets.
+ *
+ * Return value: a new #DfuEmulator
+ **/
+DfuEmulator *
+dfu_emulator_new (void)
+{
+	DfuEmulator *emulator;
+	emulator = g_object_new (DFU_TYPE_EMULATOR, NULL);
+	return emulator;
+}
+
+/**
+ * dfu_emulator_add_target: (skip)
+ * @emulator: a #DfuEmulator
+ * @alt_name: the alternate setting name, e.g. "@Flash /0x08000000/8*001Kg"
+ * @size: the memory size in bytes, only used for DFU 1.1 targets
+ * @error: a #GError, or %NULL
+ *
+ * Adds a target with the next alternate setting number. For DfuSe
+ * devices the memory layout is parsed from @alt_name.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+dfu_emulator_add_target (DfuEmulator *emulator,
+			 const gchar *alt_name,
+			 gsize size,
+			 GError **error)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	DfuEmulatorAlt *alt;
+
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), FALSE);
+	g_return_val_if_fail (alt_name != NULL, FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	alt = g_new0 (DfuEmulatorAlt, 1);
+	alt->alt_name = g_strdup (alt_name);
+	alt->size = size;
+
+	/* use the same parser as the host side to get the layout */
+	if (priv->dfuse) {
+		GPtrArray *sectors;
+		guint64 end = 0;
+		guint i;
+
+		alt->layout = g_object_new (DFU_TYPE_TARGET, NULL);
+		if (!dfu_target_parse_sectors (alt->layout, alt_name, error)) {
+			dfu_emulator_alt_free (alt);
+			return FALSE;
+		}
+		sectors = dfu_target_get_sectors (alt->layout);
+		alt->base = G_MAXUINT32;
+		for (i = 0; i < sectors->len; i++) {
+			DfuSector *sector = g_ptr_array_index (sectors, i);
+			guint32 addr = dfu_sector_get_address (sector);
+			alt->base = MIN (alt->base, addr);
+			end = MAX (end, (guint64) addr + dfu_sector_get_size (sector));
+		}
+		alt->size = end > alt->base ? end - alt->base : 0;
+	}
+	if (alt->size == 0) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INVALID_DEVICE,
+			     "no memory for target %s",
+			     alt_name);
+		dfu_emulator_alt_free (alt);
+		return FALSE;
+	}
+
+	/* not erased, so that writing without an erase is caught */
+	alt->memory = g_new0 (guint8, alt->size);
+	g_ptr_array_add (priv->alts, alt);
+	return TRUE;
+}
+
+/**
+ * dfu_emulator_get_n_targets: (skip)
+ **/
+guint
+dfu_emulator_get_n_targets (DfuEmulator *emulator)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), 0);
+	return priv->alts->len;
+}
+
+/**
+ * dfu_emulator_get_alt_name: (skip)
+ **/
+const gchar *
+dfu_emulator_get_alt_name (DfuEmulator *emulator, guint8 alt_setting)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	DfuEmulatorAlt *alt;
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), NULL);
+	if (alt_setting >= priv->alts->len)
+		return NULL;
+	alt = g_ptr_array_index (priv->alts, alt_setting);
+	return alt->alt_name;
+}
+
+/**
+ * dfu_emulator_get_dfuse: (skip)
+ **/
+gboolean
+dfu_emulator_get_dfuse (DfuEmulator *emulator)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), FALSE);
+	return priv->dfuse;
+}
+
+/**
+ * dfu_emulator_get_transfer_size: (skip)
+ **/
+guint16
+dfu_emulator_get_transfer_size (DfuEmulator *emulator)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), 0);
+	return priv->transfer_size;
+}
+
+/**
+ * dfu_emulator_get_request_count: (skip)
+ * @emulator: a #DfuEmulator
+ * @request: a #DfuRequest, e.g. %DFU_REQUEST_DNLOAD
+ *
+ * Gets how many times a request has been received, which allows the
+ * self tests to check how much traffic an operation needed.
+ *
+ * Return value: integer
+ **/
+guint
+dfu_emulator_get_request_count (DfuEmulator *emulator, DfuRequest request)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), 0);
+	g_return_val_if_fail (request < DFU_REQUEST_LAST, 0);
+	return priv->request_count[request];
+}
+
+/**
+ * dfu_emulator_get_erase_count: (skip)
+ * @emulator: a #DfuEmulator
+ *
+ * Gets how many sectors have been erased, including those erased by a
+ * mass erase.
+ *
+ * Return value: integer
+ **/
+guint
+dfu_emulator_get_erase_count (DfuEmulator *emulator)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), 0);
+	return priv->erase_count;
+}
+
+/**
+ * dfu_emulator_get_bytes_written: (skip)
+ * @emulator: a #DfuEmulator
+ *
+ * Gets how many bytes of firmware have been written to the memory.
+ *
+ * Return value: integer
+ **/
+gsize
+dfu_emulator_get_bytes_written (DfuEmulator *emulator)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), 0);
+	return priv->bytes_written;
+}
+
+/**
+ * dfu_emulator_get_chunk_size_max: (skip)
+ * @emulator: a #DfuEmulator
+ *
+ * Gets the largest payload sent in any single DNLOAD request.
+ *
+ * Return value: integer
+ **/
+gsize
+dfu_emulator_get_chunk_size_max (DfuEmulator *emulator)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), 0);
+	return priv->chunk_size_max;
+}
+
+/**
+ * dfu_emulator_get_memory: (skip)
+ * @emulator: a #DfuEmulator
+ * @alt_setting: the alternate setting
+ * @address: the memory address, which includes the DfuSe base address
+ * @length: the number of bytes
+ *
+ * Gets a copy of the emulated memory.
+ *
+ * Return value: a #GBytes, or %NULL if the range is invalid
+ **/
+GBytes *
+dfu_emulator_get_memory (DfuEmulator *emulator,
+			 guint8 alt_setting,
+			 guint32 address,
+			 gsize length)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	DfuEmulatorAlt *alt;
+
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), NULL);
+
+	if (alt_setting >= priv->alts->len)
+		return NULL;
+	alt = g_ptr_array_index (priv->alts, alt_setting);
+	if (address < alt->base ||
+	    (guint64) address - alt->base + length > alt->size)
+		return NULL;
+	return g_bytes_new (alt->memory + address - alt->base, length);
+}
+
+/**
+ * dfu_emulator_set_dfuse: (skip)
+ *
+ * Sets if the device implements the ST DfuSe extensions. This has to be
+ * set before any targets are added.
+ **/
+void
+dfu_emulator_set_dfuse (DfuEmulator *emulator, gboolean dfuse)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_if_fail (DFU_IS_EMULATOR (emulator));
+	g_return_if_fail (priv->alts->len == 0);
+	priv->dfuse = dfuse;
+}
+
+/**
+ * dfu_emulator_set_transfer_size: (skip)
+ **/
+void
+dfu_emulator_set_transfer_size (DfuEmulator *emulator, guint16 transfer_size)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_if_fail (DFU_IS_EMULATOR (emulator));
+	g_return_if_fail (transfer_size > 0);
+	priv->transfer_size = transfer_size;
+}
+
+/**
+ * dfu_emulator_set_latency: (skip)
+ *
+ * Sets how long each request takes on the emulated bus.
+ **/
+void
+dfu_emulator_set_latency (DfuEmulator *emulator, guint latency_ms)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_if_fail (DFU_IS_EMULATOR (emulator));
+	priv->latency_ms = latency_ms;
+}
+
+/**
+ * dfu_emulator_set_poll_timeout: (skip)
+ *
+ * Sets how long the device stays in dfuDNBUSY after each download,
+ * which is also the bwPollTimeout it reports.
+ **/
+void
+dfu_emulator_set_poll_timeout (DfuEmulator *emulator, guint poll_timeout_ms)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_if_fail (DFU_IS_EMULATOR (emulator));
+	g_return_if_fail (poll_timeout_ms <= 0xffffff);
+	priv->poll_timeout_ms = poll_timeout_ms;
+}
+
+/**
+ * dfu_emulator_set_fault: (skip)
+ * @emulator: a #DfuEmulator
+ * @fault: a #DfuEmulatorFault, e.g. %DFU_EMULATOR_FAULT_STALL
+ * @request_nr: the request number, where the first request is 1
+ *
+ * Arms a fault that fires once on the first request it applies to
+ * that is numbered @request_nr or later.
+ **/
+void
+dfu_emulator_set_fault (DfuEmulator *emulator,
+			DfuEmulatorFault fault,
+			guint request_nr)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_return_if_fail (DFU_IS_EMULATOR (emulator));
+	g_return_if_fail (fault < DFU_EMULATOR_FAULT_LAST);
+	priv->fault = fault;
+	priv->fault_request_nr = request_nr;
+}
+
+/**
+ * dfu_emulator_fault_fire:
+ *
+ * Returns: %TRUE if @fault was armed for this request, disarming it
+ **/
+static gboolean
+dfu_emulator_fault_fire (DfuEmulator *emulator, DfuEmulatorFault fault)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	if (priv->fault != fault)
+		return FALSE;
+	if (priv->request_nr < priv->fault_request_nr)
+		return FALSE;
+	g_debug ("emulating fault %u at request %u", fault, priv->request_nr);
+	priv->fault = DFU_EMULATOR_FAULT_NONE;
+	return TRUE;
+}
+
+/**
+ * dfu_emulator_get_alt:
+ **/
+static DfuEmulatorAlt *
+dfu_emulator_get_alt (DfuEmulator *emulator)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	if (priv->alt_setting >= priv->alts->len)
+		return NULL;
+	return g_ptr_array_index (priv->alts, priv->alt_setting);
+}
+
+/**
+ * dfu_emulator_set_alt_setting: (skip)
+ **/
+gboolean
+dfu_emulator_set_alt_setting (DfuEmulator *emulator,
+			      guint8 alt_setting,
+			      GError **error)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	if (alt_setting >= priv->alts->len) {
+		g_set_error (error,
+			     G_USB_DEVICE_ERROR,
+			     G_USB_DEVICE_ERROR_NOT_SUPPORTED,
+			     "no alternate setting 0x%02x",
+			     alt_setting);
+		return FALSE;
+	}
+	priv->alt_setting = alt_setting;
+	priv->state = DFU_STATE_DFU_IDLE;
+	priv->offset = 0;
+	return TRUE;
+}
+
+/**
+ * dfu_emulator_stall:
+ *
+ * Stalls the control pipe, which makes the device enter dfuERROR.
+ **/
+static gboolean
+dfu_emulator_stall (DfuEmulator *emulator, guint8 request, GError **error)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	g_debug ("stalling request 0x%02x in %s",
+		 request, dfu_state_to_string (priv->state));
+	priv->state = DFU_STATE_DFU_ERROR;
+	priv->status = DFU_STATUS_ERR_STALLDPKT;
+	g_set_error (error,
+		     G_USB_DEVICE_ERROR,
+		     G_USB_DEVICE_ERROR_NOT_SUPPORTED,
+		     "request 0x%02x was stalled",
+		     request);
+	return FALSE;
+}
+
+/**
+ * dfu_emulator_check_range:
+ *
+ * Returns: the status to report if [@address, @address + @length) is
+ * not mapped or is missing @cap
+ **/
+static DfuStatus
+dfu_emulator_check_range (DfuEmulator *emulator,
+			  DfuEmulatorAlt *alt,
+			  guint32 address,
+			  gsize length,
+			  DfuSectorCap cap)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	guint i;
+	g_autoptr(GPtrArray) sectors = NULL;
+
+	if (address < alt->base ||
+	    (guint64) address - alt->base + length > alt->size)
+		return DFU_STATUS_ERR_ADDRESS;
+	if (!priv->dfuse)
+		return DFU_STATUS_OK;
+	sectors = dfu_target_get_sectors_for_range (alt->layout, address, length);
+	if (sectors->len == 0)
+		return DFU_STATUS_ERR_ADDRESS;
+	for (i = 0; i < sectors->len; i++) {
+		DfuSector *sector = g_ptr_array_index (sectors, i);
+		if (!dfu_sector_has_cap (sector, cap))
+			return DFU_STATUS_ERR_TARGET;
+	}
+	return DFU_STATUS_OK;
+}
+
+/**
+ * dfu_emulator_erase:
+ **/
+static DfuStatus
+dfu_emulator_erase (DfuEmulator *emulator,
+		    DfuEmulatorAlt *alt,
+		    DfuSector *sector)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	if (!dfu_sector_has_cap (sector, DFU_SECTOR_CAP_ERASEABLE))
+		return DFU_STATUS_ERR_TARGET;
+	memset (alt->memory + dfu_sector_get_address (sector) - alt->base,
+		0xff, dfu_sector_get_size (sector));
+	priv->erase_count++;
+	return DFU_STATUS_OK;
+}
+
+/**
+ * dfu_emulator_mass_erase:
+ **/
+static DfuStatus
+dfu_emulator_mass_erase (DfuEmulator *emulator, DfuEmulatorAlt *alt)
+{
+	GPtrArray *sectors = dfu_target_get_sectors (alt->layout);
+	guint i;
+
+	for (i = 0; i < sectors->len; i++) {
+		DfuSector *sector = g_ptr_array_index (sectors, i);
+		if (dfu_sector_has_cap (sector, DFU_SECTOR_CAP_ERASEABLE))
+			dfu_emulator_erase (emulator, alt, sector);
+	}
+	return DFU_STATUS_OK;
+}
+
+/**
+ * dfu_emulator_dfuse_command:
+ *
+ * Runs a DfuSe command sent as block 0, as described in UM0424.
+ **/
+static DfuStatus
+dfu_emulator_dfuse_command (DfuEmulator *emulator,
+			    DfuEmulatorAlt *alt,
+			    const guint8 *data,
+			    gsize length)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	DfuSector *sector;
+	guint32 address = 0;
+
+	if (length == 5) {
+		memcpy (&address, data + 1, 4);
+		address = GUINT32_FROM_LE (address);
+	}
+
+	switch (data[0]) {
+	case DFU_CMD_DFUSE_SET_ADDRESS_POINTER:
+		if (length != 5)
+			break;
+		g_debug ("setting address pointer to 0x%08x", address);
+		priv->address = address;
+		return DFU_STATUS_OK;
+	case DFU_CMD_DFUSE_ERASE:
+		if (length == 1) {
+			g_debug ("mass erase");
+			return dfu_emulator_mass_erase (emulator, alt);
+		}
+		if (length != 5)
+			break;
+		g_debug ("erasing sector at 0x%08x", address);
+		sector = dfu_target_get_sector_for_addr (alt->layout, address);
+		if (sector == NULL)
+			return DFU_STATUS_ERR_ADDRESS;
+		return dfu_emulator_erase (emulator, alt, sector);
+	case DFU_CMD_DFUSE_READ_UNPROTECT:
+		if (length != 1)
+			break;
+		return dfu_emulator_mass_erase (emulator, alt);
+	default:
+		break;
+	}
+	return DFU_STATUS_ERR_STALLDPKT;
+}
+
+/**
+ * dfu_emulator_write:
+ **/
+static DfuStatus
+dfu_emulator_write (DfuEmulator *emulator,
+		    DfuEmulatorAlt *alt,
+		    guint32 address,
+		    const guint8 *data,
+		    gsize length)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	DfuStatus status;
+	guint8 *mem;
+	gsize i;
+
+	status = dfu_emulator_check_range (emulator, alt, address, length,
+					   DFU_SECTOR_CAP_WRITEABLE);
+	if (status != DFU_STATUS_OK)
+		return status;
+	mem = alt->memory + address - alt->base;
+
+	/* programming NOR flash can only clear bits */
+	if (priv->dfuse) {
+		for (i = 0; i < length; i++) {
+			if ((mem[i] & data[i]) != data[i]) {
+				g_debug ("0x%08x was not erased",
+					 (guint) (address + i));
+				return DFU_STATUS_ERR_WRITE;
+			}
+		}
+	}
+	memcpy (mem, data, length);
+	priv->bytes_written += length;
+	return DFU_STATUS_OK;
+}
+
+/**
+ * dfu_emulator_download:
+ **/
+static gboolean
+dfu_emulator_download (DfuEmulator *emulator,
+		       guint16 value,
+		       const guint8 *data,
+		       gsize length,
+		       gsize *actual_length,
+		       GError **error)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	DfuEmulatorAlt *alt = dfu_emulator_get_alt (emulator);
+
+	/* the host has to send ABORT to leave dfuUPLOAD-IDLE */
+	if (priv->state != DFU_STATE_DFU_IDLE &&
+	    priv->state != DFU_STATE_DFU_DNLOAD_IDLE)
+		return dfu_emulator_stall (emulator, DFU_REQUEST_DNLOAD, error);
+	if (alt == NULL || length > priv->transfer_size)
+		return dfu_emulator_stall (emulator, DFU_REQUEST_DNLOAD, error);
+	priv->chunk_size_max = MAX (priv->chunk_size_max, length);
+
+	/* end of the download, which is also sent when no data was
+	 * written as everything was already correct */
+	if (length == 0) {
+		priv->state = DFU_STATE_DFU_MANIFEST_SYNC;
+		return TRUE;
+	}
+
+	if (priv->dfuse) {
+		if (value == 0) {
+			priv->status_pending = dfu_emulator_dfuse_command (emulator, alt,
+									   data, length);
+		} else if (value == 1) {
+			return dfu_emulator_stall (emulator, DFU_REQUEST_DNLOAD, error);
+		} else if (dfu_emulator_fault_fire (emulator, DFU_EMULATOR_FAULT_WRITE_ERROR)) {
+			priv->status_pending = DFU_STATUS_ERR_WRITE;
+		} else {
+			guint32 address = priv->address +
+					  (guint32) (value - 2) * priv->transfer_size;
+			priv->status_pending = dfu_emulator_write (emulator, alt, address,
+								   data, length);
+		}
+	} else {
+		if (priv->state == DFU_STATE_DFU_IDLE)
+			priv->offset = 0;
+		if (dfu_emulator_fault_fire (emulator, DFU_EMULATOR_FAULT_WRITE_ERROR)) {
+			priv->status_pending = DFU_STATUS_ERR_WRITE;
+		} else {
+			priv->status_pending = dfu_emulator_write (emulator, alt,
+								   priv->offset,
+								   data, length);
+		}
+		priv->offset += length;
+	}
+
+	/* the data is only acted on at the next GetStatus */
+	priv->state = DFU_STATE_DFU_DNLOAD_SYNC;
+	*actual_length = length;
+	return TRUE;
+}
+
+/**
+ * dfu_emulator_upload:
+ **/
+static gboolean
+dfu_emulator_upload (DfuEmulator *emulator,
+		     guint16 value,
+		     guint8 *data,
+		     gsize length,
+		     gsize *actual_length,
+		     GError **error)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	DfuEmulatorAlt *alt = dfu_emulator_get_alt (emulator);
+	guint32 address;
+	gsize chunk_size = 0;
+
+	/* even after a DfuSe SetAddress the host has to send ABORT to
+	 * leave dfuDNLOAD-IDLE */
+	if (priv->state != DFU_STATE_DFU_IDLE &&
+	    priv->state != DFU_STATE_DFU_UPLOAD_IDLE)
+		return dfu_emulator_stall (emulator, DFU_REQUEST_UPLOAD, error);
+	if (alt == NULL || length > priv->transfer_size)
+		return dfu_emulator_stall (emulator, DFU_REQUEST_UPLOAD, error);
+
+	if (priv->dfuse) {
+		/* the supported commands */
+		if (value == 0) {
+			const guint8 cmds[] = { DFU_CMD_DFUSE_GET_COMMAND,
+						DFU_CMD_DFUSE_SET_ADDRESS_POINTER,
+						DFU_CMD_DFUSE_ERASE,
+						DFU_CMD_DFUSE_READ_UNPROTECT };
+			chunk_size = MIN (length, sizeof(cmds));
+			memcpy (data, cmds, chunk_size);
+			priv->state = DFU_STATE_DFU_UPLOAD_IDLE;
+			*actual_length = chunk_size;
+			return TRUE;
+		}
+		if (value == 1)
+			return dfu_emulator_stall (emulator, DFU_REQUEST_UPLOAD, error);
+		address = priv->address + (guint32) (value - 2) * priv->transfer_size;
+		if (address >= alt->base && address - alt->base < alt->size)
+			chunk_size = MIN (length, alt->size - (address - alt->base));
+	} else {
+		if (priv->state == DFU_STATE_DFU_IDLE)
+			priv->offset = 0;
+		address = priv->offset;
+		chunk_size = MIN (length, alt->size - priv->offset);
+		priv->offset += chunk_size;
+	}
+
+	/* read the memory */
+	if (chunk_size > 0) {
+		DfuStatus status;
+		status = dfu_emulator_check_range (emulator, alt, address, chunk_size,
+						   DFU_SECTOR_CAP_READABLE);
+		if (status != DFU_STATUS_OK) {
+			dfu_emulator_stall (emulator, DFU_REQUEST_UPLOAD, error);
+			priv->status = status;
+			return FALSE;
+		}
+		memcpy (data, alt->memory + address - alt->base, chunk_size);
+		if (dfu_emulator_fault_fire (emulator, DFU_EMULATOR_FAULT_CORRUPT))
+			data[chunk_size / 2] ^= 0x01;
+	}
+
+	/* a short frame ends the upload */
+	if (chunk_size < length) {
+		priv->state = DFU_STATE_DFU_IDLE;
+		priv->offset = 0;
+	} else {
+		priv->state = DFU_STATE_DFU_UPLOAD_IDLE;
+	}
+	*actual_length = chunk_size;
+	return TRUE;
+}
+
+/**
+ * dfu_emulator_download_done:
+ **/
+static void
+dfu_emulator_download_done (DfuEmulator *emulator)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	if (priv->status_pending != DFU_STATUS_OK) {
+		priv->status = priv->status_pending;
+		priv->status_pending = DFU_STATUS_OK;
+		priv->state = DFU_STATE_DFU_ERROR;
+		return;
+	}
+	priv->state = DFU_STATE_DFU_DNLOAD_IDLE;
+}
+
+/**
+ * dfu_emulator_get_status:
+ **/
+static gboolean
+dfu_emulator_get_status (DfuEmulator *emulator,
+			 guint8 *data,
+			 gsize length,
+			 gsize *actual_length,
+			 GError **error)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	gint64 now;
+	guint poll_timeout = 0;
+
+	if (length < 6)
+		return dfu_emulator_stall (emulator, DFU_REQUEST_GETSTATUS, error);
+
+	switch (priv->state) {
+	case DFU_STATE_DFU_DNLOAD_SYNC:
+		if (priv->poll_timeout_ms == 0) {
+			dfu_emulator_download_done (emulator);
+			break;
+		}
+		priv->state = DFU_STATE_DFU_DNBUSY;
+		priv->busy_until = g_get_monotonic_time () +
+				   (gint64) priv->poll_timeout_ms * 1000;
+		poll_timeout = priv->poll_timeout_ms;
+		break;
+	case DFU_STATE_DFU_DNBUSY:
+		now = g_get_monotonic_time ();
+		if (now < priv->busy_until) {
+			poll_timeout = (guint) ((priv->busy_until - now + 999) / 1000);
+			break;
+		}
+		dfu_emulator_download_done (emulator);
+		break;
+	case DFU_STATE_DFU_MANIFEST_SYNC:
+		/* manifestation tolerant */
+		priv->state = DFU_STATE_DFU_IDLE;
+		priv->offset = 0;
+		break;
+	default:
+		break;
+	}
+
+	data[0] = priv->status;
+	data[1] = poll_timeout & 0xff;
+	data[2] = (poll_timeout >> 8) & 0xff;
+	data[3] = (poll_timeout >> 16) & 0xff;
+	data[4] = priv->state;
+	data[5] = 0;
+	*actual_length = 6;
+	return TRUE;
+}
+
+/**
+ * dfu_emulator_control_transfer: (skip)
+ * @emulator: a #DfuEmulator
+ * @direction: a #GUsbDeviceDirection
+ * @request: a #DfuRequest
+ * @value: the wValue, e.g. the block number
+ * @data: the data buffer
+ * @length: the size of @data
+ * @actual_length: (out): the number of bytes transferred
+ * @error: a #GError, or %NULL
+ *
+ * Handles a class request sent to the DFU interface, failing with the
+ * same errors as g_usb_device_control_transfer().
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+dfu_emulator_control_transfer (DfuEmulator *emulator,
+			       GUsbDeviceDirection direction,
+			       guint8 request,
+			       guint16 value,
+			       guint8 *data,
+			       gsize length,
+			       gsize *actual_length,
+			       GError **error)
+{
+	DfuEmulatorPrivate *priv = GET_PRIVATE (emulator);
+	GUsbDeviceDirection direction_expected = G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE;
+	gsize actual_length_tmp = 0;
+
+	g_return_val_if_fail (DFU_IS_EMULATOR (emulator), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	if (actual_length == NULL)
+		actual_length = &actual_length_tmp;
+	*actual_length = 0;
+
+	/* emulate the time on the bus */
+	if (priv->latency_ms > 0)
+		g_usleep (priv->latency_ms * 1000);
+	priv->request_nr++;
+	if (request < DFU_REQUEST_LAST)
+		priv->request_count[request]++;
+
+	/* faults on the bus */
+	if (dfu_emulator_fault_fire (emulator, DFU_EMULATOR_FAULT_USB_ERROR)) {
+		g_set_error (error,
+			     G_USB_DEVICE_ERROR,
+			     G_USB_DEVICE_ERROR_IO,
+			     "emulated I/O error");
+		return FALSE;
+	}
+	if (dfu_emulator_fault_fire (emulator, DFU_EMULATOR_FAULT_STALL))
+		return dfu_emulator_stall (emulator, request, error);
+
+	/* the wrong way around */
+	if (request == DFU_REQUEST_UPLOAD ||
+	    request == DFU_REQUEST_GETSTATUS ||
+	    request == DFU_REQUEST_GETSTATE)
+		direction_expected = G_USB_DEVICE_DIRECTION_DEVICE_TO_HOST;
+	if (direction != direction_expected)
+		return dfu_emulator_stall (emulator, request, error);
+
+	/* only GetStatus is valid while busy */
+	if (priv->state == DFU_STATE_DFU_DNBUSY &&
+	    request != DFU_REQUEST_GETSTATUS)
+		return dfu_emulator_stall (emulator, request, error);
+
+	/* only status requests are valid in the error state */
+	if (priv->state == DFU_STATE_DFU_ERROR &&
+	    request != DFU_REQUEST_GETSTATUS &&
+	    request != DFU_REQUEST_GETSTATE &&
+	    request != DFU_REQUEST_CLRSTATUS)
+		return dfu_emulator_stall (emulator, request, error);
+
+	switch (request) {
+	case DFU_REQUEST_DETACH:
+		return TRUE;
+	case DFU_REQUEST_DNLOAD:
+		return dfu_emulator_download (emulator, value, data, length,
+					      actual_length, error);
+	case DFU_REQUEST_UPLOAD:
+		return dfu_emulator_upload (emulator, value, data, length,
+					    actual_length, error);
+	case DFU_REQUEST_GETSTATUS:
+		return dfu_emulator_get_status (emulator, data, length,
+						actual_length, error);
+	case DFU_REQUEST_CLRSTATUS:
+		priv->state = DFU_STATE_DFU_IDLE;
+		priv->status = DFU_STATUS_OK;
+		priv->status_pending = DFU_STATUS_OK;
+		priv->offset = 0;
+		return TRUE;
+	case DFU_REQUEST_GETSTATE:
+		if (length < 1)
+			return dfu_emulator_stall (emulator, request, error);
+		data[0] = priv->state;
+		*actual_length = 1;
+		return TRUE;
+	case DFU_REQUEST_ABORT:
+		priv->state = DFU_STATE_DFU_IDLE;
+		priv->status_pending = DFU_STATUS_OK;
+		priv->offset = 0;
+		return TRUE;
+	default:
+		break;
+	}
+	return dfu_emulator_stall (emulator, request, error);
+}
@@ -37,7 +37,9 @@
 #include <string.h>
 #include <stdio.h>
 
-#include "dfu-common.h"
+#include "dfu-common-private.h"
+#include "dfu-crc32-private.h"
+#include "dfu-element-private.h"
 #include "dfu-error.h"
 #include "dfu-firmware.h"
 #include "dfu-image-private.h"
@@ -56,10 +58,18 @@ typedef struct {
 	guint16			 pid;
 	guint16			 release;
 	guint32			 crc;
+	guint8			 ihex_record_size;
 	DfuCipherKind		 cipher_kind;
 	DfuFirmwareFormat	 format;
+	GPtrArray		*checksums;	/* of DfuFirmwareChecksum */
+	gboolean		 checksums_valid;
 } DfuFirmwarePrivate;
 
+typedef struct {
+	GChecksumType		 kind;
+	GChecksum		*checksum;
+} DfuFirmwareChecksum;
+
 G_DEFINE_TYPE_WITH_PRIVATE (DfuFirmware, dfu_firmware, G_TYPE_OBJECT)
 #define GET_PRIVATE(o) (dfu_firmware_get_instance_private (o))
 
@@ -73,6 +83,16 @@ dfu_firmware_class_init (DfuFirmwareClass *klass)
 	object_class->finalize = dfu_firmware_finalize;
 }
 
+/**
+ * dfu_firmware_checksum_free:
+ **/
+static void
+dfu_firmware_checksum_free (DfuFirmwareChecksum *item)
+{
+	g_checksum_free (item->checksum);
+	g_free (item);
+}
+
 /**
  * dfu_firmware_init:
  **/
@@ -83,8 +103,10 @@ dfu_firmware_init (DfuFirmware *firmware)
 	priv->vid = 0xffff;
 	priv->pid = 0xffff;
 	priv->release = 0xffff;
+	priv->ihex_record_size = 16;
 	priv->images = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
 	priv->metadata = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	priv->checksums = g_ptr_array_new_with_free_func ((GDestroyNotify) dfu_firmware_checksum_free);
 }
 
 /**
@@ -98,6 +120,7 @@ dfu_firmware_finalize (GObject *object)
 
 	g_ptr_array_unref (priv->images);
 	g_hash_table_destroy (priv->metadata);
+	g_ptr_array_unref (priv->checksums);
 
 	G_OBJECT_CLASS (dfu_firmware_parent_class)->finalize (object);
 }
@@ -400,6 +423,165 @@ dfu_firmware_set_format (DfuFirmware *firmware, DfuFirmwareFormat format)
 	priv->format = format;
 }
 
+/**
+ * dfu_firmware_set_ihex_record_size:
+ * @firmware: a #DfuFirmware
+ * @record_size: number of data bytes in each record, typically 16, 32 or 255
+ *
+ * Sets the number of data bytes written in each Intel HEX record. Larger
+ * records make the file smaller, but not all tools support them.
+ *
+ * Since: 0.7.2
+ **/
+void
+dfu_firmware_set_ihex_record_size (DfuFirmware *firmware, guint8 record_size)
+{
+	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
+	g_return_if_fail (DFU_IS_FIRMWARE (firmware));
+	g_return_if_fail (record_size > 0);
+	priv->ihex_record_size = record_size;
+}
+
+/**
+ * dfu_firmware_add_checksum_type:
+ * @firmware: a #DfuFirmware
+ * @checksum_type: a #GChecksumType, e.g. %G_CHECKSUM_SHA1
+ *
+ * Asks for a digest of the whole file to be computed whenever firmware
+ * data is parsed or written. The digest is computed in the same pass
+ * over the data as the DFU suffix CRC, so the data does not have to be
+ * read again to hash it.
+ *
+ * Since: 0.7.2
+ **/
+void
+dfu_firmware_add_checksum_type (DfuFirmware *firmware,
+				GChecksumType checksum_type)
+{
+	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
+	DfuFirmwareChecksum *item;
+	guint i;
+
+	g_return_if_fail (DFU_IS_FIRMWARE (firmware));
+
+	/* already added */
+	for (i = 0; i < priv->checksums->len; i++) {
+		item = g_ptr_array_index (priv->checksums, i);
+		if (item->kind == checksum_type)
+			return;
+	}
+	item = g_new0 (DfuFirmwareChecksum, 1);
+	item->kind = checksum_type;
+	item->checksum = g_checksum_new (checksum_type);
+	g_ptr_array_add (priv->checksums, item);
+	priv->checksums_valid = FALSE;
+}
+
+/**
+ * dfu_firmware_get_checksum:
+ * @firmware: a #DfuFirmware
+ * @checksum_type: a #GChecksumType, e.g. %G_CHECKSUM_SHA1
+ *
+ * Gets a digest of the file data that was last parsed or written.
+ *
+ * Digests are not computed when parsing with
+ * %DFU_FIRMWARE_PARSE_FLAG_LAZY.
+ *
+ * Return value: a hex string, or %NULL if dfu_firmware_add_checksum_type()
+ * was not called or no data has been parsed or written since
+ *
+ * Since: 0.7.2
+ **/
+const gchar *
+dfu_firmware_get_checksum (DfuFirmware *firmware, GChecksumType checksum_type)
+{
+	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
+	guint i;
+
+	g_return_val_if_fail (DFU_IS_FIRMWARE (firmware), NULL);
+
+	if (!priv->checksums_valid)
+		return NULL;
+	for (i = 0; i < priv->checksums->len; i++) {
+		DfuFirmwareChecksum *item = g_ptr_array_index (priv->checksums, i);
+		if (item->kind == checksum_type)
+			return g_checksum_get_string (item->checksum);
+	}
+	return NULL;
+}
+
+/**
+ * dfu_firmware_get_crc:
+ * @firmware: a #DfuFirmware
+ *
+ * Gets the CRC32 from the DFU suffix of the file that was last parsed
+ * or written.
+ *
+ * Return value: the CRC, or 0 for unset
+ *
+ * Since: 0.7.2
+ **/
+guint32
+dfu_firmware_get_crc (DfuFirmware *firmware)
+{
+	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
+	g_return_val_if_fail (DFU_IS_FIRMWARE (firmware), 0);
+	return priv->crc;
+}
+
+/* small enough that every digest sees the chunk while it is cached */
+#define DFU_FIRMWARE_CHECKSUM_CHUNK		0x4000
+
+/**
+ * dfu_firmware_checksum_begin:
+ **/
+static void
+dfu_firmware_checksum_begin (DfuFirmware *firmware)
+{
+	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
+	guint i;
+	for (i = 0; i < priv->checksums->len; i++) {
+		DfuFirmwareChecksum *item = g_ptr_array_index (priv->checksums, i);
+		g_checksum_reset (item->checksum);
+	}
+	priv->checksums_valid = TRUE;
+}
+
+/**
+ * dfu_firmware_checksum_data:
+ *
+ * Adds @length bytes to each digest, and the first @length_crc bytes to
+ * the running DFU CRC.
+ **/
+static guint32
+dfu_firmware_checksum_data (DfuFirmware *firmware,
+			    guint32 crc,
+			    const guint8 *data,
+			    gsize length,
+			    gsize length_crc)
+{
+	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
+	gsize offset;
+	guint i;
+
+	/* nothing else to do */
+	if (priv->checksums->len == 0)
+		return dfu_crc32_update (crc, data, MIN (length, length_crc));
+
+	for (offset = 0; offset < length; offset += DFU_FIRMWARE_CHECKSUM_CHUNK) {
+		gsize chunk = MIN (length - offset, DFU_FIRMWARE_CHECKSUM_CHUNK);
+		if (offset < length_crc) {
+			crc = dfu_crc32_update (crc, data + offset,
+						MIN (chunk, length_crc - offset));
+		}
+		for (i = 0; i < priv->checksums->len; i++) {
+			DfuFirmwareChecksum *item = g_ptr_array_index (priv->checksums, i);
+			g_checksum_update (item->checksum, data + offset, chunk);
+		}
+	}
+	return crc;
+}
+
 typedef struct __attribute__((packed)) {
 	guint16		release;
 	guint16		pid;
@@ -410,91 +592,73 @@ typedef struct __attribute__((packed)) {
 	guint32		crc;
 } DfuFirmwareFooter;
 
-static guint32 _crctbl[] = {
-	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
-	0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
-	0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
-	0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
-	0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
-	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
-	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
-	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
-	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
-	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
-	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
-	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
-	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
-	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
-	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
-	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
-	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
-	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
-	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d };
-
-/**
- * dfu_firmware_generate_crc32:
- **/
-static guint32
-dfu_firmware_generate_crc32 (const guint8 *data, gsize length)
-{
-	guint i;
-	guint32 accum = 0xffffffff;
-	for (i = 0; i < length; i++)
-		accum = _crctbl[(accum^data[i]) & 0xff] ^ (accum >> 8);
-	return accum;
-}
+/* maps an ASCII hex digit to 0x10 | nibble, or 0x00 if invalid */
+static const guint8 _ihex_nibble[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13,
+	['4'] = 0x14, ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17,
+	['8'] = 0x18, ['9'] = 0x19,
+	['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c,
+	['D'] = 0x1d, ['E'] = 0x1e, ['F'] = 0x1f,
+	['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c,
+	['d'] = 0x1d, ['e'] = 0x1e, ['f'] = 0x1f,
+};
 
 /**
- * dfu_firmware_ihex_parse_uint8:
+ * dfu_firmware_ihex_decode:
+ * @in: ASCII hex pairs
+ * @out: destination buffer of at least @len bytes
+ * @len: number of bytes to decode
+ * @checksum: running record checksum
+ *
+ * Decodes hex pairs into @out, adding each byte to @checksum.
+ *
+ * Return value: %FALSE if a character was not a hex digit
  **/
-static guint8
-dfu_firmware_ihex_parse_uint8 (const gchar *data, guint pos)
+static gboolean
+dfu_firmware_ihex_decode (const gchar *in, guint8 *out, guint len, guint8 *checksum)
 {
-	gchar buffer[3];
-	memcpy (buffer, data + pos, 2);
-	buffer[2] = '\0';
-	return g_ascii_strtoull (buffer, NULL, 16);
-}
+	guint8 valid = 0x10;
+	guint8 sum = *checksum;
+	guint i;
 
-/**
- * dfu_firmware_ihex_parse_uint16:
- **/
-static guint16
-dfu_firmware_ihex_parse_uint16 (const gchar *data, guint pos)
-{
-	gchar buffer[5];
-	memcpy (buffer, data + pos, 4);
-	buffer[4] = '\0';
-	return g_ascii_strtoull (buffer, NULL, 16);
+	for (i = 0; i < len; i++) {
+		guint8 hi = _ihex_nibble[(guint8) in[i * 2]];
+		guint8 lo = _ihex_nibble[(guint8) in[i * 2 + 1]];
+		valid &= hi & lo;
+		out[i] = ((hi & 0x0f) << 4) | (lo & 0x0f);
+		sum += out[i];
+	}
+	*checksum = sum;
+	return valid != 0;
 }
 
 #define	DFU_INHX32_RECORD_TYPE_DATA		0
 #define	DFU_INHX32_RECORD_TYPE_EOF		1
+#define	DFU_INHX32_RECORD_TYPE_EXTENDED_SEGMENT	2
+#define	DFU_INHX32_RECORD_TYPE_START_SEGMENT	3
 #define	DFU_INHX32_RECORD_TYPE_EXTENDED		4
+#define	DFU_INHX32_RECORD_TYPE_START_LINEAR	5
+
+/* holes up to this size are padded, larger ones start a new element */
+#define	DFU_INHX32_GAP_MERGE_MAX		0x400
+
+typedef struct {
+	guint32		 address;
+	guint		 offset;
+	guint		 size;
+} DfuFirmwareIhexRun;
+
+static gint
+dfu_firmware_ihex_run_sort_cb (gconstpointer a, gconstpointer b)
+{
+	const DfuFirmwareIhexRun *run1 = *((DfuFirmwareIhexRun **) a);
+	const DfuFirmwareIhexRun *run2 = *((DfuFirmwareIhexRun **) b);
+	if (run1->address < run2->address)
+		return -1;
+	if (run1->address > run2->address)
+		return 1;
+	return 0;
+}
 
 /**
  * dfu_firmware_add_ihex:
@@ -503,35 +667,41 @@ static gboolean
 dfu_firmware_add_ihex (DfuFirmware *firmware, GBytes *bytes,
 		       DfuFirmwareParseFlags flags, GError **error)
 {
+	DfuFirmwareIhexRun *run = NULL;
 	const gchar *in_buffer;
 	gsize len_in;
-	guint16 addr_high = 0;
 	guint16 addr_low = 0;
-	guint32 addr32 = 0;
-	guint32 addr32_last = 0;
+	guint32 addr_base = 0;
+	guint32 addr32;
+	guint32 addr32_next = 0;
 	guint8 checksum;
-	guint8 data_tmp;
+	guint8 hdr[4];
 	guint8 len_tmp;
 	guint8 type;
+	guint8 *dest;
+	guint8 tmp[256];
 	guint end;
 	guint i;
-	guint j;
 	guint offset = 0;
-	g_autoptr(DfuElement) element = NULL;
 	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(GArray) runs = NULL;
+	g_autoptr(GPtrArray) runs_sorted = NULL;
 	g_autoptr(GBytes) contents = NULL;
-	g_autoptr(GString) string = NULL;
+	g_autoptr(GByteArray) buf = NULL;
 
 	g_return_val_if_fail (bytes != NULL, FALSE);
 
-	/* create element */
+	/* create image */
 	image = dfu_image_new ();
 	dfu_image_set_name (image, "ihex");
-	element = dfu_element_new ();
 
-	/* parse records */
+	/* all the payload goes into one buffer which the elements slice;
+	 * without padding it can never be larger than half the text */
 	in_buffer = g_bytes_get_data (bytes, &len_in);
-	string = g_string_new ("");
+	buf = g_byte_array_sized_new (len_in / 2);
+	runs = g_array_new (FALSE, FALSE, sizeof (DfuFirmwareIhexRun));
+
+	/* parse records */
 	while (offset < len_in) {
 
 		/* check starting token */
@@ -545,7 +715,7 @@ dfu_firmware_add_ihex (DfuFirmware *firmware, GBytes *bytes,
 		}
 
 		/* check there's enough data for the smallest possible record */
-		if (offset + 12 > (guint) len_in) {
+		if (offset + 11 > (guint) len_in) {
 			g_set_error (error,
 				     DFU_ERROR,
 				     DFU_ERROR_INVALID_FILE,
@@ -555,13 +725,22 @@ dfu_firmware_add_ihex (DfuFirmware *firmware, GBytes *bytes,
 		}
 
 		/* length, 16-bit address, type */
-		len_tmp = dfu_firmware_ihex_parse_uint8 (in_buffer, offset+1);
-		addr_low = dfu_firmware_ihex_parse_uint16 (in_buffer, offset+3);
-		type = dfu_firmware_ihex_parse_uint8 (in_buffer, offset+7);
+		checksum = 0;
+		if (!dfu_firmware_ihex_decode (in_buffer + offset + 1, hdr, 4, &checksum)) {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INVALID_FILE,
+				     "invalid record header at %x",
+				     offset);
+			return FALSE;
+		}
+		len_tmp = hdr[0];
+		addr_low = ((guint16) hdr[1] << 8) | hdr[2];
+		type = hdr[3];
 
 		/* position of checksum */
 		end = offset + 9 + len_tmp * 2;
-		if (end > (guint) len_in) {
+		if (end + 2 > (guint) len_in) {
 			g_set_error (error,
 				     DFU_ERROR,
 				     DFU_ERROR_INVALID_FILE,
@@ -570,13 +749,55 @@ dfu_firmware_add_ihex (DfuFirmware *firmware, GBytes *bytes,
 			return FALSE;
 		}
 
-		/* verify checksum */
-		if ((flags & DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST) == 0) {
-			checksum = 0;
-			for (i = offset + 1; i < end + 2; i += 2) {
-				data_tmp = dfu_firmware_ihex_parse_uint8 (in_buffer, i);
-				checksum += data_tmp;
+		/* data records are decoded straight into the payload */
+		dest = tmp;
+		if (type == DFU_INHX32_RECORD_TYPE_DATA && len_tmp > 0) {
+			guint pos;
+			addr32 = addr_base + addr_low;
+
+			/* pad small holes with 0x00 rather than 0xff, as
+			 * we can't write 0xffff to pic14 */
+			if (run != NULL &&
+			    addr32 > addr32_next &&
+			    addr32 - addr32_next <= DFU_INHX32_GAP_MERGE_MAX) {
+				guint hole = addr32 - addr32_next;
+				pos = buf->len;
+				g_debug ("filling 0x%04x bytes from 0x%08x",
+					 hole, addr32_next);
+				g_byte_array_set_size (buf, pos + hole);
+				memset (buf->data + pos, 0x00, hole);
+				addr32_next = addr32;
+			}
+
+			/* not contiguous, so start a new element */
+			if (run == NULL || addr32 != addr32_next) {
+				DfuFirmwareIhexRun run_tmp;
+				g_debug ("new element at 0x%08x", addr32);
+				run_tmp.address = addr32;
+				run_tmp.offset = buf->len;
+				g_array_append_val (runs, run_tmp);
+				run = &g_array_index (runs, DfuFirmwareIhexRun,
+						      runs->len - 1);
 			}
+			pos = buf->len;
+			g_byte_array_set_size (buf, pos + len_tmp);
+			dest = buf->data + pos;
+			addr32_next = addr32 + len_tmp;
+		}
+
+		/* decode and checksum the record in one pass */
+		if (!dfu_firmware_ihex_decode (in_buffer + offset + 9, dest,
+					       len_tmp, &checksum) ||
+		    !dfu_firmware_ihex_decode (in_buffer + end, tmp + len_tmp,
+					       1, &checksum)) {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INVALID_FILE,
+				     "invalid hex digit in record at %x",
+				     offset);
+			return FALSE;
+		}
+		if ((flags & DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST) == 0) {
 			if (checksum != 0)  {
 				g_set_error_literal (error,
 						     DFU_ERROR,
@@ -589,42 +810,38 @@ dfu_firmware_add_ihex (DfuFirmware *firmware, GBytes *bytes,
 		/* process different record types */
 		switch (type) {
 		case DFU_INHX32_RECORD_TYPE_DATA:
-			/* if not contiguous with previous record */
-			if ((addr_high + addr_low) != addr32) {
-				if (addr32 == 0x0) {
-					g_debug ("base address %04x", addr_low);
-					dfu_element_set_address (element, addr_low);
-				}
-				addr32 = addr_high + addr_low;
-			}
-
-			/* parse bytes from line */
-			for (i = offset + 9; i < end; i += 2) {
-				/* any holes in the hex record */
-				len_tmp = addr32 - addr32_last;
-				if (addr32_last > 0x0 && len_tmp > 1) {
-					for (j = 1; j < len_tmp; j++) {
-						g_debug ("filling address 0x%04x",
-							 addr32_last + j);
-						/* although 0xff might be clearer,
-						 * we can't write 0xffff to pic14 */
-						g_string_append_c (string, 0x00);
-					}
-				}
-				/* write into buf */
-				data_tmp = dfu_firmware_ihex_parse_uint8 (in_buffer, i);
-				g_string_append_c (string, data_tmp);
-				g_debug ("writing address 0x%04x", addr32);
-				addr32_last = addr32++;
-			}
-			break;
 		case DFU_INHX32_RECORD_TYPE_EOF:
 			break;
+		case DFU_INHX32_RECORD_TYPE_EXTENDED_SEGMENT:
 		case DFU_INHX32_RECORD_TYPE_EXTENDED:
-			addr_high = dfu_firmware_ihex_parse_uint16 (in_buffer, offset+9);
-			g_error ("set base address %x", addr_high);
-			addr_high <<= 16;
-			addr32 = addr_high + addr_low;
+			if (len_tmp != 2) {
+				g_set_error (error,
+					     DFU_ERROR,
+					     DFU_ERROR_INVALID_FILE,
+					     "invalid extended address record length %i",
+					     len_tmp);
+				return FALSE;
+			}
+			addr_base = ((guint32) tmp[0] << 8) | tmp[1];
+			if (type == DFU_INHX32_RECORD_TYPE_EXTENDED)
+				addr_base <<= 16;
+			else
+				addr_base <<= 4;
+			g_debug ("set base address 0x%08x", addr_base);
+			break;
+		case DFU_INHX32_RECORD_TYPE_START_SEGMENT:
+		case DFU_INHX32_RECORD_TYPE_START_LINEAR:
+			/* the entry point means nothing to a DFU device */
+			if (len_tmp != 4) {
+				g_set_error (error,
+					     DFU_ERROR,
+					     DFU_ERROR_INVALID_FILE,
+					     "invalid start address record length %i",
+					     len_tmp);
+				return FALSE;
+			}
+			g_debug ("ignoring start address %02x%02x%02x%02x",
+				 tmp[0], tmp[1], tmp[2], tmp[3]);
 			break;
 		default:
 			g_set_error (error,
@@ -644,52 +861,200 @@ dfu_firmware_add_ihex (DfuFirmware *firmware, GBytes *bytes,
 		}
 	}
 
-	/* add single image */
-	contents = g_bytes_new (string->str, string->len);
-	dfu_element_set_contents (element, contents);
-	dfu_image_add_element (image, element);
+	/* records that go backwards must not write any address twice */
+	runs_sorted = g_ptr_array_sized_new (runs->len);
+	for (i = 0; i < runs->len; i++) {
+		guint run_end = buf->len;
+		run = &g_array_index (runs, DfuFirmwareIhexRun, i);
+		if (i + 1 < runs->len)
+			run_end = g_array_index (runs, DfuFirmwareIhexRun, i + 1).offset;
+		run->size = run_end - run->offset;
+		g_ptr_array_add (runs_sorted, run);
+	}
+	g_ptr_array_sort (runs_sorted, dfu_firmware_ihex_run_sort_cb);
+	for (i = 1; i < runs_sorted->len; i++) {
+		DfuFirmwareIhexRun *run_prev = g_ptr_array_index (runs_sorted, i - 1);
+		run = g_ptr_array_index (runs_sorted, i);
+		if ((guint64) run_prev->address + run_prev->size > run->address) {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INVALID_FILE,
+				     "overlapping records at 0x%08x",
+				     run->address);
+			return FALSE;
+		}
+	}
+
+	/* one element for each contiguous run, all sharing the buffer */
+	contents = g_byte_array_free_to_bytes (g_steal_pointer (&buf));
+	for (i = 0; i < runs->len; i++) {
+		g_autoptr(DfuElement) element = dfu_element_new ();
+		g_autoptr(GBytes) contents_run = NULL;
+		run = &g_array_index (runs, DfuFirmwareIhexRun, i);
+		contents_run = g_bytes_new_from_bytes (contents,
+						       run->offset,
+						       run->size);
+		dfu_element_set_address (element, run->address);
+		dfu_element_set_contents (element, contents_run);
+		dfu_image_add_element (image, element);
+	}
+
+	/* an empty file still has one element */
+	if (runs->len == 0) {
+		g_autoptr(DfuElement) element = dfu_element_new ();
+		dfu_element_set_contents (element, contents);
+		dfu_image_add_element (image, element);
+	}
 	dfu_firmware_add_image (firmware, image);
 	dfu_firmware_set_format (firmware, DFU_FIRMWARE_FORMAT_INTEL_HEX);
 	return TRUE;
 }
 
 /**
- * dfu_firmware_write_data_ihex_element:
+ * dfu_firmware_load_contents:
+ *
+ * Reads the data of every element into memory, so that the writers
+ * can report read and CRC errors rather than writing a truncated file.
  **/
 static gboolean
+dfu_firmware_load_contents (DfuFirmware *firmware, GError **error)
+{
+	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
+	guint i;
+	guint j;
+
+	for (i = 0; i < priv->images->len; i++) {
+		DfuImage *image = g_ptr_array_index (priv->images, i);
+		GPtrArray *elements = dfu_image_get_elements (image);
+		for (j = 0; j < elements->len; j++) {
+			DfuElement *element = g_ptr_array_index (elements, j);
+			if (!dfu_element_load_contents (element, NULL, error))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static const gchar _ihex_digits[] = "0123456789ABCDEF";
+
+/**
+ * dfu_firmware_ihex_encode:
+ * @out: destination for 2 * @len characters
+ * @data: data to encode
+ * @len: length of @data
+ * @checksum: running sum of the record bytes
+ *
+ * Encodes data as upper case hex pairs.
+ *
+ * Return value: the position after the encoded data
+ **/
+static gchar *
+dfu_firmware_ihex_encode (gchar *out, const guint8 *data, guint len, guint8 *checksum)
+{
+	guint8 sum = *checksum;
+	guint i;
+
+	for (i = 0; i < len; i++) {
+		out[0] = _ihex_digits[data[i] >> 4];
+		out[1] = _ihex_digits[data[i] & 0x0f];
+		sum += data[i];
+		out += 2;
+	}
+	*checksum = sum;
+	return out;
+}
+
+/**
+ * dfu_firmware_ihex_write_record:
+ **/
+static gchar *
+dfu_firmware_ihex_write_record (gchar *out, guint8 type, guint16 addr,
+				const guint8 *data, guint8 len)
+{
+	guint8 checksum = 0;
+	guint8 checksum_unused = 0;
+	guint8 hdr[4];
+
+	hdr[0] = len;
+	hdr[1] = addr >> 8;
+	hdr[2] = addr & 0xff;
+	hdr[3] = type;
+	*out++ = ':';
+	out = dfu_firmware_ihex_encode (out, hdr, 4, &checksum);
+	out = dfu_firmware_ihex_encode (out, data, len, &checksum);
+
+	/* the two's complement, so the record bytes sum to zero */
+	checksum = (~checksum + 1) & 0xff;
+	out = dfu_firmware_ihex_encode (out, &checksum, 1, &checksum_unused);
+	*out++ = '\n';
+	return out;
+}
+
+/* ':' + length + address + type + data + checksum + '\n' */
+#define DFU_INHX32_RECORD_LEN(data_len)	(1 + 8 + (data_len) * 2 + 2 + 1)
+
+/**
+ * dfu_firmware_write_data_ihex_element:
+ * @element: a #DfuElement
+ * @record_size: maximum data bytes per record
+ * @addr_high: the current upper 16 bits of the address
+ * @out: destination buffer, or %NULL to just get the size
+ *
+ * Writes the element as data records, adding an extended linear address
+ * record each time the upper 16 bits of the address change. Records
+ * never cross a 64 KiB boundary.
+ *
+ * Return value: the number of characters written
+ **/
+static gsize
 dfu_firmware_write_data_ihex_element (DfuElement *element,
-				      GString *str,
-				      GError **error)
+				      guint8 record_size,
+				      guint16 *addr_high,
+				      gchar *out)
 {
 	GBytes *contents;
 	const guint8 *data;
-	const guint chunk_size = 16;
+	gchar *start = out;
 	gsize len;
-	guint chunk_len;
-	guint i;
-	guint j;
+	gsize i;
+	gsize size = 0;
+	guint32 address = dfu_element_get_address (element);
 
-	/* get number of chunks */
 	contents = dfu_element_get_contents (element);
+	if (contents == NULL)
+		return 0;
 	data = g_bytes_get_data (contents, &len);
-	for (i = 0; i < len; i += chunk_size) {
-		guint8 checksum = 0;
+	for (i = 0; i < len;) {
+		guint32 addr32 = address + i;
+		guint chunk_len = MIN (len - i, record_size);
+
+		/* do not cross into the next segment */
+		chunk_len = MIN (chunk_len, 0x10000 - (addr32 & 0xffff));
+
+		/* set the new base address */
+		if ((addr32 >> 16) != *addr_high) {
+			*addr_high = addr32 >> 16;
+			if (out != NULL) {
+				guint8 buf[2] = { *addr_high >> 8, *addr_high & 0xff };
+				out = dfu_firmware_ihex_write_record (out,
+								      DFU_INHX32_RECORD_TYPE_EXTENDED,
+								      0x0000, buf, 2);
+			}
+			size += DFU_INHX32_RECORD_LEN (2);
+		}
 
-		/* length, 16-bit address, type */
-		chunk_len = MIN (len - i, 16);
-		g_string_append_printf (str, ":%02X%04X%02X",
-					chunk_len,
-					dfu_element_get_address (element) + i,
-					DFU_INHX32_RECORD_TYPE_DATA);
-		for (j = 0; j < chunk_len; j++)
-			g_string_append_printf (str, "%02X", data[i+j]);
-
-		/* add checksum */
-		for (j = 0; j < (chunk_len * 2) + 8; j++)
-			checksum += str->str[str->len - (j + 1)];
-		g_string_append_printf (str, "%02X\n", checksum);
+		/* length, 16-bit address, type, data */
+		if (out != NULL) {
+			out = dfu_firmware_ihex_write_record (out,
+							      DFU_INHX32_RECORD_TYPE_DATA,
+							      addr32 & 0xffff,
+							      data + i, chunk_len);
+		}
+		size += DFU_INHX32_RECORD_LEN (chunk_len);
+		i += chunk_len;
 	}
-	return TRUE;
+	g_assert (out == NULL || (gsize) (out - start) == size);
+	return size;
 }
 
 /**
@@ -699,30 +1064,50 @@ static GBytes *
 dfu_firmware_write_data_ihex (DfuFirmware *firmware, GError **error)
 {
 	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
-	DfuElement *element;
-	DfuImage *image;
-	GPtrArray *elements;
+	const gchar *eof = ":00000001FF\n";
+	gchar *buf;
+	gsize size = 0;
+	gsize offset = 0;
+	guint16 addr_high = 0;
 	guint i;
 	guint j;
-	g_autoptr(GString) str = NULL;
+
+	/* read any lazily loaded data before starting */
+	if (!dfu_firmware_load_contents (firmware, error))
+		return NULL;
+
+	/* work out the exact size first so there is only one allocation */
+	for (i = 0; i < priv->images->len; i++) {
+		DfuImage *image = g_ptr_array_index (priv->images, i);
+		GPtrArray *elements = dfu_image_get_elements (image);
+		for (j = 0; j < elements->len; j++) {
+			DfuElement *element = g_ptr_array_index (elements, j);
+			size += dfu_firmware_write_data_ihex_element (element,
+								      priv->ihex_record_size,
+								      &addr_high,
+								      NULL);
+		}
+	}
+	size += strlen (eof);
 
 	/* write all the element data */
-	str = g_string_new ("");
+	buf = g_malloc (size);
+	addr_high = 0;
 	for (i = 0; i < priv->images->len; i++) {
-		image = g_ptr_array_index (priv->images, i);
-		elements = dfu_image_get_elements (image);
+		DfuImage *image = g_ptr_array_index (priv->images, i);
+		GPtrArray *elements = dfu_image_get_elements (image);
 		for (j = 0; j < elements->len; j++) {
-			element = g_ptr_array_index (elements, j);
-			if (!dfu_firmware_write_data_ihex_element (element,
-								   str,
-								   error))
-				return NULL;
+			DfuElement *element = g_ptr_array_index (elements, j);
+			offset += dfu_firmware_write_data_ihex_element (element,
+									priv->ihex_record_size,
+									&addr_high,
+									buf + offset);
 		}
 	}
 
 	/* add EOF */
-	g_string_append_printf (str, ":000000%02XFF\n", DFU_INHX32_RECORD_TYPE_EOF);
-	return g_bytes_new (str->str, str->len);
+	memcpy (buf + offset, eof, strlen (eof));
+	return g_bytes_new_take (buf, size);
 }
 
 /**
@@ -796,67 +1181,130 @@ dfu_firmware_add_dfuse (DfuFirmware *firmware, GBytes *bytes, GError **error)
 	}
 
 	/* parse the image targets */
-	len -= sizeof(DfuSePrefix);
 	for (i = 0; i < prefix->targets; i++) {
 		guint consumed;
 		g_autoptr(DfuImage) image = NULL;
-		image = dfu_image_from_dfuse (data + offset, len,
+		image = dfu_image_from_dfuse (bytes, offset,
 					      &consumed, error);
 		if (image == NULL)
 			return FALSE;
 		dfu_firmware_add_image (firmware, image);
 		offset += consumed;
-		len -= consumed;
 	}
 	return TRUE;
 }
 
 /**
- * dfu_firmware_write_data_dfuse:
+ * dfu_firmware_add_binary_stream:
  **/
-static GBytes *
-dfu_firmware_write_data_dfuse (DfuFirmware *firmware, GError **error)
+static gboolean
+dfu_firmware_add_binary_stream (DfuFirmware *firmware,
+				GInputStream *stream,
+				goffset size,
+				GError **error)
 {
-	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
-	DfuSePrefix *prefix;
+	g_autoptr(DfuElement) element = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	image = dfu_image_new ();
+	element = dfu_element_new ();
+	dfu_element_set_stream (element, stream, 0, size);
+	dfu_image_add_element (image, element);
+	dfu_firmware_add_image (firmware, image);
+	return TRUE;
+}
+
+/**
+ * dfu_firmware_add_dfuse_stream:
+ **/
+static gboolean
+dfu_firmware_add_dfuse_stream (DfuFirmware *firmware,
+			       GInputStream *stream,
+			       goffset size,
+			       GCancellable *cancellable,
+			       GError **error)
+{
+	DfuSePrefix prefix;
+	goffset offset = sizeof(DfuSePrefix);
 	guint i;
-	guint32 image_size_total = 0;
-	guint32 offset = sizeof (DfuSePrefix);
-	guint8 *buf;
-	g_autoptr(GPtrArray) dfuse_images = NULL;
 
-	/* get all the image data */
-	dfuse_images = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
-	for (i = 0; i < priv->images->len; i++) {
-		DfuImage *im = g_ptr_array_index (priv->images, i);
-		GBytes *contents;
-		contents = dfu_image_to_dfuse (im);
-		image_size_total += g_bytes_get_size (contents);
-		g_ptr_array_add (dfuse_images, contents);
+	/* check the prefix (BE) */
+	if (size < (goffset) sizeof(DfuSePrefix) ||
+	    !dfu_utils_stream_read_at (stream, 0, (guint8 *) &prefix,
+				       sizeof(prefix), cancellable, NULL) ||
+	    memcmp (prefix.sig, "DfuSe", 5) != 0) {
+		g_set_error_literal (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INTERNAL,
+				     "invalid DfuSe prefix");
+		return FALSE;
 	}
-	g_debug ("image_size_total: %i", image_size_total);
 
-	buf = g_malloc0 (sizeof (DfuSePrefix) + image_size_total);
-
-	/* DfuSe header */
-	prefix = (DfuSePrefix *) buf;
-	memcpy (prefix->sig, "DfuSe", 5);
-	prefix->ver = 0x01;
-	prefix->image_size = GUINT32_TO_LE (offset + image_size_total);
-	prefix->targets = priv->images->len;
+	/* check the version */
+	if (prefix.ver != 0x01) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "invalid DfuSe version, got %02x",
+			     prefix.ver);
+		return FALSE;
+	}
 
-	/* copy images */
-	for (i = 0; i < dfuse_images->len; i++) {
-		GBytes *contents = g_ptr_array_index (dfuse_images, i);
-		gsize length;
-		const guint8 *data;
-		data = g_bytes_get_data (contents, &length);
-		memcpy (buf + offset, data, length);
-		offset += length;
+	/* check image size */
+	if (GUINT32_FROM_LE (prefix.image_size) != size) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "invalid DfuSe image size, "
+			     "got %" G_GUINT32_FORMAT ", "
+			     "expected %" G_GOFFSET_FORMAT,
+			     GUINT32_FROM_LE (prefix.image_size),
+			     size);
+		return FALSE;
 	}
 
-	/* return blob */
-	return g_bytes_new_take (buf, sizeof (DfuSePrefix) + image_size_total);
+	/* parse the image targets, leaving the element data in the stream */
+	for (i = 0; i < prefix.targets; i++) {
+		guint consumed;
+		g_autoptr(DfuImage) image = NULL;
+		image = dfu_image_from_dfuse_stream (stream, offset, size,
+						     &consumed, cancellable,
+						     error);
+		if (image == NULL)
+			return FALSE;
+		dfu_firmware_add_image (firmware, image);
+		offset += consumed;
+	}
+	return TRUE;
+}
+
+/**
+ * dfu_firmware_write_data_dfuse:
+ **/
+static void
+dfu_firmware_write_data_dfuse (DfuFirmware *firmware, GPtrArray *segments)
+{
+	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
+	DfuSePrefix *prefix;
+	guint i;
+	guint idx_prefix;
+	guint32 image_size_total = 0;
+
+	/* reserve the prefix, which needs the size of all images */
+	idx_prefix = segments->len;
+	g_ptr_array_add (segments, NULL);
+	for (i = 0; i < priv->images->len; i++) {
+		DfuImage *im = g_ptr_array_index (priv->images, i);
+		image_size_total += dfu_image_to_dfuse (im, segments);
+	}
+	g_debug ("image_size_total: %i", image_size_total);
+
+	/* DfuSe header */
+	prefix = g_new0 (DfuSePrefix, 1);
+	memcpy (prefix->sig, "DfuSe", 5);
+	prefix->ver = 0x01;
+	prefix->image_size = GUINT32_TO_LE (sizeof (DfuSePrefix) + image_size_total);
+	prefix->targets = priv->images->len;
+	g_ptr_array_index (segments, idx_prefix) = dfu_element_new_take (prefix, sizeof (DfuSePrefix));
 }
 
 /**
@@ -944,51 +1392,338 @@ dfu_firmware_parse_metadata (DfuFirmware *firmware,
 }
 
 /**
- * dfu_firmware_parse_data:
- * @firmware: a #DfuFirmware
- * @bytes: raw firmware data
- * @flags: optional flags, e.g. %DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST
- * @error: a #GError, or %NULL
+ * dfu_firmware_set_cipher_from_metadata:
+ **/
+static void
+dfu_firmware_set_cipher_from_metadata (DfuFirmware *firmware)
+{
+	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
+	const gchar *cipher_str;
+	cipher_str = dfu_firmware_get_metadata (firmware, DFU_METADATA_KEY_CIPHER_KIND);
+	if (cipher_str == NULL)
+		return;
+	if (g_strcmp0 (cipher_str, "XTEA") == 0)
+		priv->cipher_kind = DFU_CIPHER_KIND_XTEA;
+	else
+		g_warning ("Unknown CipherKind: %s", cipher_str);
+}
+
+/* only files larger than this keep their element data in the stream */
+#define DFU_FIRMWARE_STREAM_MIN_SIZE		0x10000
+#define DFU_FIRMWARE_STREAM_CRC_CHUNK		0x10000
+
+/**
+ * dfu_firmware_stream_checksum:
  *
- * Parses firmware data which may have an optional DFU suffix.
+ * Computes the DFU CRC of the first @length_crc bytes of @stream, and
+ * if @firmware is set, also the digests of the first @length bytes.
+ **/
+static gboolean
+dfu_firmware_stream_checksum (DfuFirmware *firmware,
+			      GInputStream *stream,
+			      goffset length,
+			      goffset length_crc,
+			      guint32 *crc,
+			      GCancellable *cancellable,
+			      GError **error)
+{
+	goffset offset;
+	guint32 crc_new = DFU_CRC32_INIT;
+	g_autofree guint8 *buf = g_malloc (DFU_FIRMWARE_STREAM_CRC_CHUNK);
+
+	/* only read as much as is needed */
+	if (firmware == NULL || GET_PRIVATE (firmware)->checksums->len == 0)
+		length = length_crc;
+	for (offset = 0; offset < length; ) {
+		gsize chunk = MIN (length - offset, DFU_FIRMWARE_STREAM_CRC_CHUNK);
+		gsize chunk_crc = CLAMP (length_crc - offset, 0, (goffset) chunk);
+		if (!dfu_utils_stream_read_at (stream, offset, buf, chunk,
+					       cancellable, error))
+			return FALSE;
+		if (firmware != NULL) {
+			crc_new = dfu_firmware_checksum_data (firmware, crc_new,
+							      buf, chunk,
+							      chunk_crc);
+		} else {
+			crc_new = dfu_crc32_update (crc_new, buf, chunk_crc);
+		}
+		offset += chunk;
+	}
+	if (crc != NULL)
+		*crc = crc_new;
+	return TRUE;
+}
+
+/* shared by all the elements of a lazily parsed firmware */
+typedef struct {
+	guint			 refcount;
+	GInputStream		*stream;
+	goffset			 length;
+	guint32			 crc;
+	gboolean		 checked;
+} DfuFirmwareCrcCheck;
+
+/**
+ * dfu_firmware_crc_check_unref:
+ **/
+static void
+dfu_firmware_crc_check_unref (DfuFirmwareCrcCheck *helper)
+{
+	if (--helper->refcount > 0)
+		return;
+	g_object_unref (helper->stream);
+	g_free (helper);
+}
+
+/**
+ * dfu_firmware_crc_check_cb:
+ **/
+static gboolean
+dfu_firmware_crc_check_cb (DfuElement *element,
+			   gpointer user_data,
+			   GCancellable *cancellable,
+			   GError **error)
+{
+	DfuFirmwareCrcCheck *helper = (DfuFirmwareCrcCheck *) user_data;
+	guint32 crc_new;
+
+	/* another element already did this */
+	if (helper->checked)
+		return TRUE;
+	if (!dfu_firmware_stream_checksum (NULL, helper->stream,
+					   helper->length, helper->length,
+					   &crc_new, cancellable, error))
+		return FALSE;
+	if (helper->crc != crc_new) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INVALID_FILE,
+			     "CRC failed, expected %04x, got %04x",
+			     crc_new, helper->crc);
+		return FALSE;
+	}
+	helper->checked = TRUE;
+	return TRUE;
+}
+
+/**
+ * dfu_firmware_defer_crc_check:
  *
- * Return value: %TRUE for success
+ * Makes every element verify the file CRC before its contents are
+ * first read.
+ **/
+static void
+dfu_firmware_defer_crc_check (DfuFirmware *firmware,
+			      GInputStream *stream,
+			      goffset length,
+			      guint32 crc)
+{
+	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
+	DfuFirmwareCrcCheck *helper;
+	guint i;
+	guint j;
+
+	helper = g_new0 (DfuFirmwareCrcCheck, 1);
+	helper->refcount = 1;
+	helper->stream = g_object_ref (stream);
+	helper->length = length;
+	helper->crc = crc;
+	for (i = 0; i < priv->images->len; i++) {
+		DfuImage *image = g_ptr_array_index (priv->images, i);
+		GPtrArray *elements = dfu_image_get_elements (image);
+		for (j = 0; j < elements->len; j++) {
+			DfuElement *element = g_ptr_array_index (elements, j);
+			helper->refcount++;
+			dfu_element_set_check_func (element,
+						    dfu_firmware_crc_check_cb,
+						    helper,
+						    (GDestroyNotify) dfu_firmware_crc_check_unref);
+		}
+	}
+	dfu_firmware_crc_check_unref (helper);
+}
+
+/**
+ * dfu_firmware_parse_stream_internal:
  *
- * Since: 0.5.4
+ * Parses a seekable stream of @len bytes that is not Intel HEX.
  **/
-gboolean
-dfu_firmware_parse_data (DfuFirmware *firmware, GBytes *bytes,
-			 DfuFirmwareParseFlags flags, GError **error)
+static gboolean
+dfu_firmware_parse_stream_internal (DfuFirmware *firmware,
+				    GInputStream *stream,
+				    goffset len,
+				    DfuFirmwareParseFlags flags,
+				    GCancellable *cancellable,
+				    GError **error)
+{
+	DfuFirmwareFooter ftr;
+	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
+
+	/* set defaults */
+	priv->vid = 0xffff;
+	priv->pid = 0xffff;
+	priv->release = 0xffff;
+
+	/* the digests need the whole file */
+	if (flags & DFU_FIRMWARE_PARSE_FLAG_LAZY)
+		priv->checksums_valid = FALSE;
+	else
+		dfu_firmware_checksum_begin (firmware);
+
+	/* check for DFU signature */
+	if (len >= (goffset) sizeof(ftr) &&
+	    !dfu_utils_stream_read_at (stream, len - sizeof(ftr),
+				       (guint8 *) &ftr, sizeof(ftr),
+				       cancellable, error))
+		return FALSE;
+	if (len < (goffset) sizeof(ftr) || memcmp (ftr.sig, "UFD", 3) != 0) {
+		priv->format = DFU_FIRMWARE_FORMAT_RAW;
+		if (priv->checksums_valid &&
+		    !dfu_firmware_stream_checksum (firmware, stream, len, 0,
+						   NULL, cancellable, error))
+			return FALSE;
+		return dfu_firmware_add_binary_stream (firmware, stream, len, error);
+	}
+
+	/* check version */
+	priv->format = GUINT16_FROM_LE (ftr.ver);
+	if ((flags & DFU_FIRMWARE_PARSE_FLAG_NO_VERSION_TEST) == 0) {
+		if (priv->format != DFU_FIRMWARE_FORMAT_DFU_1_0 &&
+		    priv->format != DFU_FIRMWARE_FORMAT_DFUSE) {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INTERNAL,
+				     "version check failed, got %04x",
+				     priv->format);
+			return FALSE;
+		}
+	}
+
+	/* verify the checksum without loading the whole file */
+	priv->crc = GUINT32_FROM_LE (ftr.crc);
+	if ((flags & DFU_FIRMWARE_PARSE_FLAG_LAZY) == 0) {
+		goffset length_crc = len - 4;
+		guint32 crc_new;
+		if (flags & DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST)
+			length_crc = 0;
+		if (!dfu_firmware_stream_checksum (firmware, stream,
+						   len, length_crc, &crc_new,
+						   cancellable, error))
+			return FALSE;
+		if (length_crc > 0 && priv->crc != crc_new) {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INVALID_FILE,
+				     "CRC failed, expected %04x, got %04x",
+				     crc_new, GUINT32_FROM_LE (ftr.crc));
+			return FALSE;
+		}
+	}
+
+	/* set from footer */
+	dfu_firmware_set_vid (firmware, GUINT16_FROM_LE (ftr.vid));
+	dfu_firmware_set_pid (firmware, GUINT16_FROM_LE (ftr.pid));
+	dfu_firmware_set_release (firmware, GUINT16_FROM_LE (ftr.release));
+
+	/* check reported length */
+	if (ftr.len > len) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "reported firmware size %04x larger than file %04x",
+			     (guint) ftr.len, (guint) len);
+		return FALSE;
+	}
+
+	/* parse the optional metadata segment, which is before the footer */
+	if ((flags & DFU_FIRMWARE_PARSE_FLAG_NO_METADATA) == 0 &&
+	    ftr.len > sizeof(ftr)) {
+		guint8 buf[0xff];
+		if (!dfu_utils_stream_read_at (stream, len - ftr.len,
+					       buf, ftr.len,
+					       cancellable, error))
+			return FALSE;
+		if (!dfu_firmware_parse_metadata (firmware, buf, ftr.len,
+						  ftr.len, error))
+			return FALSE;
+	}
+
+	/* set this automatically */
+	dfu_firmware_set_cipher_from_metadata (firmware);
+
+	/* parse DfuSe prefix */
+	if (priv->format == DFU_FIRMWARE_FORMAT_DFUSE) {
+		if (!dfu_firmware_add_dfuse_stream (firmware, stream,
+						    len - ftr.len,
+						    cancellable, error))
+			return FALSE;
+	} else {
+		/* just reference the old-plain DFU data */
+		if (!dfu_firmware_add_binary_stream (firmware, stream,
+						     len - ftr.len, error))
+			return FALSE;
+	}
+
+	/* check the CRC when the contents are first needed */
+	if ((flags & DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST) == 0 &&
+	    (flags & DFU_FIRMWARE_PARSE_FLAG_LAZY) > 0)
+		dfu_firmware_defer_crc_check (firmware, stream, len - 4, priv->crc);
+	return TRUE;
+}
+
+/**
+ * dfu_firmware_parse_data_internal:
+ * @crc: the DFU CRC of all but the last four bytes of @bytes, or %NULL
+ *
+ * Parses firmware data. If @crc is set then the caller has already
+ * computed it and the digests while reading the data.
+ **/
+static gboolean
+dfu_firmware_parse_data_internal (DfuFirmware *firmware,
+				  GBytes *bytes,
+				  const guint32 *crc,
+				  DfuFirmwareParseFlags flags,
+				  GError **error)
 {
 	DfuFirmwareFooter *ftr;
 	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
-	const gchar *cipher_str;
 	gsize len;
+	gsize length_crc;
 	guint32 crc_new;
 	guint8 *data;
 	g_autoptr(GBytes) contents = NULL;
 
-	g_return_val_if_fail (DFU_IS_FIRMWARE (firmware), FALSE);
-	g_return_val_if_fail (bytes != NULL, FALSE);
-	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
-
-	/* sanity check */
-	g_assert_cmpint (sizeof(DfuFirmwareFooter), ==, 16);
-	g_assert_cmpint (sizeof(DfuSePrefix), ==, 11);
-
 	/* set defaults */
 	priv->vid = 0xffff;
 	priv->pid = 0xffff;
 	priv->release = 0xffff;
 
-	/* this is ihex */
+	/* only read the headers now, and the payload and CRC when needed */
 	data = (guint8 *) g_bytes_get_data (bytes, &len);
-	if (data[0] == ':')
+	if ((flags & DFU_FIRMWARE_PARSE_FLAG_LAZY) &&
+	    (len == 0 || data[0] != ':')) {
+		g_autoptr(GInputStream) stream = NULL;
+		stream = g_memory_input_stream_new_from_bytes (bytes);
+		return dfu_firmware_parse_stream_internal (firmware, stream, len,
+							   flags, NULL, error);
+	}
+
+	/* the digests may have been computed while reading */
+	if (crc == NULL)
+		dfu_firmware_checksum_begin (firmware);
+
+	/* this is ihex */
+	if (len > 0 && data[0] == ':') {
+		if (crc == NULL)
+			dfu_firmware_checksum_data (firmware, DFU_CRC32_INIT, data, len, 0);
 		return dfu_firmware_add_ihex (firmware, bytes, flags, error);
+	}
 
 	/* too small to be a DFU file */
 	if (len < 16) {
 		priv->format = DFU_FIRMWARE_FORMAT_RAW;
+		if (crc == NULL)
+			dfu_firmware_checksum_data (firmware, DFU_CRC32_INIT, data, len, 0);
 		return dfu_firmware_add_binary (firmware, bytes, error);
 	}
 
@@ -996,6 +1731,8 @@ dfu_firmware_parse_data (DfuFirmware *firmware, GBytes *bytes,
 	ftr = (DfuFirmwareFooter *) &data[len - sizeof(DfuFirmwareFooter)];
 	if (memcmp (ftr->sig, "UFD", 3) != 0) {
 		priv->format = DFU_FIRMWARE_FORMAT_RAW;
+		if (crc == NULL)
+			dfu_firmware_checksum_data (firmware, DFU_CRC32_INIT, data, len, 0);
 		return dfu_firmware_add_binary (firmware, bytes, error);
 	}
 
@@ -1013,14 +1750,22 @@ dfu_firmware_parse_data (DfuFirmware *firmware, GBytes *bytes,
 		}
 	}
 
-	/* verify the checksum */
+	/* verify the checksum, computing any digests in the same pass */
 	priv->crc = GUINT32_FROM_LE (ftr->crc);
-	if ((flags & DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST) == 0) {
-		crc_new = dfu_firmware_generate_crc32 (data, len - 4);
+	length_crc = len - 4;
+	if (flags & DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST)
+		length_crc = 0;
+	if (crc != NULL) {
+		crc_new = *crc;
+	} else {
+		crc_new = dfu_firmware_checksum_data (firmware, DFU_CRC32_INIT,
+						      data, len, length_crc);
+	}
+	if (length_crc > 0) {
 		if (priv->crc != crc_new) {
 			g_set_error (error,
 				     DFU_ERROR,
-				     DFU_ERROR_INTERNAL,
+				     DFU_ERROR_INVALID_FILE,
 				     "CRC failed, expected %04x, got %04x",
 				     crc_new, GUINT32_FROM_LE (ftr->crc));
 			return FALSE;
@@ -1049,13 +1794,7 @@ dfu_firmware_parse_data (DfuFirmware *firmware, GBytes *bytes,
 	}
 
 	/* set this automatically */
-	cipher_str = dfu_firmware_get_metadata (firmware, DFU_METADATA_KEY_CIPHER_KIND);
-	if (cipher_str != NULL) {
-		if (g_strcmp0 (cipher_str, "XTEA") == 0)
-			priv->cipher_kind = DFU_CIPHER_KIND_XTEA;
-		else
-			g_warning ("Unknown CipherKind: %s", cipher_str);
-	}
+	dfu_firmware_set_cipher_from_metadata (firmware);
 
 	/* parse DfuSe prefix */
 	contents = g_bytes_new_from_bytes (bytes, 0, len - ftr->len);
@@ -1066,6 +1805,40 @@ dfu_firmware_parse_data (DfuFirmware *firmware, GBytes *bytes,
 	return dfu_firmware_add_binary (firmware, contents, error);
 }
 
+/**
+ * dfu_firmware_parse_data:
+ * @firmware: a #DfuFirmware
+ * @bytes: raw firmware data
+ * @flags: optional flags, e.g. %DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST
+ * @error: a #GError, or %NULL
+ *
+ * Parses firmware data which may have an optional DFU suffix.
+ *
+ * If %DFU_FIRMWARE_PARSE_FLAG_LAZY is set then only the footer, metadata
+ * and DfuSe headers are parsed. The element data is copied out of
+ * @bytes and the CRC is checked only when the element contents are
+ * first read.
+ *
+ * Return value: %TRUE for success
+ *
+ * Since: 0.5.4
+ **/
+gboolean
+dfu_firmware_parse_data (DfuFirmware *firmware, GBytes *bytes,
+			 DfuFirmwareParseFlags flags, GError **error)
+{
+	g_return_val_if_fail (DFU_IS_FIRMWARE (firmware), FALSE);
+	g_return_val_if_fail (bytes != NULL, FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	/* sanity check */
+	g_assert_cmpint (sizeof(DfuFirmwareFooter), ==, 16);
+	g_assert_cmpint (sizeof(DfuSePrefix), ==, 11);
+
+	return dfu_firmware_parse_data_internal (firmware, bytes, NULL,
+						 flags, error);
+}
+
 /**
  * dfu_firmware_parse_file:
  * @firmware: a #DfuFirmware
@@ -1076,6 +1849,11 @@ dfu_firmware_parse_data (DfuFirmware *firmware, GBytes *bytes,
  *
  * Parses a DFU firmware, which may contain an optional footer.
  *
+ * If %DFU_FIRMWARE_PARSE_FLAG_MMAP is set and @file is local then the
+ * file is mapped read-only and the raw and DfuSe element contents point
+ * into the mapping rather than being copied. The file must not be
+ * truncated while @firmware is alive.
+ *
  * Return value: %TRUE for success
  *
  * Since: 0.5.4
@@ -1100,6 +1878,20 @@ dfu_firmware_parse_file (DfuFirmware *firmware, GFile *file,
 	if (g_str_has_suffix (basename, ".xdfu"))
 		priv->cipher_kind = DFU_CIPHER_KIND_XTEA;
 
+	/* elements will reference the mapping instead of a copy */
+	if (flags & DFU_FIRMWARE_PARSE_FLAG_MMAP) {
+		g_autofree gchar *filename = g_file_get_path (file);
+		if (filename != NULL) {
+			g_autoptr(GMappedFile) mapped_file = NULL;
+			mapped_file = g_mapped_file_new (filename, FALSE, error);
+			if (mapped_file == NULL)
+				return FALSE;
+			bytes = g_mapped_file_get_bytes (mapped_file);
+			return dfu_firmware_parse_data (firmware, bytes, flags, error);
+		}
+		g_debug ("%s is not local, loading instead", basename);
+	}
+
 	if (!g_file_load_contents (file, cancellable, &contents,
 				   &length, NULL, error))
 		return FALSE;
@@ -1107,6 +1899,142 @@ dfu_firmware_parse_file (DfuFirmware *firmware, GFile *file,
 	return dfu_firmware_parse_data (firmware, bytes, flags, error);
 }
 
+/* the DFU suffix, including any metadata, is never longer than this */
+#define DFU_FIRMWARE_SUFFIX_MAX			0xff
+
+/**
+ * dfu_firmware_parse_stream_sequential:
+ *
+ * Reads @stream from start to end, updating the CRC and digests as each
+ * chunk arrives. The last bytes are not part of the CRC and the suffix
+ * size is only known at the end, so a trailing window the size of the
+ * largest suffix is held back until the stream is finished.
+ **/
+static gboolean
+dfu_firmware_parse_stream_sequential (DfuFirmware *firmware,
+				      GInputStream *stream,
+				      DfuFirmwareParseFlags flags,
+				      GCancellable *cancellable,
+				      GError **error)
+{
+	gboolean do_crc = (flags & DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST) == 0;
+	gsize window = 0;
+	guint32 crc = DFU_CRC32_INIT;
+	g_autoptr(GByteArray) buf = g_byte_array_new ();
+	g_autoptr(GBytes) bytes = NULL;
+
+	dfu_firmware_checksum_begin (firmware);
+	while (TRUE) {
+		gsize done = buf->len;
+		gsize flush;
+		gssize len;
+
+		/* read straight into the end of the buffer */
+		g_byte_array_set_size (buf, done + DFU_FIRMWARE_STREAM_CRC_CHUNK);
+		len = g_input_stream_read (stream, buf->data + done,
+					   DFU_FIRMWARE_STREAM_CRC_CHUNK,
+					   cancellable, error);
+		if (len < 0)
+			return FALSE;
+		g_byte_array_set_size (buf, done + len);
+		if (len == 0)
+			break;
+
+		/* Intel HEX has no DFU suffix */
+		if (done == 0 && buf->data[0] == ':')
+			do_crc = FALSE;
+
+		/* everything before the window can never be in the suffix */
+		window += len;
+		if (window <= DFU_FIRMWARE_SUFFIX_MAX)
+			continue;
+		flush = window - DFU_FIRMWARE_SUFFIX_MAX;
+		crc = dfu_firmware_checksum_data (firmware, crc,
+						  buf->data + buf->len - window,
+						  flush, do_crc ? flush : 0);
+		window -= flush;
+	}
+
+	/* the suffix, apart from the CRC itself */
+	crc = dfu_firmware_checksum_data (firmware, crc,
+					  buf->data + buf->len - window, window,
+					  do_crc && window >= 4 ? window - 4 : 0);
+
+	/* the data is in memory now, so there is nothing to defer */
+	bytes = g_byte_array_free_to_bytes (g_steal_pointer (&buf));
+	return dfu_firmware_parse_data_internal (firmware, bytes, &crc,
+						 flags & ~DFU_FIRMWARE_PARSE_FLAG_LAZY,
+						 error);
+}
+
+/**
+ * dfu_firmware_parse_stream:
+ * @firmware: a #DfuFirmware
+ * @stream: a #GInputStream
+ * @flags: optional flags, e.g. %DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: a #GError, or %NULL
+ *
+ * Parses a DFU firmware from a stream, which may contain an optional
+ * footer.
+ *
+ * If @stream is seekable then only the footer, metadata and DfuSe
+ * headers are read up front, and the CRC is computed in fixed-size
+ * chunks. The raw and DfuSe element contents are read from @stream
+ * when they are needed, so @stream must stay valid and unmodified
+ * while @firmware is alive. Streams that cannot seek are read once
+ * into memory, and the CRC is computed as the data arrives.
+ *
+ * Return value: %TRUE for success
+ *
+ * Since: 0.7.2
+ **/
+gboolean
+dfu_firmware_parse_stream (DfuFirmware *firmware,
+			   GInputStream *stream,
+			   DfuFirmwareParseFlags flags,
+			   GCancellable *cancellable,
+			   GError **error)
+{
+	goffset len;
+	goffset len_min = DFU_FIRMWARE_STREAM_MIN_SIZE;
+	guint8 first = 0;
+
+	g_return_val_if_fail (DFU_IS_FIRMWARE (firmware), FALSE);
+	g_return_val_if_fail (G_IS_INPUT_STREAM (stream), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	/* get the total size */
+	if (G_IS_SEEKABLE (stream) &&
+	    g_seekable_can_seek (G_SEEKABLE (stream))) {
+		if (!g_seekable_seek (G_SEEKABLE (stream), 0, G_SEEK_END,
+				      cancellable, error))
+			return FALSE;
+		len = g_seekable_tell (G_SEEKABLE (stream));
+		if (len > 0 &&
+		    !dfu_utils_stream_read_at (stream, 0, &first, 1,
+					       cancellable, error))
+			return FALSE;
+	} else {
+		len = -1;
+	}
+
+	/* not worth streaming, or not possible */
+	if (flags & DFU_FIRMWARE_PARSE_FLAG_LAZY)
+		len_min = 0;
+	if (len < len_min || first == ':') {
+		if (len >= 0 && !g_seekable_seek (G_SEEKABLE (stream), 0,
+						  G_SEEK_SET, cancellable,
+						  error))
+			return FALSE;
+		return dfu_firmware_parse_stream_sequential (firmware, stream,
+							     flags, cancellable,
+							     error);
+	}
+	return dfu_firmware_parse_stream_internal (firmware, stream, len,
+						   flags, cancellable, error);
+}
+
 /**
  * dfu_firmware_get_metadata:
  * @firmware: a #DfuFirmware
@@ -1245,70 +2173,111 @@ dfu_firmware_build_metadata_table (DfuFirmware *firmware, GError **error)
 	return g_bytes_new (mdbuf, idx);
 }
 
+/**
+ * dfu_firmware_new_segment:
+ **/
+static DfuElement *
+dfu_firmware_new_segment (GBytes *bytes)
+{
+	DfuElement *element = dfu_element_new ();
+	dfu_element_set_contents (element, bytes);
+	g_bytes_unref (bytes);
+	return element;
+}
+
+/**
+ * dfu_firmware_checksum_segment:
+ *
+ * Adds the segment to each digest, and if @crc is set to the running
+ * DFU CRC. Segments backed by a stream are read one chunk at a time.
+ **/
+static gboolean
+dfu_firmware_checksum_segment (DfuFirmware *firmware,
+			       DfuElement *segment,
+			       guint32 *crc,
+			       GError **error)
+{
+	gsize offset;
+	gsize size = dfu_element_get_size (segment);
+	guint32 crc_new = crc != NULL ? *crc : DFU_CRC32_INIT;
+
+	for (offset = 0; offset < size; offset += DFU_FIRMWARE_STREAM_CRC_CHUNK) {
+		const guint8 *data;
+		gsize length;
+		g_autoptr(GBytes) chunk = NULL;
+		chunk = dfu_element_get_chunk (segment, offset,
+					       DFU_FIRMWARE_STREAM_CRC_CHUNK,
+					       NULL, error);
+		if (chunk == NULL)
+			return FALSE;
+		data = g_bytes_get_data (chunk, &length);
+		crc_new = dfu_firmware_checksum_data (firmware, crc_new,
+						      data, length,
+						      crc != NULL ? length : 0);
+	}
+	if (crc != NULL)
+		*crc = crc_new;
+	return TRUE;
+}
+
 /**
  * dfu_firmware_add_footer:
  **/
-static GBytes *
-dfu_firmware_add_footer (DfuFirmware *firmware, GBytes *contents, GError **error)
+static gboolean
+dfu_firmware_add_footer (DfuFirmware *firmware, GPtrArray *segments, GError **error)
 {
 	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
 	DfuFirmwareFooter *ftr;
-	const guint8 *data_bin;
-	const guint8 *data_md;
-	gsize length_bin = 0;
-	gsize length_md = 0;
-	guint32 crc_new;
-	guint8 *buf;
-	g_autoptr(GBytes) metadata_table = NULL;
+	GBytes *metadata_table;
+	guint32 crc_new = DFU_CRC32_INIT;
+	guint i;
 
 	/* get any file metadata */
 	metadata_table = dfu_firmware_build_metadata_table (firmware, error);
 	if (metadata_table == NULL)
-		return NULL;
-	data_md = g_bytes_get_data (metadata_table, &length_md);
-
-	/* add the raw firmware data */
-	data_bin = g_bytes_get_data (contents, &length_bin);
-	buf = g_malloc0 (length_bin + length_md + 0x10);
-	memcpy (buf + 0, data_bin, length_bin);
-
-	/* add the metadata table */
-	memcpy (buf + length_bin, data_md, length_md);
+		return FALSE;
 
 	/* set up LE footer */
-	ftr = (DfuFirmwareFooter *) (buf + length_bin + length_md);
+	ftr = g_new0 (DfuFirmwareFooter, 1);
 	ftr->release = GUINT16_TO_LE (priv->release);
 	ftr->pid = GUINT16_TO_LE (priv->pid);
 	ftr->vid = GUINT16_TO_LE (priv->vid);
 	ftr->ver = GUINT16_TO_LE (priv->format);
-	ftr->len = sizeof (DfuFirmwareFooter) + length_md;
+	ftr->len = sizeof (DfuFirmwareFooter) + g_bytes_get_size (metadata_table);
 	memcpy(ftr->sig, "UFD", 3);
-	crc_new = dfu_firmware_generate_crc32 (buf, length_bin + length_md + 12);
+	g_ptr_array_add (segments, dfu_firmware_new_segment (metadata_table));
+
+	/* CRC each segment in place rather than joining them first */
+	for (i = 0; i < segments->len; i++) {
+		DfuElement *segment = g_ptr_array_index (segments, i);
+		if (!dfu_firmware_checksum_segment (firmware, segment,
+						    &crc_new, error)) {
+			g_free (ftr);
+			return FALSE;
+		}
+	}
+	crc_new = dfu_crc32_update (crc_new, (const guint8 *) ftr, 12);
 	ftr->crc = GUINT32_TO_LE (crc_new);
-
-	/* return all data */
-	return g_bytes_new_take (buf, length_bin + length_md + 0x10);
+	priv->crc = crc_new;
+	dfu_firmware_checksum_data (firmware, crc_new, (const guint8 *) ftr,
+				    sizeof (DfuFirmwareFooter), 0);
+	g_ptr_array_add (segments, dfu_element_new_take (ftr, sizeof (DfuFirmwareFooter)));
+	return TRUE;
 }
 
 /**
- * dfu_firmware_write_data:
- * @firmware: a #DfuFirmware
- * @error: a #GError, or %NULL
- *
- * Writes DFU data to a data blob with a DFU-specific footer.
- *
- * Return value: (transfer none): firmware data
+ * dfu_firmware_write_segments:
  *
- * Since: 0.5.4
+ * Builds the file as a list of segments, where the elements are
+ * referenced rather than copied. Element data that is backed by a
+ * stream is only read when the segments are written out.
  **/
-GBytes *
-dfu_firmware_write_data (DfuFirmware *firmware, GError **error)
+static GPtrArray *
+dfu_firmware_write_segments (DfuFirmware *firmware, GError **error)
 {
 	DfuFirmwarePrivate *priv = GET_PRIVATE (firmware);
 	DfuImage *image;
-
-	g_return_val_if_fail (DFU_IS_FIRMWARE (firmware), NULL);
-	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+	g_autoptr(GPtrArray) segments = NULL;
 
 	/* at least one image */
 	if (priv->images == 0) {
@@ -1330,55 +2299,58 @@ dfu_firmware_write_data (DfuFirmware *firmware, GError **error)
 		return NULL;
 	}
 
+	segments = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	dfu_firmware_checksum_begin (firmware);
+
 	/* raw */
 	if (priv->format == DFU_FIRMWARE_FORMAT_RAW) {
-		GBytes *contents;
 		DfuElement *element;
 		image = dfu_firmware_get_image_default (firmware);
 		g_assert (image != NULL);
-		element = dfu_image_get_element (image, 0);
-		if (element == NULL) {
-			g_set_error (error,
-				     DFU_ERROR,
-				     DFU_ERROR_NOT_FOUND,
-				     "no firmware element data to write");
+		element = dfu_image_get_element_flat (image, NULL, error);
+		if (element == NULL)
 			return NULL;
-		}
-		contents = dfu_element_get_contents (element);
-		return g_bytes_ref (contents);
+		g_ptr_array_add (segments, element);
+		if (!dfu_firmware_checksum_segment (firmware, element, NULL, error))
+			return NULL;
+		return g_steal_pointer (&segments);
 	}
 
-	/* plain-old DFU */
+	/* plain-old DFU has no addresses, so the elements are padded */
 	if (priv->format == DFU_FIRMWARE_FORMAT_DFU_1_0) {
-		GBytes *contents;
 		DfuElement *element;
 		image = dfu_firmware_get_image_default (firmware);
 		g_assert (image != NULL);
-		element = dfu_image_get_element (image, 0);
-		if (element == NULL) {
-			g_set_error (error,
-				     DFU_ERROR,
-				     DFU_ERROR_NOT_FOUND,
-				     "no firmware element data to write");
+		element = dfu_image_get_element_flat (image, NULL, error);
+		if (element == NULL)
 			return NULL;
-		}
-		contents = dfu_element_get_contents (element);
-		g_assert (contents != NULL);
-		return dfu_firmware_add_footer (firmware, contents, error);
+		g_ptr_array_add (segments, element);
+		if (!dfu_firmware_add_footer (firmware, segments, error))
+			return NULL;
+		return g_steal_pointer (&segments);
 	}
 
 	/* DfuSe */
 	if (priv->format == DFU_FIRMWARE_FORMAT_DFUSE) {
-		g_autoptr(GBytes) contents = NULL;
-		contents = dfu_firmware_write_data_dfuse (firmware, error);
-		if (contents == NULL)
+		dfu_firmware_write_data_dfuse (firmware, segments);
+		if (!dfu_firmware_add_footer (firmware, segments, error))
 			return NULL;
-		return dfu_firmware_add_footer (firmware, contents, error);
+		return g_steal_pointer (&segments);
 	}
 
 	/* Intel HEX */
-	if (priv->format == DFU_FIRMWARE_FORMAT_INTEL_HEX)
-		return dfu_firmware_write_data_ihex (firmware, error);
+	if (priv->format == DFU_FIRMWARE_FORMAT_INTEL_HEX) {
+		GBytes *contents;
+		DfuElement *segment;
+		contents = dfu_firmware_write_data_ihex (firmware, error);
+		if (contents == NULL)
+			return NULL;
+		segment = dfu_firmware_new_segment (contents);
+		g_ptr_array_add (segments, segment);
+		if (!dfu_firmware_checksum_segment (firmware, segment, NULL, error))
+			return NULL;
+		return g_steal_pointer (&segments);
+	}
 
 	/* invalid */
 	g_set_error (error,
@@ -1389,6 +2361,95 @@ dfu_firmware_write_data (DfuFirmware *firmware, GError **error)
 	return NULL;
 }
 
+/**
+ * dfu_firmware_write_data:
+ * @firmware: a #DfuFirmware
+ * @error: a #GError, or %NULL
+ *
+ * Writes DFU data to a data blob with a DFU-specific footer.
+ *
+ * Return value: (transfer full): firmware data
+ *
+ * Since: 0.5.4
+ **/
+GBytes *
+dfu_firmware_write_data (DfuFirmware *firmware, GError **error)
+{
+	gsize length_total = 0;
+	gsize offset = 0;
+	guint8 *buf;
+	guint i;
+	g_autoptr(GPtrArray) segments = NULL;
+
+	g_return_val_if_fail (DFU_IS_FIRMWARE (firmware), NULL);
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+	/* get segments */
+	segments = dfu_firmware_write_segments (firmware, error);
+	if (segments == NULL)
+		return NULL;
+	if (segments->len == 1) {
+		DfuElement *segment = g_ptr_array_index (segments, 0);
+		return dfu_element_get_chunk (segment, 0,
+					      dfu_element_get_size (segment),
+					      NULL, error);
+	}
+
+	/* join them with a single copy */
+	for (i = 0; i < segments->len; i++)
+		length_total += dfu_element_get_size (g_ptr_array_index (segments, i));
+	buf = g_malloc (length_total);
+	for (i = 0; i < segments->len; i++) {
+		DfuElement *segment = g_ptr_array_index (segments, i);
+		const guint8 *data;
+		gsize length;
+		g_autoptr(GBytes) chunk = NULL;
+		chunk = dfu_element_get_chunk (segment, 0,
+					       dfu_element_get_size (segment),
+					       NULL, error);
+		if (chunk == NULL) {
+			g_free (buf);
+			return NULL;
+		}
+		data = g_bytes_get_data (chunk, &length);
+		memcpy (buf + offset, data, length);
+		offset += length;
+	}
+	return g_bytes_new_take (buf, length_total);
+}
+
+/**
+ * dfu_firmware_write_segment:
+ *
+ * Writes the segment to the stream, reading element data that is backed
+ * by a stream one chunk at a time.
+ **/
+static gboolean
+dfu_firmware_write_segment (GOutputStream *stream,
+			    DfuElement *segment,
+			    GCancellable *cancellable,
+			    GError **error)
+{
+	gsize offset;
+	gsize size = dfu_element_get_size (segment);
+
+	for (offset = 0; offset < size; offset += DFU_FIRMWARE_STREAM_CRC_CHUNK) {
+		const guint8 *data;
+		gsize length;
+		g_autoptr(GBytes) chunk = NULL;
+		chunk = dfu_element_get_chunk (segment, offset,
+					       DFU_FIRMWARE_STREAM_CRC_CHUNK,
+					       cancellable, error);
+		if (chunk == NULL)
+			return FALSE;
+		data = g_bytes_get_data (chunk, &length);
+		if (!g_output_stream_write_all (stream, data, length, NULL,
+						cancellable, error))
+			return FALSE;
+	}
+	return TRUE;
+}
+
 /**
  * dfu_firmware_write_file:
  * @firmware: a #DfuFirmware
@@ -1406,30 +2467,40 @@ gboolean
 dfu_firmware_write_file (DfuFirmware *firmware, GFile *file,
 			 GCancellable *cancellable, GError **error)
 {
-	const guint8 *data;
-	gsize length = 0;
-	g_autoptr(GBytes) bytes = NULL;
+	guint i;
+	g_autoptr(GFileOutputStream) stream = NULL;
+	g_autoptr(GPtrArray) segments = NULL;
 
 	g_return_val_if_fail (DFU_IS_FIRMWARE (firmware), FALSE);
 	g_return_val_if_fail (G_IS_FILE (file), FALSE);
 	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
-	/* get blob */
-	bytes = dfu_firmware_write_data (firmware, error);
-	if (bytes == NULL)
+	/* get segments */
+	segments = dfu_firmware_write_segments (firmware, error);
+	if (segments == NULL)
 		return FALSE;
 
-	/* save to firmware */
-	data = g_bytes_get_data (bytes, &length);
-	return g_file_replace_contents (file,
-					(const gchar *) data,
-					length,
-					NULL,
-					FALSE,
-					G_FILE_CREATE_NONE,
-					NULL,
-					cancellable,
-					error);
+	/* save to firmware without joining the segments */
+	stream = g_file_replace (file, NULL, FALSE,
+				 G_FILE_CREATE_NONE,
+				 cancellable, error);
+	if (stream == NULL)
+		return FALSE;
+	for (i = 0; i < segments->len; i++) {
+		DfuElement *segment = g_ptr_array_index (segments, i);
+		if (!dfu_firmware_write_segment (G_OUTPUT_STREAM (stream),
+						 segment, cancellable, error)) {
+			g_autoptr(GCancellable) abort = g_cancellable_new ();
+
+			/* closing cancelled leaves the old file in place */
+			g_cancellable_cancel (abort);
+			g_output_stream_close (G_OUTPUT_STREAM (stream),
+					       abort, NULL);
+			return FALSE;
+		}
+	}
+	return g_output_stream_close (G_OUTPUT_STREAM (stream),
+				      cancellable, error);
 }
 
 /**
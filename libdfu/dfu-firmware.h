@@ -55,6 +55,8 @@ struct _DfuFirmwareClass
  * @DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST:		Do not verify the CRC
  * @DFU_FIRMWARE_PARSE_FLAG_NO_VERSION_TEST:		Do not verify the DFU version
  * @DFU_FIRMWARE_PARSE_FLAG_NO_METADATA:		Do not read the metadata table
+ * @DFU_FIRMWARE_PARSE_FLAG_MMAP:			Map the file rather than reading it into memory
+ * @DFU_FIRMWARE_PARSE_FLAG_LAZY:			Only parse headers, deferring data and CRC checks
  *
  * The optional flags used for parsing.
  **/
@@ -63,6 +65,8 @@ typedef enum {
 	DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST		= (1 << 0),
 	DFU_FIRMWARE_PARSE_FLAG_NO_VERSION_TEST		= (1 << 1),
 	DFU_FIRMWARE_PARSE_FLAG_NO_METADATA		= (1 << 2),
+	DFU_FIRMWARE_PARSE_FLAG_MMAP			= (1 << 3),	/* Since: 0.7.2 */
+	DFU_FIRMWARE_PARSE_FLAG_LAZY			= (1 << 4),	/* Since: 0.7.2 */
 	/*< private >*/
 	DFU_FIRMWARE_PARSE_FLAG_LAST
 } DfuFirmwareParseFlags;
@@ -114,6 +118,13 @@ void		 dfu_firmware_set_release	(DfuFirmware	*firmware,
 						 guint16	 release);
 void		 dfu_firmware_set_format	(DfuFirmware	*firmware,
 						 DfuFirmwareFormat format);
+void		 dfu_firmware_set_ihex_record_size (DfuFirmware	*firmware,
+						 guint8		 record_size);
+void		 dfu_firmware_add_checksum_type	(DfuFirmware	*firmware,
+						 GChecksumType	 checksum_type);
+const gchar	*dfu_firmware_get_checksum	(DfuFirmware	*firmware,
+						 GChecksumType	 checksum_type);
+guint32		 dfu_firmware_get_crc		(DfuFirmware	*firmware);
 
 gboolean	 dfu_firmware_parse_data	(DfuFirmware	*firmware,
 						 GBytes		*bytes,
@@ -124,6 +135,11 @@ gboolean	 dfu_firmware_parse_file	(DfuFirmware	*firmware,
 						 DfuFirmwareParseFlags flags,
 						 GCancellable	*cancellable,
 						 GError		**error);
+gboolean	 dfu_firmware_parse_stream	(DfuFirmware	*firmware,
+						 GInputStream	*stream,
+						 DfuFirmwareParseFlags flags,
+						 GCancellable	*cancellable,
+						 GError		**error);
 
 GBytes		*dfu_firmware_write_data	(DfuFirmware	*firmware,
 						 GError		**error);
@@ -26,11 +26,21 @@
 
 G_BEGIN_DECLS
 
-DfuImage	*dfu_image_from_dfuse		(const guint8	*data,
-						 guint32	 length,
+DfuImage	*dfu_image_from_dfuse		(GBytes		*bytes,
+						 guint32	 offset,
 						 guint32	*consumed,
 						 GError		**error);
-GBytes		*dfu_image_to_dfuse		(DfuImage	*image);
+DfuImage	*dfu_image_from_dfuse_stream	(GInputStream	*stream,
+						 goffset	 offset,
+						 goffset	 limit,
+						 guint32	*consumed,
+						 GCancellable	*cancellable,
+						 GError		**error);
+guint32		 dfu_image_to_dfuse		(DfuImage	*image,
+						 GPtrArray	*segments);
+DfuElement	*dfu_image_get_element_flat	(DfuImage	*image,
+						 GCancellable	*cancellable,
+						 GError		**error);
 
 G_END_DECLS
 
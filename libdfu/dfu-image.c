@@ -34,7 +34,7 @@
 #include <string.h>
 #include <stdio.h>
 
-#include "dfu-common.h"
+#include "dfu-common-private.h"
 #include "dfu-element-private.h"
 #include "dfu-error.h"
 #include "dfu-image-private.h"
@@ -224,11 +224,128 @@ dfu_image_get_size (DfuImage *image)
 	g_return_val_if_fail (DFU_IS_IMAGE (image), 0);
 	for (i = 0; i < priv->elements->len; i++) {
 		DfuElement *element = g_ptr_array_index (priv->elements, i);
-		length += g_bytes_get_size (dfu_element_get_contents (element));
+		length += dfu_element_get_size (element);
 	}
 	return length;
 }
 
+/* the padding between elements could otherwise be huge */
+#define DFU_IMAGE_FLAT_SIZE_MAX		0x4000000
+
+/**
+ * dfu_image_sort_elements_cb:
+ **/
+static gint
+dfu_image_sort_elements_cb (gconstpointer a, gconstpointer b)
+{
+	DfuElement *element1 = *((DfuElement **) a);
+	DfuElement *element2 = *((DfuElement **) b);
+	guint32 addr1 = dfu_element_get_address (element1);
+	guint32 addr2 = dfu_element_get_address (element2);
+	if (addr1 < addr2)
+		return -1;
+	if (addr1 > addr2)
+		return 1;
+	return 0;
+}
+
+/**
+ * dfu_image_get_element_flat: (skip)
+ * @image: a #DfuImage
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: a #GError, or %NULL
+ *
+ * Gets all the elements in the image as one element, for formats and
+ * devices that have no way to set the address of each element. Any
+ * holes between the elements are padded with 0x00, as when a sparse
+ * Intel HEX file is imported.
+ *
+ * Return value: (transfer full): a #DfuElement, or %NULL for error
+ **/
+DfuElement *
+dfu_image_get_element_flat (DfuImage *image,
+			    GCancellable *cancellable,
+			    GError **error)
+{
+	DfuImagePrivate *priv = GET_PRIVATE (image);
+	DfuElement *element_first;
+	DfuElement *element_last;
+	guint32 addr_base;
+	guint64 size;
+	guint i;
+	g_autofree guint8 *buf = NULL;
+	g_autoptr(DfuElement) element_flat = NULL;
+	g_autoptr(GBytes) contents = NULL;
+	g_autoptr(GPtrArray) elements = NULL;
+
+	g_return_val_if_fail (DFU_IS_IMAGE (image), NULL);
+
+	/* nothing to do */
+	if (priv->elements->len == 0) {
+		g_set_error_literal (error,
+				     DFU_ERROR,
+				     DFU_ERROR_NOT_FOUND,
+				     "no firmware element data");
+		return NULL;
+	}
+	if (priv->elements->len == 1)
+		return g_object_ref (g_ptr_array_index (priv->elements, 0));
+
+	/* the records in a hex file do not have to be in order */
+	elements = g_ptr_array_new ();
+	for (i = 0; i < priv->elements->len; i++)
+		g_ptr_array_add (elements, g_ptr_array_index (priv->elements, i));
+	g_ptr_array_sort (elements, dfu_image_sort_elements_cb);
+	for (i = 1; i < elements->len; i++) {
+		DfuElement *element1 = g_ptr_array_index (elements, i - 1);
+		DfuElement *element2 = g_ptr_array_index (elements, i);
+		if ((guint64) dfu_element_get_address (element1) +
+		    dfu_element_get_size (element1) >
+		    dfu_element_get_address (element2)) {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_NOT_SUPPORTED,
+				     "elements overlap at 0x%08x",
+				     dfu_element_get_address (element2));
+			return NULL;
+		}
+	}
+	element_first = g_ptr_array_index (elements, 0);
+	element_last = g_ptr_array_index (elements, elements->len - 1);
+	addr_base = dfu_element_get_address (element_first);
+	size = (guint64) dfu_element_get_address (element_last) +
+	       dfu_element_get_size (element_last) - addr_base;
+	if (size > DFU_IMAGE_FLAT_SIZE_MAX) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_NOT_SUPPORTED,
+			     "elements span 0x%08x bytes which is too large "
+			     "to write as one element",
+			     (guint) size);
+		return NULL;
+	}
+
+	/* copy each element into place */
+	buf = g_malloc0 (size);
+	for (i = 0; i < elements->len; i++) {
+		DfuElement *element = g_ptr_array_index (elements, i);
+		g_autoptr(GBytes) chunk = NULL;
+		chunk = dfu_element_get_chunk (element, 0,
+					       dfu_element_get_size (element),
+					       cancellable, error);
+		if (chunk == NULL)
+			return NULL;
+		memcpy (buf + dfu_element_get_address (element) - addr_base,
+			g_bytes_get_data (chunk, NULL),
+			g_bytes_get_size (chunk));
+	}
+	contents = g_bytes_new_take (g_steal_pointer (&buf), size);
+	element_flat = dfu_element_new ();
+	dfu_element_set_address (element_flat, addr_base);
+	dfu_element_set_contents (element_flat, contents);
+	return g_steal_pointer (&element_flat);
+}
+
 /**
  * dfu_image_add_element:
  * @image: a #DfuImage
@@ -339,8 +456,8 @@ typedef struct __attribute__((packed)) {
 
 /**
  * dfu_image_from_dfuse: (skip)
- * @data: data buffer
- * @length: length of @data we can access
+ * @bytes: data buffer
+ * @offset: offset into @bytes of the image prefix
  * @consumed: (out): the number of bytes we consued
  * @error: a #GError, or %NULL
  *
@@ -349,32 +466,36 @@ typedef struct __attribute__((packed)) {
  * Returns: a #DfuImage, or %NULL for error
  **/
 DfuImage *
-dfu_image_from_dfuse (const guint8 *data,
-		      guint32 length,
+dfu_image_from_dfuse (GBytes *bytes,
+		      guint32 offset,
 		      guint32 *consumed,
 		      GError **error)
 {
 	DfuImagePrivate *priv;
 	DfuSeImagePrefix *im;
+	const guint8 *data;
+	gsize length;
 	guint32 elements;
-	guint32 offset = sizeof(DfuSeImagePrefix);
+	guint32 offset_start = offset;
 	guint j;
 	g_autoptr(DfuImage) image = NULL;
 
 	g_assert_cmpint(sizeof(DfuSeImagePrefix), ==, 274);
 
 	/* check input buffer size */
-	if (length < sizeof(DfuSeImagePrefix)) {
+	data = g_bytes_get_data (bytes, &length);
+	if (offset > length ||
+	    length - offset < sizeof(DfuSeImagePrefix)) {
 		g_set_error (error,
 			     DFU_ERROR,
 			     DFU_ERROR_INTERNAL,
 			     "invalid image data size %u",
-			     (guint32) length);
+			     (guint32) (length - MIN (offset, length)));
 		return NULL;
 	}
 
 	/* verify image signature */
-	im = (DfuSeImagePrefix *) data;
+	im = (DfuSeImagePrefix *) (data + offset);
 	if (memcmp (im->sig, "Target", 6) != 0) {
 		g_set_error_literal (error,
 				     DFU_ERROR,
@@ -391,23 +512,101 @@ dfu_image_from_dfuse (const guint8 *data,
 		memcpy (priv->name, im->target_name, 255);
 
 	/* parse elements */
-	length -= offset;
+	offset += sizeof(DfuSeImagePrefix);
 	elements = GUINT32_FROM_LE (im->elements);
 	for (j = 0; j < elements; j++) {
 		guint32 consumed_local;
 		g_autoptr(DfuElement) element = NULL;
-		element = dfu_element_from_dfuse (data + offset, length,
+		element = dfu_element_from_dfuse (bytes, offset,
 						  &consumed_local, error);
 		if (element == NULL)
 			return NULL;
 		dfu_image_add_element (image, element);
 		offset += consumed_local;
-		length -= consumed_local;
 	}
 
 	/* return size */
 	if (consumed != NULL)
-		*consumed = offset;
+		*consumed = offset - offset_start;
+
+	return g_object_ref (image);
+}
+
+/**
+ * dfu_image_from_dfuse_stream: (skip)
+ * @stream: a seekable #GInputStream
+ * @offset: offset of the image prefix in @stream
+ * @limit: offset of the end of the DfuSe data in @stream
+ * @consumed: (out): the number of bytes we consued
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: a #GError, or %NULL
+ *
+ * Unpacks an image from a DfuSe stream without reading the element data.
+ *
+ * Returns: a #DfuImage, or %NULL for error
+ **/
+DfuImage *
+dfu_image_from_dfuse_stream (GInputStream *stream,
+			     goffset offset,
+			     goffset limit,
+			     guint32 *consumed,
+			     GCancellable *cancellable,
+			     GError **error)
+{
+	DfuImagePrivate *priv;
+	DfuSeImagePrefix im;
+	guint32 elements;
+	goffset offset_start = offset;
+	guint j;
+	g_autoptr(DfuImage) image = NULL;
+
+	/* check input buffer size */
+	if (offset + (goffset) sizeof(DfuSeImagePrefix) > limit) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "invalid image data size %u",
+			     (guint32) MAX (limit - offset, 0));
+		return NULL;
+	}
+	if (!dfu_utils_stream_read_at (stream, offset, (guint8 *) &im,
+				       sizeof(im), cancellable, error))
+		return NULL;
+
+	/* verify image signature */
+	if (memcmp (im.sig, "Target", 6) != 0) {
+		g_set_error_literal (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INVALID_FILE,
+				     "invalid DfuSe target signature");
+		return NULL;
+	}
+
+	/* create new image */
+	image = dfu_image_new ();
+	priv = GET_PRIVATE (image);
+	priv->alt_setting = im.alt_setting;
+	if (GUINT32_FROM_LE (im.target_named) == 0x01)
+		memcpy (priv->name, im.target_name, 255);
+
+	/* parse elements */
+	offset += sizeof(DfuSeImagePrefix);
+	elements = GUINT32_FROM_LE (im.elements);
+	for (j = 0; j < elements; j++) {
+		guint32 consumed_local;
+		g_autoptr(DfuElement) element = NULL;
+		element = dfu_element_from_dfuse_stream (stream, offset, limit,
+							 &consumed_local,
+							 cancellable, error);
+		if (element == NULL)
+			return NULL;
+		dfu_image_add_element (image, element);
+		offset += consumed_local;
+	}
+
+	/* return size */
+	if (consumed != NULL)
+		*consumed = offset - offset_start;
 
 	return g_object_ref (image);
 }
@@ -415,36 +614,33 @@ dfu_image_from_dfuse (const guint8 *data,
 /**
  * dfu_image_to_dfuse: (skip)
  * @image: a #DfuImage
+ * @segments: (element-type DfuElement): array of segments to append to
  *
- * Packs a DfuSe image
+ * Packs a DfuSe image. The image header, element headers and the
+ * elements themselves are appended to @segments so that the caller can
+ * write them out without joining them first.
  *
- * Returns: (transfer full): the packed data
+ * Returns: the number of bytes added to @segments
  **/
-GBytes *
-dfu_image_to_dfuse (DfuImage *image)
+guint32
+dfu_image_to_dfuse (DfuImage *image, GPtrArray *segments)
 {
 	DfuImagePrivate *priv = GET_PRIVATE (image);
-	DfuElement *element;
 	DfuSeImagePrefix *im;
-	GBytes *bytes;
 	guint32 length_total = 0;
-	guint32 offset = sizeof (DfuSeImagePrefix);
-	guint8 *buf;
+	guint idx_prefix;
 	guint i;
-	g_autoptr(GPtrArray) element_array = NULL;
 
-	/* get total size */
-	element_array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+	/* reserve the prefix, which needs the size of all elements */
+	idx_prefix = segments->len;
+	g_ptr_array_add (segments, NULL);
 	for (i = 0; i < priv->elements->len; i++) {
-		element = g_ptr_array_index (priv->elements, i);
-		bytes = dfu_element_to_dfuse (element);
-		g_ptr_array_add (element_array, bytes);
-		length_total += g_bytes_get_size (bytes);
+		DfuElement *element = g_ptr_array_index (priv->elements, i);
+		length_total += dfu_element_to_dfuse (element, segments);
 	}
 
 	/* add prefix */
-	buf = g_malloc0 (length_total + sizeof (DfuSeImagePrefix));
-	im = (DfuSeImagePrefix *) buf;
+	im = g_new0 (DfuSeImagePrefix, 1);
 	memcpy (im->sig, "Target", 6);
 	im->alt_setting = priv->alt_setting;
 	if (priv->name != NULL) {
@@ -453,15 +649,6 @@ dfu_image_to_dfuse (DfuImage *image)
 	}
 	im->target_size = GUINT32_TO_LE (length_total);
 	im->elements = GUINT32_TO_LE (priv->elements->len);
-
-	/* copy data */
-	for (i = 0; i < element_array->len; i++) {
-		const guint8 *data;
-		gsize length;
-		bytes = g_ptr_array_index (element_array, i);
-		data = g_bytes_get_data (bytes, &length);
-		memcpy (buf + offset, data, length);
-		offset += length;
-	}
-	return g_bytes_new_take (buf, length_total + sizeof (DfuSeImagePrefix));
+	g_ptr_array_index (segments, idx_prefix) = dfu_element_new_take (im, sizeof (DfuSeImagePrefix));
+	return length_total + sizeof (DfuSeImagePrefix);
 }
@@ -0,0 +1,83 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __DFU_JOURNAL_PRIVATE_H
+#define __DFU_JOURNAL_PRIVATE_H
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "dfu-image.h"
+
+G_BEGIN_DECLS
+
+#define DFU_TYPE_JOURNAL (dfu_journal_get_type ())
+G_DECLARE_DERIVABLE_TYPE (DfuJournal, dfu_journal, DFU, JOURNAL, GObject)
+
+struct _DfuJournalClass
+{
+	GObjectClass		 parent_class;
+};
+
+/**
+ * DfuJournalState:
+ * @DFU_JOURNAL_STATE_UNKNOWN:		Nothing is known about the sector
+ * @DFU_JOURNAL_STATE_ERASED:		Erased, and nothing has been written since
+ * @DFU_JOURNAL_STATE_WRITING:		Some of the new data has been written
+ * @DFU_JOURNAL_STATE_WRITTEN:		All of the new data has been written
+ * @DFU_JOURNAL_STATE_VERIFIED:		All of the new data has been read back
+ *
+ * The progress of a download for each sector.
+ **/
+typedef enum {
+	DFU_JOURNAL_STATE_UNKNOWN,
+	DFU_JOURNAL_STATE_ERASED,
+	DFU_JOURNAL_STATE_WRITING,
+	DFU_JOURNAL_STATE_WRITTEN,
+	DFU_JOURNAL_STATE_VERIFIED,
+	/*< private >*/
+	DFU_JOURNAL_STATE_LAST
+} DfuJournalState;
+
+DfuJournal	*dfu_journal_new			(void);
+
+gboolean	 dfu_journal_load			(DfuJournal	*journal,
+							 const gchar	*filename,
+							 const gchar	*digest,
+							 GError		**error);
+gboolean	 dfu_journal_save			(DfuJournal	*journal,
+							 GError		**error);
+gboolean	 dfu_journal_clear			(DfuJournal	*journal,
+							 GError		**error);
+
+DfuJournalState	 dfu_journal_get_state			(DfuJournal	*journal,
+							 guint32	 address);
+gboolean	 dfu_journal_set_state			(DfuJournal	*journal,
+							 guint32	 address,
+							 DfuJournalState state);
+
+gchar		*dfu_journal_get_image_digest		(DfuImage	*image,
+							 GCancellable	*cancellable,
+							 GError		**error);
+
+G_END_DECLS
+
+#endif /* __DFU_JOURNAL_PRIVATE_H */
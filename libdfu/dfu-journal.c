@@ -0,0 +1,422 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Copyright (C) 2015 Richard Hughes <richard@hughsie.com>
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/**
+ * SECTION:dfu-journal
+ * @short_description: A record of the sectors written to a target
+ *
+ * This object records the progress of a download to a DfuSe target for
+ * each sector, so that a download that was interrupted can be continued
+ * from the first sector that was not completely written.
+ *
+ * The journal is only valid for one image, and so it is keyed by a
+ * digest of the image data. It is saved atomically so that it is never
+ * left half-written if the host goes away.
+ *
+ * See also: #DfuTarget
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "dfu-common.h"
+#include "dfu-element.h"
+#include "dfu-element-private.h"
+#include "dfu-error.h"
+#include "dfu-journal-private.h"
+
+static void dfu_journal_finalize			 (GObject *object);
+
+/**
+ * DfuJournalPrivate:
+ *
+ * Private #DfuJournal data
+ **/
+typedef struct {
+	gchar			*filename;
+	gchar			*digest;
+	GHashTable		*states;	/* of address:DfuJournalState */
+} DfuJournalPrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (DfuJournal, dfu_journal, G_TYPE_OBJECT)
+#define GET_PRIVATE(o) (dfu_journal_get_instance_private (o))
+
+/* read the image in pieces as it may be backed by a stream */
+#define DFU_JOURNAL_DIGEST_CHUNK		0x4000
+
+/**
+ * dfu_journal_class_init:
+ **/
+static void
+dfu_journal_class_init (DfuJournalClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	object_class->finalize = dfu_journal_finalize;
+}
+
+/**
+ * dfu_journal_init:
+ **/
+static void
+dfu_journal_init (DfuJournal *journal)
+{
+	DfuJournalPrivate *priv = GET_PRIVATE (journal);
+	priv->states = g_hash_table_new (g_direct_hash, g_direct_equal);
+}
+
+/**
+ * dfu_journal_finalize:
+ **/
+static void
+dfu_journal_finalize (GObject *object)
+{
+	DfuJournal *journal = DFU_JOURNAL (object);
+	DfuJournalPrivate *priv = GET_PRIVATE (journal);
+
+	g_free (priv->filename);
+	g_free (priv->digest);
+	g_hash_table_unref (priv->states);
+
+	G_OBJECT_CLASS (dfu_journal_parent_class)->finalize (object);
+}
+
+/**
+ * dfu_journal_new: (skip)
+ *
+ * Creates a new, empty journal.
+ *
+ * Return value: a new #DfuJournal
+ **/
+DfuJournal *
+dfu_journal_new (void)
+{
+	DfuJournal *journal;
+	journal = g_object_new (DFU_TYPE_JOURNAL, NULL);
+	return journal;
+}
+
+/**
+ * dfu_journal_state_to_string:
+ **/
+static const gchar *
+dfu_journal_state_to_string (DfuJournalState state)
+{
+	if (state == DFU_JOURNAL_STATE_ERASED)
+		return "erased";
+	if (state == DFU_JOURNAL_STATE_WRITING)
+		return "writing";
+	if (state == DFU_JOURNAL_STATE_WRITTEN)
+		return "written";
+	if (state == DFU_JOURNAL_STATE_VERIFIED)
+		return "verified";
+	return NULL;
+}
+
+/**
+ * dfu_journal_state_from_string:
+ **/
+static DfuJournalState
+dfu_journal_state_from_string (const gchar *state)
+{
+	if (g_strcmp0 (state, "erased") == 0)
+		return DFU_JOURNAL_STATE_ERASED;
+	if (g_strcmp0 (state, "writing") == 0)
+		return DFU_JOURNAL_STATE_WRITING;
+	if (g_strcmp0 (state, "written") == 0)
+		return DFU_JOURNAL_STATE_WRITTEN;
+	if (g_strcmp0 (state, "verified") == 0)
+		return DFU_JOURNAL_STATE_VERIFIED;
+	return DFU_JOURNAL_STATE_UNKNOWN;
+}
+
+/**
+ * dfu_journal_load:
+ * @journal: a #DfuJournal
+ * @filename: the file to use for the journal
+ * @digest: the digest of the image being downloaded
+ * @error: a #GError, or %NULL
+ *
+ * Loads the journal from a file. If the file does not exist, or was
+ * saved for a different image, then the journal is empty.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+dfu_journal_load (DfuJournal *journal,
+		  const gchar *filename,
+		  const gchar *digest,
+		  GError **error)
+{
+	DfuJournalPrivate *priv = GET_PRIVATE (journal);
+	guint i;
+	g_autofree gchar *digest_old = NULL;
+	g_autoptr(GError) error_local = NULL;
+	g_autoptr(GKeyFile) kf = NULL;
+	g_auto(GStrv) keys = NULL;
+
+	g_return_val_if_fail (DFU_IS_JOURNAL (journal), FALSE);
+	g_return_val_if_fail (filename != NULL, FALSE);
+	g_return_val_if_fail (digest != NULL, FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	/* save these for later */
+	g_free (priv->filename);
+	priv->filename = g_strdup (filename);
+	g_free (priv->digest);
+	priv->digest = g_strdup (digest);
+	g_hash_table_remove_all (priv->states);
+
+	/* nothing was interrupted */
+	kf = g_key_file_new ();
+	if (!g_key_file_load_from_file (kf, filename, G_KEY_FILE_NONE,
+					&error_local)) {
+		if (g_error_matches (error_local, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			return TRUE;
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "failed to load %s: %s",
+			     filename, error_local->message);
+		return FALSE;
+	}
+
+	/* the interrupted download was for different firmware */
+	digest_old = g_key_file_get_string (kf, "DfuJournal", "Digest", NULL);
+	if (g_strcmp0 (digest_old, digest) != 0) {
+		g_debug ("ignoring journal %s for different image", filename);
+		return TRUE;
+	}
+
+	/* the key is the sector address */
+	keys = g_key_file_get_keys (kf, "Sectors", NULL, NULL);
+	for (i = 0; keys != NULL && keys[i] != NULL; i++) {
+		DfuJournalState state;
+		guint64 address;
+		gchar *endptr = NULL;
+		g_autofree gchar *tmp = NULL;
+
+		address = g_ascii_strtoull (keys[i], &endptr, 16);
+		if (address > G_MAXUINT32 || endptr[0] != '\0') {
+			g_debug ("ignoring invalid journal address %s", keys[i]);
+			continue;
+		}
+		tmp = g_key_file_get_string (kf, "Sectors", keys[i], NULL);
+		state = dfu_journal_state_from_string (tmp);
+		if (state == DFU_JOURNAL_STATE_UNKNOWN)
+			continue;
+		g_hash_table_insert (priv->states,
+				     GUINT_TO_POINTER (address),
+				     GUINT_TO_POINTER (state));
+	}
+	g_debug ("loaded %u sectors from journal %s",
+		 g_hash_table_size (priv->states), filename);
+	return TRUE;
+}
+
+/**
+ * dfu_journal_save:
+ * @journal: a #DfuJournal
+ * @error: a #GError, or %NULL
+ *
+ * Saves the journal to the file that was passed to dfu_journal_load().
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+dfu_journal_save (DfuJournal *journal, GError **error)
+{
+	DfuJournalPrivate *priv = GET_PRIVATE (journal);
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	g_autofree gchar *dirname = NULL;
+	g_autoptr(GKeyFile) kf = NULL;
+
+	g_return_val_if_fail (DFU_IS_JOURNAL (journal), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	/* not loaded */
+	if (priv->filename == NULL) {
+		g_set_error_literal (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INTERNAL,
+				     "journal has not been loaded");
+		return FALSE;
+	}
+
+	kf = g_key_file_new ();
+	g_key_file_set_string (kf, "DfuJournal", "Digest", priv->digest);
+	g_hash_table_iter_init (&iter, priv->states);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		g_autofree gchar *address = NULL;
+		address = g_strdup_printf ("%08x", GPOINTER_TO_UINT (key));
+		g_key_file_set_string (kf, "Sectors", address,
+				       dfu_journal_state_to_string (GPOINTER_TO_UINT (value)));
+	}
+
+	/* this replaces the old file atomically */
+	dirname = g_path_get_dirname (priv->filename);
+	if (g_mkdir_with_parents (dirname, 0755) != 0) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "failed to create %s", dirname);
+		return FALSE;
+	}
+	return g_key_file_save_to_file (kf, priv->filename, error);
+}
+
+/**
+ * dfu_journal_clear:
+ * @journal: a #DfuJournal
+ * @error: a #GError, or %NULL
+ *
+ * Forgets the state of every sector and deletes the file, for instance
+ * when the download has completed.
+ *
+ * Return value: %TRUE for success
+ **/
+gboolean
+dfu_journal_clear (DfuJournal *journal, GError **error)
+{
+	DfuJournalPrivate *priv = GET_PRIVATE (journal);
+
+	g_return_val_if_fail (DFU_IS_JOURNAL (journal), FALSE);
+	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+	g_hash_table_remove_all (priv->states);
+	if (priv->filename == NULL)
+		return TRUE;
+	if (g_unlink (priv->filename) != 0 && errno != ENOENT) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "failed to delete %s: %s",
+			     priv->filename, g_strerror (errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * dfu_journal_get_state:
+ * @journal: a #DfuJournal
+ * @address: the sector address
+ *
+ * Gets the progress of the download for a sector.
+ *
+ * Return value: a #DfuJournalState, e.g. %DFU_JOURNAL_STATE_WRITTEN
+ **/
+DfuJournalState
+dfu_journal_get_state (DfuJournal *journal, guint32 address)
+{
+	DfuJournalPrivate *priv = GET_PRIVATE (journal);
+	g_return_val_if_fail (DFU_IS_JOURNAL (journal), DFU_JOURNAL_STATE_UNKNOWN);
+	return GPOINTER_TO_UINT (g_hash_table_lookup (priv->states,
+						      GUINT_TO_POINTER (address)));
+}
+
+/**
+ * dfu_journal_set_state:
+ * @journal: a #DfuJournal
+ * @address: the sector address
+ * @state: a #DfuJournalState, e.g. %DFU_JOURNAL_STATE_WRITTEN
+ *
+ * Sets the progress of the download for a sector. The journal is not
+ * saved until dfu_journal_save() is called.
+ *
+ * Return value: %TRUE if the state was changed
+ **/
+gboolean
+dfu_journal_set_state (DfuJournal *journal,
+		       guint32 address,
+		       DfuJournalState state)
+{
+	DfuJournalPrivate *priv = GET_PRIVATE (journal);
+
+	g_return_val_if_fail (DFU_IS_JOURNAL (journal), FALSE);
+	g_return_val_if_fail (state < DFU_JOURNAL_STATE_LAST, FALSE);
+
+	if (dfu_journal_get_state (journal, address) == state)
+		return FALSE;
+	if (state == DFU_JOURNAL_STATE_UNKNOWN) {
+		g_hash_table_remove (priv->states, GUINT_TO_POINTER (address));
+		return TRUE;
+	}
+	g_hash_table_insert (priv->states,
+			     GUINT_TO_POINTER (address),
+			     GUINT_TO_POINTER (state));
+	return TRUE;
+}
+
+/**
+ * dfu_journal_get_image_digest:
+ * @image: a #DfuImage
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: a #GError, or %NULL
+ *
+ * Gets a SHA-256 digest of the address, size and data of every element
+ * in the image, which is used to find the journal for the image.
+ *
+ * Return value: a hex string, or %NULL for error
+ **/
+gchar *
+dfu_journal_get_image_digest (DfuImage *image,
+			      GCancellable *cancellable,
+			      GError **error)
+{
+	GPtrArray *elements;
+	guint i;
+	g_autoptr(GChecksum) csum = NULL;
+
+	g_return_val_if_fail (DFU_IS_IMAGE (image), NULL);
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+	csum = g_checksum_new (G_CHECKSUM_SHA256);
+	elements = dfu_image_get_elements (image);
+	for (i = 0; i < elements->len; i++) {
+		DfuElement *element = g_ptr_array_index (elements, i);
+		gsize offset;
+		gsize size = dfu_element_get_size (element);
+		guint32 tmp;
+
+		tmp = GUINT32_TO_LE (dfu_element_get_address (element));
+		g_checksum_update (csum, (const guchar *) &tmp, sizeof (tmp));
+		tmp = GUINT32_TO_LE (size);
+		g_checksum_update (csum, (const guchar *) &tmp, sizeof (tmp));
+		for (offset = 0; offset < size; offset += DFU_JOURNAL_DIGEST_CHUNK) {
+			gsize len;
+			const guint8 *data;
+			g_autoptr(GBytes) bytes = NULL;
+			bytes = dfu_element_get_chunk (element, offset,
+						       DFU_JOURNAL_DIGEST_CHUNK,
+						       cancellable, error);
+			if (bytes == NULL)
+				return NULL;
+			data = g_bytes_get_data (bytes, &len);
+			g_checksum_update (csum, data, len);
+		}
+	}
+	return g_strdup (g_checksum_get_string (csum));
+}
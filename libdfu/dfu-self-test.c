@@ -22,13 +22,21 @@
 #include "config.h"
 
 #include <glib-object.h>
+#include <glib/gstdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "dfu-cipher.h"
+#include "dfu-cipher-private.h"
 #include "dfu-common.h"
 #include "dfu-context.h"
-#include "dfu-device.h"
+#include "dfu-context-private.h"
+#include "dfu-crc32-private.h"
+#include "dfu-device-private.h"
+#include "dfu-element-private.h"
 #include "dfu-error.h"
 #include "dfu-firmware.h"
+#include "dfu-journal-private.h"
 #include "dfu-sector-private.h"
 #include "dfu-target-private.h"
 
@@ -101,6 +109,60 @@ dfu_firmware_xdfu_func (void)
 	g_assert_cmpint (dfu_firmware_get_cipher_kind (firmware), ==, DFU_CIPHER_KIND_XTEA);
 }
 
+static void
+dfu_crc32_func (void)
+{
+	gsize i;
+	gsize j;
+	gsize length = 0x100000;
+	guint32 crc_ref;
+	guint32 crc_new;
+	g_autofree guint8 *buf = g_malloc (length);
+
+	/* known answer */
+	g_assert_cmpint (dfu_crc32_generate ((const guint8 *) "123456789", 9), ==, 0x340bc6d9);
+	g_assert_cmpint (dfu_crc32_generate (NULL, 0), ==, DFU_CRC32_INIT);
+
+	/* every length and alignment around the 8 byte stride */
+	for (i = 0; i < length; i++)
+		buf[i] = g_random_int_range (0x00, 0x100);
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < 128; j++) {
+			crc_ref = dfu_crc32_update_bytewise (DFU_CRC32_INIT, buf + i, j);
+			crc_new = dfu_crc32_update (DFU_CRC32_INIT, buf + i, j);
+			g_assert_cmpint (crc_new, ==, crc_ref);
+		}
+	}
+
+	/* incremental updates match one big update */
+	crc_ref = dfu_crc32_generate (buf, length);
+	crc_new = dfu_crc32_update (DFU_CRC32_INIT, buf, 13);
+	crc_new = dfu_crc32_update (crc_new, buf + 13, 0x1000 - 13);
+	crc_new = dfu_crc32_update (crc_new, buf + 0x1000, length - 0x1000);
+	g_assert_cmpint (crc_new, ==, crc_ref);
+	g_assert_cmpint (dfu_crc32_update_bytewise (DFU_CRC32_INIT, buf, length), ==, crc_ref);
+
+	/* compare against the old byte-at-a-time table */
+	if (g_test_perf ()) {
+		gdouble elapsed_ref;
+		gdouble elapsed_new;
+		g_autoptr(GTimer) timer = g_timer_new ();
+		for (i = 0; i < 16; i++)
+			crc_ref = dfu_crc32_update_bytewise (crc_ref, buf, length);
+		elapsed_ref = g_timer_elapsed (timer, NULL);
+		g_timer_reset (timer);
+		for (i = 0; i < 16; i++)
+			crc_new = dfu_crc32_update (crc_new, buf, length);
+		elapsed_new = g_timer_elapsed (timer, NULL);
+		g_assert_cmpint (crc_new, ==, crc_ref);
+		g_test_minimized_result (elapsed_new,
+					 "%s %.1f MB/s, bytewise %.1f MB/s",
+					 dfu_crc32_get_impl (),
+					 (16 * length) / (elapsed_new * 1e6),
+					 (16 * length) / (elapsed_ref * 1e6));
+	}
+}
+
 static void
 dfu_enums_func (void)
 {
@@ -250,11 +312,15 @@ dfu_firmware_dfuse_func (void)
 {
 	gboolean ret;
 	g_autofree gchar *filename = NULL;
+	g_autofree gchar *filename_tmp = NULL;
+	g_autofree gchar *tmpdir = NULL;
 	g_autoptr(DfuFirmware) firmware = NULL;
+	g_autoptr(GBytes) roundtrip_file = NULL;
 	g_autoptr(GBytes) roundtrip_orig = NULL;
 	g_autoptr(GBytes) roundtrip = NULL;
 	g_autoptr(GError) error = NULL;
 	g_autoptr(GFile) file = NULL;
+	g_autoptr(GFile) file_tmp = NULL;
 
 	/* load a DeFUse firmware */
 	filename = dfu_test_get_filename ("dev_VRBRAIN.dfu");
@@ -286,6 +352,476 @@ dfu_firmware_dfuse_func (void)
 //			     g_bytes_get_size (roundtrip), NULL);
 
 	g_assert_cmpstr (_g_bytes_compare_verbose (roundtrip, roundtrip_orig), ==, NULL);
+
+	/* writing the segments directly gives the same file */
+	tmpdir = g_dir_make_tmp ("dfu-self-test-XXXXXX", &error);
+	g_assert_no_error (error);
+	g_assert (tmpdir != NULL);
+	filename_tmp = g_build_filename (tmpdir, "dfuse.dfu", NULL);
+	file_tmp = g_file_new_for_path (filename_tmp);
+	ret = dfu_firmware_write_file (firmware, file_tmp, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	roundtrip_file = dfu_self_test_get_bytes_for_file (file_tmp, &error);
+	g_assert_no_error (error);
+	g_assert (roundtrip_file != NULL);
+	g_assert_cmpstr (_g_bytes_compare_verbose (roundtrip_file, roundtrip_orig), ==, NULL);
+	g_unlink (filename_tmp);
+	g_rmdir (tmpdir);
+}
+
+static void
+dfu_firmware_mmap_func (void)
+{
+	DfuElement *element;
+	DfuImage *image;
+	gboolean ret;
+	guint32 size_orig;
+	g_autofree gchar *filename = NULL;
+	g_autoptr(DfuFirmware) firmware = NULL;
+	g_autoptr(DfuFirmware) firmware2 = NULL;
+	g_autoptr(GBytes) orig = NULL;
+	g_autoptr(GBytes) orig2 = NULL;
+	g_autoptr(GBytes) roundtrip = NULL;
+	g_autoptr(GBytes) modified = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GFile) file = NULL;
+
+	/* map a DfuSe firmware */
+	filename = dfu_test_get_filename ("dev_VRBRAIN.dfu");
+	g_assert (filename != NULL);
+	file = g_file_new_for_path (filename);
+	orig = dfu_self_test_get_bytes_for_file (file, &error);
+	g_assert_no_error (error);
+	g_assert (orig != NULL);
+	firmware = dfu_firmware_new ();
+	ret = dfu_firmware_parse_file (firmware, file,
+				       DFU_FIRMWARE_PARSE_FLAG_MMAP,
+				       NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_firmware_get_format (firmware), ==, DFU_FIRMWARE_FORMAT_DFUSE);
+	g_assert_cmpint (dfu_firmware_get_size (firmware), ==, 0x168d5);
+
+	/* can we roundtrip straight from the mapping */
+	roundtrip = dfu_firmware_write_data (firmware, &error);
+	g_assert_no_error (error);
+	g_assert (roundtrip != NULL);
+	g_assert_cmpstr (_g_bytes_compare_verbose (roundtrip, orig), ==, NULL);
+
+	/* modifying copies into a new buffer, leaving the file alone */
+	image = dfu_firmware_get_image_default (firmware);
+	g_assert (image != NULL);
+	element = dfu_image_get_element (image, 0);
+	g_assert (element != NULL);
+	size_orig = g_bytes_get_size (dfu_element_get_contents (element));
+	dfu_element_set_target_size (element, size_orig + 0x100);
+	dfu_firmware_set_vid (firmware, 0x1234);
+	modified = dfu_firmware_write_data (firmware, &error);
+	g_assert_no_error (error);
+	g_assert (modified != NULL);
+	firmware2 = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware2, modified,
+				       DFU_FIRMWARE_PARSE_FLAG_NONE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_firmware_get_vid (firmware2), ==, 0x1234);
+	g_assert_cmpint (dfu_firmware_get_size (firmware2), ==, 0x168d5 + 0x100);
+	orig2 = dfu_self_test_get_bytes_for_file (file, &error);
+	g_assert_no_error (error);
+	g_assert_cmpstr (_g_bytes_compare_verbose (orig2, orig), ==, NULL);
+}
+
+static GInputStream *
+dfu_self_test_get_unseekable_stream (GBytes *bytes, GError **error)
+{
+	g_autoptr(GBytes) deflated = NULL;
+	g_autoptr(GConverter) compressor = NULL;
+	g_autoptr(GConverter) decompressor = NULL;
+	g_autoptr(GInputStream) istream = NULL;
+	g_autoptr(GInputStream) istream_deflate = NULL;
+	g_autoptr(GInputStream) istream_deflated = NULL;
+	g_autoptr(GOutputStream) ostream = NULL;
+
+	/* a GConverterInputStream cannot seek, so deflate the data first
+	 * and then read it back through one */
+	compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+	istream = g_memory_input_stream_new_from_bytes (bytes);
+	istream_deflate = g_converter_input_stream_new (istream, compressor);
+	ostream = g_memory_output_stream_new_resizable ();
+	if (g_output_stream_splice (ostream, istream_deflate,
+				    G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+				    NULL, error) < 0)
+		return NULL;
+	deflated = g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (ostream));
+	decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+	istream_deflated = g_memory_input_stream_new_from_bytes (deflated);
+	return g_converter_input_stream_new (istream_deflated, decompressor);
+}
+
+static void
+dfu_firmware_stream_func (void)
+{
+	DfuElement *element;
+	DfuImage *image;
+	gboolean ret;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *filename_tmp = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	guint8 *data;
+	gsize len;
+	g_autofree gchar *sha1 = NULL;
+	g_autoptr(DfuFirmware) firmware = NULL;
+	g_autoptr(DfuFirmware) firmware2 = NULL;
+	g_autoptr(DfuFirmware) firmware3 = NULL;
+	g_autoptr(GBytes) chunk = NULL;
+	g_autoptr(GBytes) corrupt = NULL;
+	g_autoptr(GBytes) orig = NULL;
+	g_autoptr(GBytes) roundtrip = NULL;
+	g_autoptr(GBytes) roundtrip2 = NULL;
+	g_autoptr(GBytes) roundtrip_file = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GFile) file = NULL;
+	g_autoptr(GFile) file_tmp = NULL;
+	g_autoptr(GFileInputStream) stream = NULL;
+	g_autoptr(GInputStream) stream_corrupt = NULL;
+	g_autoptr(GInputStream) stream_unseekable = NULL;
+
+	/* parse a DfuSe firmware without loading the element data */
+	filename = dfu_test_get_filename ("dev_VRBRAIN.dfu");
+	g_assert (filename != NULL);
+	file = g_file_new_for_path (filename);
+	orig = dfu_self_test_get_bytes_for_file (file, &error);
+	g_assert_no_error (error);
+	g_assert (orig != NULL);
+	stream = g_file_read (file, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (stream != NULL);
+	firmware = dfu_firmware_new ();
+	ret = dfu_firmware_parse_stream (firmware, G_INPUT_STREAM (stream),
+					 DFU_FIRMWARE_PARSE_FLAG_NONE,
+					 NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_firmware_get_format (firmware), ==, DFU_FIRMWARE_FORMAT_DFUSE);
+	g_assert_cmpint (dfu_firmware_get_size (firmware), ==, 0x168d5);
+
+	/* read part of the element straight from the stream */
+	image = dfu_firmware_get_image_default (firmware);
+	g_assert (image != NULL);
+	element = dfu_image_get_element (image, 0);
+	g_assert (element != NULL);
+	g_assert_cmpint (dfu_element_get_size (element), ==, 0x168d5);
+	chunk = dfu_element_get_chunk (element, 0x168d0, 0x100, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (chunk != NULL);
+	g_assert_cmpint (g_bytes_get_size (chunk), ==, 5);
+
+	/* the element data is copied from the stream a chunk at a time */
+	tmpdir = g_dir_make_tmp ("dfu-self-test-XXXXXX", &error);
+	g_assert_no_error (error);
+	g_assert (tmpdir != NULL);
+	filename_tmp = g_build_filename (tmpdir, "stream.dfu", NULL);
+	file_tmp = g_file_new_for_path (filename_tmp);
+	ret = dfu_firmware_write_file (firmware, file_tmp, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	roundtrip_file = dfu_self_test_get_bytes_for_file (file_tmp, &error);
+	g_assert_no_error (error);
+	g_assert (roundtrip_file != NULL);
+	g_assert_cmpstr (_g_bytes_compare_verbose (roundtrip_file, orig), ==, NULL);
+	g_unlink (filename_tmp);
+	g_rmdir (tmpdir);
+
+	/* loading the contents gives the same file back */
+	roundtrip = dfu_firmware_write_data (firmware, &error);
+	g_assert_no_error (error);
+	g_assert (roundtrip != NULL);
+	g_assert_cmpstr (_g_bytes_compare_verbose (roundtrip, orig), ==, NULL);
+
+	/* a stream that cannot seek is read once, with the digests and CRC
+	 * computed as it goes */
+	stream_unseekable = dfu_self_test_get_unseekable_stream (orig, &error);
+	g_assert_no_error (error);
+	g_assert (stream_unseekable != NULL);
+	g_assert (!G_IS_SEEKABLE (stream_unseekable));
+	sha1 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA1, orig);
+	firmware2 = dfu_firmware_new ();
+	dfu_firmware_add_checksum_type (firmware2, G_CHECKSUM_SHA1);
+	ret = dfu_firmware_parse_stream (firmware2, stream_unseekable,
+					 DFU_FIRMWARE_PARSE_FLAG_NONE,
+					 NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_firmware_get_format (firmware2), ==, DFU_FIRMWARE_FORMAT_DFUSE);
+	g_assert_cmpint (dfu_firmware_get_vid (firmware2), ==, 0x0483);
+	g_assert_cmpstr (dfu_firmware_get_checksum (firmware2, G_CHECKSUM_SHA1), ==, sha1);
+	roundtrip2 = dfu_firmware_write_data (firmware2, &error);
+	g_assert_no_error (error);
+	g_assert (roundtrip2 != NULL);
+	g_assert_cmpstr (_g_bytes_compare_verbose (roundtrip2, orig), ==, NULL);
+
+	/* and a corrupt payload fails the CRC in the same way */
+	data = g_memdup (g_bytes_get_data (orig, &len), len);
+	data[0x200] ^= 0xff;
+	corrupt = g_bytes_new_take (data, len);
+	stream_corrupt = dfu_self_test_get_unseekable_stream (corrupt, &error);
+	g_assert_no_error (error);
+	g_assert (stream_corrupt != NULL);
+	firmware3 = dfu_firmware_new ();
+	ret = dfu_firmware_parse_stream (firmware3, stream_corrupt,
+					 DFU_FIRMWARE_PARSE_FLAG_NONE,
+					 NULL, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_INVALID_FILE);
+	g_assert (!ret);
+}
+
+static void
+dfu_firmware_lazy_func (void)
+{
+	DfuElement *element;
+	DfuImage *image;
+	gboolean ret;
+	guint8 *data;
+	gsize len;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *filename_tmp = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	g_autoptr(DfuFirmware) firmware = NULL;
+	g_autoptr(DfuFirmware) firmware2 = NULL;
+	g_autoptr(GBytes) chunk = NULL;
+	g_autoptr(GBytes) corrupt = NULL;
+	g_autoptr(GBytes) orig = NULL;
+	g_autoptr(GBytes) roundtrip = NULL;
+	g_autoptr(GBytes) roundtrip_corrupt = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GFile) file = NULL;
+	g_autoptr(GFile) file_tmp = NULL;
+
+	filename = dfu_test_get_filename ("dev_VRBRAIN.dfu");
+	g_assert (filename != NULL);
+	file = g_file_new_for_path (filename);
+	orig = dfu_self_test_get_bytes_for_file (file, &error);
+	g_assert_no_error (error);
+	g_assert (orig != NULL);
+
+	/* only the headers are parsed */
+	firmware = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware, orig,
+				       DFU_FIRMWARE_PARSE_FLAG_LAZY, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_firmware_get_vid (firmware), ==, 0x0483);
+	g_assert_cmpint (dfu_firmware_get_format (firmware), ==, DFU_FIRMWARE_FORMAT_DFUSE);
+	g_assert_cmpint (dfu_firmware_get_size (firmware), ==, 0x168d5);
+
+	/* nothing is read until asked for */
+	image = dfu_firmware_get_image_default (firmware);
+	g_assert (image != NULL);
+	element = dfu_image_get_element (image, 0);
+	g_assert (element != NULL);
+	g_assert (dfu_element_get_contents (element) == NULL);
+	ret = dfu_element_load_contents (element, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert (dfu_element_get_contents (element) != NULL);
+
+	/* loading the contents checks the CRC */
+	roundtrip = dfu_firmware_write_data (firmware, &error);
+	g_assert_no_error (error);
+	g_assert (roundtrip != NULL);
+	g_assert_cmpstr (_g_bytes_compare_verbose (roundtrip, orig), ==, NULL);
+
+	/* corrupt the payload, which is not noticed until it is read */
+	data = g_memdup (g_bytes_get_data (orig, &len), len);
+	data[0x200] ^= 0xff;
+	corrupt = g_bytes_new_take (data, len);
+	firmware2 = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware2, corrupt,
+				       DFU_FIRMWARE_PARSE_FLAG_LAZY, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	image = dfu_firmware_get_image_default (firmware2);
+	g_assert (image != NULL);
+	element = dfu_image_get_element (image, 0);
+	g_assert (element != NULL);
+	g_assert (dfu_element_get_contents (element) == NULL);
+	chunk = dfu_element_get_chunk (element, 0, 0x100, NULL, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_INVALID_FILE);
+	g_assert (chunk == NULL);
+	g_clear_error (&error);
+	ret = dfu_element_load_contents (element, NULL, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_INVALID_FILE);
+	g_assert (!ret);
+	g_assert (dfu_element_get_contents (element) == NULL);
+	g_clear_error (&error);
+
+	/* writing the corrupt file back out fails in the same way */
+	roundtrip_corrupt = dfu_firmware_write_data (firmware2, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_INVALID_FILE);
+	g_assert (roundtrip_corrupt == NULL);
+	g_clear_error (&error);
+
+	/* as does converting it to another format */
+	dfu_firmware_set_format (firmware2, DFU_FIRMWARE_FORMAT_RAW);
+	tmpdir = g_dir_make_tmp ("dfu-self-test-XXXXXX", &error);
+	g_assert_no_error (error);
+	g_assert (tmpdir != NULL);
+	filename_tmp = g_build_filename (tmpdir, "corrupt.bin", NULL);
+	file_tmp = g_file_new_for_path (filename_tmp);
+	ret = dfu_firmware_write_file (firmware2, file_tmp, NULL, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_INVALID_FILE);
+	g_assert (!ret);
+	g_unlink (filename_tmp);
+	g_rmdir (tmpdir);
+}
+
+static void
+dfu_firmware_checksum_func (void)
+{
+	gboolean ret;
+	guint32 crc;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *sha1 = NULL;
+	g_autofree gchar *sha256 = NULL;
+	g_autoptr(DfuFirmware) firmware = NULL;
+	g_autoptr(GBytes) orig = NULL;
+	g_autoptr(GBytes) roundtrip = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GFile) file = NULL;
+
+	filename = dfu_test_get_filename ("dev_VRBRAIN.dfu");
+	g_assert (filename != NULL);
+	file = g_file_new_for_path (filename);
+	orig = dfu_self_test_get_bytes_for_file (file, &error);
+	g_assert_no_error (error);
+	g_assert (orig != NULL);
+	sha1 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA1, orig);
+	sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, orig);
+
+	/* not asked for */
+	firmware = dfu_firmware_new ();
+	g_assert (dfu_firmware_get_checksum (firmware, G_CHECKSUM_SHA1) == NULL);
+
+	/* computed in the same pass as the CRC */
+	dfu_firmware_add_checksum_type (firmware, G_CHECKSUM_SHA1);
+	dfu_firmware_add_checksum_type (firmware, G_CHECKSUM_SHA256);
+	g_assert (dfu_firmware_get_checksum (firmware, G_CHECKSUM_SHA1) == NULL);
+	ret = dfu_firmware_parse_data (firmware, orig,
+				       DFU_FIRMWARE_PARSE_FLAG_NONE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpstr (dfu_firmware_get_checksum (firmware, G_CHECKSUM_SHA1), ==, sha1);
+	g_assert_cmpstr (dfu_firmware_get_checksum (firmware, G_CHECKSUM_SHA256), ==, sha256);
+	g_assert (dfu_firmware_get_checksum (firmware, G_CHECKSUM_MD5) == NULL);
+	crc = dfu_firmware_get_crc (firmware);
+
+	/* and again when writing */
+	roundtrip = dfu_firmware_write_data (firmware, &error);
+	g_assert_no_error (error);
+	g_assert (roundtrip != NULL);
+	g_assert_cmpstr (dfu_firmware_get_checksum (firmware, G_CHECKSUM_SHA1), ==, sha1);
+	g_assert_cmpstr (dfu_firmware_get_checksum (firmware, G_CHECKSUM_SHA256), ==, sha256);
+	g_assert_cmpint (dfu_firmware_get_crc (firmware), ==, crc);
+}
+
+static void
+dfu_cipher_xtea_func (void)
+{
+	gboolean ret;
+	gsize i;
+	guint8 buf[19];
+	const gchar *key = "00c0ffeedeadbeef89abcdef01234567";
+	const guint8 buf_enc[] = { 0x26, 0xf3, 0x89, 0x4d, 0x34, 0xf7, 0xa0, 0x36,
+				   0xce, 0x9e, 0xcc, 0xaf, 0x27, 0xb1, 0xcb, 0x73,
+				   0x10, 0x11, 0x12 };
+	guint impl;
+	guint8 buf_kat[91];
+	const guint8 buf_kat_enc[] = {
+		0x26, 0xf3, 0x89, 0x4d, 0x34, 0xf7, 0xa0, 0x36,
+		0xce, 0x9e, 0xcc, 0xaf, 0x27, 0xb1, 0xcb, 0x73,
+		0xb5, 0x61, 0x58, 0x0a, 0x1d, 0x23, 0xa8, 0x53,
+		0x6b, 0x8b, 0xa5, 0xa7, 0x5f, 0x2e, 0x3a, 0xbd,
+		0x21, 0xd8, 0x1b, 0x1c, 0x60, 0x55, 0xbd, 0x44,
+		0xe8, 0x4e, 0x7c, 0xb6, 0x44, 0xf8, 0xd6, 0x97,
+		0x70, 0xa2, 0xad, 0x42, 0x81, 0xa8, 0x18, 0xef,
+		0xd5, 0x33, 0x79, 0x6d, 0x45, 0x0a, 0x87, 0x4b,
+		0x37, 0x0b, 0xe6, 0x94, 0x20, 0x98, 0x66, 0xb7,
+		0xc2, 0x73, 0x57, 0x99, 0x05, 0xfc, 0xa4, 0x9f,
+		0x4a, 0xf8, 0x5f, 0x63, 0x50, 0xf1, 0x84, 0x9d,
+		0x58, 0x59, 0x5a };
+	g_autofree guint8 *large = NULL;
+	g_autofree guint8 *large_orig = NULL;
+	g_autofree guint8 *large_ref = NULL;
+	g_autoptr(GError) error = NULL;
+
+	/* eleven known blocks through every implementation, which covers
+	 * two whole groups of lanes and some single blocks */
+	for (impl = DFU_CIPHER_XTEA_IMPL_AUTO; impl < DFU_CIPHER_XTEA_IMPL_LAST; impl++) {
+		for (i = 0; i < sizeof(buf_kat); i++)
+			buf_kat[i] = i;
+		ret = dfu_cipher_xtea_with_impl (impl, key, buf_kat,
+						 sizeof(buf_kat), TRUE, &error);
+		if (g_error_matches (error, DFU_ERROR, DFU_ERROR_NOT_SUPPORTED)) {
+			g_debug ("XTEA implementation %u not built", impl);
+			g_clear_error (&error);
+			continue;
+		}
+		g_assert_no_error (error);
+		g_assert (ret);
+		g_assert (memcmp (buf_kat, buf_kat_enc, sizeof(buf_kat)) == 0);
+		ret = dfu_cipher_xtea_with_impl (impl, key, buf_kat,
+						 sizeof(buf_kat), FALSE, &error);
+		g_assert_no_error (error);
+		g_assert (ret);
+		for (i = 0; i < sizeof(buf_kat); i++)
+			g_assert_cmpint (buf_kat[i], ==, i);
+	}
+
+	/* known blocks, with the partial block left alone */
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i;
+	ret = dfu_cipher_encrypt (DFU_CIPHER_KIND_XTEA, key,
+				  buf, sizeof(buf), &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert (memcmp (buf, buf_enc, sizeof(buf)) == 0);
+	ret = dfu_cipher_decrypt (DFU_CIPHER_KIND_XTEA, key,
+				  buf, sizeof(buf), &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	for (i = 0; i < sizeof(buf); i++)
+		g_assert_cmpint (buf[i], ==, i);
+
+	/* more than 64k, and not a whole number of lanes */
+	large = g_malloc (0x10000 * 3 + 0x1d);
+	for (i = 0; i < 0x10000 * 3 + 0x1d; i++)
+		large[i] = i * 13;
+	large_orig = g_memdup (large, 0x10000 * 3 + 0x1d);
+	ret = dfu_cipher_encrypt (DFU_CIPHER_KIND_XTEA, "deadbeef",
+				  large, 0x10000 * 3 + 0x1d, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert (memcmp (large, large_orig, 0x10000 * 3 + 0x1d) != 0);
+	g_assert (memcmp (large + 0x30018, large_orig + 0x30018, 5) == 0);
+	large_ref = g_memdup (large_orig, 0x10000 * 3 + 0x1d);
+	ret = dfu_cipher_xtea_with_impl (DFU_CIPHER_XTEA_IMPL_BLOCKWISE, "deadbeef",
+					 large_ref, 0x10000 * 3 + 0x1d, TRUE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert (memcmp (large, large_ref, 0x10000 * 3 + 0x1d) == 0);
+	ret = dfu_cipher_decrypt (DFU_CIPHER_KIND_XTEA, "deadbeef",
+				  large, 0x10000 * 3 + 0x1d, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert (memcmp (large, large_orig, 0x10000 * 3 + 0x1d) == 0);
+
+	/* key too long */
+	ret = dfu_cipher_decrypt (DFU_CIPHER_KIND_XTEA,
+				  "0123456789abcdef0123456789abcdef0",
+				  buf, sizeof(buf), &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_NOT_SUPPORTED);
+	g_assert (!ret);
 }
 
 static void
@@ -327,6 +863,7 @@ dfu_firmware_metadata_func (void)
 static void
 dfu_firmware_intel_hex_func (void)
 {
+	const gchar *bad_hex = ":044000003DEG20F080\n:00000001FF\n";
 	const guint8 *data;
 	gboolean ret;
 	gsize len;
@@ -334,9 +871,13 @@ dfu_firmware_intel_hex_func (void)
 	g_autofree gchar *filename_ref = NULL;
 	g_autofree gchar *str = NULL;
 	g_autoptr(DfuFirmware) firmware = NULL;
+	g_autoptr(DfuFirmware) firmware_bad = NULL;
+	g_autoptr(DfuFirmware) firmware_hex = NULL;
+	g_autoptr(GBytes) data_bad = NULL;
 	g_autoptr(GBytes) data_bin2 = NULL;
 	g_autoptr(GBytes) data_bin = NULL;
 	g_autoptr(GBytes) data_hex = NULL;
+	g_autoptr(GBytes) data_hex2 = NULL;
 	g_autoptr(GBytes) data_ref = NULL;
 	g_autoptr(GError) error = NULL;
 	g_autoptr(GFile) file_bin = NULL;
@@ -376,23 +917,233 @@ dfu_firmware_intel_hex_func (void)
 	data = g_bytes_get_data (data_hex, &len);
 	str = g_strndup ((const gchar *) data, len);
 	g_assert_cmpstr (str, ==,
-			 ":104000003DEF20F000000000FACF01F0FBCF02F0AF\n"
-			 ":10401000E9CF03F0EACF04F0E1CF05F0E2CF06F005\n"
-			 ":10402000D9CF07F0DACF08F0F3CF09F0F4CF0AF021\n"
-			 ":10403000F6CF0BF0F7CF0CF0F8CF0DF0F5CF0EF044\n"
-			 ":104040000EC0F5FF0DC0F8FF0CC0F7FF0BC0F6FF45\n"
-			 ":104050000AC0F4FF09C0F3FF08C0DAFF07C0D9FF24\n"
-			 ":1040600006C0E2FF05C0E1FF04C0EAFF03C0E9FF0A\n"
-			 ":1040700002C0FBFF01C0FAFF11003FEF20F00001BB\n"
-			 ":0840800042EF20F03DEF20F037\n"
+			 ":104000003DEF20F000000000FACF01F0FBCF02F0FE\n"
+			 ":10401000E9CF03F0EACF04F0E1CF05F0E2CF06F0FC\n"
+			 ":10402000D9CF07F0DACF08F0F3CF09F0F4CF0AF0D8\n"
+			 ":10403000F6CF0BF0F7CF0CF0F8CF0DF0F5CF0EF078\n"
+			 ":104040000EC0F5FF0DC0F8FF0CC0F7FF0BC0F6FF68\n"
+			 ":104050000AC0F4FF09C0F3FF08C0DAFF07C0D9FFA8\n"
+			 ":1040600006C0E2FF05C0E1FF04C0EAFF03C0E9FFAC\n"
+			 ":1040700002C0FBFF01C0FAFF11003FEF20F000017A\n"
+			 ":0840800042EF20F03DEF20F0BB\n"
 			 ":00000001FF\n");
 
+	/* the checksums are valid, so the output can be parsed again */
+	firmware_hex = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware_hex, data_hex,
+				       DFU_FIRMWARE_PARSE_FLAG_NONE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_firmware_get_size (firmware_hex), ==, 136);
+
+	/* one record holds the whole image at the maximum record size */
+	dfu_firmware_set_ihex_record_size (firmware, 255);
+	data_hex2 = dfu_firmware_write_data (firmware, &error);
+	g_assert_no_error (error);
+	g_assert (data_hex2 != NULL);
+	data = g_bytes_get_data (data_hex2, &len);
+	g_assert_cmpint (len, ==, 1 + 8 + 136 * 2 + 2 + 1 + strlen (":00000001FF\n"));
+	g_assert (strncmp ((const gchar *) data, ":88400000", 9) == 0);
+	dfu_firmware_set_ihex_record_size (firmware, 16);
+
 	/* do we match the binary file again */
 	dfu_firmware_set_format (firmware, DFU_FIRMWARE_FORMAT_RAW);
 	data_bin2 = dfu_firmware_write_data (firmware, &error);
 	g_assert_no_error (error);
 	g_assert (data_bin2 != NULL);
 	g_assert_cmpstr (_g_bytes_compare_verbose (data_bin, data_bin2), ==, NULL);
+
+	/* invalid hex digits are an error, not silently truncated */
+	data_bad = g_bytes_new_static (bad_hex, strlen (bad_hex));
+	firmware_bad = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware_bad, data_bad,
+				       DFU_FIRMWARE_PARSE_FLAG_NO_CRC_TEST,
+				       &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_INVALID_FILE);
+	g_assert (!ret);
+}
+
+static void
+dfu_firmware_intel_hex_sparse_func (void)
+{
+	DfuElement *element;
+	DfuImage *image;
+	GBytes *contents;
+	const gchar *hex =
+		":020000040800F2\n"
+		":0400000001020304F2\n"
+		":020006000506ED\n"
+		":020000021000EC\n"
+		":020010000708DF\n"
+		":0400000508000000EF\n"
+		":00000001FF\n";
+	const gchar *hex_backwards =
+		":02000800AABB91\n"
+		":0400000001020304F2\n"
+		":00000001FF\n";
+	const gchar *hex_overlap =
+		":0400000001020304F2\n"
+		":02000200AABB97\n"
+		":00000001FF\n";
+	const guint8 data0[] = { 0x01, 0x02, 0x03, 0x04, 0x00, 0x00, 0x05, 0x06 };
+	const guint8 data1[] = { 0x07, 0x08 };
+	gboolean ret;
+	g_autofree gchar *str = NULL;
+	g_autoptr(DfuFirmware) firmware = NULL;
+	g_autoptr(DfuFirmware) firmware_backwards = NULL;
+	g_autoptr(DfuFirmware) firmware_out = NULL;
+	g_autoptr(DfuFirmware) firmware_overlap = NULL;
+	g_autoptr(GBytes) data_backwards = NULL;
+	g_autoptr(GBytes) data_hex = NULL;
+	g_autoptr(GBytes) data_out = NULL;
+	g_autoptr(GBytes) data_overlap = NULL;
+	g_autoptr(GError) error = NULL;
+
+	/* small holes are padded, far segments become new elements */
+	data_hex = g_bytes_new_static (hex, strlen (hex));
+	firmware = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware, data_hex,
+				       DFU_FIRMWARE_PARSE_FLAG_NONE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	image = dfu_firmware_get_image_default (firmware);
+	g_assert (image != NULL);
+	g_assert_cmpint (dfu_image_get_elements (image)->len, ==, 2);
+
+	element = dfu_image_get_element (image, 0);
+	g_assert_cmpint (dfu_element_get_address (element), ==, 0x08000000);
+	contents = dfu_element_get_contents (element);
+	g_assert_cmpint (g_bytes_get_size (contents), ==, sizeof (data0));
+	g_assert (memcmp (g_bytes_get_data (contents, NULL), data0, sizeof (data0)) == 0);
+
+	element = dfu_image_get_element (image, 1);
+	g_assert_cmpint (dfu_element_get_address (element), ==, 0x00010010);
+	contents = dfu_element_get_contents (element);
+	g_assert_cmpint (g_bytes_get_size (contents), ==, sizeof (data1));
+	g_assert (memcmp (g_bytes_get_data (contents, NULL), data1, sizeof (data1)) == 0);
+
+	/* the upper address bits are written back out */
+	data_out = dfu_firmware_write_data (firmware, &error);
+	g_assert_no_error (error);
+	g_assert (data_out != NULL);
+	str = g_strndup (g_bytes_get_data (data_out, NULL), g_bytes_get_size (data_out));
+	g_assert_cmpstr (str, ==,
+			 ":020000040800F2\n"
+			 ":080000000102030400000506E3\n"
+			 ":020000040001F9\n"
+			 ":020010000708DF\n"
+			 ":00000001FF\n");
+
+	/* and the extended address records are accepted by the parser */
+	firmware_out = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware_out, data_out,
+				       DFU_FIRMWARE_PARSE_FLAG_NONE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	image = dfu_firmware_get_image_default (firmware_out);
+	g_assert (image != NULL);
+	g_assert_cmpint (dfu_image_get_elements (image)->len, ==, 2);
+
+	/* records can go backwards as long as they do not overlap */
+	data_backwards = g_bytes_new_static (hex_backwards, strlen (hex_backwards));
+	firmware_backwards = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware_backwards, data_backwards,
+				       DFU_FIRMWARE_PARSE_FLAG_NONE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	image = dfu_firmware_get_image_default (firmware_backwards);
+	g_assert (image != NULL);
+	g_assert_cmpint (dfu_image_get_elements (image)->len, ==, 2);
+	element = dfu_image_get_element (image, 1);
+	g_assert_cmpint (dfu_element_get_address (element), ==, 0x0);
+	g_assert_cmpint (g_bytes_get_size (dfu_element_get_contents (element)), ==, 4);
+
+	/* writing the same address twice is ambiguous */
+	data_overlap = g_bytes_new_static (hex_overlap, strlen (hex_overlap));
+	firmware_overlap = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware_overlap, data_overlap,
+				       DFU_FIRMWARE_PARSE_FLAG_NONE, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_INVALID_FILE);
+	g_assert (!ret);
+}
+
+static void
+dfu_firmware_intel_hex_sparse_raw_func (void)
+{
+	DfuElement *element;
+	DfuImage *image;
+	GBytes *contents;
+	const guint8 *data;
+	const gchar *hex =
+		":020000040800F2\n"
+		":0400000001020304F2\n"
+		":02080000AABB91\n"
+		":00000001FF\n";
+	const gchar *hex_far =
+		":020000040800F2\n"
+		":0400000001020304F2\n"
+		":020000040001F9\n"
+		":020010000708DF\n"
+		":00000001FF\n";
+	gboolean ret;
+	guint i;
+	g_autoptr(DfuFirmware) firmware = NULL;
+	g_autoptr(DfuFirmware) firmware_far = NULL;
+	g_autoptr(DfuFirmware) firmware_raw = NULL;
+	g_autoptr(GBytes) data_far = NULL;
+	g_autoptr(GBytes) data_hex = NULL;
+	g_autoptr(GBytes) data_raw = NULL;
+	g_autoptr(GError) error = NULL;
+
+	/* the hole is too big to pad, so there are two elements */
+	data_hex = g_bytes_new_static (hex, strlen (hex));
+	firmware = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware, data_hex,
+				       DFU_FIRMWARE_PARSE_FLAG_NONE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	image = dfu_firmware_get_image_default (firmware);
+	g_assert (image != NULL);
+	g_assert_cmpint (dfu_image_get_elements (image)->len, ==, 2);
+
+	/* raw has no addresses, so the hole has to be padded */
+	dfu_firmware_set_format (firmware, DFU_FIRMWARE_FORMAT_RAW);
+	data_raw = dfu_firmware_write_data (firmware, &error);
+	g_assert_no_error (error);
+	g_assert (data_raw != NULL);
+	g_assert_cmpint (g_bytes_get_size (data_raw), ==, 0x802);
+
+	/* and every element survives the round trip */
+	firmware_raw = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware_raw, data_raw,
+				       DFU_FIRMWARE_PARSE_FLAG_NONE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_firmware_get_format (firmware_raw), ==, DFU_FIRMWARE_FORMAT_RAW);
+	image = dfu_firmware_get_image_default (firmware_raw);
+	g_assert (image != NULL);
+	g_assert_cmpint (dfu_image_get_elements (image)->len, ==, 1);
+	element = dfu_image_get_element (image, 0);
+	contents = dfu_element_get_contents (element);
+	g_assert_cmpint (g_bytes_get_size (contents), ==, 0x802);
+	data = g_bytes_get_data (contents, NULL);
+	for (i = 0; i < 4; i++)
+		g_assert_cmpint (data[i], ==, i + 1);
+	for (i = 4; i < 0x800; i++)
+		g_assert_cmpint (data[i], ==, 0x00);
+	g_assert_cmpint (data[0x800], ==, 0xaa);
+	g_assert_cmpint (data[0x801], ==, 0xbb);
+
+	/* refuse to pad elements that are megabytes apart */
+	data_far = g_bytes_new_static (hex_far, strlen (hex_far));
+	firmware_far = dfu_firmware_new ();
+	ret = dfu_firmware_parse_data (firmware_far, data_far,
+				       DFU_FIRMWARE_PARSE_FLAG_NONE, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	dfu_firmware_set_format (firmware_far, DFU_FIRMWARE_FORMAT_DFU_1_0);
+	g_assert (dfu_firmware_write_data (firmware_far, &error) == NULL);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_NOT_SUPPORTED);
 }
 
 static void
@@ -674,6 +1425,1231 @@ dfu_target_dfuse_func (void)
 	g_assert_cmpint (dfu_target_get_cipher_kind (target), ==, DFU_CIPHER_KIND_XTEA);
 }
 
+static void
+dfu_target_sectors_func (void)
+{
+	DfuSector *sector;
+	gboolean ret;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GPtrArray) sectors = NULL;
+
+	/* contiguous pages */
+	target = g_object_new (DFU_TYPE_TARGET, NULL);
+	ret = dfu_target_parse_sectors (target, "@Flash /0x08000000/4*002Kg", &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert (dfu_target_get_sector_for_addr (target, 0x07ffffff) == NULL);
+	sector = dfu_target_get_sector_for_addr (target, 0x08000000);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x08000000);
+	sector = dfu_target_get_sector_for_addr (target, 0x080007ff);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x08000000);
+	sector = dfu_target_get_sector_for_addr (target, 0x08000800);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x08000800);
+	sector = dfu_target_get_sector_for_addr (target, 0x08001fff);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x08001800);
+	g_assert (dfu_target_get_sector_for_addr (target, 0x08002000) == NULL);
+
+	/* going backwards */
+	sector = dfu_target_get_sector_for_addr (target, 0x08001000);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x08001000);
+	sector = dfu_target_get_sector_for_addr (target, 0x08000000);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x08000000);
+
+	/* ranges */
+	sectors = dfu_target_get_sectors_for_range (target, 0x080007ff, 2);
+	g_assert_cmpint (sectors->len, ==, 2);
+	sector = g_ptr_array_index (sectors, 1);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x08000800);
+	g_ptr_array_unref (sectors);
+	sectors = dfu_target_get_sectors_for_range (target, 0x08000000, 0x2000);
+	g_assert_cmpint (sectors->len, ==, 4);
+	g_ptr_array_unref (sectors);
+	sectors = dfu_target_get_sectors_for_range (target, 0x07fff000, 0x1001);
+	g_assert_cmpint (sectors->len, ==, 1);
+	g_ptr_array_unref (sectors);
+	sectors = dfu_target_get_sectors_for_range (target, 0x08002000, 0x10);
+	g_assert_cmpint (sectors->len, ==, 0);
+	g_ptr_array_unref (sectors);
+
+	/* the same number of sectors somewhere else */
+	sector = dfu_target_get_sector_for_addr (target, 0x08000800);
+	g_assert (sector != NULL);
+	ret = dfu_target_parse_sectors (target, "@Flash /0x20000000/4*002Kg", &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert (dfu_target_get_sector_for_addr (target, 0x08000800) == NULL);
+	sector = dfu_target_get_sector_for_addr (target, 0x20000800);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x20000800);
+
+	/* overlapping, where the first declared sector wins */
+	ret = dfu_target_parse_sectors (target, "@Flash2 /0xF000/4*100Ba/0xE000/3*8Kg/0x80000/2*24Kg", &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	sector = dfu_target_get_sector_for_addr (target, 0xf000);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0xf000);
+	sector = dfu_target_get_sector_for_addr (target, 0xf190);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0xe000);
+	sector = dfu_target_get_sector_for_addr (target, 0x8bfff);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x86000);
+	g_assert (dfu_target_get_sector_for_addr (target, 0x8c000) == NULL);
+	sectors = dfu_target_get_sectors_for_range (target, 0xf000, 0x100);
+	g_assert_cmpint (sectors->len, ==, 4);
+	sector = g_ptr_array_index (sectors, 0);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0xe000);
+
+	/* sequential lookups across the split sector */
+	sector = dfu_target_get_sector_for_addr (target, 0xefff);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0xe000);
+	sector = dfu_target_get_sector_for_addr (target, 0xf12c);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0xf12c);
+	sector = dfu_target_get_sector_for_addr (target, 0xf18f);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0xf12c);
+	sector = dfu_target_get_sector_for_addr (target, 0xf190);
+	g_assert (sector != NULL);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0xe000);
+}
+
+static void
+dfu_target_blank_func (void)
+{
+	guint8 buf[67];
+	guint i;
+
+	/* check every alignment and every position of a programmed byte */
+	memset (buf, 0xff, sizeof (buf));
+	for (i = 0; i < 8; i++) {
+		g_autoptr(GBytes) blank = NULL;
+		blank = g_bytes_new_static (buf + i, sizeof (buf) - i);
+		g_assert (dfu_target_chunk_is_blank (blank));
+	}
+	for (i = 0; i < sizeof (buf); i++) {
+		g_autoptr(GBytes) bytes = NULL;
+		buf[i] = 0xfe;
+		bytes = g_bytes_new (buf, sizeof (buf));
+		g_assert (!dfu_target_chunk_is_blank (bytes));
+		buf[i] = 0xff;
+	}
+}
+
+static void
+dfu_target_erase_plan_func (void)
+{
+	DfuSector *sector;
+	gboolean ret;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GPtrArray) sectors = NULL;
+	const struct {
+		guint32 address;
+		gsize size;
+	} elements[] = {
+		{ 0x08000f00, 0x200 },	/* across a boundary */
+		{ 0x08000900, 0x100 },	/* same sector as the one above */
+		{ 0x08000100, 0x100 },
+		{ 0, 0 }
+	};
+	guint i;
+
+	target = g_object_new (DFU_TYPE_TARGET, NULL);
+	ret = dfu_target_parse_sectors (target, "@Flash /0x08000000/4*002Kg", &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	image = dfu_image_new ();
+	for (i = 0; elements[i].size != 0; i++) {
+		g_autoptr(DfuElement) element = dfu_element_new ();
+		g_autoptr(GBytes) fw = NULL;
+		g_autofree guint8 *buf = g_malloc0 (elements[i].size);
+		fw = g_bytes_new (buf, elements[i].size);
+		dfu_element_set_address (element, elements[i].address);
+		dfu_element_set_contents (element, fw);
+		dfu_image_add_element (image, element);
+	}
+
+	/* each sector is only erased once, in address order */
+	sectors = dfu_target_get_erase_plan (target, image);
+	g_assert_cmpint (sectors->len, ==, 3);
+	sector = g_ptr_array_index (sectors, 0);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x08000000);
+	sector = g_ptr_array_index (sectors, 1);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x08000800);
+	sector = g_ptr_array_index (sectors, 2);
+	g_assert_cmpint (dfu_sector_get_address (sector), ==, 0x08001000);
+}
+
+static DfuImage *
+dfu_emulator_image_new (guint32 address, gsize size)
+{
+	DfuImage *image = dfu_image_new ();
+	g_autoptr(DfuElement) element = dfu_element_new ();
+	g_autoptr(GBytes) fw = NULL;
+	guint8 *buf = g_malloc (size);
+	gsize i;
+
+	/* a pattern with an erased region in the middle */
+	for (i = 0; i < size; i++)
+		buf[i] = i >= size / 3 && i < 2 * size / 3 ? 0xff : (guint8) (i * 7);
+	fw = g_bytes_new_take (buf, size);
+	dfu_element_set_address (element, address);
+	dfu_element_set_contents (element, fw);
+	dfu_image_add_element (image, element);
+	return image;
+}
+
+/* an open emulated device with one target, where a sector map as the
+ * name makes it a DfuSe device */
+static DfuDevice *
+dfu_self_test_emulated_device_new (const gchar *alt_name,
+				   guint32 size,
+				   guint poll_timeout_ms,
+				   DfuEmulator **emulator,
+				   DfuTarget **target)
+{
+	DfuDevice *device;
+	gboolean ret;
+	g_autoptr(GError) error = NULL;
+
+	*emulator = dfu_emulator_new ();
+	if (alt_name[0] == '@') {
+		dfu_emulator_set_dfuse (*emulator, TRUE);
+		dfu_emulator_set_transfer_size (*emulator, 256);
+	}
+	if (poll_timeout_ms > 0)
+		dfu_emulator_set_poll_timeout (*emulator, poll_timeout_ms);
+	ret = dfu_emulator_add_target (*emulator, alt_name, size, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	device = dfu_device_new_emulated (*emulator);
+	ret = dfu_device_open (device, DFU_DEVICE_OPEN_FLAG_NONE, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	if (target != NULL) {
+		*target = dfu_device_get_target_by_alt_setting (device, 0, &error);
+		g_assert_no_error (error);
+		g_assert (*target != NULL);
+	}
+	return device;
+}
+
+static void
+dfu_emulator_dfu_func (void)
+{
+	DfuElement *element;
+	GBytes *contents;
+	gboolean ret;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuImage) image_upload = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GBytes) memory = NULL;
+	g_autoptr(GError) error = NULL;
+
+	device = dfu_self_test_emulated_device_new ("Flash", 0x1000, 0,
+						    &emulator, &target);
+
+	/* write with a final short chunk */
+	image = dfu_emulator_image_new (0x0, 3000);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	element = dfu_image_get_element_default (image);
+	memory = dfu_emulator_get_memory (emulator, 0, 0x0, 3000);
+	g_assert (g_bytes_compare (memory, dfu_element_get_contents (element)) == 0);
+
+	/* read back everything until the short read */
+	image_upload = dfu_target_upload (target, DFU_TARGET_TRANSFER_FLAG_NONE,
+					  NULL, &error);
+	g_assert_no_error (error);
+	g_assert (image_upload != NULL);
+	element = dfu_image_get_element_default (image_upload);
+	contents = dfu_element_get_contents (element);
+	g_assert_cmpint (g_bytes_get_size (contents), ==, 0x1000);
+	g_bytes_unref (memory);
+	memory = dfu_emulator_get_memory (emulator, 0, 0x0, 0x1000);
+	g_assert (g_bytes_compare (memory, contents) == 0);
+}
+
+static void
+dfu_emulator_upload_func (void)
+{
+	DfuElement *element;
+	GBytes *contents;
+	GPtrArray *elements;
+	gboolean ret;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuImage) image_upload = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GBytes) memory = NULL;
+	g_autoptr(GError) error = NULL;
+
+	/* the upload is sized from the sector map */
+	device = dfu_self_test_emulated_device_new ("@Flash /0x08000000/8*001Kg",
+						    0, 1, &emulator, &target);
+	image = dfu_emulator_image_new (0x08000000, 0x2000);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_NONE,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	image_upload = dfu_target_upload (target, DFU_TARGET_TRANSFER_FLAG_NONE,
+					  NULL, &error);
+	g_assert_no_error (error);
+	g_assert (image_upload != NULL);
+	elements = dfu_image_get_elements (image_upload);
+	g_assert_cmpint (elements->len, ==, 1);
+	element = g_ptr_array_index (elements, 0);
+	g_assert_cmpint (dfu_element_get_address (element), ==, 0x08000000);
+	contents = dfu_element_get_contents (element);
+	g_assert_cmpint (g_bytes_get_size (contents), ==, 0x2000);
+	memory = dfu_emulator_get_memory (emulator, 0, 0x08000000, 0x2000);
+	g_assert (g_bytes_compare (memory, contents) == 0);
+	element = dfu_image_get_element_default (image);
+	g_assert (g_bytes_compare (contents, dfu_element_get_contents (element)) == 0);
+}
+
+static void
+dfu_emulator_transfer_size_func (void)
+{
+	DfuElement *element;
+	gboolean ret;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GBytes) memory = NULL;
+	g_autoptr(GError) error = NULL;
+
+	emulator = dfu_emulator_new ();
+	ret = dfu_emulator_add_target (emulator, "Flash", 0x1000, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	device = dfu_device_new_emulated (emulator);
+
+	/* set before opening, like dfu-tool does */
+	dfu_device_set_transfer_size (device, 64);
+	ret = dfu_device_open (device, DFU_DEVICE_OPEN_FLAG_NONE, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_device_get_transfer_size (device), ==, 64);
+	target = dfu_device_get_target_by_alt_setting (device, 0, &error);
+	g_assert_no_error (error);
+	g_assert (target != NULL);
+
+	image = dfu_emulator_image_new (0x0, 1000);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_emulator_get_chunk_size_max (emulator), ==, 64);
+	element = dfu_image_get_element_default (image);
+	memory = dfu_emulator_get_memory (emulator, 0, 0x0, 1000);
+	g_assert (g_bytes_compare (memory, dfu_element_get_contents (element)) == 0);
+}
+
+static void
+dfu_emulator_dfuse_func (void)
+{
+	DfuElement *element;
+	gboolean ret;
+	guint dnload_cnt;
+	guint dnload_cnt_blank;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GBytes) memory = NULL;
+	g_autoptr(GError) error = NULL;
+
+	device = dfu_self_test_emulated_device_new ("@Flash /0x08000000/8*001Kg", 0, 1,
+						    &emulator, &target);
+
+	/* the sectors have to be erased before they can be written */
+	image = dfu_emulator_image_new (0x08000000, 0x1800);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	element = dfu_image_get_element_default (image);
+	memory = dfu_emulator_get_memory (emulator, 0, 0x08000000, 0x1800);
+	g_assert (g_bytes_compare (memory, dfu_element_get_contents (element)) == 0);
+	dnload_cnt = dfu_emulator_get_request_count (emulator, DFU_REQUEST_DNLOAD);
+
+	/* the erased region does not need writing */
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				   DFU_TARGET_TRANSFER_FLAG_SKIP_BLANK,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_target_get_bytes_skipped (target), ==, 0x800);
+	dnload_cnt_blank = dfu_emulator_get_request_count (emulator, DFU_REQUEST_DNLOAD) - dnload_cnt;
+	g_assert_cmpint (dnload_cnt_blank, <, dnload_cnt);
+
+	/* nothing has changed */
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_DIFFERENTIAL,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_target_get_bytes_skipped (target), ==, 0x1800);
+}
+
+static void
+dfu_emulator_skip_blank_func (void)
+{
+	DfuElement *element;
+	gboolean ret;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuFirmware) firmware = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GBytes) memory = NULL;
+	g_autoptr(GError) error = NULL;
+
+	device = dfu_self_test_emulated_device_new ("@Flash /0x08000000/8*001Kg", 0, 1,
+						    &emulator, NULL);
+
+	/* the flag has to get from the device to the target */
+	image = dfu_emulator_image_new (0x08000000, 0x1800);
+	firmware = dfu_firmware_new ();
+	dfu_firmware_add_image (firmware, image);
+	ret = dfu_device_download (device, firmware,
+				   DFU_TARGET_TRANSFER_FLAG_WILDCARD_VID |
+				   DFU_TARGET_TRANSFER_FLAG_WILDCARD_PID |
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				   DFU_TARGET_TRANSFER_FLAG_SKIP_BLANK,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	/* the blank chunks in the middle were never sent */
+	target = dfu_device_get_target_by_alt_setting (device, 0, &error);
+	g_assert_no_error (error);
+	g_assert (target != NULL);
+	g_assert_cmpint (dfu_target_get_bytes_skipped (target), ==, 0x800);
+	g_assert_cmpint (dfu_emulator_get_bytes_written (emulator), ==, 0x1000);
+	element = dfu_image_get_element_default (image);
+	memory = dfu_emulator_get_memory (emulator, 0, 0x08000000, 0x1800);
+	g_assert (g_bytes_compare (memory, dfu_element_get_contents (element)) == 0);
+}
+
+static void
+dfu_emulator_differential_func (void)
+{
+	DfuElement *element;
+	gboolean ret;
+	gsize bytes_written;
+	guint erase_count;
+	guint8 *data;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuFirmware) firmware = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GBytes) fw = NULL;
+	g_autoptr(GBytes) memory = NULL;
+	g_autoptr(GError) error = NULL;
+
+	device = dfu_self_test_emulated_device_new ("@Flash /0x08000000/8*001Kg", 0, 1,
+						    &emulator, NULL);
+	image = dfu_emulator_image_new (0x08000000, 0x1800);
+	firmware = dfu_firmware_new ();
+	dfu_firmware_add_image (firmware, image);
+	ret = dfu_device_download (device, firmware,
+				   DFU_TARGET_TRANSFER_FLAG_WILDCARD_VID |
+				   DFU_TARGET_TRANSFER_FLAG_WILDCARD_PID,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	erase_count = dfu_emulator_get_erase_count (emulator);
+	bytes_written = dfu_emulator_get_bytes_written (emulator);
+
+	/* change one byte in the second sector */
+	element = dfu_image_get_element_default (image);
+	data = g_memdup (g_bytes_get_data (dfu_element_get_contents (element), NULL), 0x1800);
+	data[0x500] ^= 0xff;
+	fw = g_bytes_new_take (data, 0x1800);
+	dfu_element_set_contents (element, fw);
+	ret = dfu_device_download (device, firmware,
+				   DFU_TARGET_TRANSFER_FLAG_WILDCARD_VID |
+				   DFU_TARGET_TRANSFER_FLAG_WILDCARD_PID |
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				   DFU_TARGET_TRANSFER_FLAG_DIFFERENTIAL,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	/* the other sectors were neither erased nor written */
+	g_assert_cmpint (dfu_emulator_get_erase_count (emulator) - erase_count, ==, 1);
+	g_assert_cmpint (dfu_emulator_get_bytes_written (emulator) - bytes_written, ==, 0x400);
+	target = dfu_device_get_target_by_alt_setting (device, 0, &error);
+	g_assert_no_error (error);
+	g_assert (target != NULL);
+	g_assert_cmpint (dfu_target_get_bytes_skipped (target), ==, 0x1400);
+	memory = dfu_emulator_get_memory (emulator, 0, 0x08000000, 0x1800);
+	g_assert (g_bytes_compare (memory, fw) == 0);
+}
+
+static void
+dfu_emulator_set_address_func (void)
+{
+	DfuElement *element;
+	gboolean ret;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuElement) element_upload = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GError) error = NULL;
+
+	/* the device stays busy for a while after every request */
+	device = dfu_self_test_emulated_device_new ("@Flash /0x08000000/8*001Kg", 0, 5,
+						    &emulator, &target);
+	image = dfu_emulator_image_new (0x08000400, 0x400);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_NONE,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	/* the upload would be stalled if SetAddress did not wait */
+	element_upload = dfu_target_upload_element (target, 0x08000400, 0x400,
+						    NULL, &error);
+	g_assert_no_error (error);
+	g_assert (element_upload != NULL);
+	element = dfu_image_get_element_default (image);
+	g_assert (g_bytes_compare (dfu_element_get_contents (element_upload),
+				   dfu_element_get_contents (element)) == 0);
+}
+
+static void
+dfu_emulator_upload_state_func (void)
+{
+	gboolean ret;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuElement) element_upload = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GError) error = NULL;
+
+	/* two groups of sectors, so the address is set again half way
+	 * through reading back */
+	device = dfu_self_test_emulated_device_new ("@Flash /0x08000000/4*001Kg,4*001Kg", 0, 1,
+						    &emulator, &target);
+	image = dfu_emulator_image_new (0x08000000, 0x2000);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				   DFU_TARGET_TRANSFER_FLAG_DIFFERENTIAL,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	/* stopping at the requested size leaves the device in
+	 * dfuUPLOAD-IDLE, where the next DNLOAD is stalled */
+	element_upload = dfu_target_upload_element (target, 0x08000000, 0x400,
+						    NULL, &error);
+	g_assert_no_error (error);
+	g_assert (element_upload != NULL);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_NONE,
+				   NULL, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_NOT_SUPPORTED);
+	g_assert (!ret);
+	g_clear_error (&error);
+	ret = dfu_device_clear_status (device, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+}
+
+static void
+dfu_emulator_read_only_func (void)
+{
+	gboolean ret;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuElement) element = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GBytes) fw = NULL;
+	g_autoptr(GError) error = NULL;
+
+	/* the last four sectors can only be read */
+	device = dfu_self_test_emulated_device_new ("@Flash /0x08000000/4*001Kg,4*001Ka", 0, 0,
+						    &emulator, &target);
+
+	/* only the second element is in the read-only sectors */
+	image = dfu_emulator_image_new (0x08000000, 0x400);
+	element = dfu_element_new ();
+	fw = g_bytes_new_take (g_malloc0 (0x400), 0x400);
+	dfu_element_set_address (element, 0x08001000);
+	dfu_element_set_contents (element, fw);
+	dfu_image_add_element (image, element);
+
+	/* nothing is erased as the whole image cannot be written */
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_NONE,
+				   NULL, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_INVALID_DEVICE);
+	g_assert (!ret);
+	g_assert_cmpint (dfu_emulator_get_request_count (emulator, DFU_REQUEST_DNLOAD), ==, 0);
+}
+
+static void
+dfu_emulator_fault_func (void)
+{
+	gboolean ret;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GError) error = NULL;
+
+	device = dfu_self_test_emulated_device_new ("Flash", 0x1000, 0,
+						    &emulator, &target);
+	image = dfu_emulator_image_new (0x0, 0x800);
+
+	/* the device reports errWRITE */
+	dfu_emulator_set_fault (emulator, DFU_EMULATOR_FAULT_WRITE_ERROR, 0);
+	ret = dfu_target_download (target, image, DFU_TARGET_TRANSFER_FLAG_NONE,
+				   NULL, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_NOT_SUPPORTED);
+	g_assert (!ret);
+	g_assert_cmpint (dfu_device_get_state (device), ==, DFU_STATE_DFU_ERROR);
+	g_assert_cmpint (dfu_device_get_status (device), ==, DFU_STATUS_ERR_WRITE);
+	g_clear_error (&error);
+	ret = dfu_device_clear_status (device, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	/* the data read back does not match */
+	dfu_emulator_set_fault (emulator, DFU_EMULATOR_FAULT_CORRUPT, 0);
+	ret = dfu_target_download (target, image, DFU_TARGET_TRANSFER_FLAG_VERIFY,
+				   NULL, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_VERIFY_FAILED);
+	g_assert (!ret);
+	g_clear_error (&error);
+	ret = dfu_device_abort (device, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	/* the transfer fails on the bus */
+	dfu_emulator_set_fault (emulator, DFU_EMULATOR_FAULT_USB_ERROR, 0);
+	ret = dfu_target_download (target, image, DFU_TARGET_TRANSFER_FLAG_NONE,
+				   NULL, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_NOT_SUPPORTED);
+	g_assert (!ret);
+	g_clear_error (&error);
+
+	/* and the device still works afterwards */
+	ret = dfu_device_abort (device, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	ret = dfu_target_download (target, image, DFU_TARGET_TRANSFER_FLAG_VERIFY,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+}
+
+static void
+dfu_emulator_tuning_func (void)
+{
+	gboolean ret;
+	guint i;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	g_autoptr(GError) error = NULL;
+
+	tmpdir = g_dir_make_tmp ("dfu-self-test-XXXXXX", &error);
+	g_assert_no_error (error);
+	g_assert (tmpdir != NULL);
+	filename = g_build_filename (tmpdir, "dfu-tuning.conf", NULL);
+
+	/* save from one device and load into a new one */
+	for (i = 0; i < 3; i++) {
+		g_autoptr(DfuDevice) device = NULL;
+		g_autoptr(DfuEmulator) emulator = dfu_emulator_new ();
+		dfu_emulator_set_transfer_size (emulator, 256);
+		ret = dfu_emulator_add_target (emulator, "Flash", 0x1000, &error);
+		g_assert_no_error (error);
+		g_assert (ret);
+		device = dfu_device_new_emulated (emulator);
+		dfu_device_set_tuning_filename (device, filename);
+		ret = dfu_device_open (device, DFU_DEVICE_OPEN_FLAG_NONE, NULL, &error);
+		g_assert_no_error (error);
+		g_assert (ret);
+		if (i == 0) {
+			g_assert_cmpint (dfu_device_get_transfer_size (device), ==, 256);
+			dfu_device_set_transfer_size (device, 128);
+			dfu_device_set_timeout (device, 1234);
+		} else if (i == 1) {
+			g_assert_cmpint (dfu_device_get_transfer_size (device), ==, 128);
+			g_assert_cmpint (dfu_device_get_timeout (device), ==, 1234);
+			dfu_device_set_transfer_size (device, 4096);
+		} else {
+			/* larger than the device supports */
+			g_assert_cmpint (dfu_device_get_transfer_size (device), ==, 256);
+			g_assert_cmpint (dfu_device_get_timeout (device), ==, 1234);
+			break;
+		}
+		ret = dfu_device_save_tuning (device, &error);
+		g_assert_no_error (error);
+		g_assert (ret);
+	}
+	g_unlink (filename);
+	g_rmdir (tmpdir);
+}
+
+static guint
+dfu_emulator_get_request_total (DfuEmulator *emulator)
+{
+	guint i;
+	guint total = 0;
+	for (i = 0; i < DFU_REQUEST_LAST; i++)
+		total += dfu_emulator_get_request_count (emulator, i);
+	return total;
+}
+
+static void
+dfu_emulator_resume_func (void)
+{
+	DfuElement *element;
+	gboolean ret;
+	guint request_cnt;
+	guint request_cnt_resume;
+	g_autofree gchar *basename = NULL;
+	g_autofree gchar *digest = NULL;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GBytes) memory = NULL;
+	g_autoptr(GError) error = NULL;
+
+	device = dfu_self_test_emulated_device_new ("@Flash /0x08000000/8*001Kg", 0, 1,
+						    &emulator, &target);
+	tmpdir = g_dir_make_tmp ("dfu-self-test-XXXXXX", &error);
+	g_assert_no_error (error);
+	g_assert (tmpdir != NULL);
+	dfu_device_set_journal_dir (device, tmpdir);
+
+	/* the journal is only used for the same image */
+	image = dfu_emulator_image_new (0x08000000, 0x1800);
+	digest = dfu_journal_get_image_digest (image, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (digest != NULL);
+	basename = g_strdup_printf ("emulated-00-%s.conf", digest);
+	filename = g_build_filename (tmpdir, basename, NULL);
+
+	/* the journal is deleted when the download completes */
+	request_cnt = dfu_emulator_get_request_total (emulator);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				   DFU_TARGET_TRANSFER_FLAG_RESUME,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	request_cnt = dfu_emulator_get_request_total (emulator) - request_cnt;
+	g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+
+	/* the cable is pulled half way through */
+	dfu_emulator_set_fault (emulator, DFU_EMULATOR_FAULT_USB_ERROR,
+				dfu_emulator_get_request_total (emulator) +
+				request_cnt / 2);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				   DFU_TARGET_TRANSFER_FLAG_RESUME,
+				   NULL, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_NOT_SUPPORTED);
+	g_assert (!ret);
+	g_clear_error (&error);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+	ret = dfu_device_abort (device, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	/* only the rest of the image is written */
+	request_cnt_resume = dfu_emulator_get_request_total (emulator);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				   DFU_TARGET_TRANSFER_FLAG_RESUME,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	request_cnt_resume = dfu_emulator_get_request_total (emulator) - request_cnt_resume;
+	g_assert_cmpint (request_cnt_resume, <, request_cnt);
+	g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+	element = dfu_image_get_element_default (image);
+	memory = dfu_emulator_get_memory (emulator, 0, 0x08000000, 0x1800);
+	g_assert (g_bytes_compare (memory, dfu_element_get_contents (element)) == 0);
+
+	/* a download that is not resumed deletes the old journal */
+	dfu_emulator_set_fault (emulator, DFU_EMULATOR_FAULT_USB_ERROR,
+				dfu_emulator_get_request_total (emulator) +
+				request_cnt / 2);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				   DFU_TARGET_TRANSFER_FLAG_RESUME,
+				   NULL, &error);
+	g_assert_error (error, DFU_ERROR, DFU_ERROR_NOT_SUPPORTED);
+	g_assert (!ret);
+	g_clear_error (&error);
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+	ret = dfu_device_abort (device, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_rmdir (tmpdir);
+}
+
+typedef struct {
+	DfuEmulator		*emulator;
+	guint			 complete_cnt;
+} DfuEmulatorFaultHelper;
+
+static void
+dfu_emulator_fault_after_verify_cb (DfuTarget *target,
+				    guint percentage,
+				    gpointer user_data)
+{
+	DfuEmulatorFaultHelper *helper = (DfuEmulatorFaultHelper *) user_data;
+
+	/* the first element is written and then read back, and the
+	 * request after the abort is the first one for the next element */
+	if (percentage == 100 && ++helper->complete_cnt == 2) {
+		dfu_emulator_set_fault (helper->emulator,
+					DFU_EMULATOR_FAULT_USB_ERROR,
+					dfu_emulator_get_request_total (helper->emulator) + 2);
+	}
+}
+
+static void
+dfu_emulator_resume_shared_func (void)
+{
+	DfuEmulatorFaultHelper helper = { NULL, 0 };
+	DfuElement *element;
+	gboolean ret;
+	guint i;
+	g_autofree gchar *tmpdir = NULL;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuElement) element2 = dfu_element_new ();
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GBytes) fw = NULL;
+	g_autoptr(GError) error = NULL;
+	GPtrArray *elements;
+
+	device = dfu_self_test_emulated_device_new ("@Flash /0x08000000/8*001Kg", 0, 1,
+						    &emulator, &target);
+	tmpdir = g_dir_make_tmp ("dfu-self-test-XXXXXX", &error);
+	g_assert_no_error (error);
+	g_assert (tmpdir != NULL);
+	dfu_device_set_journal_dir (device, tmpdir);
+
+	/* the second element starts half way through the second sector */
+	image = dfu_emulator_image_new (0x08000000, 0x1200);
+	fw = g_bytes_new_take (g_malloc0 (0x600), 0x600);
+	dfu_element_set_address (element2, 0x08001200);
+	dfu_element_set_contents (element2, fw);
+	dfu_image_add_element (image, element2);
+
+	/* the cable is pulled before the second element writes anything */
+	helper.emulator = emulator;
+	g_signal_connect (target, "percentage-changed",
+			  G_CALLBACK (dfu_emulator_fault_after_verify_cb),
+			  &helper);
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				   DFU_TARGET_TRANSFER_FLAG_RESUME,
+				   NULL, &error);
+	g_assert (error != NULL);
+	g_assert (!ret);
+	g_clear_error (&error);
+	g_signal_handlers_disconnect_by_data (target, &helper);
+	g_assert_cmpint (helper.complete_cnt, ==, 2);
+	ret = dfu_device_abort (device, NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+
+	/* the shared sector is written again with both elements */
+	ret = dfu_target_download (target, image,
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				   DFU_TARGET_TRANSFER_FLAG_RESUME,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	elements = dfu_image_get_elements (image);
+	for (i = 0; i < elements->len; i++) {
+		g_autoptr(GBytes) memory = NULL;
+		element = g_ptr_array_index (elements, i);
+		memory = dfu_emulator_get_memory (emulator, 0,
+						  dfu_element_get_address (element),
+						  dfu_element_get_size (element));
+		g_assert (g_bytes_compare (memory, dfu_element_get_contents (element)) == 0);
+	}
+	g_rmdir (tmpdir);
+}
+
+typedef struct {
+	DfuDevice		*device;
+	DfuImage		*image;
+	gboolean		 ret;
+	GError			*error;
+} DfuEmulatorThreadHelper;
+
+static gpointer
+dfu_emulator_thread_cb (gpointer user_data)
+{
+	DfuEmulatorThreadHelper *helper = (DfuEmulatorThreadHelper *) user_data;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GError) error_local = NULL;
+
+	target = dfu_device_get_target_by_alt_setting (helper->device, 0,
+						       &helper->error);
+	if (target == NULL)
+		return NULL;
+	helper->ret = dfu_target_download (target, helper->image,
+					   DFU_TARGET_TRANSFER_FLAG_VERIFY,
+					   NULL, &helper->error);
+	if (!helper->ret)
+		return NULL;
+
+	/* the default main context is owned by the main thread */
+	if (dfu_device_wait_for_replug (helper->device, 10, NULL, &error_local)) {
+		helper->ret = FALSE;
+		return NULL;
+	}
+	if (!g_error_matches (error_local, DFU_ERROR, DFU_ERROR_INVALID_DEVICE))
+		helper->ret = FALSE;
+	return NULL;
+}
+
+static void
+dfu_emulator_threads_func (void)
+{
+	DfuEmulatorThreadHelper helpers[2];
+	DfuEmulator *emulators[2];
+	GThread *threads[2];
+	gboolean ret;
+	guint i;
+
+	/* nothing else can run the default main context now */
+	ret = g_main_context_acquire (NULL);
+	g_assert (ret);
+
+	/* flash two devices at the same time */
+	for (i = 0; i < 2; i++) {
+		memset (&helpers[i], 0, sizeof (DfuEmulatorThreadHelper));
+		helpers[i].device = dfu_self_test_emulated_device_new ("@Flash /0x08000000/8*001Kg",
+									0, 1, &emulators[i],
+									NULL);
+		dfu_emulator_set_latency (emulators[i], 1);
+		helpers[i].image = dfu_emulator_image_new (0x08000000, 0x400 * (i + 1));
+		threads[i] = g_thread_new ("dfu-self-test",
+					   dfu_emulator_thread_cb,
+					   &helpers[i]);
+	}
+	for (i = 0; i < 2; i++) {
+		DfuElement *element;
+		g_autoptr(GBytes) memory = NULL;
+		g_thread_join (threads[i]);
+		g_assert_no_error (helpers[i].error);
+		g_assert (helpers[i].ret);
+		element = dfu_image_get_element_default (helpers[i].image);
+		memory = dfu_emulator_get_memory (emulators[i], 0, 0x08000000,
+						  0x400 * (i + 1));
+		g_assert (g_bytes_compare (memory, dfu_element_get_contents (element)) == 0);
+		g_object_unref (helpers[i].image);
+		g_object_unref (helpers[i].device);
+		g_object_unref (emulators[i]);
+	}
+	g_main_context_release (NULL);
+}
+
+static gpointer
+dfu_emulator_replug_thread_cb (gpointer user_data)
+{
+	DfuDevice *device = DFU_DEVICE (user_data);
+	g_autoptr(GError) error = NULL;
+
+	/* nothing is going to reconnect */
+	if (dfu_device_wait_for_replug (device, 10, NULL, &error))
+		return GINT_TO_POINTER (FALSE);
+	return GINT_TO_POINTER (g_error_matches (error, DFU_ERROR, DFU_ERROR_INVALID_DEVICE));
+}
+
+static gboolean
+dfu_emulator_replug_idle_cb (gpointer user_data)
+{
+	gboolean *dispatched = (gboolean *) user_data;
+	*dispatched = TRUE;
+	return G_SOURCE_REMOVE;
+}
+
+static void
+dfu_emulator_replug_thread_func (void)
+{
+	GThread *thread;
+	gboolean dispatched = FALSE;
+	gboolean ret;
+	guint id;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+
+	emulator = dfu_emulator_new ();
+	device = dfu_device_new_emulated (emulator);
+
+	/* no thread is running the default main context, but a worker
+	 * waiting for the device must still not dispatch its sources */
+	id = g_idle_add (dfu_emulator_replug_idle_cb, &dispatched);
+	thread = g_thread_new ("dfu-self-test", dfu_emulator_replug_thread_cb, device);
+	ret = GPOINTER_TO_INT (g_thread_join (thread));
+	g_assert (ret);
+	g_assert (!dispatched);
+	g_source_remove (id);
+}
+
+typedef struct {
+	DfuDevice		*device;
+	gint			 done;
+	gboolean		 ret;
+	GError			*error;
+} DfuEmulatorReplugHelper;
+
+static gpointer
+dfu_emulator_replug_wake_thread_cb (gpointer user_data)
+{
+	DfuEmulatorReplugHelper *helper = (DfuEmulatorReplugHelper *) user_data;
+	helper->ret = dfu_device_wait_for_replug (helper->device, 5000,
+						  NULL, &helper->error);
+	g_atomic_int_set (&helper->done, TRUE);
+	return NULL;
+}
+
+static void
+dfu_emulator_replug_wake_func (void)
+{
+	DfuEmulatorReplugHelper helper;
+	GThread *thread;
+	gboolean ret;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GError) error = NULL;
+
+	device = dfu_self_test_emulated_device_new ("Flash", 0x400, 0,
+						    &emulator, &target);
+	memset (&helper, 0, sizeof (DfuEmulatorReplugHelper));
+	helper.device = device;
+	thread = g_thread_new ("dfu-self-test",
+			       dfu_emulator_replug_wake_thread_cb,
+			       &helper);
+
+	/* the worker may not be waiting yet, so keep unplugging and
+	 * replugging the device until it has been woken up */
+	while (!g_atomic_int_get (&helper.done)) {
+		dfu_device_set_new_emulator (device, NULL);
+		dfu_device_set_new_emulator (device, emulator);
+		g_usleep (1000);
+	}
+	g_thread_join (thread);
+	g_assert_no_error (helper.error);
+	g_assert (helper.ret);
+
+	/* and the device can still be used */
+	image = dfu_target_upload (target, DFU_TARGET_TRANSFER_FLAG_NONE,
+				   NULL, &error);
+	g_assert_no_error (error);
+	g_assert (image != NULL);
+}
+
+static void
+dfu_context_signal_cb (DfuContext *context, DfuDevice *device, gpointer user_data)
+{
+	guint *cnt = (guint *) user_data;
+	(*cnt)++;
+}
+
+static void
+dfu_context_replug_func (void)
+{
+	DfuEmulatorReplugHelper helper;
+	GThread *thread;
+	guint cnt_changed = 0;
+	guint cnt_removed = 0;
+	g_autoptr(DfuContext) context = NULL;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuDevice) device_tmp = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(GPtrArray) devices = NULL;
+
+	context = dfu_context_new ();
+	g_signal_connect (context, "device-changed",
+			  G_CALLBACK (dfu_context_signal_cb), &cnt_changed);
+	g_signal_connect (context, "device-removed",
+			  G_CALLBACK (dfu_context_signal_cb), &cnt_removed);
+	device = dfu_self_test_emulated_device_new ("Flash", 0x400, 0,
+						    &emulator, NULL);
+	dfu_context_add_emulated (context, device);
+
+	/* a worker waiting for the device is woken by the hotplug path */
+	memset (&helper, 0, sizeof (DfuEmulatorReplugHelper));
+	helper.device = device;
+	thread = g_thread_new ("dfu-self-test",
+			       dfu_emulator_replug_wake_thread_cb,
+			       &helper);
+	while (!g_atomic_int_get (&helper.done)) {
+		dfu_context_replug_emulated (context, device, NULL);
+		dfu_context_replug_emulated (context, device, emulator);
+		g_usleep (1000);
+	}
+	g_thread_join (thread);
+	g_assert_no_error (helper.error);
+	g_assert (helper.ret);
+	while (g_main_context_iteration (NULL, FALSE));
+	g_assert_cmpint (cnt_changed, >, 0);
+	g_assert_cmpint (cnt_removed, ==, 0);
+	device_tmp = dfu_context_get_device_by_platform_id (context, "emulated", NULL);
+	g_assert (device_tmp == device);
+
+	/* it is removed if it does not come back in time */
+	dfu_context_set_timeout (context, 1);
+	dfu_context_replug_emulated (context, device, NULL);
+	do {
+		g_main_context_iteration (NULL, TRUE);
+		g_clear_pointer (&devices, g_ptr_array_unref);
+		devices = dfu_context_get_devices (context);
+	} while (devices->len > 0);
+	while (g_main_context_iteration (NULL, FALSE));
+	g_assert_cmpint (cnt_removed, ==, 1);
+}
+
+typedef struct {
+	DfuContext		*context;
+	gint			 done;
+	gboolean		 ret;
+	gint			 reads;
+} DfuContextThreadHelper;
+
+static gpointer
+dfu_context_reader_thread_cb (gpointer user_data)
+{
+	DfuContextThreadHelper *helper = (DfuContextThreadHelper *) user_data;
+
+	while (!g_atomic_int_get (&helper->done)) {
+		guint i;
+		g_autoptr(DfuDevice) device = NULL;
+		g_autoptr(GPtrArray) devices = NULL;
+
+		/* every device returned is referenced for the caller */
+		devices = dfu_context_get_devices (helper->context);
+		for (i = 0; i < devices->len; i++) {
+			DfuDevice *device_tmp = g_ptr_array_index (devices, i);
+			if (!DFU_IS_DEVICE (device_tmp))
+				helper->ret = FALSE;
+		}
+		device = dfu_context_get_device_by_platform_id (helper->context,
+							       "emulated",
+							       NULL);
+		if (device != NULL && !DFU_IS_DEVICE (device))
+			helper->ret = FALSE;
+		g_atomic_int_inc (&helper->reads);
+	}
+	return NULL;
+}
+
+static void
+dfu_context_threads_func (void)
+{
+	DfuContextThreadHelper helpers[2];
+	GThread *threads[2];
+	guint i;
+	guint j;
+	g_autoptr(DfuContext) context = NULL;
+
+	/* devices are removed as soon as they are unplugged */
+	context = dfu_context_new ();
+	dfu_context_set_timeout (context, 0);
+	for (i = 0; i < 2; i++) {
+		memset (&helpers[i], 0, sizeof (DfuContextThreadHelper));
+		helpers[i].context = context;
+		helpers[i].ret = TRUE;
+		threads[i] = g_thread_new ("dfu-self-test",
+					   dfu_context_reader_thread_cb,
+					   &helpers[i]);
+	}
+	for (i = 0; i < 2; i++) {
+		while (g_atomic_int_get (&helpers[i].reads) == 0)
+			g_usleep (100);
+	}
+
+	/* add and remove devices while the list is being read */
+	for (j = 0; j < 25; j++) {
+		DfuDevice *devices[4];
+		for (i = 0; i < 4; i++) {
+			g_autoptr(DfuEmulator) emulator = dfu_emulator_new ();
+			devices[i] = dfu_device_new_emulated (emulator);
+			dfu_context_add_emulated (context, devices[i]);
+		}
+		for (i = 0; i < 4; i++) {
+			dfu_context_replug_emulated (context, devices[i], NULL);
+			g_object_unref (devices[i]);
+		}
+		while (TRUE) {
+			g_autoptr(GPtrArray) devices_tmp = NULL;
+			devices_tmp = dfu_context_get_devices (context);
+			if (devices_tmp->len == 0)
+				break;
+			g_main_context_iteration (NULL, TRUE);
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		g_atomic_int_set (&helpers[i].done, TRUE);
+		g_thread_join (threads[i]);
+		g_assert (helpers[i].ret);
+	}
+	while (g_main_context_iteration (NULL, FALSE));
+}
+
 int
 main (int argc, char **argv)
 {
@@ -687,13 +2663,42 @@ main (int argc, char **argv)
 
 	/* tests go here */
 	g_test_add_func ("/libdfu/enums", dfu_enums_func);
+	g_test_add_func ("/libdfu/crc32", dfu_crc32_func);
+	g_test_add_func ("/libdfu/cipher{xtea}", dfu_cipher_xtea_func);
 	g_test_add_func ("/libdfu/target(DfuSe}", dfu_target_dfuse_func);
+	g_test_add_func ("/libdfu/target{sectors}", dfu_target_sectors_func);
+	g_test_add_func ("/libdfu/target{erase-plan}", dfu_target_erase_plan_func);
+	g_test_add_func ("/libdfu/target{blank}", dfu_target_blank_func);
+	g_test_add_func ("/libdfu/emulator{dfu}", dfu_emulator_dfu_func);
+	g_test_add_func ("/libdfu/emulator{upload}", dfu_emulator_upload_func);
+	g_test_add_func ("/libdfu/emulator{transfer-size}", dfu_emulator_transfer_size_func);
+	g_test_add_func ("/libdfu/emulator{dfuse}", dfu_emulator_dfuse_func);
+	g_test_add_func ("/libdfu/emulator{skip-blank}", dfu_emulator_skip_blank_func);
+	g_test_add_func ("/libdfu/emulator{differential}", dfu_emulator_differential_func);
+	g_test_add_func ("/libdfu/emulator{set-address}", dfu_emulator_set_address_func);
+	g_test_add_func ("/libdfu/emulator{upload-state}", dfu_emulator_upload_state_func);
+	g_test_add_func ("/libdfu/emulator{read-only}", dfu_emulator_read_only_func);
+	g_test_add_func ("/libdfu/emulator{fault}", dfu_emulator_fault_func);
+	g_test_add_func ("/libdfu/emulator{tuning}", dfu_emulator_tuning_func);
+	g_test_add_func ("/libdfu/emulator{resume}", dfu_emulator_resume_func);
+	g_test_add_func ("/libdfu/emulator{resume-shared}", dfu_emulator_resume_shared_func);
+	g_test_add_func ("/libdfu/emulator{threads}", dfu_emulator_threads_func);
+	g_test_add_func ("/libdfu/emulator{replug-thread}", dfu_emulator_replug_thread_func);
+	g_test_add_func ("/libdfu/emulator{replug-wake}", dfu_emulator_replug_wake_func);
+	g_test_add_func ("/libdfu/context{replug}", dfu_context_replug_func);
+	g_test_add_func ("/libdfu/context{threads}", dfu_context_threads_func);
 	g_test_add_func ("/libdfu/firmware{raw}", dfu_firmware_raw_func);
 	g_test_add_func ("/libdfu/firmware{dfu}", dfu_firmware_dfu_func);
 	g_test_add_func ("/libdfu/firmware{dfuse}", dfu_firmware_dfuse_func);
+	g_test_add_func ("/libdfu/firmware{mmap}", dfu_firmware_mmap_func);
+	g_test_add_func ("/libdfu/firmware{stream}", dfu_firmware_stream_func);
+	g_test_add_func ("/libdfu/firmware{lazy}", dfu_firmware_lazy_func);
+	g_test_add_func ("/libdfu/firmware{checksum}", dfu_firmware_checksum_func);
 	g_test_add_func ("/libdfu/firmware{xdfu}", dfu_firmware_xdfu_func);
 	g_test_add_func ("/libdfu/firmware{metadata}", dfu_firmware_metadata_func);
 	g_test_add_func ("/libdfu/firmware{intel-hex}", dfu_firmware_intel_hex_func);
+	g_test_add_func ("/libdfu/firmware{intel-hex-sparse}", dfu_firmware_intel_hex_sparse_func);
+	g_test_add_func ("/libdfu/firmware{intel-hex-sparse-raw}", dfu_firmware_intel_hex_sparse_raw_func);
 	g_test_add_func ("/libdfu/device", dfu_device_func);
 	g_test_add_func ("/libdfu/colorhug+", dfu_colorhug_plus_func);
 	return g_test_run ();
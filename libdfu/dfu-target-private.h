@@ -25,22 +25,48 @@
 #include <gusb.h>
 
 #include "dfu-device.h"
+#include "dfu-sector.h"
 #include "dfu-target.h"
 
 G_BEGIN_DECLS
 
+typedef enum {
+	DFU_CMD_DFUSE_GET_COMMAND		= 0x00,
+	DFU_CMD_DFUSE_SET_ADDRESS_POINTER	= 0x21,
+	DFU_CMD_DFUSE_ERASE			= 0x41,
+	DFU_CMD_DFUSE_READ_UNPROTECT		= 0x92,
+	DFU_CMD_DFUSE_LAST
+} DfuCmdDfuse;
+
 DfuTarget	*dfu_target_new				(DfuDevice	*device,
 							 GUsbInterface	*iface);
+DfuTarget	*dfu_target_new_for_alt			(DfuDevice	*device,
+							 guint8		 alt_setting,
+							 const gchar	*alt_name);
 
 GBytes		*dfu_target_upload_chunk		(DfuTarget	*target,
 							 guint8		 index,
 							 GCancellable	*cancellable,
 							 GError		**error);
 
+DfuSector	*dfu_target_get_sector_for_addr		(DfuTarget	*target,
+							 guint32	 addr);
+GPtrArray	*dfu_target_get_sectors_for_range	(DfuTarget	*target,
+							 guint32	 addr,
+							 guint32	 length);
+GPtrArray	*dfu_target_get_erase_plan		(DfuTarget	*target,
+							 DfuImage	*image);
+DfuElement	*dfu_target_upload_element		(DfuTarget	*target,
+							 guint32	 address,
+							 gsize		 expected_size,
+							 GCancellable	*cancellable,
+							 GError		**error);
+
 /* export this just for the self tests */
 gboolean	 dfu_target_parse_sectors		(DfuTarget	*target,
 							 const gchar	*alt_name,
 							 GError		**error);
+gboolean	 dfu_target_chunk_is_blank		(GBytes		*bytes);
 
 G_END_DECLS
 
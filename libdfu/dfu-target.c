@@ -35,24 +35,27 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <string.h>
 #include <math.h>
+#include <glib/gstdio.h>
 
 #include "dfu-common.h"
 #include "dfu-device-private.h"
+#include "dfu-element-private.h"
 #include "dfu-error.h"
+#include "dfu-image-private.h"
+#include "dfu-journal-private.h"
 #include "dfu-sector-private.h"
 #include "dfu-target-private.h"
 
 static void dfu_target_finalize			 (GObject *object);
 
-typedef enum {
-	DFU_CMD_DFUSE_GET_COMMAND		= 0x00,
-	DFU_CMD_DFUSE_SET_ADDRESS_POINTER	= 0x21,
-	DFU_CMD_DFUSE_ERASE			= 0x41,
-	DFU_CMD_DFUSE_READ_UNPROTECT		= 0x92,
-	DFU_CMD_DFUSE_LAST
-} DfuCmdDfuse;
+/* bounds in ms for polling a device that reports it is busy */
+#define DFU_TARGET_POLL_BACKOFF_MIN		1
+#define DFU_TARGET_POLL_BACKOFF_QUIRK_MIN	5
+#define DFU_TARGET_POLL_BACKOFF_MAX		250
+#define DFU_TARGET_POLL_BUSY_MAX		60000	/* mass erase can be slow */
 
 /**
  * DfuTargetPrivate:
@@ -67,9 +70,26 @@ typedef struct {
 	guint8			 alt_idx;
 	gchar			*alt_name;
 	GPtrArray		*sectors;		/* of DfuSector */
-	GHashTable		*sectors_erased;	/* of DfuSector:1 */
+	GBytes			*dfuse_commands;
+	GHashTable		*sectors_unchanged;	/* of DfuSector */
+	GHashTable		*sectors_pending;	/* of DfuSector:elements */
+	GArray			*sectors_index;		/* of DfuTargetSectorRange */
+	GArray			*sectors_lookup;	/* of DfuTargetSectorRange */
+	gboolean		 sectors_index_valid;
+	guint			 sectors_cursor;
+	guint			 bytes_skipped;
+	DfuJournal		*journal;		/* only when resuming */
 } DfuTargetPrivate;
 
+/* the sector geometry, sorted by address for fast lookups */
+typedef struct {
+	guint32			 address;
+	guint64			 end;			/* exclusive */
+	guint64			 end_max;		/* of this and all before */
+	guint			 idx;			/* into priv->sectors */
+	DfuSector		*sector;		/* not refcounted */
+} DfuTargetSectorRange;
+
 enum {
 	SIGNAL_PERCENTAGE_CHANGED,
 	SIGNAL_LAST
@@ -115,7 +135,10 @@ dfu_target_init (DfuTarget *target)
 {
 	DfuTargetPrivate *priv = GET_PRIVATE (target);
 	priv->sectors = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	priv->sectors_erased = g_hash_table_new (g_direct_hash, g_direct_equal);
+	priv->sectors_unchanged = g_hash_table_new (g_direct_hash, g_direct_equal);
+	priv->sectors_pending = g_hash_table_new (g_direct_hash, g_direct_equal);
+	priv->sectors_index = g_array_new (FALSE, FALSE, sizeof (DfuTargetSectorRange));
+	priv->sectors_lookup = g_array_new (FALSE, FALSE, sizeof (DfuTargetSectorRange));
 }
 
 /**
@@ -129,7 +152,14 @@ dfu_target_finalize (GObject *object)
 
 	g_free (priv->alt_name);
 	g_ptr_array_unref (priv->sectors);
-	g_hash_table_unref (priv->sectors_erased);
+	if (priv->dfuse_commands != NULL)
+		g_bytes_unref (priv->dfuse_commands);
+	g_hash_table_unref (priv->sectors_unchanged);
+	g_hash_table_unref (priv->sectors_pending);
+	g_array_unref (priv->sectors_index);
+	g_array_unref (priv->sectors_lookup);
+	if (priv->journal != NULL)
+		g_object_unref (priv->journal);
 
 	/* we no longer care */
 	if (priv->device != NULL) {
@@ -163,28 +193,272 @@ dfu_target_sectors_to_string (DfuTarget *target)
 	return g_string_free (str, FALSE);
 }
 
+/**
+ * dfu_target_sector_range_sort_cb:
+ **/
+static gint
+dfu_target_sector_range_sort_cb (gconstpointer a, gconstpointer b)
+{
+	const DfuTargetSectorRange *range1 = a;
+	const DfuTargetSectorRange *range2 = b;
+	if (range1->address < range2->address)
+		return -1;
+	if (range1->address > range2->address)
+		return 1;
+	/* overlapping sectors are kept in the order they were declared */
+	if (range1->idx < range2->idx)
+		return -1;
+	if (range1->idx > range2->idx)
+		return 1;
+	return 0;
+}
+
+/**
+ * dfu_target_sector_bound_sort_cb:
+ **/
+static gint
+dfu_target_sector_bound_sort_cb (gconstpointer a, gconstpointer b)
+{
+	guint64 bound1 = *((const guint64 *) a);
+	guint64 bound2 = *((const guint64 *) b);
+	if (bound1 < bound2)
+		return -1;
+	if (bound1 > bound2)
+		return 1;
+	return 0;
+}
+
+/**
+ * dfu_target_sectors_lookup_flatten:
+ *
+ * Splits overlapping sectors at every start and end address, so that
+ * each address maps to the first declared sector that covers it.
+ **/
+static void
+dfu_target_sectors_lookup_flatten (DfuTarget *target)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	DfuTargetSectorRange *ranges = (DfuTargetSectorRange *) priv->sectors_index->data;
+	guint i;
+	guint j;
+	g_autoptr(GArray) bounds = NULL;
+
+	bounds = g_array_sized_new (FALSE, FALSE, sizeof (guint64),
+				    priv->sectors_index->len * 2);
+	for (i = 0; i < priv->sectors_index->len; i++) {
+		guint64 address = ranges[i].address;
+		g_array_append_val (bounds, address);
+		g_array_append_val (bounds, ranges[i].end);
+	}
+	g_array_sort (bounds, dfu_target_sector_bound_sort_cb);
+	for (i = 0; i + 1 < bounds->len; i++) {
+		DfuTargetSectorRange *best = NULL;
+		DfuTargetSectorRange segment;
+		guint64 start = g_array_index (bounds, guint64, i);
+		guint64 end = g_array_index (bounds, guint64, i + 1);
+
+		if (start == end)
+			continue;
+		for (j = 0; j < priv->sectors_index->len; j++) {
+			if (ranges[j].address > start)
+				break;
+			if (ranges[j].end <= start)
+				continue;
+			if (best == NULL || ranges[j].idx < best->idx)
+				best = &ranges[j];
+		}
+		if (best == NULL)
+			continue;
+
+		/* grow the last segment if it is the same sector */
+		if (priv->sectors_lookup->len > 0) {
+			DfuTargetSectorRange *prev;
+			prev = &g_array_index (priv->sectors_lookup,
+					       DfuTargetSectorRange,
+					       priv->sectors_lookup->len - 1);
+			if (prev->sector == best->sector && prev->end == start) {
+				prev->end = end;
+				prev->end_max = end;
+				continue;
+			}
+		}
+		segment = *best;
+		segment.address = (guint32) start;
+		segment.end = end;
+		segment.end_max = end;
+		g_array_append_val (priv->sectors_lookup, segment);
+	}
+}
+
+/**
+ * dfu_target_sectors_index_ensure:
+ *
+ * Rebuilds the sorted index if the sectors have changed since it was
+ * last built.
+ **/
+static void
+dfu_target_sectors_index_ensure (DfuTarget *target)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	DfuTargetSectorRange *ranges;
+	gboolean overlap = FALSE;
+	guint64 end_max = 0;
+	guint i;
+
+	if (priv->sectors_index_valid)
+		return;
+
+	g_array_set_size (priv->sectors_index, 0);
+	g_array_set_size (priv->sectors_lookup, 0);
+	for (i = 0; i < priv->sectors->len; i++) {
+		DfuSector *sector = g_ptr_array_index (priv->sectors, i);
+		DfuTargetSectorRange range;
+
+		/* sectors without a size only describe the start address */
+		range.address = dfu_sector_get_address (sector);
+		range.end = (guint64) range.address + MAX (dfu_sector_get_size (sector), 1);
+		range.end_max = 0;
+		range.idx = i;
+		range.sector = sector;
+		g_array_append_val (priv->sectors_index, range);
+	}
+	g_array_sort (priv->sectors_index, dfu_target_sector_range_sort_cb);
+
+	/* the parser can generate overlapping sectors */
+	ranges = (DfuTargetSectorRange *) priv->sectors_index->data;
+	for (i = 0; i < priv->sectors_index->len; i++) {
+		if (ranges[i].address < end_max)
+			overlap = TRUE;
+		end_max = MAX (end_max, ranges[i].end);
+		ranges[i].end_max = end_max;
+	}
+
+	/* without overlaps every address already has just one sector */
+	if (overlap) {
+		dfu_target_sectors_lookup_flatten (target);
+	} else {
+		g_array_append_vals (priv->sectors_lookup,
+				     priv->sectors_index->data,
+				     priv->sectors_index->len);
+	}
+	priv->sectors_cursor = 0;
+	priv->sectors_index_valid = TRUE;
+}
+
+/**
+ * dfu_target_sectors_index_invalidate:
+ *
+ * Must be called whenever priv->sectors is changed.
+ **/
+static void
+dfu_target_sectors_index_invalidate (DfuTarget *target)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	priv->sectors_index_valid = FALSE;
+	priv->sectors_cursor = 0;
+}
+
+/**
+ * dfu_target_add_sector:
+ **/
+static void
+dfu_target_add_sector (DfuTarget *target, DfuSector *sector)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	g_ptr_array_add (priv->sectors, sector);
+	dfu_target_sectors_index_invalidate (target);
+}
+
 /**
  * dfu_target_get_sector_for_addr:
+ * @target: a #DfuTarget
+ * @addr: a memory address
  *
- * Returns: the sector that should be used for a specific address, or %NULL
+ * Finds the sector that covers a specific address. Sequential lookups,
+ * e.g. for each chunk of a transfer, are satisfied without a search.
+ *
+ * Returns: (transfer none): the sector, or %NULL
  **/
-static DfuSector *
+DfuSector *
 dfu_target_get_sector_for_addr (DfuTarget *target, guint32 addr)
 {
 	DfuTargetPrivate *priv = GET_PRIVATE (target);
-	DfuSector *sector;
+	DfuTargetSectorRange *segments;
 	guint i;
+	guint lo = 0;
+	guint hi;
+
+	dfu_target_sectors_index_ensure (target);
+	segments = (DfuTargetSectorRange *) priv->sectors_lookup->data;
+	hi = priv->sectors_lookup->len;
+
+	/* same or next sector as last time */
+	for (i = priv->sectors_cursor; i < hi && i <= priv->sectors_cursor + 1; i++) {
+		if (addr >= segments[i].address && addr < segments[i].end) {
+			priv->sectors_cursor = i;
+			return segments[i].sector;
+		}
+	}
 
-	for (i = 0; i < priv->sectors->len; i++) {
-		sector = g_ptr_array_index (priv->sectors, i);
-		if (addr < dfu_sector_get_address (sector))
-			continue;
-		if (addr > dfu_sector_get_address (sector) +
-				dfu_sector_get_size (sector))
+	/* the segments do not overlap, so only the last one that starts
+	 * at or before the address can cover it */
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+		if (segments[mid].address <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || addr >= segments[lo - 1].end)
+		return NULL;
+	priv->sectors_cursor = lo - 1;
+	return segments[lo - 1].sector;
+}
+
+/**
+ * dfu_target_get_sectors_for_range:
+ * @target: a #DfuTarget
+ * @addr: a memory address
+ * @length: the number of bytes from @addr
+ *
+ * Finds all the sectors that cover any part of [@addr, @addr + @length).
+ *
+ * Returns: (transfer container) (element-type DfuSector): sectors sorted
+ * by address, which may be empty
+ **/
+GPtrArray *
+dfu_target_get_sectors_for_range (DfuTarget *target, guint32 addr, guint32 length)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	DfuTargetSectorRange *ranges;
+	GPtrArray *sectors;
+	guint64 addr_end = (guint64) addr + MAX (length, 1);
+	guint lo = 0;
+	guint hi;
+	guint i;
+
+	dfu_target_sectors_index_ensure (target);
+	ranges = (DfuTargetSectorRange *) priv->sectors_index->data;
+	hi = priv->sectors_index->len;
+
+	/* skip every range that ends before the address; end_max only
+	 * ever grows so this is a binary search too */
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+		if (ranges[mid].end_max <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	sectors = g_ptr_array_new ();
+	for (i = lo; i < priv->sectors_index->len; i++) {
+		if (ranges[i].address >= addr_end)
+			break;
+		if (ranges[i].end <= addr)
 			continue;
-		return sector;
+		g_ptr_array_add (sectors, ranges[i].sector);
 	}
-	return NULL;
+	return sectors;
 }
 
 /**
@@ -309,7 +583,7 @@ dfu_target_parse_sector (DfuTarget *target,
 					 zone,
 					 number,
 					 cap);
-		g_ptr_array_add (priv->sectors, sector);
+		dfu_target_add_sector (target, sector);
 		addr_offset += dfu_sector_get_size (sector);
 	}
 	return TRUE;
@@ -352,7 +626,7 @@ dfu_target_parse_sectors (DfuTarget *target, const gchar *alt_name, GError **err
 					 0x0, /* number */
 					 DFU_SECTOR_CAP_READABLE |
 					 DFU_SECTOR_CAP_WRITEABLE);
-		g_ptr_array_add (priv->sectors, sector);
+		dfu_target_add_sector (target, sector);
 	}
 
 	/* not a DfuSe alternative name */
@@ -361,6 +635,7 @@ dfu_target_parse_sectors (DfuTarget *target, const gchar *alt_name, GError **err
 
 	/* clear any existing zones */
 	g_ptr_array_set_size (priv->sectors, 0);
+	dfu_target_sectors_index_invalidate (target);
 
 	/* parse zones */
 	zones = g_strsplit (alt_name, "/", -1);
@@ -432,6 +707,36 @@ dfu_target_new (DfuDevice *device, GUsbInterface *iface)
 	return target;
 }
 
+/**
+ * dfu_target_new_for_alt: (skip)
+ * @device: a #DfuDevice
+ * @alt_setting: the alternate setting
+ * @alt_name: the alternate setting name, or %NULL
+ *
+ * Creates a new DFU target where the alternate setting is already known,
+ * e.g. for an emulated device with no USB interface.
+ *
+ * Return value: a #DfuTarget
+ **/
+DfuTarget *
+dfu_target_new_for_alt (DfuDevice *device, guint8 alt_setting, const gchar *alt_name)
+{
+	DfuTargetPrivate *priv;
+	DfuTarget *target;
+	target = g_object_new (DFU_TYPE_TARGET, NULL);
+	priv = GET_PRIVATE (target);
+	priv->device = device;
+	priv->alt_idx = 0x00;
+	priv->alt_setting = alt_setting;
+	priv->alt_name = g_strdup (alt_name);
+
+	/* if we try to ref the target and destroy the device */
+	g_object_add_weak_pointer (G_OBJECT (priv->device),
+				   (gpointer *) &priv->device);
+
+	return target;
+}
+
 /**
  * dfu_target_get_sectors:
  * @target: a #GUsbDevice
@@ -559,19 +864,16 @@ static gboolean
 dfu_target_use_alt_setting (DfuTarget *target, GError **error)
 {
 	DfuTargetPrivate *priv = GET_PRIVATE (target);
-	GUsbDevice *dev;
 	g_autoptr(GError) error_local = NULL;
 
 	g_return_val_if_fail (DFU_IS_TARGET (target), FALSE);
 	g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
 	/* use the correct setting */
-	dev = dfu_device_get_usb_dev (priv->device);
 	if (dfu_device_get_mode (priv->device) == DFU_MODE_DFU) {
-		if (!g_usb_device_set_interface_alt (dev,
-						     (gint) dfu_device_get_interface (priv->device),
-						     (gint) priv->alt_setting,
-						     &error_local)) {
+		if (!dfu_device_set_interface_alt (priv->device,
+						   priv->alt_setting,
+						   &error_local)) {
 			g_set_error (error,
 				     DFU_ERROR,
 				     DFU_ERROR_NOT_SUPPORTED,
@@ -637,7 +939,7 @@ dfu_target_setup (DfuTarget *target, GError **error)
 					 DFU_SECTOR_CAP_READABLE |
 					 DFU_SECTOR_CAP_WRITEABLE);
 		g_debug ("no UM0424 sector descripton in %s", priv->alt_name);
-		g_ptr_array_add (priv->sectors, sector);
+		dfu_target_add_sector (target, sector);
 	}
 
 	priv->done_setup = TRUE;
@@ -655,19 +957,15 @@ dfu_target_download_chunk (DfuTarget *target, guint8 index, GBytes *bytes,
 	g_autoptr(GError) error_local = NULL;
 	gsize actual_length;
 
-	if (!g_usb_device_control_transfer (dfu_device_get_usb_dev (priv->device),
-					    G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE,
-					    G_USB_DEVICE_REQUEST_TYPE_CLASS,
-					    G_USB_DEVICE_RECIPIENT_INTERFACE,
-					    DFU_REQUEST_DNLOAD,
-					    index,
-					    dfu_device_get_interface (priv->device),
-					    (guint8 *) g_bytes_get_data (bytes, NULL),
-					    g_bytes_get_size (bytes),
-					    &actual_length,
-					    dfu_device_get_timeout (priv->device),
-					    cancellable,
-					    &error_local)) {
+	if (!dfu_device_control_transfer (priv->device,
+					  G_USB_DEVICE_DIRECTION_HOST_TO_DEVICE,
+					  DFU_REQUEST_DNLOAD,
+					  index,
+					  (guint8 *) g_bytes_get_data (bytes, NULL),
+					  g_bytes_get_size (bytes),
+					  &actual_length,
+					  cancellable,
+					  &error_local)) {
 		/* refresh the error code */
 		dfu_device_error_fixup (priv->device, cancellable, &error_local);
 		g_set_error (error,
@@ -686,6 +984,60 @@ dfu_target_download_chunk (DfuTarget *target, guint8 index, GBytes *bytes,
 	return TRUE;
 }
 
+/**
+ * dfu_target_wait_for_idle:
+ *
+ * Waits for the device to finish processing a download. Each delay is
+ * the bwPollTimeout from the last GetStatus, falling back to a bounded
+ * exponential backoff if the device is busy but does not give one.
+ **/
+static gboolean
+dfu_target_wait_for_idle (DfuTarget *target,
+			  guint *waited_ms,
+			  GCancellable *cancellable,
+			  GError **error)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	gboolean ignore_timeout;
+	guint backoff = DFU_TARGET_POLL_BACKOFF_MIN;
+	guint waited = 0;
+
+	/* the poll timeout is nonsense on some devices */
+	ignore_timeout = dfu_device_has_quirk (priv->device,
+					       DFU_DEVICE_QUIRK_IGNORE_POLLTIMEOUT);
+	if (ignore_timeout)
+		backoff = DFU_TARGET_POLL_BACKOFF_QUIRK_MIN;
+
+	while (dfu_device_get_state (priv->device) == DFU_STATE_DFU_DNBUSY) {
+		guint delay = 0;
+		if (!ignore_timeout)
+			delay = dfu_device_get_download_timeout (priv->device);
+		if (delay == 0) {
+			delay = backoff;
+			backoff = MIN (backoff * 2, DFU_TARGET_POLL_BACKOFF_MAX);
+		}
+		if (waited + delay > DFU_TARGET_POLL_BUSY_MAX) {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_NOT_SUPPORTED,
+				     "device was busy for more than %ums",
+				     (guint) DFU_TARGET_POLL_BUSY_MAX);
+			return FALSE;
+		}
+		if (g_cancellable_set_error_if_cancelled (cancellable, error))
+			return FALSE;
+		g_usleep (delay * 1000);
+		waited += delay;
+
+		/* getting the status moves the state machine to DNLOAD-IDLE */
+		if (!dfu_target_check_status (target, cancellable, error))
+			return FALSE;
+	}
+	if (waited_ms != NULL)
+		*waited_ms += waited;
+	return TRUE;
+}
+
 /**
  * dfu_target_set_address:
  * @target: a #DfuTarget
@@ -730,7 +1082,9 @@ dfu_target_set_address (DfuTarget *target,
 	/* for ST devices, the action only occurs when we do GetStatus */
 	if (!dfu_target_check_status (target, cancellable, error))
 		return FALSE;
-	return TRUE;
+
+	/* the next request would be stalled if the device is still busy */
+	return dfu_target_wait_for_idle (target, NULL, cancellable, error);
 }
 
 /**
@@ -779,10 +1133,13 @@ dfu_target_erase_address (DfuTarget *target,
 		return FALSE;
 
 	/* 2nd check required to get error code */
-	return dfu_target_check_status (target, cancellable, error);
+	if (!dfu_target_check_status (target, cancellable, error))
+		return FALSE;
+
+	/* erasing can take a long time */
+	return dfu_target_wait_for_idle (target, NULL, cancellable, error);
 }
 
-#if 0
 
 /**
  * dfu_target_mass_erase:
@@ -807,8 +1164,8 @@ dfu_target_mass_erase (DfuTarget *target,
 		       GError **error)
 {
 	DfuTargetPrivate *priv = GET_PRIVATE (target);
-	GBytes *data_in;
 	guint8 buf[1];
+	g_autoptr(GBytes) data_in = NULL;
 
 	/* invalid */
 	if (!dfu_device_has_dfuse_support (priv->device)) {
@@ -830,9 +1187,15 @@ dfu_target_mass_erase (DfuTarget *target,
 		return FALSE;
 
 	/* 2nd check required to get error code */
-	return dfu_target_check_status (target, cancellable, error);
+	if (!dfu_target_check_status (target, cancellable, error))
+		return FALSE;
+
+	/* erasing can take a long time */
+	return dfu_target_wait_for_idle (target, NULL, cancellable, error);
 }
 
+#if 0
+
 /**
  * dfu_target_read_unprotect:
  * @target: a #DfuTarget
@@ -879,31 +1242,31 @@ dfu_target_read_unprotect (DfuTarget *target,
 #endif
 
 /**
- * dfu_target_upload_chunk: (skip)
+ * dfu_target_upload_chunk_into:
+ *
+ * Reads one chunk from the device directly into @buf, which must have
+ * space for at least the transfer size.
  **/
-GBytes *
-dfu_target_upload_chunk (DfuTarget *target, guint8 index,
-			 GCancellable *cancellable, GError **error)
+static gboolean
+dfu_target_upload_chunk_into (DfuTarget *target,
+			      guint8 index,
+			      guint8 *buf,
+			      gsize *actual_length,
+			      GCancellable *cancellable,
+			      GError **error)
 {
 	DfuTargetPrivate *priv = GET_PRIVATE (target);
 	g_autoptr(GError) error_local = NULL;
-	guint8 *buf;
-	gsize actual_length;
 	guint16 transfer_size = dfu_device_get_transfer_size (priv->device);
 
-	buf = g_new0 (guint8, transfer_size);
-	if (!g_usb_device_control_transfer (dfu_device_get_usb_dev (priv->device),
-					    G_USB_DEVICE_DIRECTION_DEVICE_TO_HOST,
-					    G_USB_DEVICE_REQUEST_TYPE_CLASS,
-					    G_USB_DEVICE_RECIPIENT_INTERFACE,
-					    DFU_REQUEST_UPLOAD,
-					    index,
-					    dfu_device_get_interface (priv->device),
-					    buf, (gsize) transfer_size,
-					    &actual_length,
-					    dfu_device_get_timeout (priv->device),
-					    cancellable,
-					    &error_local)) {
+	if (!dfu_device_control_transfer (priv->device,
+					  G_USB_DEVICE_DIRECTION_DEVICE_TO_HOST,
+					  DFU_REQUEST_UPLOAD,
+					  index,
+					  buf, (gsize) transfer_size,
+					  actual_length,
+					  cancellable,
+					  &error_local)) {
 		/* refresh the error code */
 		dfu_device_error_fixup (priv->device, cancellable, &error_local);
 		g_set_error (error,
@@ -911,22 +1274,70 @@ dfu_target_upload_chunk (DfuTarget *target, guint8 index,
 			     DFU_ERROR_NOT_SUPPORTED,
 			     "cannot upload data: %s",
 			     error_local->message);
-		return NULL;
+		return FALSE;
 	}
 
 	/* for ST devices, the action only occurs when we do GetStatus */
 	if (!dfu_device_has_quirk (priv->device, DFU_DEVICE_QUIRK_NO_GET_STATUS_UPLOAD)) {
 		if (!dfu_target_check_status (target, cancellable, error))
-			return NULL;
+			return FALSE;
 	}
+	return TRUE;
+}
+
+/**
+ * dfu_target_upload_chunk: (skip)
+ **/
+GBytes *
+dfu_target_upload_chunk (DfuTarget *target, guint8 index,
+			 GCancellable *cancellable, GError **error)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	guint8 *buf;
+	gsize actual_length = 0;
+	guint16 transfer_size = dfu_device_get_transfer_size (priv->device);
 
+	buf = g_new0 (guint8, transfer_size);
+	if (!dfu_target_upload_chunk_into (target, index, buf, &actual_length,
+					   cancellable, error)) {
+		g_free (buf);
+		return NULL;
+	}
 	return g_bytes_new_take (buf, actual_length);
 }
 
+/**
+ * dfu_target_upload_guess_size:
+ *
+ * Returns: the number of bytes that are likely to be uploaded from
+ * @address, or 0 if unknown
+ **/
+static gsize
+dfu_target_upload_guess_size (DfuTarget *target, guint32 address, gsize expected_size)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	DfuSector *sector;
+	guint32 sector_offset;
+
+	if (expected_size > 0)
+		return expected_size;
+
+	/* read to the end of the zone */
+	if (!dfu_device_has_dfuse_support (priv->device))
+		return 0;
+	sector = dfu_target_get_sector_for_addr (target, address);
+	if (sector == NULL)
+		return 0;
+	sector_offset = address - dfu_sector_get_address (sector);
+	if (sector_offset >= dfu_sector_get_size_left (sector))
+		return 0;
+	return dfu_sector_get_size_left (sector) - sector_offset;
+}
+
 /**
  * dfu_target_upload_element:
  **/
-static DfuElement *
+DfuElement *
 dfu_target_upload_element (DfuTarget *target,
 			   guint32 address,
 			   gsize expected_size,
@@ -936,18 +1347,17 @@ dfu_target_upload_element (DfuTarget *target,
 	DfuTargetPrivate *priv = GET_PRIVATE (target);
 	DfuSector *sector;
 	DfuElement *element = NULL;
-	GBytes *chunk_tmp;
 	gsize chunk_size;
 	gsize offset = 0;
 	gsize total_size = 0;
 	guint16 transfer_size = dfu_device_get_transfer_size (priv->device);
-	guint8 *buffer;
 	guint32 last_sector_id = G_MAXUINT;
 	guint dfuse_sector_offset = 0;
+	guint dfuse_block_start = 0;
 	guint i;
 	guint old_percentage = G_MAXUINT;
 	g_autoptr(GBytes) contents = NULL;
-	g_autoptr(GPtrArray) chunks = NULL;
+	g_autoptr(GByteArray) buf = NULL;
 
 	/* ST uses wBlockNum=0 for DfuSe commands and wBlockNum=1 is reserved */
 	if (dfu_device_has_dfuse_support (priv->device)) {
@@ -955,10 +1365,20 @@ dfu_target_upload_element (DfuTarget *target,
 		dfuse_sector_offset = 2;
 	}
 
+	/* each chunk is read directly into place, so allocate enough space
+	 * for the whole element and the final short read up-front */
+	buf = g_byte_array_sized_new (dfu_target_upload_guess_size (target,
+								    address,
+								    expected_size) +
+				      transfer_size);
+
 	/* get all the chunks from the hardware */
-	chunks = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
 	for (i = 0; i < 0xffff; i++) {
 
+		/* stop between chunks if cancelled */
+		if (g_cancellable_set_error_if_cancelled (cancellable, error))
+			return NULL;
+
 		/* for DfuSe devices we need to handle the address manually */
 		if (dfu_device_has_dfuse_support (priv->device)) {
 
@@ -981,38 +1401,47 @@ dfu_target_upload_element (DfuTarget *target,
 				return NULL;
 			}
 
-			/* manually set the sector address */
+			/* manually set the sector address, which is a DNLOAD
+			 * and so is stalled in dfuUPLOAD-IDLE */
 			if (dfu_sector_get_id (sector) != last_sector_id) {
+				if (i > 0 &&
+				    !dfu_device_abort (priv->device, cancellable, error))
+					return NULL;
 				g_debug ("setting DfuSe address to 0x%04x", (guint) offset);
 				if (!dfu_target_set_address (target,
 							     offset,
 							     cancellable,
 							     error))
 					return NULL;
+
+				/* leave dfuDNLOAD-IDLE before uploading */
+				if (!dfu_device_abort (priv->device, cancellable, error))
+					return NULL;
 				last_sector_id = dfu_sector_get_id (sector);
+				dfuse_block_start = i;
 			}
 		}
 
-		/* read chunk of data */
-		chunk_tmp = dfu_target_upload_chunk (target,
-						     i + dfuse_sector_offset,
-						     cancellable,
-						     error);
-		if (chunk_tmp == NULL)
+		/* read chunk of data to the end of the buffer, which only
+		 * reallocates if the size was not known in advance */
+		g_byte_array_set_size (buf, total_size + transfer_size);
+		chunk_size = 0;
+		if (!dfu_target_upload_chunk_into (target,
+						   i - dfuse_block_start + dfuse_sector_offset,
+						   buf->data + total_size,
+						   &chunk_size,
+						   cancellable,
+						   error))
 			return NULL;
 
 		/* keep a sum of all the chunks */
-		chunk_size = g_bytes_get_size (chunk_tmp);
 		total_size += chunk_size;
 		offset += chunk_size;
-
-		/* add to array */
 		g_debug ("got #%04x chunk of size %" G_GSIZE_FORMAT,
 			 i, chunk_size);
-		g_ptr_array_add (chunks, chunk_tmp);
 
 		/* update UI */
-		if (chunk_size > 0) {
+		if (chunk_size > 0 && expected_size > 0) {
 			guint percentage = (total_size * 100) / expected_size;
 			if (percentage != old_percentage) {
 				g_signal_emit (target,
@@ -1024,8 +1453,16 @@ dfu_target_upload_element (DfuTarget *target,
 		/* detect short write as EOF */
 		if (chunk_size < transfer_size)
 			break;
+
+		/* DfuSe devices will happily read past the region */
+		if (expected_size > 0 && total_size >= expected_size)
+			break;
 	}
 
+	/* the last chunk may have been a full transfer */
+	if (expected_size > 0 && total_size > expected_size)
+		total_size = expected_size;
+
 	/* check final size */
 	if (expected_size > 0) {
 		if (total_size != expected_size) {
@@ -1039,19 +1476,9 @@ dfu_target_upload_element (DfuTarget *target,
 		}
 	}
 
-	/* stitch them all together */
-	offset = 0;
-	buffer = g_malloc0 (total_size);
-	for (i = 0; i < chunks->len; i++) {
-		const guint8 *chunk_data;
-		chunk_tmp = g_ptr_array_index (chunks, i);
-		chunk_data = g_bytes_get_data (chunk_tmp, &chunk_size);
-		memcpy (buffer + offset, chunk_data, chunk_size);
-		offset += chunk_size;
-	}
-
-	/* create new image */
-	contents = g_bytes_new_take (buffer, total_size);
+	/* create new image without copying the data */
+	g_byte_array_set_size (buf, total_size);
+	contents = g_byte_array_free_to_bytes (g_steal_pointer (&buf));
 	element = dfu_element_new ();
 	dfu_element_set_contents (element, contents);
 	return element;
@@ -1137,6 +1564,12 @@ dfu_target_upload (DfuTarget *target,
 		if (element == NULL)
 			return NULL;
 
+		/* a DfuSe upload stops at the end of the zone rather than
+		 * with a short frame, so go back to dfuIDLE */
+		if (dfu_device_has_dfuse_support (priv->device) &&
+		    !dfu_device_abort (priv->device, cancellable, error))
+			return NULL;
+
 		/* this element was uploaded okay */
 		dfu_image_add_element (image, element);
 
@@ -1166,185 +1599,1002 @@ dfu_target_upload (DfuTarget *target,
 }
 
 /**
- * _g_bytes_compare_verbose:
+ * dfu_target_sectors_pending_adjust:
+ *
+ * Counts the elements that still have to be downloaded into each sector.
  **/
-static gchar *
-_g_bytes_compare_verbose (GBytes *bytes1, GBytes *bytes2)
+static void
+dfu_target_sectors_pending_adjust (DfuTarget *target,
+				   DfuElement *element,
+				   gint delta)
 {
-	const guint8 *data1;
-	const guint8 *data2;
-	gsize length1;
-	gsize length2;
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
 	guint i;
+	g_autoptr(GPtrArray) sectors = NULL;
+
+	sectors = dfu_target_get_sectors_for_range (target,
+						    dfu_element_get_address (element),
+						    dfu_element_get_size (element));
+	for (i = 0; i < sectors->len; i++) {
+		DfuSector *sector = g_ptr_array_index (sectors, i);
+		gint cnt = GPOINTER_TO_INT (g_hash_table_lookup (priv->sectors_pending, sector));
+		cnt += delta;
+		if (cnt > 0)
+			g_hash_table_insert (priv->sectors_pending, sector, GINT_TO_POINTER (cnt));
+		else
+			g_hash_table_remove (priv->sectors_pending, sector);
+	}
+}
 
-	data1 = g_bytes_get_data (bytes1, &length1);
-	data2 = g_bytes_get_data (bytes2, &length2);
+/**
+ * dfu_target_sector_is_shared:
+ *
+ * Returns %TRUE if an element after the current one also writes to the
+ * sector, in which case the sector is not complete until that is done.
+ **/
+static gboolean
+dfu_target_sector_is_shared (DfuTarget *target, DfuSector *sector)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	return GPOINTER_TO_INT (g_hash_table_lookup (priv->sectors_pending, sector)) > 1;
+}
 
-	/* not the same length */
-	if (length1 != length2) {
-		return g_strdup_printf ("got %" G_GSIZE_FORMAT " bytes, "
-					"expected %" G_GSIZE_FORMAT,
-					length1, length2);
-	}
+/**
+ * dfu_target_journal_set_sector:
+ *
+ * Records the progress for one sector, saving the journal if it changed.
+ * A sector shared with a later element stays as being written, so that
+ * resuming does not skip the data the later element has to write.
+ **/
+static gboolean
+dfu_target_journal_set_sector (DfuTarget *target,
+			       DfuSector *sector,
+			       DfuJournalState state,
+			       GError **error)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	if (priv->journal == NULL || sector == NULL)
+		return TRUE;
+	if (state >= DFU_JOURNAL_STATE_WRITTEN &&
+	    dfu_target_sector_is_shared (target, sector))
+		return TRUE;
+	if (!dfu_journal_set_state (priv->journal,
+				    dfu_sector_get_address (sector),
+				    state))
+		return TRUE;
+	return dfu_journal_save (priv->journal, error);
+}
 
-	/* return 00 01 02 03 */
-	for (i = 0; i < length1; i++) {
-		if (data1[i] != data2[i]) {
-			return g_strdup_printf ("got 0x%02x, expected 0x%02x @ 0x%04x",
-						data1[i], data2[i], i);
-		}
+/**
+ * dfu_target_journal_set_sectors:
+ *
+ * Records the progress for several sectors, saving the journal once.
+ **/
+static gboolean
+dfu_target_journal_set_sectors (DfuTarget *target,
+				GPtrArray *sectors,
+				DfuJournalState state,
+				GError **error)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	gboolean changed = FALSE;
+	guint i;
+
+	if (priv->journal == NULL)
+		return TRUE;
+	for (i = 0; i < sectors->len; i++) {
+		DfuSector *sector = g_ptr_array_index (sectors, i);
+		if (dfu_journal_set_state (priv->journal,
+					   dfu_sector_get_address (sector),
+					   state))
+			changed = TRUE;
 	}
-	return NULL;
+	if (!changed)
+		return TRUE;
+	return dfu_journal_save (priv->journal, error);
 }
 
 /**
- * dfu_target_download_element:
+ * dfu_target_journal_write_chunk:
+ *
+ * Records that a chunk is about to be written. The sector that the
+ * previous chunk started in is then complete, and every sector that this
+ * chunk covers has to be erased again if the download is interrupted.
  **/
 static gboolean
-dfu_target_download_element (DfuTarget *target,
-			     DfuElement *element,
-			     DfuTargetTransferFlags flags,
-			     GCancellable *cancellable,
-			     GError **error)
+dfu_target_journal_write_chunk (DfuTarget *target,
+				guint32 address,
+				gsize length,
+				DfuSector **sector_last,
+				GError **error)
 {
 	DfuTargetPrivate *priv = GET_PRIVATE (target);
 	DfuSector *sector;
-	GBytes *bytes;
+	gboolean changed = FALSE;
 	guint i;
-	guint nr_chunks;
-	guint dfuse_sector_offset = 0;
-	guint last_sector_id = G_MAXUINT;
-	guint old_percentage = G_MAXUINT;
-	guint16 transfer_size = dfu_device_get_transfer_size (priv->device);
-	g_autoptr(GError) error_local = NULL;
-
-	/* ST uses wBlockNum=0 for DfuSe commands and wBlockNum=1 is reserved */
-	if (dfu_device_has_dfuse_support (priv->device))
-		dfuse_sector_offset = 2;
+	g_autoptr(GPtrArray) sectors = NULL;
 
-	/* round up as we have to transfer incomplete blocks */
-	bytes = dfu_element_get_contents (element);
-	nr_chunks = ceil ((gdouble) g_bytes_get_size (bytes) /
-			  (gdouble) transfer_size);
-	if (nr_chunks == 0) {
-		g_set_error_literal (error,
-				     DFU_ERROR,
-				     DFU_ERROR_INVALID_FILE,
-				     "zero-length firmware");
-		return FALSE;
+	sectors = dfu_target_get_sectors_for_range (target, address, length);
+	if (sectors->len == 0)
+		return TRUE;
+	sector = g_ptr_array_index (sectors, 0);
+	if (*sector_last != NULL && *sector_last != sector &&
+	    !dfu_target_sector_is_shared (target, *sector_last)) {
+		if (dfu_journal_set_state (priv->journal,
+					   dfu_sector_get_address (*sector_last),
+					   DFU_JOURNAL_STATE_WRITTEN))
+			changed = TRUE;
 	}
-	for (i = 0; i < nr_chunks + 1; i++) {
+	*sector_last = sector;
+	for (i = 0; i < sectors->len; i++) {
+		sector = g_ptr_array_index (sectors, i);
+		if (dfu_journal_set_state (priv->journal,
+					   dfu_sector_get_address (sector),
+					   DFU_JOURNAL_STATE_WRITING))
+			changed = TRUE;
+	}
+	if (!changed)
+		return TRUE;
+	return dfu_journal_save (priv->journal, error);
+}
+
+/**
+ * dfu_target_verify_element:
+ *
+ * Reads back the element from the device one chunk at a time, comparing
+ * each chunk with the firmware as it arrives so that the first difference
+ * is reported without reading the rest of the device.
+ **/
+static gboolean
+dfu_target_verify_element (DfuTarget *target,
+			   DfuElement *element,
+			   GCancellable *cancellable,
+			   GError **error)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	DfuSector *sector = NULL;
+	gsize offset = 0;
+	gsize size = dfu_element_get_size (element);
+	guint32 address = dfu_element_get_address (element);
+	guint32 last_sector_id = G_MAXUINT;
+	guint dfuse_sector_offset = 0;
+	guint dfuse_block_start = 0;
+	guint i;
+	guint old_percentage = G_MAXUINT;
+	guint16 transfer_size = dfu_device_get_transfer_size (priv->device);
+	gboolean uploading = FALSE;
+	g_autofree guint8 *buf = NULL;
+	DfuSector *journal_sector = NULL;
+
+	/* ST uses wBlockNum=0 for DfuSe commands and wBlockNum=1 is reserved */
+	if (dfu_device_has_dfuse_support (priv->device))
+		dfuse_sector_offset = 2;
+
+	/* only ever one chunk in memory */
+	buf = g_malloc (transfer_size);
+	for (i = 0; offset < size; i++) {
+		const guint8 *data;
+		gsize chunk_size = 0;
 		gsize length;
-		gsize offset;
 		guint percentage;
-		g_autoptr(GBytes) bytes_tmp = NULL;
+		g_autoptr(GBytes) bytes = NULL;
 
-		/* caclulate the offset into the element data */
-		offset = i * transfer_size;
+		/* stop between chunks if cancelled */
+		if (g_cancellable_set_error_if_cancelled (cancellable, error))
+			return FALSE;
 
-		/* for DfuSe devices we need to handle the erase and setting
-		 * the address manually */
+		/* for DfuSe devices we need to handle the address manually */
 		if (dfu_device_has_dfuse_support (priv->device)) {
 
 			/* check the sector with this element address is suitable */
-			sector = dfu_target_get_sector_for_addr (target, offset);
+			sector = dfu_target_get_sector_for_addr (target, address + offset);
 			if (sector == NULL) {
 				g_set_error (error,
 					     DFU_ERROR,
 					     DFU_ERROR_INVALID_DEVICE,
 					     "no memory sector at 0x%04x",
-					     (guint) offset);
+					     (guint) (address + offset));
 				return FALSE;
 			}
-			if (!dfu_sector_has_cap (sector, DFU_SECTOR_CAP_WRITEABLE)) {
+			if (!dfu_sector_has_cap (sector, DFU_SECTOR_CAP_READABLE)) {
 				g_set_error (error,
 					     DFU_ERROR,
 					     DFU_ERROR_INVALID_DEVICE,
-					     "memory sector at 0x%04x is not writable",
-					     (guint) offset);
+					     "memory sector at 0x%04x is not readble",
+					     (guint) (address + offset));
 				return FALSE;
 			}
 
-			/* if it's erasable and not yet blanked */
-			if (!dfu_sector_has_cap (sector, DFU_SECTOR_CAP_ERASEABLE) &&
-			    g_hash_table_lookup (priv->sectors_erased, sector) == NULL) {
-				g_debug ("erasing DfuSe address at 0x%04x", (guint) offset);
-				if (!dfu_target_erase_address (target,
-							       offset,
-							       cancellable,
-							       error))
-					return FALSE;
-				g_hash_table_insert (priv->sectors_erased,
-						     sector,
-						     GINT_TO_POINTER (1));
+			/* an earlier download already read this back */
+			if (priv->journal != NULL &&
+			    dfu_journal_get_state (priv->journal,
+						   dfu_sector_get_address (sector)) == DFU_JOURNAL_STATE_VERIFIED) {
+				length = MIN (transfer_size, size - offset);
+				if (address + offset + length <=
+				    dfu_sector_get_address (sector) + dfu_sector_get_size (sector)) {
+					g_debug ("skipping verified #%04x chunk", i);
+					offset += length;
+					last_sector_id = G_MAXUINT;
+					continue;
+				}
 			}
 
-			/* manually set the sector address */
+			/* manually set the sector address, which is a DNLOAD
+			 * and so is stalled in dfuUPLOAD-IDLE */
 			if (dfu_sector_get_id (sector) != last_sector_id) {
-				g_debug ("setting DfuSe address to 0x%04x", (guint) offset);
+				if (uploading) {
+					if (!dfu_device_abort (priv->device, cancellable, error))
+						return FALSE;
+					uploading = FALSE;
+				}
+				g_debug ("setting DfuSe address to 0x%04x",
+					 (guint) (address + offset));
 				if (!dfu_target_set_address (target,
-							     offset,
+							     address + offset,
 							     cancellable,
 							     error))
 					return FALSE;
+
+				/* leave dfuDNLOAD-IDLE before uploading */
+				if (!dfu_device_abort (priv->device, cancellable, error))
+					return FALSE;
 				last_sector_id = dfu_sector_get_id (sector);
+				dfuse_block_start = i;
 			}
 		}
 
+		/* read chunk of data */
+		if (!dfu_target_upload_chunk_into (target,
+						   i - dfuse_block_start + dfuse_sector_offset,
+						   buf,
+						   &chunk_size,
+						   cancellable,
+						   error))
+			return FALSE;
+		uploading = TRUE;
+
+		/* compare with the same part of the firmware */
+		length = MIN (chunk_size, size - offset);
+		bytes = dfu_element_get_chunk (element, offset, length,
+					       cancellable, error);
+		if (bytes == NULL)
+			return FALSE;
+		data = g_bytes_get_data (bytes, NULL);
+		if (memcmp (buf, data, length) != 0) {
+			gsize j;
+			for (j = 0; buf[j] == data[j]; j++);
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_VERIFY_FAILED,
+				     "verify failed: got 0x%02x, expected 0x%02x @ 0x%04x",
+				     buf[j], data[j], (guint) (address + offset + j));
+			return FALSE;
+		}
+		offset += length;
+
+		/* the last sector has been completely read back */
+		if (priv->journal != NULL && sector != journal_sector) {
+			if (!dfu_target_journal_set_sector (target, journal_sector,
+							    DFU_JOURNAL_STATE_VERIFIED,
+							    error))
+				return FALSE;
+			journal_sector = sector;
+		}
+
+		/* update UI */
+		percentage = (offset * 100) / size;
+		if (percentage != old_percentage) {
+			g_signal_emit (target,
+				       signals[SIGNAL_PERCENTAGE_CHANGED],
+				       0, percentage);
+			old_percentage = percentage;
+		}
+
+		/* detect short read as EOF */
+		if (chunk_size < transfer_size && offset < size) {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_VERIFY_FAILED,
+				     "verify failed: got %" G_GSIZE_FORMAT " bytes, "
+				     "expected %" G_GSIZE_FORMAT,
+				     offset, size);
+			return FALSE;
+		}
+	}
+
+	/* the upload was not read to the end */
+	if (!dfu_target_journal_set_sector (target, journal_sector,
+					    DFU_JOURNAL_STATE_VERIFIED,
+					    error))
+		return FALSE;
+	return dfu_device_abort (priv->device, cancellable, error);
+}
+
+/**
+ * dfu_target_sector_sort_cb:
+ **/
+static gint
+dfu_target_sector_sort_cb (gconstpointer a, gconstpointer b)
+{
+	DfuSector *sector1 = *((DfuSector **) a);
+	DfuSector *sector2 = *((DfuSector **) b);
+	if (dfu_sector_get_address (sector1) < dfu_sector_get_address (sector2))
+		return -1;
+	if (dfu_sector_get_address (sector1) > dfu_sector_get_address (sector2))
+		return 1;
+	return 0;
+}
+
+/**
+ * dfu_target_get_erase_plan:
+ * @target: a #DfuTarget
+ * @image: a #DfuImage
+ *
+ * Works out which sectors have to be erased before all the elements in
+ * the image can be written.
+ *
+ * Returns: (transfer container) (element-type DfuSector): erasable
+ * sectors sorted by address, each only listed once
+ **/
+GPtrArray *
+dfu_target_get_erase_plan (DfuTarget *target, DfuImage *image)
+{
+	GPtrArray *elements;
+	GPtrArray *plan;
+	guint i;
+	guint j;
+	g_autoptr(GHashTable) hash = NULL;
+
+	plan = g_ptr_array_new ();
+	hash = g_hash_table_new (g_direct_hash, g_direct_equal);
+	elements = dfu_image_get_elements (image);
+	for (i = 0; i < elements->len; i++) {
+		DfuElement *element = g_ptr_array_index (elements, i);
+		g_autoptr(GPtrArray) sectors = NULL;
+		sectors = dfu_target_get_sectors_for_range (target,
+							    dfu_element_get_address (element),
+							    dfu_element_get_size (element));
+		for (j = 0; j < sectors->len; j++) {
+			DfuSector *sector = g_ptr_array_index (sectors, j);
+			if (!dfu_sector_has_cap (sector, DFU_SECTOR_CAP_ERASEABLE))
+				continue;
+			if (g_hash_table_contains (hash, sector))
+				continue;
+			g_hash_table_add (hash, sector);
+			g_ptr_array_add (plan, sector);
+		}
+	}
+	g_ptr_array_sort (plan, dfu_target_sector_sort_cb);
+	return plan;
+}
+
+/**
+ * dfu_target_has_dfuse_command:
+ *
+ * Checks the DfuSe "Get Command" list, which is only read from the
+ * device the first time it is needed.
+ **/
+static gboolean
+dfu_target_has_dfuse_command (DfuTarget *target,
+			      DfuCmdDfuse cmd,
+			      GCancellable *cancellable)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	const guint8 *data;
+	gsize len;
+	guint i;
+
+	if (priv->dfuse_commands == NULL) {
+		g_autoptr(GError) error_local = NULL;
+		g_autoptr(GError) error_abort = NULL;
+		priv->dfuse_commands = dfu_target_upload_chunk (target, 0,
+								cancellable,
+								&error_local);
+		if (priv->dfuse_commands == NULL) {
+			g_debug ("failed to get DfuSe commands: %s",
+				 error_local->message);
+			priv->dfuse_commands = g_bytes_new (NULL, 0);
+		}
+
+		/* go back to dfuIDLE */
+		if (!dfu_device_abort (priv->device, cancellable, &error_abort))
+			g_debug ("failed to abort: %s", error_abort->message);
+	}
+
+	data = g_bytes_get_data (priv->dfuse_commands, &len);
+	for (i = 0; i < len; i++) {
+		if (data[i] == cmd)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * dfu_target_erase_sectors:
+ *
+ * Erases sectors before they are written, using a mass erase if the
+ * sectors are all the erasable memory on the target.
+ **/
+static gboolean
+dfu_target_erase_sectors (DfuTarget *target,
+			  GPtrArray *sectors,
+			  GCancellable *cancellable,
+			  GError **error)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	guint i;
+	guint nr_erasable = 0;
+	guint old_percentage = G_MAXUINT;
+
+	if (sectors->len == 0)
+		return TRUE;
+
+	/* the plan never contains duplicates, so just compare the size */
+	for (i = 0; i < priv->sectors->len; i++) {
+		DfuSector *sector = g_ptr_array_index (priv->sectors, i);
+		if (dfu_sector_has_cap (sector, DFU_SECTOR_CAP_ERASEABLE))
+			nr_erasable++;
+	}
+	if (sectors->len == nr_erasable &&
+	    dfu_target_has_dfuse_command (target, DFU_CMD_DFUSE_ERASE, cancellable)) {
+		g_debug ("mass erasing all %u sectors", nr_erasable);
+		g_signal_emit (target, signals[SIGNAL_PERCENTAGE_CHANGED], 0, 0);
+		if (!dfu_target_mass_erase (target, cancellable, error))
+			return FALSE;
+		g_signal_emit (target, signals[SIGNAL_PERCENTAGE_CHANGED], 0, 100);
+		return TRUE;
+	}
+
+	/* erase each sector in address order */
+	for (i = 0; i < sectors->len; i++) {
+		DfuSector *sector = g_ptr_array_index (sectors, i);
+		guint percentage = (i * 100) / sectors->len;
+		if (percentage != old_percentage) {
+			g_signal_emit (target,
+				       signals[SIGNAL_PERCENTAGE_CHANGED],
+				       0, percentage);
+			old_percentage = percentage;
+		}
+		g_debug ("erasing DfuSe address at 0x%04x",
+			 dfu_sector_get_address (sector));
+		if (!dfu_target_erase_address (target,
+					       dfu_sector_get_address (sector),
+					       cancellable,
+					       error))
+			return FALSE;
+	}
+	g_signal_emit (target, signals[SIGNAL_PERCENTAGE_CHANGED], 0, 100);
+	return TRUE;
+}
+
+/**
+ * dfu_target_sectors_unchanged_fixup:
+ *
+ * A chunk that spans sectors has to be written if any of them has
+ * changed, and so all of those sectors also have to be erased.
+ **/
+static void
+dfu_target_sectors_unchanged_fixup (DfuTarget *target, DfuImage *image)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	GPtrArray *elements;
+	gboolean modified;
+	guint i;
+	guint j;
+	guint16 transfer_size = dfu_device_get_transfer_size (priv->device);
+
+	elements = dfu_image_get_elements (image);
+	do {
+		modified = FALSE;
+		for (i = 0; i < elements->len; i++) {
+			DfuElement *element = g_ptr_array_index (elements, i);
+			gsize size = dfu_element_get_size (element);
+			gsize offset;
+			for (offset = 0; offset < size; offset += transfer_size) {
+				gboolean changed = FALSE;
+				g_autoptr(GPtrArray) chunk = NULL;
+				chunk = dfu_target_get_sectors_for_range (target,
+									  dfu_element_get_address (element) + offset,
+									  MIN (transfer_size, size - offset));
+				if (chunk->len < 2)
+					continue;
+				for (j = 0; j < chunk->len; j++) {
+					DfuSector *sector = g_ptr_array_index (chunk, j);
+					if (!g_hash_table_contains (priv->sectors_unchanged, sector))
+						changed = TRUE;
+				}
+				if (!changed)
+					continue;
+				for (j = 0; j < chunk->len; j++) {
+					DfuSector *sector = g_ptr_array_index (chunk, j);
+					if (g_hash_table_remove (priv->sectors_unchanged, sector))
+						modified = TRUE;
+				}
+			}
+		}
+	} while (modified);
+}
+
+/**
+ * dfu_target_remove_unchanged_sectors:
+ *
+ * Reads back the parts of each sector that the image covers, and removes
+ * the sectors that already contain the new data from the erase plan.
+ * Chunks that cover these sectors are not written.
+ **/
+static gboolean
+dfu_target_remove_unchanged_sectors (DfuTarget *target,
+				     DfuImage *image,
+				     GPtrArray *sectors,
+				     GCancellable *cancellable,
+				     GError **error)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	GPtrArray *elements;
+	guint i;
+	guint j;
+
+	elements = dfu_image_get_elements (image);
+	for (i = 0; i < sectors->len; i++) {
+		DfuSector *sector = g_ptr_array_index (sectors, i);
+		gboolean changed = FALSE;
+		guint32 sector_start = dfu_sector_get_address (sector);
+		guint32 sector_end = sector_start + dfu_sector_get_size (sector);
+
+		/* only compare the data that is going to be written */
+		for (j = 0; j < elements->len && !changed; j++) {
+			DfuElement *element = g_ptr_array_index (elements, j);
+			guint32 addr = dfu_element_get_address (element);
+			guint32 start = MAX (addr, sector_start);
+			guint32 end = MIN (addr + dfu_element_get_size (element), sector_end);
+			g_autoptr(DfuElement) element_tmp = NULL;
+			g_autoptr(GBytes) bytes = NULL;
+			if (start >= end)
+				continue;
+			bytes = dfu_element_get_chunk (element, start - addr,
+						       end - start,
+						       cancellable, error);
+			if (bytes == NULL)
+				return FALSE;
+			element_tmp = dfu_target_upload_element (target, start,
+								 end - start,
+								 cancellable,
+								 error);
+			if (element_tmp == NULL)
+				return FALSE;
+
+			/* a DfuSe device in dfuUPLOAD-IDLE stalls the next
+			 * SetAddress or DNLOAD, so go back to dfuIDLE */
+			if (!dfu_device_abort (priv->device, cancellable, error))
+				return FALSE;
+			if (g_bytes_compare (dfu_element_get_contents (element_tmp),
+					     bytes) != 0)
+				changed = TRUE;
+		}
+		if (!changed)
+			g_hash_table_add (priv->sectors_unchanged, sector);
+	}
+
+	dfu_target_sectors_unchanged_fixup (target, image);
+
+	/* these do not need erasing */
+	for (i = 0; i < sectors->len; ) {
+		DfuSector *sector = g_ptr_array_index (sectors, i);
+		if (g_hash_table_contains (priv->sectors_unchanged, sector)) {
+			g_ptr_array_remove_index (sectors, i);
+			continue;
+		}
+		i++;
+	}
+	g_debug ("%u sectors unchanged, %u need writing",
+		 g_hash_table_size (priv->sectors_unchanged), sectors->len);
+	return TRUE;
+}
+
+/**
+ * dfu_target_journal_get_prefix:
+ *
+ * Gets the start of the journal filenames for this target. The serial
+ * number is included when known so that identical devices plugged into
+ * the same port one after the other do not share a journal.
+ **/
+static gchar *
+dfu_target_journal_get_prefix (DfuTarget *target)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	const gchar *serial = dfu_device_get_serial_number (priv->device);
+	gchar *prefix;
+
+	if (serial != NULL) {
+		prefix = g_strdup_printf ("%s-%s-%02x-",
+					  dfu_device_get_platform_id (priv->device),
+					  serial, priv->alt_setting);
+	} else {
+		prefix = g_strdup_printf ("%s-%02x-",
+					  dfu_device_get_platform_id (priv->device),
+					  priv->alt_setting);
+	}
+	g_strdelimit (prefix, "/\\", '_');
+	return prefix;
+}
+
+/**
+ * dfu_target_journal_remove_stale:
+ *
+ * Deletes the journals left by interrupted downloads of this target,
+ * apart from @basename_keep if set.
+ **/
+static gboolean
+dfu_target_journal_remove_stale (DfuTarget *target,
+				 const gchar *basename_keep,
+				 GError **error)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	const gchar *journal_dir = dfu_device_get_journal_dir (priv->device);
+	const gchar *fn;
+	g_autofree gchar *prefix = NULL;
+	g_autoptr(GDir) dir = NULL;
+
+	/* nothing has ever been journalled */
+	dir = g_dir_open (journal_dir, 0, NULL);
+	if (dir == NULL)
+		return TRUE;
+	prefix = dfu_target_journal_get_prefix (target);
+	while ((fn = g_dir_read_name (dir)) != NULL) {
+		g_autofree gchar *filename = NULL;
+		if (!g_str_has_prefix (fn, prefix) ||
+		    !g_str_has_suffix (fn, ".conf"))
+			continue;
+		if (g_strcmp0 (fn, basename_keep) == 0)
+			continue;
+		filename = g_build_filename (journal_dir, fn, NULL);
+		g_debug ("removing stale journal %s", filename);
+		if (g_unlink (filename) != 0 && errno != ENOENT) {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INTERNAL,
+				     "failed to delete %s: %s",
+				     filename, g_strerror (errno));
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * dfu_target_journal_load:
+ *
+ * Loads the journal for the image, and removes the sectors that an
+ * interrupted download already wrote from the erase plan. Sectors that
+ * were erased but not written to do not have to be erased again either.
+ **/
+static gboolean
+dfu_target_journal_load (DfuTarget *target,
+			 DfuImage *image,
+			 GPtrArray *sectors,
+			 GCancellable *cancellable,
+			 GError **error)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	guint i;
+	g_autofree gchar *basename = NULL;
+	g_autofree gchar *digest = NULL;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *prefix = NULL;
+
+	/* one file for each target and image so devices can be written in
+	 * parallel, and a different image never resumes the wrong journal */
+	digest = dfu_journal_get_image_digest (image, cancellable, error);
+	if (digest == NULL)
+		return FALSE;
+	prefix = dfu_target_journal_get_prefix (target);
+	basename = g_strdup_printf ("%s%s.conf", prefix, digest);
+	if (!dfu_target_journal_remove_stale (target, basename, error))
+		return FALSE;
+	filename = g_build_filename (dfu_device_get_journal_dir (priv->device),
+				     basename, NULL);
+	priv->journal = dfu_journal_new ();
+	if (!dfu_journal_load (priv->journal, filename, digest, error))
+		return FALSE;
+
+	/* the data is already there, and is checked when verifying */
+	for (i = 0; i < sectors->len; i++) {
+		DfuSector *sector = g_ptr_array_index (sectors, i);
+		switch (dfu_journal_get_state (priv->journal,
+					       dfu_sector_get_address (sector))) {
+		case DFU_JOURNAL_STATE_WRITTEN:
+		case DFU_JOURNAL_STATE_VERIFIED:
+			g_hash_table_add (priv->sectors_unchanged, sector);
+			break;
+		default:
+			break;
+		}
+	}
+	dfu_target_sectors_unchanged_fixup (target, image);
+
+	/* these do not need erasing */
+	for (i = 0; i < sectors->len; ) {
+		DfuSector *sector = g_ptr_array_index (sectors, i);
+		if (g_hash_table_contains (priv->sectors_unchanged, sector) ||
+		    dfu_journal_get_state (priv->journal,
+					   dfu_sector_get_address (sector)) == DFU_JOURNAL_STATE_ERASED) {
+			g_ptr_array_remove_index (sectors, i);
+			continue;
+		}
+		i++;
+	}
+	g_debug ("resuming with %u sectors already written, %u need erasing",
+		 g_hash_table_size (priv->sectors_unchanged), sectors->len);
+	return TRUE;
+}
+
+/**
+ * dfu_target_check_sectors_writable:
+ *
+ * Checks that [@addr, @addr + @length) is completely covered by sectors
+ * that can all be written.
+ **/
+static gboolean
+dfu_target_check_sectors_writable (DfuTarget *target,
+				   guint32 addr,
+				   gsize length,
+				   GError **error)
+{
+	guint64 addr_end = (guint64) addr + length;
+	guint64 addr_next = addr;
+	guint i;
+	g_autoptr(GPtrArray) sectors = NULL;
+
+	sectors = dfu_target_get_sectors_for_range (target, addr, length);
+	for (i = 0; i < sectors->len && addr_next < addr_end; i++) {
+		DfuSector *sector = g_ptr_array_index (sectors, i);
+		guint64 sector_end;
+		if (dfu_sector_get_address (sector) > addr_next)
+			break;
+		if (!dfu_sector_has_cap (sector, DFU_SECTOR_CAP_WRITEABLE)) {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INVALID_DEVICE,
+				     "memory sector at 0x%04x is not writable",
+				     dfu_sector_get_address (sector));
+			return FALSE;
+		}
+		sector_end = (guint64) dfu_sector_get_address (sector) +
+			     dfu_sector_get_size (sector);
+		addr_next = MAX (addr_next, sector_end);
+	}
+	if (addr_next < addr_end) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INVALID_DEVICE,
+			     "no memory sector at 0x%04x",
+			     (guint) addr_next);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * dfu_target_chunk_is_blank:
+ * @bytes: a #GBytes
+ *
+ * Checks if a chunk only contains 0xff, i.e. what erased flash reads
+ * back as. This compares 64 bits at a time as the images can be large.
+ *
+ * Return value: %TRUE if the chunk is blank
+ **/
+gboolean
+dfu_target_chunk_is_blank (GBytes *bytes)
+{
+	const guint8 *data;
+	gsize len;
+	gsize i = 0;
+
+	data = g_bytes_get_data (bytes, &len);
+	if (len == 0)
+		return FALSE;
+
+	/* align so the 64 bit loads are cheap */
+	for (; i < len && ((guintptr) (data + i) & 7) != 0; i++) {
+		if (data[i] != 0xff)
+			return FALSE;
+	}
+	for (; i + 8 <= len; i += 8) {
+		guint64 tmp;
+		memcpy (&tmp, data + i, 8);
+		if (tmp != G_MAXUINT64)
+			return FALSE;
+	}
+
+	/* trailing bytes */
+	for (; i < len; i++) {
+		if (data[i] != 0xff)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * dfu_target_download_element:
+ **/
+static gboolean
+dfu_target_download_element (DfuTarget *target,
+			     DfuElement *element,
+			     DfuTargetTransferFlags flags,
+			     GCancellable *cancellable,
+			     GError **error)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	DfuSector *sector;
+	gsize size;
+	guint i;
+	guint nr_chunks;
+	guint dfuse_sector_offset = 0;
+	guint dfuse_block_start = 0;
+	guint last_sector_id = G_MAXUINT;
+	guint old_percentage = G_MAXUINT;
+	guint waited_ms = 0;
+	gsize bytes_skipped = 0;
+	gint64 time_start = g_get_monotonic_time ();
+	gdouble elapsed;
+	guint16 transfer_size = dfu_device_get_transfer_size (priv->device);
+	DfuSector *journal_sector = NULL;
+	g_autoptr(GError) error_local = NULL;
+
+	/* ST uses wBlockNum=0 for DfuSe commands and wBlockNum=1 is reserved */
+	if (dfu_device_has_dfuse_support (priv->device))
+		dfuse_sector_offset = 2;
+
+	/* round up as we have to transfer incomplete blocks; the element
+	 * data may be backed by a stream so only read one chunk at a time */
+	size = dfu_element_get_size (element);
+	nr_chunks = ceil ((gdouble) size / (gdouble) transfer_size);
+	if (nr_chunks == 0) {
+		g_set_error_literal (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INVALID_FILE,
+				     "zero-length firmware");
+		return FALSE;
+	}
+
+	for (i = 0; i < nr_chunks + 1; i++) {
+		gsize offset;
+		guint32 address;
+		guint percentage;
+		g_autoptr(GBytes) bytes_tmp = NULL;
+
+		/* stop between chunks if cancelled */
+		if (g_cancellable_set_error_if_cancelled (cancellable, error))
+			return FALSE;
+
+		/* leave the device waiting for more data */
+		if (i == nr_chunks && (flags & DFU_TARGET_TRANSFER_FLAG_NO_MANIFEST) > 0)
+			break;
+
+		/* caclulate the offset into the element data */
+		offset = i * transfer_size;
+		address = dfu_element_get_address (element) + offset;
+
 		/* we have to write one final zero-sized chunk for EOF */
 		if (i < nr_chunks) {
-			length = g_bytes_get_size (bytes) - offset;
-			if (length > transfer_size)
-				length = transfer_size;
-			bytes_tmp = g_bytes_new_from_bytes (bytes, offset, length);
+			bytes_tmp = dfu_element_get_chunk (element, offset,
+							   transfer_size,
+							   cancellable, error);
+			if (bytes_tmp == NULL)
+				return FALSE;
 		} else {
 			bytes_tmp = g_bytes_new (NULL, 0);
 		}
+
+		/* for DfuSe devices we need to handle setting the address
+		 * manually, apart from the final EOF chunk */
+		if (dfu_device_has_dfuse_support (priv->device) && i < nr_chunks) {
+
+			/* check the sector with this element address is suitable */
+			sector = dfu_target_get_sector_for_addr (target, address);
+			if (sector == NULL) {
+				g_set_error (error,
+					     DFU_ERROR,
+					     DFU_ERROR_INVALID_DEVICE,
+					     "no memory sector at 0x%04x",
+					     address);
+				return FALSE;
+			}
+
+			/* the data in the sector is already correct */
+			if (g_hash_table_contains (priv->sectors_unchanged, sector)) {
+				g_debug ("skipping unchanged #%04x chunk", i);
+				bytes_skipped += g_bytes_get_size (bytes_tmp);
+				last_sector_id = G_MAXUINT;
+				continue;
+			}
+
+			/* the sector has already been erased, so writing 0xff
+			 * is a no-op; the address has to be set again when
+			 * the writes resume as the block number is implicit */
+			if ((flags & DFU_TARGET_TRANSFER_FLAG_SKIP_BLANK) &&
+			    dfu_sector_has_cap (sector, DFU_SECTOR_CAP_ERASEABLE) &&
+			    dfu_target_chunk_is_blank (bytes_tmp)) {
+				g_debug ("skipping blank #%04x chunk", i);
+				bytes_skipped += g_bytes_get_size (bytes_tmp);
+				last_sector_id = G_MAXUINT;
+				continue;
+			}
+
+			/* manually set the sector address */
+			if (dfu_sector_get_id (sector) != last_sector_id) {
+				g_debug ("setting DfuSe address to 0x%04x", address);
+				if (!dfu_target_set_address (target,
+							     address,
+							     cancellable,
+							     error))
+					return FALSE;
+				last_sector_id = dfu_sector_get_id (sector);
+				dfuse_block_start = i;
+			}
+
+			/* so the download can be resumed */
+			if (priv->journal != NULL) {
+				if (!dfu_target_journal_write_chunk (target,
+								     address,
+								     g_bytes_get_size (bytes_tmp),
+								     &journal_sector,
+								     error))
+					return FALSE;
+			}
+		}
 		g_debug ("writing #%04x chunk of size %" G_GSIZE_FORMAT,
 			 i, g_bytes_get_size (bytes_tmp));
 		if (!dfu_target_download_chunk (target,
-						i + dfuse_sector_offset,
+						i - dfuse_block_start + dfuse_sector_offset,
 						bytes_tmp,
 						cancellable,
 						error))
 			return FALSE;
 
 		/* update UI */
-		percentage = (offset * 100) / g_bytes_get_size (bytes);
+		percentage = (offset * 100) / size;
 		if (percentage != old_percentage) {
 			g_signal_emit (target,
 				       signals[SIGNAL_PERCENTAGE_CHANGED],
 				       0, percentage);
 		}
 
-		/* give the target a chance to update */
-		g_usleep (dfu_device_get_download_timeout (priv->device) * 1000);
-
-		/* getting the status moves the state machine to DNLOAD-IDLE */
-		if (!dfu_device_refresh (priv->device, cancellable, error))
+		/* give the target a chance to update, but only if it needs it */
+		if (!dfu_target_wait_for_idle (target, &waited_ms,
+					       cancellable, error))
 			return FALSE;
 	}
 
+	/* report the throughput so the pacing can be tuned */
+	elapsed = (gdouble) (g_get_monotonic_time () - time_start) / G_USEC_PER_SEC;
+	g_debug ("wrote %" G_GSIZE_FORMAT " bytes in %.2fs (%.1f KiB/s), "
+		 "%ums waiting for the device, %" G_GSIZE_FORMAT " bytes skipped",
+		 size, elapsed,
+		 elapsed > 0.f ? (gdouble) size / 1024.f / elapsed : 0.f,
+		 waited_ms, bytes_skipped);
+	priv->bytes_skipped += bytes_skipped;
+	if (!dfu_target_journal_set_sector (target, journal_sector,
+					    DFU_JOURNAL_STATE_WRITTEN,
+					    error))
+		return FALSE;
+
 	/* verify */
 	if (flags & DFU_TARGET_TRANSFER_FLAG_VERIFY) {
-		GBytes *bytes_tmp;
-		g_autoptr(DfuElement) element_tmp = NULL;
-		element_tmp = dfu_target_upload_element (target,
-							 dfu_element_get_address (element),
-							 g_bytes_get_size (bytes),
-							 cancellable,
-							 error);
-		if (element_tmp == NULL)
-			return FALSE;
-		bytes_tmp = dfu_element_get_contents (element_tmp);
-		if (g_bytes_compare (bytes_tmp, bytes) != 0) {
-			g_autofree gchar *bytes_cmp_str = NULL;
-			bytes_cmp_str = _g_bytes_compare_verbose (bytes_tmp, bytes);
-			g_set_error (error,
-				     DFU_ERROR,
-				     DFU_ERROR_VERIFY_FAILED,
-				     "verify failed: %s",
-				     bytes_cmp_str);
+		if (!dfu_target_verify_element (target, element,
+						cancellable, &error_local)) {
+			/* the journal cannot be trusted if the data is wrong */
+			if (priv->journal != NULL &&
+			    g_error_matches (error_local,
+					     DFU_ERROR,
+					     DFU_ERROR_VERIFY_FAILED)) {
+				g_autoptr(GError) error_journal = NULL;
+				if (!dfu_journal_clear (priv->journal, &error_journal)) {
+					g_debug ("failed to clear journal: %s",
+						 error_journal->message);
+				}
+			}
+			g_propagate_error (error, g_steal_pointer (&error_local));
 			return FALSE;
 		}
 	}
@@ -1378,6 +2628,7 @@ dfu_target_download (DfuTarget *target, DfuImage *image,
 	GPtrArray *elements;
 	gboolean ret;
 	guint i;
+	g_autoptr(GPtrArray) elements_flat = NULL;
 
 	g_return_val_if_fail (DFU_IS_TARGET (target), FALSE);
 	g_return_val_if_fail (DFU_IS_IMAGE (image), FALSE);
@@ -1400,11 +2651,8 @@ dfu_target_download (DfuTarget *target, DfuImage *image,
 	if (!dfu_target_use_alt_setting (target, error))
 		return FALSE;
 
-	/* mark these as all erased */
-	if (dfu_device_has_dfuse_support (priv->device))
-		g_hash_table_remove_all (priv->sectors_erased);
-
 	/* download all elements in the image to the device */
+	priv->bytes_skipped = 0;
 	elements = dfu_image_get_elements (image);
 	if (elements->len == 0) {
 		g_set_error_literal (error,
@@ -1413,8 +2661,79 @@ dfu_target_download (DfuTarget *target, DfuImage *image,
 				     "no image elements");
 		return FALSE;
 	}
+
+	/* erase everything that is going to be written in one go */
+	g_hash_table_remove_all (priv->sectors_unchanged);
+	g_hash_table_remove_all (priv->sectors_pending);
+	g_clear_object (&priv->journal);
+	if (dfu_device_has_dfuse_support (priv->device)) {
+		g_autoptr(GPtrArray) sectors = NULL;
+
+		/* check all the sectors before erasing anything */
+		for (i = 0; i < elements->len; i++) {
+			element = g_ptr_array_index (elements, i);
+			if (!dfu_target_check_sectors_writable (target,
+								dfu_element_get_address (element),
+								dfu_element_get_size (element),
+								error))
+				return FALSE;
+		}
+		sectors = dfu_target_get_erase_plan (target, image);
+		if (flags & DFU_TARGET_TRANSFER_FLAG_DIFFERENTIAL) {
+			if (!dfu_target_remove_unchanged_sectors (target, image,
+								  sectors,
+								  cancellable,
+								  error))
+				return FALSE;
+		}
+		if (flags & DFU_TARGET_TRANSFER_FLAG_RESUME) {
+			if (!dfu_target_journal_load (target, image, sectors,
+						      cancellable, error))
+				return FALSE;
+		} else {
+			/* the device is about to be overwritten anyway */
+			if (!dfu_target_journal_remove_stale (target, NULL, error))
+				return FALSE;
+		}
+
+		/* sectors can be shared by more than one element */
+		for (i = 0; i < elements->len; i++) {
+			element = g_ptr_array_index (elements, i);
+			dfu_target_sectors_pending_adjust (target, element, 1);
+		}
+
+		/* the old contents are gone as soon as the erase starts */
+		if (!dfu_target_journal_set_sectors (target, sectors,
+						     DFU_JOURNAL_STATE_UNKNOWN,
+						     error))
+			return FALSE;
+		if (!dfu_target_erase_sectors (target, sectors,
+					       cancellable, error))
+			return FALSE;
+		if (!dfu_target_journal_set_sectors (target, sectors,
+						     DFU_JOURNAL_STATE_ERASED,
+						     error))
+			return FALSE;
+	} else {
+		if (flags & (DFU_TARGET_TRANSFER_FLAG_DIFFERENTIAL |
+			     DFU_TARGET_TRANSFER_FLAG_RESUME))
+			g_debug ("no sector map, so writing all the data");
+
+		/* there is no way to set the address of each element */
+		if (elements->len > 1) {
+			element = dfu_image_get_element_flat (image,
+							      cancellable,
+							      error);
+			if (element == NULL)
+				return FALSE;
+			elements_flat = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+			g_ptr_array_add (elements_flat, element);
+			elements = elements_flat;
+		}
+	}
+
 	for (i = 0; i < elements->len; i++) {
-		element = dfu_image_get_element (image, i);
+		element = g_ptr_array_index (elements, i);
 		g_debug ("downloading element at 0x%04x",
 			 dfu_element_get_address (element));
 		ret = dfu_target_download_element (target,
@@ -1424,6 +2743,14 @@ dfu_target_download (DfuTarget *target, DfuImage *image,
 						   error);
 		if (!ret)
 			return FALSE;
+		dfu_target_sectors_pending_adjust (target, element, -1);
+	}
+
+	/* nothing left to resume */
+	if (priv->journal != NULL) {
+		if (!dfu_journal_clear (priv->journal, error))
+			return FALSE;
+		g_clear_object (&priv->journal);
 	}
 
 	/* attempt to switch back to runtime */
@@ -1447,47 +2774,6 @@ dfu_target_download (DfuTarget *target, DfuImage *image,
 	return TRUE;
 }
 
-#if 0
-/**
- * dfu_target_get_commands:
- **/
-static gboolean
-dfu_target_get_commands (DfuTarget *target,
-			 GCancellable *cancellable,
-			 GError **error)
-{
-	GBytes *data_in;
-	GBytes *data_out;
-	guint8 buf[1];
-
-	/* invalid */
-	if (!dfu_device_has_dfuse_support (priv->device)) {
-		g_set_error_literal (error,
-				     DFU_ERROR,
-				     DFU_ERROR_NOT_SUPPORTED,
-				     "only supported for DfuSe targets");
-		return FALSE;
-	}
-
-	/* format buffer */
-	buf[0] = DFU_CMD_DFUSE_GET_COMMAND;
-	data_in = g_bytes_new_static (buf, sizeof(buf));
-	if (!dfu_target_download_chunk (target, 0, data_in, cancellable, error))
-		return FALSE;
-
-	/* return results */
-	data_out = dfu_target_upload_chunk (target, 0, cancellable, error);
-	if (data_out == NULL)
-		return FALSE;
-
-	// N bytes,
-	// each byte is the command code
-
-	// FIXME: parse?
-	return TRUE;
-}
-#endif
-
 /**
  * dfu_target_get_alt_setting:
  * @target: a #DfuTarget
@@ -1556,3 +2842,23 @@ dfu_target_get_cipher_kind (DfuTarget *target)
 	g_return_val_if_fail (DFU_IS_TARGET (target), 0);
 	return priv->cipher_kind;
 }
+
+/**
+ * dfu_target_get_bytes_skipped:
+ * @target: a #DfuTarget
+ *
+ * Gets the number of bytes that the last download did not have to send
+ * to the device, for instance when using %DFU_TARGET_TRANSFER_FLAG_SKIP_BLANK
+ * or %DFU_TARGET_TRANSFER_FLAG_DIFFERENTIAL.
+ *
+ * Return value: a size in bytes
+ *
+ * Since: 0.7.2
+ **/
+guint
+dfu_target_get_bytes_skipped (DfuTarget *target)
+{
+	DfuTargetPrivate *priv = GET_PRIVATE (target);
+	g_return_val_if_fail (DFU_IS_TARGET (target), 0);
+	return priv->bytes_skipped;
+}
@@ -62,6 +62,10 @@ struct _DfuTargetClass
  * @DFU_TARGET_TRANSFER_FLAG_WILDCARD_VID:	Allow downloading images with wildcard VIDs
  * @DFU_TARGET_TRANSFER_FLAG_WILDCARD_PID:	Allow downloading images with wildcard PIDs
  * @DFU_TARGET_TRANSFER_FLAG_ANY_CIPHER:	Allow any cipher kinds to be downloaded
+ * @DFU_TARGET_TRANSFER_FLAG_SKIP_BLANK:	Do not write blank chunks to erased DfuSe sectors
+ * @DFU_TARGET_TRANSFER_FLAG_DIFFERENTIAL:	Only erase and write DfuSe sectors that have changed
+ * @DFU_TARGET_TRANSFER_FLAG_RESUME:		Continue an interrupted DfuSe download from the journal
+ * @DFU_TARGET_TRANSFER_FLAG_NO_MANIFEST:	Do not manifest the download, so the same memory can be written again
  *
  * The optional flags used for transfering firmware.
  **/
@@ -74,6 +78,10 @@ typedef enum {
 	DFU_TARGET_TRANSFER_FLAG_WILDCARD_VID	= (1 << 4),
 	DFU_TARGET_TRANSFER_FLAG_WILDCARD_PID	= (1 << 5),
 	DFU_TARGET_TRANSFER_FLAG_ANY_CIPHER	= (1 << 6),
+	DFU_TARGET_TRANSFER_FLAG_SKIP_BLANK	= (1 << 7),
+	DFU_TARGET_TRANSFER_FLAG_DIFFERENTIAL	= (1 << 8),
+	DFU_TARGET_TRANSFER_FLAG_RESUME		= (1 << 9),
+	DFU_TARGET_TRANSFER_FLAG_NO_MANIFEST	= (1 << 10),
 	/*< private >*/
 	DFU_TARGET_TRANSFER_FLAG_LAST
 } DfuTargetTransferFlags;
@@ -92,6 +100,7 @@ gboolean	 dfu_target_download			(DfuTarget	*target,
 							 GCancellable	*cancellable,
 							 GError		**error);
 DfuCipherKind	 dfu_target_get_cipher_kind		(DfuTarget	*target);
+guint		 dfu_target_get_bytes_skipped		(DfuTarget	*target);
 
 G_END_DECLS
 
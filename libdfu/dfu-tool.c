@@ -30,12 +30,19 @@
 #include <appstream-glib.h>
 
 #include "dfu-device-private.h"
+#include "dfu-element-private.h"
+#include "dfu-target-private.h"
 
 typedef struct {
 	GCancellable		*cancellable;
 	GPtrArray		*cmd_array;
 	gboolean		 force;
+	gboolean		 skip_blank;
+	gboolean		 differential;
+	gboolean		 resume;
+	gboolean		 all;
 	gchar			*device_vid_pid;
+	gchar			*match_vid_pid;
 	guint16			 transfer_size;
 } DfuToolPrivate;
 
@@ -63,6 +70,7 @@ dfu_tool_private_free (DfuToolPrivate *priv)
 	if (priv == NULL)
 		return;
 	g_free (priv->device_vid_pid);
+	g_free (priv->match_vid_pid);
 	g_object_unref (priv->cancellable);
 	if (priv->cmd_array != NULL)
 		g_ptr_array_unref (priv->cmd_array);
@@ -212,6 +220,37 @@ dfu_tool_run (DfuToolPrivate *priv,
 	return FALSE;
 }
 
+/**
+ * dfu_tool_parse_vid_pid:
+ **/
+static gboolean
+dfu_tool_parse_vid_pid (const gchar *str, guint16 *vid, guint16 *pid, GError **error)
+{
+	gchar *tmp;
+	guint64 vid_tmp;
+	guint64 pid_tmp;
+
+	vid_tmp = g_ascii_strtoull (str, &tmp, 16);
+	if (vid_tmp == 0 || vid_tmp > G_MAXUINT16 || tmp[0] != ':') {
+		g_set_error_literal (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INTERNAL,
+				     "Invalid format of VID:PID");
+		return FALSE;
+	}
+	pid_tmp = g_ascii_strtoull (tmp + 1, NULL, 16);
+	if (pid_tmp > G_MAXUINT16) {
+		g_set_error_literal (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INTERNAL,
+				     "Invalid format of VID:PID");
+		return FALSE;
+	}
+	*vid = vid_tmp;
+	*pid = pid_tmp;
+	return TRUE;
+}
+
 /**
  * dfu_tool_get_defalt_device:
  **/
@@ -227,34 +266,12 @@ dfu_tool_get_defalt_device (DfuToolPrivate *priv, GError **error)
 
 	/* we specified it manually */
 	if (priv->device_vid_pid != NULL) {
-		gchar *tmp;
-		guint64 pid;
-		guint64 vid;
+		guint16 pid;
+		guint16 vid;
 
 		/* parse */
-		vid = g_ascii_strtoull (priv->device_vid_pid, &tmp, 16);
-		if (vid == 0 || vid > G_MAXUINT16) {
-			g_set_error_literal (error,
-					     DFU_ERROR,
-					     DFU_ERROR_INTERNAL,
-					     "Invalid format of VID:PID");
+		if (!dfu_tool_parse_vid_pid (priv->device_vid_pid, &vid, &pid, error))
 			return NULL;
-		}
-		if (tmp[0] != ':') {
-			g_set_error_literal (error,
-					     DFU_ERROR,
-					     DFU_ERROR_INTERNAL,
-					     "Invalid format of VID:PID");
-			return NULL;
-		}
-		pid = g_ascii_strtoull (tmp + 1, NULL, 16);
-		if (vid == 0 || vid > G_MAXUINT16) {
-			g_set_error_literal (error,
-					     DFU_ERROR,
-					     DFU_ERROR_INTERNAL,
-					     "Invalid format of VID:PID");
-			return NULL;
-		}
 
 		/* find device */
 		device = dfu_context_get_device_by_vid_pid (dfu_context,
@@ -1223,61 +1240,6 @@ dfu_tool_watch_cancelled_cb (GCancellable *cancellable, gpointer user_data)
 	g_main_loop_quit (loop);
 }
 
-/**
- * dfu_tool_parse_xtea_key:
- **/
-static gboolean
-dfu_tool_parse_xtea_key (const gchar *key, guint32 *keys, GError **error)
-{
-	guint i;
-	guint key_len;
-	g_autofree gchar *key_pad = NULL;
-
-	/* too long */
-	key_len = strlen (key);
-	if (key_len > 32) {
-		g_set_error (error,
-			     DFU_ERROR,
-			     DFU_ERROR_NOT_SUPPORTED,
-			     "Key string too long at %i chars, max 16",
-			     key_len);
-		return FALSE;
-	}
-
-	/* parse 4x32b values or generate a hash */
-	if (key_len == 32) {
-		for (i = 0; i < 4; i++) {
-			gchar buf[] = "xxxxxxxx";
-			gchar *endptr;
-			guint64 tmp;
-
-			/* copy to 4-char buf (with NUL) */
-			memcpy (buf, key + i*8, 8);
-			tmp = g_ascii_strtoull (buf, &endptr, 16);
-			if (endptr && endptr[0] != '\0') {
-				g_set_error (error,
-					     DFU_ERROR,
-					     DFU_ERROR_NOT_SUPPORTED,
-					     "Failed to parse key '%s'", key);
-				return FALSE;
-			}
-			keys[3-i] = tmp;
-		}
-	} else {
-		gsize buf_len = 16;
-		g_autoptr(GChecksum) csum = NULL;
-		csum = g_checksum_new (G_CHECKSUM_MD5);
-		g_checksum_update (csum, (const guchar *) key, key_len);
-		g_checksum_get_digest (csum, (guint8 *) keys, &buf_len);
-		g_assert (buf_len == 16);
-	}
-
-	/* success */
-	g_debug ("using XTEA key %04x%04x%04x%04x",
-		 keys[3], keys[2], keys[1], keys[0]);
-	return TRUE;
-}
-
 /**
  * dfu_tool_get_firmware_contents_default:
  **/
@@ -1306,6 +1268,8 @@ dfu_tool_get_firmware_contents_default (DfuFirmware *firmware,
 				     "No default element");
 		return NULL;
 	}
+	if (!dfu_element_load_contents (element, NULL, error))
+		return NULL;
 	contents = dfu_element_get_contents (element);
 	if (contents == NULL) {
 		g_set_error_literal (error,
@@ -1317,63 +1281,6 @@ dfu_tool_get_firmware_contents_default (DfuFirmware *firmware,
 	return (guint8 *) g_bytes_get_data (contents, length);
 }
 
-#define XTEA_DELTA		0x9e3779b9
-#define XTEA_NUM_ROUNDS		32
-
-/**
- * dfu_tool_encrypt_xtea:
- **/
-static void
-dfu_tool_encrypt_xtea (const guint32 key[4], guint8 *data, guint16 length)
-{
-	guint32 sum;
-	guint32 *tmp = (guint32 *) data;
-	guint32 v0;
-	guint32 v1;
-	guint8 i;
-	guint j;
-
-	for (j = 0; j < length / 4; j += 2) {
-		sum = 0;
-		v0 = tmp[j];
-		v1 = tmp[j+1];
-		for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
-			v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + key[sum & 3]);
-			sum += XTEA_DELTA;
-			v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + key[(sum >> 11) & 3]);
-		}
-		tmp[j] = v0;
-		tmp[j+1] = v1;
-	}
-}
-
-/**
- * dfu_tool_decrypt_xtea:
- **/
-static void
-dfu_tool_decrypt_xtea (const guint32 key[4], guint8 *data, guint16 length)
-{
-	guint32 sum;
-	guint32 *tmp = (guint32 *) data;
-	guint32 v0;
-	guint32 v1;
-	guint8 i;
-	guint j;
-
-	for (j = 0; j < length / 4; j += 2) {
-		v0 = tmp[j];
-		v1 = tmp[j+1];
-		sum = XTEA_DELTA * XTEA_NUM_ROUNDS;
-		for (i = 0; i < XTEA_NUM_ROUNDS; i++) {
-			v1 -= (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + key[(sum >> 11) & 3]);
-			sum -= XTEA_DELTA;
-			v0 -= (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + key[sum & 3]);
-		}
-		tmp[j] = v0;
-		tmp[j+1] = v1;
-	}
-}
-
 /**
  * dfu_tool_encrypt:
  **/
@@ -1432,10 +1339,9 @@ dfu_tool_encrypt (DfuToolPrivate *priv, gchar **values, GError **error)
 
 	/* check type */
 	if (g_strcmp0 (values[2], "xtea") == 0) {
-		guint32 key[4];
-		if (!dfu_tool_parse_xtea_key (values[3], key, error))
+		if (!dfu_cipher_encrypt (DFU_CIPHER_KIND_XTEA, values[3],
+					 data, len, error))
 			return FALSE;
-		dfu_tool_encrypt_xtea (key, data, len);
 		dfu_firmware_set_metadata (firmware,
 					   DFU_METADATA_KEY_CIPHER_KIND,
 					   "XTEA");
@@ -1515,10 +1421,9 @@ dfu_tool_decrypt (DfuToolPrivate *priv, gchar **values, GError **error)
 
 	/* check type */
 	if (g_strcmp0 (values[2], "xtea") == 0) {
-		guint32 key[4];
-		if (!dfu_tool_parse_xtea_key (values[3], key, error))
+		if (!dfu_cipher_decrypt (DFU_CIPHER_KIND_XTEA, values[3],
+					 data, len, error))
 			return FALSE;
-		dfu_tool_decrypt_xtea (key, data, len);
 		dfu_firmware_remove_metadata (firmware,
 					      DFU_METADATA_KEY_CIPHER_KIND);
 	} else {
@@ -1582,7 +1487,8 @@ dfu_tool_watch (DfuToolPrivate *priv, gchar **values, GError **error)
 static gboolean
 dfu_tool_dump (DfuToolPrivate *priv, gchar **values, GError **error)
 {
-	DfuFirmwareParseFlags flags = DFU_FIRMWARE_PARSE_FLAG_NONE;
+	DfuFirmwareParseFlags flags = DFU_FIRMWARE_PARSE_FLAG_MMAP |
+				      DFU_FIRMWARE_PARSE_FLAG_LAZY;
 	guint i;
 
 	/* check args */
@@ -1622,6 +1528,235 @@ dfu_tool_dump (DfuToolPrivate *priv, gchar **values, GError **error)
 	return TRUE;
 }
 
+/**
+ * dfu_tool_print_throughput:
+ **/
+static void
+dfu_tool_print_throughput (guint size, gint64 time_start)
+{
+	gdouble elapsed;
+	elapsed = (gdouble) (g_get_monotonic_time () - time_start) / G_USEC_PER_SEC;
+	if (elapsed <= 0.f)
+		return;
+	g_print ("Took %.1fs at %.1f KiB/s\n",
+		 elapsed, (gdouble) size / 1024.f / elapsed);
+}
+
+/**
+ * dfu_tool_print_skipped:
+ **/
+static void
+dfu_tool_print_skipped (DfuDevice *device)
+{
+	GPtrArray *targets;
+	guint i;
+	guint skipped = 0;
+
+	targets = dfu_device_get_targets (device);
+	for (i = 0; i < targets->len; i++) {
+		DfuTarget *target = g_ptr_array_index (targets, i);
+		skipped += dfu_target_get_bytes_skipped (target);
+	}
+	if (skipped > 0)
+		g_print ("%u bytes did not need to be written\n", skipped);
+}
+
+/**
+ * dfu_tool_benchmark:
+ **/
+static gboolean
+dfu_tool_benchmark (DfuToolPrivate *priv, gchar **values, GError **error)
+{
+	const guint16 transfer_sizes[] = { 64, 128, 256, 512, 1024, 2048, 4096, 0 };
+	gdouble elapsed_best = G_MAXDOUBLE;
+	gchar *endptr;
+	guint16 transfer_size_best = 0;
+	guint64 address;
+	guint64 size;
+	guint i;
+	guint timeout_best = 0;
+	guint timeout_default;
+	guint16 transfer_size_max;
+	guint8 *buf;
+	g_autoptr(DfuDevice) device = NULL;
+	g_autoptr(DfuElement) element = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(DfuTarget) target = NULL;
+	g_autoptr(GBytes) contents = NULL;
+
+	/* check args */
+	if (g_strv_length (values) < 3) {
+		g_set_error_literal (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INTERNAL,
+				     "Invalid arguments, expected "
+				     "DEVICE-ALT-NAME|DEVICE-ALT-ID ADDRESS SIZE");
+		return FALSE;
+	}
+	address = g_ascii_strtoull (values[1], &endptr, 0);
+	if (address > G_MAXUINT32 || endptr[0] != '\0') {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "Failed to parse address '%s'",
+			     values[1]);
+		return FALSE;
+	}
+	size = g_ascii_strtoull (values[2], &endptr, 0);
+	if (size == 0 || size > G_MAXUINT32 || endptr[0] != '\0') {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INTERNAL,
+			     "Failed to parse size '%s'",
+			     values[2]);
+		return FALSE;
+	}
+
+	/* open correct device */
+	device = dfu_tool_get_defalt_device (priv, error);
+	if (device == NULL)
+		return FALSE;
+	if (!dfu_device_open (device,
+			      DFU_DEVICE_OPEN_FLAG_NONE,
+			      priv->cancellable,
+			      error))
+		return FALSE;
+
+	/* APP -> DFU */
+	if (dfu_device_get_mode (device) == DFU_MODE_RUNTIME) {
+		g_debug ("detaching");
+		if (!dfu_device_detach (device, priv->cancellable, error))
+			return FALSE;
+		if (!dfu_device_wait_for_replug (device,
+						 DFU_DEVICE_REPLUG_TIMEOUT,
+						 priv->cancellable,
+						 error))
+			return FALSE;
+	}
+
+	/* get target */
+	target = dfu_device_get_target_by_alt_name (device,
+						    values[0],
+						    NULL);
+	if (target == NULL) {
+		guint64 tmp = g_ascii_strtoull (values[0], &endptr, 10);
+		if (tmp > 0xff || endptr[0] != '\0') {
+			g_set_error (error,
+				     DFU_ERROR,
+				     DFU_ERROR_INTERNAL,
+				     "Failed to parse alt-setting '%s'",
+				     values[0]);
+			return FALSE;
+		}
+		target = dfu_device_get_target_by_alt_setting (device,
+							       tmp,
+							       error);
+		if (target == NULL)
+			return FALSE;
+	}
+
+	/* a pattern that will not be mistaken for erased memory */
+	buf = g_malloc (size);
+	for (i = 0; i < size; i++)
+		buf[i] = (guint8) (i * 7 + 1);
+	contents = g_bytes_new_take (buf, size);
+	element = dfu_element_new ();
+	dfu_element_set_address (element, address);
+	dfu_element_set_contents (element, contents);
+	image = dfu_image_new ();
+	dfu_image_add_element (image, element);
+
+	/* try each transfer size */
+	g_print ("WARNING: the region at 0x%08x will be overwritten\n",
+		 (guint) address);
+	timeout_default = dfu_device_get_timeout (device);
+	transfer_size_max = dfu_device_get_transfer_size_max (device);
+	for (i = 0; transfer_sizes[i] != 0; i++) {
+		gdouble elapsed_read;
+		gdouble elapsed_write;
+		gint64 time_start;
+		guint nr_chunks;
+		g_autoptr(DfuElement) element_tmp = NULL;
+		g_autoptr(GError) error_local = NULL;
+
+		/* the device is not required to accept anything larger */
+		if (transfer_size_max > 0 && transfer_sizes[i] > transfer_size_max) {
+			g_debug ("skipping %u as larger than wTransferSize %u",
+				 transfer_sizes[i], transfer_size_max);
+			continue;
+		}
+		dfu_device_set_transfer_size (device, transfer_sizes[i]);
+
+		/* write */
+		time_start = g_get_monotonic_time ();
+		if (!dfu_target_download (target, image,
+					  DFU_TARGET_TRANSFER_FLAG_NO_MANIFEST,
+					  priv->cancellable,
+					  &error_local) ||
+		    !dfu_device_abort (device, priv->cancellable, &error_local)) {
+			g_print ("%6u: failed to write: %s\n",
+				 transfer_sizes[i], error_local->message);
+			dfu_device_clear_status (device, priv->cancellable, NULL);
+			dfu_device_abort (device, priv->cancellable, NULL);
+			continue;
+		}
+		elapsed_write = (gdouble) (g_get_monotonic_time () - time_start) / G_USEC_PER_SEC;
+
+		/* read back */
+		time_start = g_get_monotonic_time ();
+		element_tmp = dfu_target_upload_element (target, address, size,
+							 priv->cancellable,
+							 &error_local);
+		if (element_tmp == NULL) {
+			g_print ("%6u: failed to read: %s\n",
+				 transfer_sizes[i], error_local->message);
+			dfu_device_clear_status (device, priv->cancellable, NULL);
+			dfu_device_abort (device, priv->cancellable, NULL);
+			continue;
+		}
+		elapsed_read = (gdouble) (g_get_monotonic_time () - time_start) / G_USEC_PER_SEC;
+		if (!dfu_device_abort (device, priv->cancellable, error))
+			return FALSE;
+
+		/* some bootloaders misreport the transfer size they can do */
+		if (g_bytes_compare (dfu_element_get_contents (element_tmp),
+				     contents) != 0) {
+			g_print ("%6u: data read back was different\n",
+				 transfer_sizes[i]);
+			continue;
+		}
+		g_print ("%6u: write %.1f KiB/s, read %.1f KiB/s\n",
+			 transfer_sizes[i],
+			 elapsed_write > 0.f ? (gdouble) size / 1024.f / elapsed_write : 0.f,
+			 elapsed_read > 0.f ? (gdouble) size / 1024.f / elapsed_read : 0.f);
+
+		/* allow each request to take a few times the average */
+		if (elapsed_write + elapsed_read < elapsed_best) {
+			nr_chunks = (size + transfer_sizes[i] - 1) / transfer_sizes[i];
+			elapsed_best = elapsed_write + elapsed_read;
+			transfer_size_best = transfer_sizes[i];
+			timeout_best = MAX (timeout_default,
+					    (guint) (elapsed_best * 4000.f / nr_chunks));
+		}
+	}
+	if (transfer_size_best == 0) {
+		g_set_error_literal (error,
+				     DFU_ERROR,
+				     DFU_ERROR_NOT_SUPPORTED,
+				     "No transfer size worked");
+		return FALSE;
+	}
+
+	/* save for next time */
+	dfu_device_set_transfer_size (device, transfer_size_best);
+	dfu_device_set_timeout (device, timeout_best);
+	if (!dfu_device_save_tuning (device, error))
+		return FALSE;
+	g_print ("Using transfer size %u and timeout %ums\n",
+		 transfer_size_best, timeout_best);
+	return TRUE;
+}
+
 /**
  * dfu_tool_write_alt:
  **/
@@ -1631,6 +1766,7 @@ dfu_tool_write_alt (DfuToolPrivate *priv, gchar **values, GError **error)
 	DfuImage *image;
 	DfuTargetTransferFlags flags = DFU_TARGET_TRANSFER_FLAG_VERIFY;
 	DfuToolProgressHelper helper;
+	gint64 time_start;
 	g_autofree gchar *str_debug = NULL;
 	g_autoptr(DfuDevice) device = NULL;
 	g_autoptr(DfuFirmware) firmware = NULL;
@@ -1652,7 +1788,7 @@ dfu_tool_write_alt (DfuToolPrivate *priv, gchar **values, GError **error)
 	firmware = dfu_firmware_new ();
 	file = g_file_new_for_path (values[0]);
 	if (!dfu_firmware_parse_file (firmware, file,
-				      DFU_FIRMWARE_PARSE_FLAG_NONE,
+				      DFU_FIRMWARE_PARSE_FLAG_MMAP,
 				      priv->cancellable, error))
 		return FALSE;
 
@@ -1756,8 +1892,15 @@ dfu_tool_write_alt (DfuToolPrivate *priv, gchar **values, GError **error)
 	if (priv->force) {
 		flags |= DFU_TARGET_TRANSFER_FLAG_ANY_CIPHER;
 	}
+	if (priv->skip_blank)
+		flags |= DFU_TARGET_TRANSFER_FLAG_SKIP_BLANK;
+	if (priv->differential)
+		flags |= DFU_TARGET_TRANSFER_FLAG_DIFFERENTIAL;
+	if (priv->resume)
+		flags |= DFU_TARGET_TRANSFER_FLAG_RESUME;
 
 	/* transfer */
+	time_start = g_get_monotonic_time ();
 	if (!dfu_target_download (target,
 				  image,
 				  flags,
@@ -1768,6 +1911,326 @@ dfu_tool_write_alt (DfuToolPrivate *priv, gchar **values, GError **error)
 	/* success */
 	g_print ("%u bytes successfully downloaded to device\n",
 		 dfu_image_get_size (image));
+	if (dfu_target_get_bytes_skipped (target) > 0) {
+		g_print ("%u bytes did not need to be written\n",
+			 dfu_target_get_bytes_skipped (target));
+	}
+	dfu_tool_print_throughput (dfu_image_get_size (image), time_start);
+	return TRUE;
+}
+
+typedef struct {
+	GMainLoop		*loop;
+	GPtrArray		*items;
+	guint			 n_pending;
+	guint			 marks_shown;
+} DfuToolWriteAllHelper;
+
+typedef struct {
+	DfuToolWriteAllHelper	*helper;
+	DfuDevice		*device;
+	DfuFirmware		*firmware;
+	DfuTargetTransferFlags	 flags;
+	GCancellable		*cancellable;
+	GThread			*thread;
+	GError			*error;
+	gint			 percentage;	/* atomic */
+	gint			 verifying;	/* atomic */
+	gint64			 time_start;
+	gint64			 time_done;
+} DfuToolWriteAllItem;
+
+/**
+ * dfu_tool_write_all_item_free:
+ **/
+static void
+dfu_tool_write_all_item_free (DfuToolWriteAllItem *item)
+{
+	if (item->thread != NULL)
+		g_thread_join (item->thread);
+	if (item->error != NULL)
+		g_error_free (item->error);
+	g_object_unref (item->device);
+	g_object_unref (item->firmware);
+	g_object_unref (item->cancellable);
+	g_free (item);
+}
+
+/**
+ * dfu_tool_write_all_get_percentage:
+ *
+ * Each device is written and then read back, so the download counts for
+ * the first half and the verify for the second half of the progress.
+ **/
+static guint
+dfu_tool_write_all_get_percentage (DfuToolWriteAllHelper *helper)
+{
+	guint i;
+	guint total = 0;
+
+	for (i = 0; i < helper->items->len; i++) {
+		DfuToolWriteAllItem *item = g_ptr_array_index (helper->items, i);
+		if (item->time_done != 0) {
+			total += 100;
+			continue;
+		}
+		total += g_atomic_int_get (&item->percentage) / 2;
+		if (g_atomic_int_get (&item->verifying))
+			total += 50;
+	}
+	return total / helper->items->len;
+}
+
+/**
+ * dfu_tool_write_all_print_progress:
+ **/
+static void
+dfu_tool_write_all_print_progress (DfuToolWriteAllHelper *helper)
+{
+	const guint marks_total = 30;
+	guint i;
+	guint marks_now;
+
+	marks_now = dfu_tool_write_all_get_percentage (helper) * marks_total / 100;
+	for (i = helper->marks_shown; i < marks_now; i++)
+		g_print ("#");
+	helper->marks_shown = marks_now;
+}
+
+/**
+ * dfu_tool_write_all_progress_cb:
+ **/
+static gboolean
+dfu_tool_write_all_progress_cb (gpointer user_data)
+{
+	DfuToolWriteAllHelper *helper = (DfuToolWriteAllHelper *) user_data;
+	dfu_tool_write_all_print_progress (helper);
+	return TRUE;
+}
+
+/**
+ * dfu_tool_write_all_state_changed_cb:
+ *
+ * This is called from the worker thread.
+ **/
+static void
+dfu_tool_write_all_state_changed_cb (DfuDevice *device,
+				     DfuState state,
+				     DfuToolWriteAllItem *item)
+{
+	/* a differential write reads back before the download too */
+	switch (state) {
+	case DFU_STATE_DFU_DNLOAD_IDLE:
+		g_atomic_int_set (&item->verifying, FALSE);
+		break;
+	case DFU_STATE_DFU_UPLOAD_IDLE:
+		g_atomic_int_set (&item->percentage, 0);
+		g_atomic_int_set (&item->verifying, TRUE);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * dfu_tool_write_all_percentage_changed_cb:
+ *
+ * This is called from the worker thread.
+ **/
+static void
+dfu_tool_write_all_percentage_changed_cb (DfuDevice *device,
+					  guint percentage,
+					  DfuToolWriteAllItem *item)
+{
+	g_atomic_int_set (&item->percentage, percentage);
+}
+
+/**
+ * dfu_tool_write_all_done_cb:
+ *
+ * This is called in the main thread when a worker thread has finished.
+ **/
+static gboolean
+dfu_tool_write_all_done_cb (gpointer user_data)
+{
+	DfuToolWriteAllItem *item = (DfuToolWriteAllItem *) user_data;
+	DfuToolWriteAllHelper *helper = item->helper;
+
+	item->time_done = g_get_monotonic_time ();
+	if (--helper->n_pending == 0)
+		g_main_loop_quit (helper->loop);
+	return FALSE;
+}
+
+/**
+ * dfu_tool_write_all_thread_cb:
+ *
+ * Each device gets its own thread rather than using the shared GTask
+ * pool, which would limit how many devices can be written at once.
+ * The main thread keeps running the default context so that the
+ * devices can be found again when they replug.
+ **/
+static gpointer
+dfu_tool_write_all_thread_cb (gpointer user_data)
+{
+	DfuToolWriteAllItem *item = (DfuToolWriteAllItem *) user_data;
+
+	item->time_start = g_get_monotonic_time ();
+	if (dfu_device_open (item->device,
+			     DFU_DEVICE_OPEN_FLAG_NONE,
+			     item->cancellable,
+			     &item->error)) {
+		if (dfu_device_get_mode (item->device) == DFU_MODE_RUNTIME) {
+			item->flags |= DFU_TARGET_TRANSFER_FLAG_DETACH;
+			item->flags |= DFU_TARGET_TRANSFER_FLAG_ATTACH;
+			item->flags |= DFU_TARGET_TRANSFER_FLAG_WAIT_RUNTIME;
+		}
+		dfu_device_download (item->device,
+				     item->firmware,
+				     item->flags,
+				     item->cancellable,
+				     &item->error);
+	}
+	g_main_context_invoke (NULL, dfu_tool_write_all_done_cb, item);
+	return NULL;
+}
+
+/**
+ * dfu_tool_write_all:
+ **/
+static gboolean
+dfu_tool_write_all (DfuToolPrivate *priv,
+		    DfuFirmware *firmware,
+		    DfuTargetTransferFlags flags,
+		    GError **error)
+{
+	DfuToolWriteAllHelper helper;
+	gint64 time_start;
+	guint16 pid = 0;
+	guint16 vid = 0;
+	guint i;
+	guint n_failed = 0;
+	guint progress_id;
+	g_autoptr(DfuContext) dfu_context = NULL;
+	g_autoptr(GMainLoop) loop = NULL;
+	g_autoptr(GPtrArray) devices = NULL;
+	g_autoptr(GPtrArray) items = NULL;
+
+	/* parse */
+	if (priv->match_vid_pid != NULL) {
+		if (!dfu_tool_parse_vid_pid (priv->match_vid_pid, &vid, &pid, error))
+			return FALSE;
+	}
+
+	/* get all the matching DFU devices */
+	dfu_context = dfu_context_new ();
+	dfu_context_enumerate (dfu_context, NULL);
+	devices = dfu_context_get_devices (dfu_context);
+	items = g_ptr_array_new_with_free_func ((GDestroyNotify) dfu_tool_write_all_item_free);
+	for (i = 0; i < devices->len; i++) {
+		DfuDevice *device = g_ptr_array_index (devices, i);
+		DfuToolWriteAllItem *item;
+
+		/* match either the current or the runtime IDs */
+		if (priv->match_vid_pid != NULL) {
+			GUsbDevice *dev = dfu_device_get_usb_dev (device);
+			if ((dev == NULL ||
+			     g_usb_device_get_vid (dev) != vid ||
+			     g_usb_device_get_pid (dev) != pid) &&
+			    (dfu_device_get_runtime_vid (device) != vid ||
+			     dfu_device_get_runtime_pid (device) != pid))
+				continue;
+		}
+
+		/* this has to be added to the device so we can deal with detach */
+		g_object_set_data_full (G_OBJECT (device), "DfuContext",
+					g_object_ref (dfu_context),
+					(GDestroyNotify) g_object_unref);
+
+		/* set before the worker thread opens the device */
+		if (priv->transfer_size > 0)
+			dfu_device_set_transfer_size (device, priv->transfer_size);
+		item = g_new0 (DfuToolWriteAllItem, 1);
+		item->helper = &helper;
+		item->device = g_object_ref (device);
+		item->firmware = g_object_ref (firmware);
+		item->flags = flags;
+		item->cancellable = g_object_ref (priv->cancellable);
+		g_ptr_array_add (items, item);
+	}
+	if (items->len == 0) {
+		g_set_error_literal (error,
+				     DFU_ERROR,
+				     DFU_ERROR_NOT_FOUND,
+				     "no matching DFU devices");
+		return FALSE;
+	}
+
+	/* start a worker thread for each device */
+	loop = g_main_loop_new (NULL, FALSE);
+	helper.loop = loop;
+	helper.items = items;
+	helper.n_pending = items->len;
+	helper.marks_shown = 0;
+	time_start = g_get_monotonic_time ();
+	for (i = 0; i < items->len; i++) {
+		DfuToolWriteAllItem *item = g_ptr_array_index (items, i);
+		g_signal_connect (item->device, "state-changed",
+				  G_CALLBACK (dfu_tool_write_all_state_changed_cb), item);
+		g_signal_connect (item->device, "percentage-changed",
+				  G_CALLBACK (dfu_tool_write_all_percentage_changed_cb), item);
+		item->thread = g_thread_new ("dfu-tool-write",
+					     dfu_tool_write_all_thread_cb,
+					     item);
+	}
+
+	/* show one progress bar for all the devices */
+	/* TRANSLATORS: when copying to more than one device */
+	g_print ("%s %u devices: ", _("Writing"), items->len);
+	progress_id = g_timeout_add (100, dfu_tool_write_all_progress_cb, &helper);
+	g_main_loop_run (loop);
+	g_source_remove (progress_id);
+	dfu_tool_write_all_print_progress (&helper);
+	g_print ("\n");
+
+	/* print a summary for each device */
+	for (i = 0; i < items->len; i++) {
+		DfuToolWriteAllItem *item = g_ptr_array_index (items, i);
+		g_autofree gchar *title = NULL;
+		g_autofree gchar *msg = NULL;
+
+		g_thread_join (item->thread);
+		item->thread = NULL;
+		g_signal_handlers_disconnect_by_data (item->device, item);
+		title = g_strdup_printf ("%04x:%04x %s",
+					 dfu_device_get_runtime_vid (item->device),
+					 dfu_device_get_runtime_pid (item->device),
+					 dfu_device_get_platform_id (item->device));
+		if (item->error != NULL) {
+			/* TRANSLATORS: the device could not be written */
+			msg = g_strdup_printf ("%s: %s", _("FAIL"),
+					       item->error->message);
+			n_failed++;
+		} else {
+			/* TRANSLATORS: the device was written and verified */
+			msg = g_strdup_printf ("%s (%.1fs)", _("PASS"),
+					       (gdouble) (item->time_done - item->time_start) /
+					       G_USEC_PER_SEC);
+		}
+		dfu_tool_print_indent (title, msg, 0);
+	}
+	dfu_tool_print_throughput (dfu_firmware_get_size (firmware) * items->len,
+				   time_start);
+
+	/* any failures fail the command */
+	if (n_failed > 0) {
+		g_set_error (error,
+			     DFU_ERROR,
+			     DFU_ERROR_INVALID_DEVICE,
+			     "%u of %u devices failed to write",
+			     n_failed, items->len);
+		return FALSE;
+	}
 	return TRUE;
 }
 
@@ -1779,6 +2242,7 @@ dfu_tool_write (DfuToolPrivate *priv, gchar **values, GError **error)
 {
 	DfuTargetTransferFlags flags = DFU_TARGET_TRANSFER_FLAG_VERIFY;
 	DfuToolProgressHelper helper;
+	gint64 time_start;
 	g_autofree gchar *str_debug = NULL;
 	g_autoptr(DfuDevice) device = NULL;
 	g_autoptr(DfuFirmware) firmware = NULL;
@@ -1797,10 +2261,31 @@ dfu_tool_write (DfuToolPrivate *priv, gchar **values, GError **error)
 	firmware = dfu_firmware_new ();
 	file = g_file_new_for_path (values[0]);
 	if (!dfu_firmware_parse_file (firmware, file,
-				      DFU_FIRMWARE_PARSE_FLAG_NONE,
+				      DFU_FIRMWARE_PARSE_FLAG_MMAP,
 				      priv->cancellable, error))
 		return FALSE;
 
+	/* print the new object */
+	str_debug = dfu_firmware_to_string (firmware);
+	g_debug ("DFU: %s", str_debug);
+
+	/* allow wildcards */
+	if (priv->force) {
+		flags |= DFU_TARGET_TRANSFER_FLAG_WILDCARD_VID;
+		flags |= DFU_TARGET_TRANSFER_FLAG_WILDCARD_PID;
+		flags |= DFU_TARGET_TRANSFER_FLAG_ANY_CIPHER;
+	}
+	if (priv->skip_blank)
+		flags |= DFU_TARGET_TRANSFER_FLAG_SKIP_BLANK;
+	if (priv->differential)
+		flags |= DFU_TARGET_TRANSFER_FLAG_DIFFERENTIAL;
+	if (priv->resume)
+		flags |= DFU_TARGET_TRANSFER_FLAG_RESUME;
+
+	/* write all the matching devices at the same time */
+	if (priv->all || priv->match_vid_pid != NULL)
+		return dfu_tool_write_all (priv, firmware, flags, error);
+
 	/* open correct device */
 	device = dfu_tool_get_defalt_device (priv, error);
 	if (device == NULL)
@@ -1811,10 +2296,6 @@ dfu_tool_write (DfuToolPrivate *priv, gchar **values, GError **error)
 			      error))
 		return FALSE;
 
-	/* print the new object */
-	str_debug = dfu_firmware_to_string (firmware);
-	g_debug ("DFU: %s", str_debug);
-
 	/* put in correct mode */
 	if (dfu_device_get_mode (device) == DFU_MODE_RUNTIME) {
 		flags |= DFU_TARGET_TRANSFER_FLAG_DETACH;
@@ -1822,13 +2303,6 @@ dfu_tool_write (DfuToolPrivate *priv, gchar **values, GError **error)
 		flags |= DFU_TARGET_TRANSFER_FLAG_WAIT_RUNTIME;
 	}
 
-	/* allow wildcards */
-	if (priv->force) {
-		flags |= DFU_TARGET_TRANSFER_FLAG_WILDCARD_VID;
-		flags |= DFU_TARGET_TRANSFER_FLAG_WILDCARD_PID;
-		flags |= DFU_TARGET_TRANSFER_FLAG_ANY_CIPHER;
-	}
-
 	/* transfer */
 	helper.last_state = DFU_STATE_DFU_ERROR;
 	helper.marks_total = 30;
@@ -1837,6 +2311,7 @@ dfu_tool_write (DfuToolPrivate *priv, gchar **values, GError **error)
 			  G_CALLBACK (fu_tool_state_changed_cb), &helper);
 	g_signal_connect (device, "percentage-changed",
 			  G_CALLBACK (fu_tool_percentage_changed_cb), &helper);
+	time_start = g_get_monotonic_time ();
 	if (!dfu_device_download (device,
 				  firmware,
 				  flags,
@@ -1847,6 +2322,8 @@ dfu_tool_write (DfuToolPrivate *priv, gchar **values, GError **error)
 	/* success */
 	g_print ("%u bytes successfully downloaded to device\n",
 		 dfu_firmware_get_size (firmware));
+	dfu_tool_print_skipped (device);
+	dfu_tool_print_throughput (dfu_firmware_get_size (firmware), time_start);
 	return TRUE;
 }
 
@@ -2036,6 +2513,16 @@ main (int argc, char *argv[])
 			"Specify the number of bytes per USB transfer", "BYTES" },
 		{ "force", '\0', 0, G_OPTION_ARG_NONE, &priv->force,
 			"Force the action ignoring all warnings", NULL },
+		{ "skip-blank", '\0', 0, G_OPTION_ARG_NONE, &priv->skip_blank,
+			"Do not write blank chunks to erased sectors", NULL },
+		{ "differential", '\0', 0, G_OPTION_ARG_NONE, &priv->differential,
+			"Only write sectors that have changed", NULL },
+		{ "resume", '\0', 0, G_OPTION_ARG_NONE, &priv->resume,
+			"Continue an interrupted write", NULL },
+		{ "all", '\0', 0, G_OPTION_ARG_NONE, &priv->all,
+			"Write to all DFU devices at the same time", NULL },
+		{ "match", '\0', 0, G_OPTION_ARG_STRING, &priv->match_vid_pid,
+			"Write to all DFU devices matching the Vendor/Product ID", "VID:PID" },
 		{ NULL}
 	};
 
@@ -2137,6 +2624,12 @@ main (int argc, char *argv[])
 		     /* TRANSLATORS: command description */
 		     _("Dump details about a firmware file"),
 		     dfu_tool_dump);
+	dfu_tool_add (priv->cmd_array,
+		     "benchmark",
+		     NULL,
+		     /* TRANSLATORS: command description */
+		     _("Find the fastest transfer size using a scratch region"),
+		     dfu_tool_benchmark);
 	dfu_tool_add (priv->cmd_array,
 		     "watch",
 		     NULL,
@@ -29,6 +29,7 @@
 
 #define __DFU_H_INSIDE__
 
+#include <libdfu/dfu-cipher.h>
 #include <libdfu/dfu-common.h>
 #include <libdfu/dfu-context.h>
 #include <libdfu/dfu-device.h>
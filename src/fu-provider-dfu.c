@@ -37,8 +37,18 @@ static void	fu_provider_dfu_finalize	(GObject	*object);
 typedef struct {
 	DfuContext		*context;
 	GHashTable		*devices;	/* platform_id:DfuDevice */
+	GHashTable		*verify_cache;	/* key:FuProviderDfuVerifyItem */
+	gboolean		 transfer_in_progress;
 } FuProviderDfuPrivate;
 
+/* the firmware read back from a device, which is only valid for as long
+ * as the device stays plugged in with the same runtime version */
+typedef struct {
+	gchar			*platform_id;
+	guint16			 release;
+	gchar			*checksum;
+} FuProviderDfuVerifyItem;
+
 G_DEFINE_TYPE_WITH_PRIVATE (FuProviderDfu, fu_provider_dfu, FU_TYPE_PROVIDER)
 #define GET_PRIVATE(o) (fu_provider_dfu_get_instance_private (o))
 
@@ -51,6 +61,72 @@ fu_provider_dfu_get_name (FuProvider *provider)
 	return "DFU";
 }
 
+/**
+ * fu_provider_dfu_verify_item_free:
+ **/
+static void
+fu_provider_dfu_verify_item_free (FuProviderDfuVerifyItem *item)
+{
+	g_free (item->platform_id);
+	g_free (item->checksum);
+	g_free (item);
+}
+
+/**
+ * fu_provider_dfu_verify_cache_key:
+ **/
+static gchar *
+fu_provider_dfu_verify_cache_key (const gchar *platform_id,
+				  GChecksumType checksum_type)
+{
+	return g_strdup_printf ("%s:%i", platform_id, checksum_type);
+}
+
+typedef struct {
+	const gchar		*platform_id;
+	guint			 release;
+} FuProviderDfuInvalidateHelper;
+
+/**
+ * fu_provider_dfu_verify_cache_invalidate_cb:
+ **/
+static gboolean
+fu_provider_dfu_verify_cache_invalidate_cb (gpointer key,
+					    gpointer value,
+					    gpointer user_data)
+{
+	FuProviderDfuVerifyItem *item = (FuProviderDfuVerifyItem *) value;
+	FuProviderDfuInvalidateHelper *helper = (FuProviderDfuInvalidateHelper *) user_data;
+	if (g_strcmp0 (item->platform_id, helper->platform_id) != 0)
+		return FALSE;
+	return item->release != helper->release;
+}
+
+/**
+ * fu_provider_dfu_verify_cache_invalidate:
+ *
+ * Removes the cached checksums for a device unless they were read back
+ * when the device had the runtime version @release. Use %G_MAXUINT to
+ * remove them all.
+ **/
+static void
+fu_provider_dfu_verify_cache_invalidate (FuProviderDfu *provider_dfu,
+					 const gchar *platform_id,
+					 guint release)
+{
+	FuProviderDfuPrivate *priv = GET_PRIVATE (provider_dfu);
+	FuProviderDfuInvalidateHelper helper;
+	guint cnt;
+
+	helper.platform_id = platform_id;
+	helper.release = release;
+	cnt = g_hash_table_foreach_remove (priv->verify_cache,
+					   fu_provider_dfu_verify_cache_invalidate_cb,
+					   &helper);
+	if (cnt > 0)
+		g_debug ("invalidated %u cached checksums for %s", cnt, platform_id);
+}
+
 /**
  * fu_provider_dfu_device_update:
  **/
@@ -121,6 +197,12 @@ fu_provider_dfu_device_changed_cb (DfuContext *ctx,
 		return;
 	}
 	fu_provider_dfu_device_update (provider_dfu, dev, device);
+
+	/* the runtime version is only known in runtime mode */
+	if (dfu_device_get_mode (device) == DFU_MODE_RUNTIME) {
+		fu_provider_dfu_verify_cache_invalidate (provider_dfu, platform_id,
+							 dfu_device_get_runtime_release (device));
+	}
 }
 
 /**
@@ -190,8 +272,11 @@ fu_provider_dfu_device_removed_cb (DfuContext *ctx,
 	FuDevice *dev;
 	const gchar *platform_id;
 
-	/* convert DfuDevice to FuDevice */
+	/* a different device could be plugged into the same port */
 	platform_id = dfu_device_get_platform_id (device);
+	fu_provider_dfu_verify_cache_invalidate (provider_dfu, platform_id, G_MAXUINT);
+
+	/* convert DfuDevice to FuDevice */
 	dev = g_hash_table_lookup (priv->devices, platform_id);
 	if (dev == NULL) {
 		g_warning ("cannot find device %s", platform_id);
@@ -233,6 +318,77 @@ fu_provider_dfu_state_changed_cb (DfuDevice *device,
 	}
 }
 
+typedef struct {
+	GMainLoop		*loop;
+	GAsyncResult		*res;
+} FuProviderDfuHelper;
+
+/**
+ * fu_provider_dfu_async_cb:
+ **/
+static void
+fu_provider_dfu_async_cb (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+	FuProviderDfuHelper *helper = (FuProviderDfuHelper *) user_data;
+	helper->res = g_object_ref (res);
+	g_main_loop_quit (helper->loop);
+}
+
+/**
+ * fu_provider_dfu_check_idle:
+ *
+ * Other requests can be dispatched in the main context while a transfer
+ * is running, so only one is allowed at a time.
+ **/
+static gboolean
+fu_provider_dfu_check_idle (FuProviderDfu *provider_dfu, GError **error)
+{
+	FuProviderDfuPrivate *priv = GET_PRIVATE (provider_dfu);
+	if (priv->transfer_in_progress) {
+		g_set_error_literal (error,
+				     FWUPD_ERROR,
+				     FWUPD_ERROR_ALREADY_PENDING,
+				     "another DFU transfer is in progress");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * fu_provider_dfu_helper_init:
+ **/
+static void
+fu_provider_dfu_helper_init (FuProviderDfu *provider_dfu,
+			     FuProviderDfuHelper *helper)
+{
+	FuProviderDfuPrivate *priv = GET_PRIVATE (provider_dfu);
+	g_autoptr(GMainContext) context = g_main_context_ref_thread_default ();
+	priv->transfer_in_progress = TRUE;
+	helper->loop = g_main_loop_new (context, FALSE);
+	helper->res = NULL;
+}
+
+/**
+ * fu_provider_dfu_helper_run:
+ *
+ * The USB transfer is done in a worker thread, and the thread-default
+ * main context, which is the default context in the daemon, is iterated
+ * until it completes. This keeps D-Bus requests being answered and the
+ * hotplug events that the DfuContext needs for the replug being delivered.
+ *
+ * Returns: (transfer full): the result of the transfer
+ **/
+static GAsyncResult *
+fu_provider_dfu_helper_run (FuProviderDfu *provider_dfu,
+			    FuProviderDfuHelper *helper)
+{
+	FuProviderDfuPrivate *priv = GET_PRIVATE (provider_dfu);
+	g_main_loop_run (helper->loop);
+	g_main_loop_unref (helper->loop);
+	priv->transfer_in_progress = FALSE;
+	return helper->res;
+}
+
 /**
  * fu_provider_dfu_update:
  *
@@ -249,9 +405,14 @@ fu_provider_dfu_update (FuProvider *provider,
 	FuProviderDfuPrivate *priv = GET_PRIVATE (provider_dfu);
 	DfuDevice *device;
 	const gchar *platform_id;
+	FuProviderDfuHelper helper;
 	g_autoptr(DfuDevice) dfu_device = NULL;
 	g_autoptr(DfuFirmware) dfu_firmware = NULL;
 	g_autoptr(GError) error_local = NULL;
+	g_autoptr(GAsyncResult) res = NULL;
+
+	if (!fu_provider_dfu_check_idle (provider_dfu, error))
+		return FALSE;
 
 	/* get device */
 	platform_id = fu_device_get_id (dev);
@@ -280,17 +441,24 @@ fu_provider_dfu_update (FuProvider *provider,
 	g_signal_connect (device, "state-changed",
 			  G_CALLBACK (fu_provider_dfu_state_changed_cb), provider);
 
+	/* the version may not change when reinstalling */
+	fu_provider_dfu_verify_cache_invalidate (provider_dfu, platform_id, G_MAXUINT);
+
 	/* hit hardware */
 	dfu_firmware = dfu_firmware_new ();
 	if (!dfu_firmware_parse_data (dfu_firmware, blob_fw,
 				      DFU_FIRMWARE_PARSE_FLAG_NONE, error))
 		return FALSE;
-	if (!dfu_device_download (device, dfu_firmware,
-				  DFU_TARGET_TRANSFER_FLAG_DETACH |
-				  DFU_TARGET_TRANSFER_FLAG_VERIFY |
-				  DFU_TARGET_TRANSFER_FLAG_WAIT_RUNTIME,
-				  NULL,
-				  error))
+	fu_provider_dfu_helper_init (provider_dfu, &helper);
+	dfu_device_download_async (device, dfu_firmware,
+				   DFU_TARGET_TRANSFER_FLAG_DETACH |
+				   DFU_TARGET_TRANSFER_FLAG_VERIFY |
+				   DFU_TARGET_TRANSFER_FLAG_WAIT_RUNTIME,
+				   NULL,
+				   fu_provider_dfu_async_cb,
+				   &helper);
+	res = fu_provider_dfu_helper_run (provider_dfu, &helper);
+	if (!dfu_device_download_finish (device, res, error))
 		return FALSE;
 
 	/* we're done */
@@ -316,15 +484,21 @@ fu_provider_dfu_verify (FuProvider *provider,
 {
 	FuProviderDfu *provider_dfu = FU_PROVIDER_DFU (provider);
 	FuProviderDfuPrivate *priv = GET_PRIVATE (provider_dfu);
-	GBytes *blob_fw;
 	GChecksumType checksum_type;
 	DfuDevice *device;
 	const gchar *platform_id;
-	g_autofree gchar *hash = NULL;
+	FuProviderDfuHelper helper;
+	FuProviderDfuVerifyItem *item;
+	g_autofree gchar *key = NULL;
 	g_autoptr(DfuDevice) dfu_device = NULL;
+	g_autoptr(GAsyncResult) res = NULL;
+	g_autoptr(GBytes) blob_fw = NULL;
 	g_autoptr(DfuFirmware) dfu_firmware = NULL;
 	g_autoptr(GError) error_local = NULL;
 
+	if (!fu_provider_dfu_check_idle (provider_dfu, error))
+		return FALSE;
+
 	/* get device */
 	platform_id = fu_device_get_id (dev);
 	device = dfu_context_get_device_by_platform_id (priv->context,
@@ -339,6 +513,18 @@ fu_provider_dfu_verify (FuProvider *provider,
 		return FALSE;
 	}
 
+	/* reading back the firmware is slow and needs two replugs */
+	checksum_type = fu_provider_get_checksum_type (flags);
+	key = fu_provider_dfu_verify_cache_key (platform_id, checksum_type);
+	item = g_hash_table_lookup (priv->verify_cache, key);
+	if (item != NULL &&
+	    item->release == dfu_device_get_runtime_release (device)) {
+		g_debug ("using cached checksum for %s", platform_id);
+		fu_device_set_checksum (dev, item->checksum);
+		fu_device_set_checksum_kind (dev, checksum_type);
+		return TRUE;
+	}
+
 	/* open it */
 	if (!dfu_device_open (device, DFU_DEVICE_OPEN_FLAG_NONE,
 			      NULL, &error_local)) {
@@ -354,11 +540,15 @@ fu_provider_dfu_verify (FuProvider *provider,
 
 	/* get data from hardware */
 	g_debug ("uploading from device->host");
-	dfu_firmware = dfu_device_upload (device,
-					  DFU_TARGET_TRANSFER_FLAG_DETACH |
-					  DFU_TARGET_TRANSFER_FLAG_WAIT_RUNTIME,
-					  NULL,
-					  error);
+	fu_provider_dfu_helper_init (provider_dfu, &helper);
+	dfu_device_upload_async (device,
+				 DFU_TARGET_TRANSFER_FLAG_DETACH |
+				 DFU_TARGET_TRANSFER_FLAG_WAIT_RUNTIME,
+				 NULL,
+				 fu_provider_dfu_async_cb,
+				 &helper);
+	res = fu_provider_dfu_helper_run (provider_dfu, &helper);
+	dfu_firmware = dfu_device_upload_finish (device, res, error);
 	if (dfu_firmware == NULL)
 		return FALSE;
 
@@ -371,14 +561,23 @@ fu_provider_dfu_verify (FuProvider *provider,
 		return FALSE;
 	}
 
-	/* get the checksum */
+	/* get the checksum, computed while the file is written */
+	dfu_firmware_add_checksum_type (dfu_firmware, checksum_type);
 	blob_fw = dfu_firmware_write_data (dfu_firmware, error);
 	if (blob_fw == NULL)
 		return FALSE;
-	checksum_type = fu_provider_get_checksum_type (flags);
-	hash = g_compute_checksum_for_bytes (checksum_type, blob_fw);
-	fu_device_set_checksum (dev, hash);
-	fu_device_set_checksum_kind (device, checksum_type);
+	fu_device_set_checksum (dev, dfu_firmware_get_checksum (dfu_firmware,
+								checksum_type));
+	fu_device_set_checksum_kind (dev, checksum_type);
+
+	/* the device is back in runtime mode, so the version is current */
+	item = g_new0 (FuProviderDfuVerifyItem, 1);
+	item->platform_id = g_strdup (platform_id);
+	item->release = dfu_device_get_runtime_release (device);
+	item->checksum = g_strdup (dfu_firmware_get_checksum (dfu_firmware,
+							      checksum_type));
+	g_hash_table_insert (priv->verify_cache,
+			     g_steal_pointer (&key), item);
 	fu_provider_set_status (provider, FWUPD_STATUS_IDLE);
 	return TRUE;
 }
@@ -408,6 +607,8 @@ fu_provider_dfu_init (FuProviderDfu *provider_dfu)
 	FuProviderDfuPrivate *priv = GET_PRIVATE (provider_dfu);
 	priv->devices = g_hash_table_new_full (g_str_hash, g_str_equal,
 					       g_free, (GDestroyNotify) g_object_unref);
+	priv->verify_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						    (GDestroyNotify) fu_provider_dfu_verify_item_free);
 	priv->context = dfu_context_new ();
 	g_signal_connect (priv->context, "device-added",
 			  G_CALLBACK (fu_provider_dfu_device_added_cb),
@@ -430,11 +631,22 @@ fu_provider_dfu_finalize (GObject *object)
 	FuProviderDfuPrivate *priv = GET_PRIVATE (provider_dfu);
 
 	g_hash_table_unref (priv->devices);
+	g_hash_table_unref (priv->verify_cache);
 	g_object_unref (priv->context);
 
 	G_OBJECT_CLASS (fu_provider_dfu_parent_class)->finalize (object);
 }
 
+/**
+ * fu_provider_dfu_get_context:
+ **/
+DfuContext *
+fu_provider_dfu_get_context (FuProviderDfu *provider_dfu)
+{
+	FuProviderDfuPrivate *priv = GET_PRIVATE (provider_dfu);
+	return priv->context;
+}
+
 /**
  * fu_provider_dfu_new:
  **/
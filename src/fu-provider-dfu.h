@@ -23,6 +23,7 @@
 #define __FU_PROVIDER_DFU_H
 
 #include <glib-object.h>
+#include <libdfu/dfu.h>
 
 #include "fu-device.h"
 #include "fu-provider.h"
@@ -38,6 +39,7 @@ struct _FuProviderDfuClass
 };
 
 FuProvider	*fu_provider_dfu_new		(void);
+DfuContext	*fu_provider_dfu_get_context	(FuProviderDfu	*provider_dfu);
 
 G_END_DECLS
 
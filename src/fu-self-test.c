@@ -26,12 +26,16 @@
 #include <glib/gstdio.h>
 #include <gio/gfiledescriptorbased.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "fu-keyring.h"
 #include "fu-pending.h"
+#include "fu-provider-dfu.h"
 #include "fu-provider-fake.h"
 #include "fu-provider-rpi.h"
 #include "fu-rom.h"
+#include "libdfu/dfu-context-private.h"
+#include "libdfu/dfu-device-private.h"
 
 /**
  * fu_test_get_filename:
@@ -175,6 +179,13 @@ _provider_device_added_cb (FuProvider *provider, FuDevice *device, gpointer user
 	*dev = g_object_ref (device);
 }
 
+static void
+_provider_device_removed_cb (FuProvider *provider, FuDevice *device, gpointer user_data)
+{
+	guint *cnt = (guint *) user_data;
+	(*cnt)++;
+}
+
 static void
 fu_provider_func (void)
 {
@@ -349,6 +360,206 @@ fu_provider_rpi_func (void)
 	g_unlink (pending_db);
 }
 
+typedef struct {
+	DfuContext		*context;
+	DfuDevice		*device;
+	DfuEmulator		*emulator;
+	gboolean		 waiting;
+	guint			 replug_cnt;
+} FuProviderDfuReplugHelper;
+
+static void
+_dfu_device_state_changed_cb (DfuDevice *device, DfuState state, gpointer user_data)
+{
+	FuProviderDfuReplugHelper *helper = (FuProviderDfuReplugHelper *) user_data;
+	helper->waiting = state == DFU_STATE_DFU_MANIFEST_WAIT_RESET;
+}
+
+static gboolean
+_dfu_device_replug_cb (gpointer user_data)
+{
+	FuProviderDfuReplugHelper *helper = (FuProviderDfuReplugHelper *) user_data;
+
+	/* only once the device has been told to reset */
+	if (!helper->waiting)
+		return G_SOURCE_CONTINUE;
+	dfu_context_replug_emulated (helper->context, helper->device, NULL);
+	dfu_context_replug_emulated (helper->context, helper->device,
+				     helper->emulator);
+	helper->replug_cnt++;
+	return G_SOURCE_CONTINUE;
+}
+
+static guint
+_dfu_device_replug_watch (FuProviderDfuReplugHelper *helper)
+{
+	helper->waiting = FALSE;
+	return g_timeout_add (10, _dfu_device_replug_cb, helper);
+}
+
+static gboolean
+_provider_dfu_verify (FuProvider *provider,
+		      FuDevice *device,
+		      FuProviderDfuReplugHelper *helper,
+		      GError **error)
+{
+	gboolean ret;
+	guint id = _dfu_device_replug_watch (helper);
+	ret = fu_provider_verify (provider, device, FU_PROVIDER_VERIFY_FLAG_NONE, error);
+	g_source_remove (id);
+	return ret;
+}
+
+static void
+fu_provider_dfu_func (void)
+{
+	DfuContext *context;
+	FuProviderDfuReplugHelper helper;
+	gboolean ret;
+	guint cnt = 0;
+	guint cnt_removed = 0;
+	guint uploads;
+	guint8 *buf;
+	guint i;
+	guint id;
+	g_autofree gchar *checksum = NULL;
+	g_autofree gchar *pending_db = NULL;
+	g_autoptr(DfuDevice) dfu_device = NULL;
+	g_autoptr(DfuElement) element = NULL;
+	g_autoptr(DfuEmulator) emulator = NULL;
+	g_autoptr(DfuFirmware) firmware = NULL;
+	g_autoptr(DfuImage) image = NULL;
+	g_autoptr(FuDevice) device = NULL;
+	g_autoptr(FuProvider) provider = NULL;
+	g_autoptr(GBytes) blob_fw = NULL;
+	g_autoptr(GBytes) fw = NULL;
+	g_autoptr(GBytes) memory = NULL;
+	g_autoptr(GError) error = NULL;
+
+	/* plug in an emulated DfuSe device */
+	provider = fu_provider_dfu_new ();
+	g_signal_connect (provider, "device-added",
+			  G_CALLBACK (_provider_device_added_cb),
+			  &device);
+	g_signal_connect (provider, "status-changed",
+			  G_CALLBACK (_provider_status_changed_cb),
+			  &cnt);
+	context = fu_provider_dfu_get_context (FU_PROVIDER_DFU (provider));
+	emulator = dfu_emulator_new ();
+	dfu_emulator_set_dfuse (emulator, TRUE);
+	dfu_emulator_set_transfer_size (emulator, 256);
+	ret = dfu_emulator_add_target (emulator, "@Flash /0x08000000/8*001Kg", 0, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	dfu_device = dfu_device_new_emulated (emulator);
+	dfu_context_add_emulated (context, dfu_device);
+	while (g_main_context_iteration (NULL, FALSE));
+	g_assert (device != NULL);
+	g_assert_cmpstr (fu_device_get_id (device), ==, "emulated");
+
+	/* build a DfuSe file */
+	buf = g_malloc (0x1800);
+	for (i = 0; i < 0x1800; i++)
+		buf[i] = (guint8) (i * 7);
+	fw = g_bytes_new_take (buf, 0x1800);
+	element = dfu_element_new ();
+	dfu_element_set_address (element, 0x08000000);
+	dfu_element_set_contents (element, fw);
+	image = dfu_image_new ();
+	dfu_image_add_element (image, element);
+	firmware = dfu_firmware_new ();
+	dfu_firmware_add_image (firmware, image);
+	dfu_firmware_set_vid (firmware, 0x0483);
+	dfu_firmware_set_pid (firmware, 0xdf11);
+	dfu_firmware_set_format (firmware, DFU_FIRMWARE_FORMAT_DFUSE);
+	blob_fw = dfu_firmware_write_data (firmware, &error);
+	g_assert_no_error (error);
+	g_assert (blob_fw != NULL);
+
+	/* the device is replugged through the DfuContext, which only works
+	 * if the default context is run during the update */
+	memset (&helper, 0, sizeof (FuProviderDfuReplugHelper));
+	helper.context = context;
+	helper.device = dfu_device;
+	helper.emulator = emulator;
+	g_signal_connect (dfu_device, "state-changed",
+			  G_CALLBACK (_dfu_device_state_changed_cb),
+			  &helper);
+	id = _dfu_device_replug_watch (&helper);
+	ret = fu_provider_update (provider, device, NULL, blob_fw, NULL,
+				  FWUPD_INSTALL_FLAG_NONE, &error);
+	g_source_remove (id);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (helper.replug_cnt, >, 0);
+	g_assert_cmpint (cnt, >, 0);
+	memory = dfu_emulator_get_memory (emulator, 0, 0x08000000, 0x1800);
+	g_assert (g_bytes_compare (memory, fw) == 0);
+
+	/* read the firmware back */
+	uploads = dfu_emulator_get_request_count (emulator, DFU_REQUEST_UPLOAD);
+	ret = _provider_dfu_verify (provider, device, &helper, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_emulator_get_request_count (emulator, DFU_REQUEST_UPLOAD), >, uploads);
+	checksum = g_strdup (fu_device_get_checksum (device));
+	g_assert (checksum != NULL);
+
+	/* the second time the cached checksum is used */
+	uploads = dfu_emulator_get_request_count (emulator, DFU_REQUEST_UPLOAD);
+	fu_device_set_checksum (device, NULL);
+	ret = _provider_dfu_verify (provider, device, &helper, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_emulator_get_request_count (emulator, DFU_REQUEST_UPLOAD), ==, uploads);
+	g_assert_cmpstr (fu_device_get_checksum (device), ==, checksum);
+
+	/* but not once the runtime has a different version */
+	dfu_device_set_runtime_release (dfu_device, 0x0102);
+	ret = _provider_dfu_verify (provider, device, &helper, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_emulator_get_request_count (emulator, DFU_REQUEST_UPLOAD), >, uploads);
+	g_assert_cmpstr (fu_device_get_checksum (device), ==, checksum);
+
+	/* or after an update, even of the same version */
+	id = _dfu_device_replug_watch (&helper);
+	ret = fu_provider_update (provider, device, NULL, blob_fw, NULL,
+				  FWUPD_INSTALL_FLAG_NONE, &error);
+	g_source_remove (id);
+	g_assert_no_error (error);
+	g_assert (ret);
+	uploads = dfu_emulator_get_request_count (emulator, DFU_REQUEST_UPLOAD);
+	ret = _provider_dfu_verify (provider, device, &helper, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_emulator_get_request_count (emulator, DFU_REQUEST_UPLOAD), >, uploads);
+
+	/* or after the device has been removed and plugged back in */
+	g_signal_connect (provider, "device-removed",
+			  G_CALLBACK (_provider_device_removed_cb),
+			  &cnt_removed);
+	dfu_context_set_timeout (context, 1);
+	dfu_context_replug_emulated (context, dfu_device, NULL);
+	while (cnt_removed == 0)
+		g_main_context_iteration (NULL, TRUE);
+	g_clear_object (&device);
+	dfu_device_set_new_emulator (dfu_device, emulator);
+	dfu_context_add_emulated (context, dfu_device);
+	while (g_main_context_iteration (NULL, FALSE));
+	g_assert (device != NULL);
+	uploads = dfu_emulator_get_request_count (emulator, DFU_REQUEST_UPLOAD);
+	ret = _provider_dfu_verify (provider, device, &helper, &error);
+	g_assert_no_error (error);
+	g_assert (ret);
+	g_assert_cmpint (dfu_emulator_get_request_count (emulator, DFU_REQUEST_UPLOAD), >, uploads);
+	g_assert_cmpstr (fu_device_get_checksum (device), ==, checksum);
+
+	/* clean up */
+	pending_db = g_build_filename (LOCALSTATEDIR, "lib", "fwupd", "pending.db", NULL);
+	g_unlink (pending_db);
+}
+
 static void
 fu_pending_func (void)
 {
@@ -485,6 +696,7 @@ main (int argc, char **argv)
 	g_test_add_func ("/fwupd/pending", fu_pending_func);
 	g_test_add_func ("/fwupd/provider", fu_provider_func);
 	g_test_add_func ("/fwupd/provider{rpi}", fu_provider_rpi_func);
+	g_test_add_func ("/fwupd/provider{dfu}", fu_provider_dfu_func);
 	g_test_add_func ("/fwupd/keyring", fu_keyring_func);
 	return g_test_run ();
 }